@@ -63,6 +63,7 @@ const char *fossil_reserved_name(int N, int omitRepo){
      ".fslckout-journal",
      ".fslckout-wal",
      ".fslckout-shm",
+     ".fslckout-fsmonitor",
 
      /* The use of ".fos" as the name of the checkout database is
      ** deprecated.  Use ".fslckout" instead.  At some point, the following
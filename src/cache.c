@@ -15,10 +15,12 @@
 *******************************************************************************
 **
 ** This file implements a cache for expense operations such as
-** /zip and /tarball.
+** /zip and /tarball.  The same cache file also holds fully expanded
+** copies of artifacts that sit at the end of long delta chains.
 */
 #include "config.h"
 #include <sqlite3.h>
+#include <time.h>
 #include "cache.h"
 
 /*
@@ -75,7 +77,18 @@ static sqlite3 *cacheOpen(int bForce){
      ");"
      "CREATE TRIGGER IF NOT EXISTS cacheDel AFTER DELETE ON cache BEGIN"
      "  DELETE FROM blob WHERE id=OLD.id;"
-     "END;",
+     "END;"
+     "CREATE TABLE IF NOT EXISTS artifact("
+       "uuid TEXT PRIMARY KEY,"    /* SHA1 hash of the artifact */
+       "sz INT,"                   /* Size of content in bytes */
+       "tm INT,"                   /* Last access time (unix timestamp) */
+       "data BLOB"                 /* Fully expanded content */
+     ");"
+     "CREATE INDEX IF NOT EXISTS artifactTm ON artifact(tm);"
+     "CREATE TABLE IF NOT EXISTS artifactsz("
+       "id INTEGER PRIMARY KEY,"   /* Always 1 */
+       "total INT"                 /* Sum of artifact.sz */
+     ");",
      0, 0, 0);
   if( rc!=SQLITE_OK ){
     sqlite3_close(db);
@@ -187,6 +200,17 @@ cache_write_end:
   sqlite3_close(db);
 }
 
+/*
+** Return true if this server has a cache file, and so cache_write()
+** will retain what is written.
+*/
+int cache_exists(void){
+  char *zDbName = cacheName();
+  int rc = zDbName!=0 && file_size(zDbName)>0;
+  fossil_free(zDbName);
+  return rc;
+}
+
 /*
 ** Attempt to read content out of the cache with the given zKey.  Return
 ** non-zero on success and zero if unable to locate the content.
@@ -229,6 +253,292 @@ cache_read_done:
   return rc;
 }
 
+/*
+** State of the expanded-artifact cache.  The database connection is
+** opened on first use and held until the repository is closed, since
+** content_get() may consult the cache many times per process.
+*/
+static struct {
+  int eState;          /* 0: not yet checked.  1: open.  2: disabled */
+  int mnDepth;         /* Minimum delta chain depth worth caching */
+  i64 szLimit;         /* Maximum total size of cached artifacts */
+  sqlite3 *db;         /* Connection to the cache database */
+} artifactCache;
+
+/*
+** Return the minimum delta chain depth for which expanded artifacts are
+** kept in the cache, or 0 if the expanded-artifact cache is disabled.
+**
+** The cache is enabled only when the cache file exists and the
+** "delta-cache-depth" setting is a positive integer.
+*/
+int cache_artifact_depth(void){
+  if( artifactCache.eState==0 ){
+    artifactCache.eState = 2;
+    artifactCache.mnDepth = db_get_int("delta-cache-depth", 0);
+    artifactCache.szLimit = db_get_int("delta-cache-size", 100000000);
+    if( artifactCache.mnDepth>0 && artifactCache.szLimit>0 ){
+      artifactCache.db = cacheOpen(0);
+      if( artifactCache.db ){
+        sqlite3_busy_timeout(artifactCache.db, 1000);
+        artifactCache.eState = 1;
+      }
+    }
+  }
+  return artifactCache.eState==1 ? artifactCache.mnDepth : 0;
+}
+
+/*
+** Close the expanded-artifact cache, if it is open.  The settings that
+** control the cache are reread on next use.
+*/
+void cache_artifact_close(void){
+  sqlite3_close(artifactCache.db);
+  memset(&artifactCache, 0, sizeof(artifactCache));
+}
+
+/*
+** Look up the hash and size of artifact rid.  Return 0 if rid does not
+** name a real artifact.
+*/
+static int cache_artifact_info(int rid, char **pzUuid, int *pSz){
+  static Stmt q;
+  int rc = 0;
+  db_static_prepare(&q, "SELECT uuid, size FROM blob WHERE rid=:rid");
+  db_bind_int(&q, ":rid", rid);
+  if( db_step(&q)==SQLITE_ROW ){
+    *pzUuid = fossil_strdup(db_column_text(&q, 0));
+    *pSz = db_column_int(&q, 1);
+    rc = *pSz>=0;
+    if( !rc ) fossil_free(*pzUuid);
+  }
+  db_reset(&q);
+  return rc;
+}
+
+/*
+** Run a query on the expanded-artifact cache that returns a single
+** integer, with zArg (if not NULL) bound to ?1.  Return 0 if there is
+** no result.
+*/
+static i64 cache_artifact_int64(const char *zSql, const char *zArg){
+  sqlite3_stmt *pStmt;
+  i64 v = 0;
+  pStmt = cacheStmt(artifactCache.db, zSql);
+  if( pStmt ){
+    if( zArg ) sqlite3_bind_text(pStmt, 1, zArg, -1, SQLITE_STATIC);
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      v = sqlite3_column_int64(pStmt, 0);
+    }
+    sqlite3_finalize(pStmt);
+  }
+  return v;
+}
+
+/*
+** Return the total size of the expanded-artifact cache, which is kept in
+** the ARTIFACTSZ table so that it need not be recomputed on each write.
+** Compute it from the ARTIFACT table if it has not been recorded yet,
+** for example in a cache file created by an older version of Fossil.
+** Must be called inside a write transaction.
+*/
+static i64 cache_artifact_total(void){
+  sqlite3_stmt *pStmt;
+  i64 szTotal;
+  pStmt = cacheStmt(artifactCache.db, "SELECT total FROM artifactsz");
+  if( pStmt && sqlite3_step(pStmt)==SQLITE_ROW ){
+    szTotal = sqlite3_column_int64(pStmt, 0);
+    sqlite3_finalize(pStmt);
+    return szTotal;
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_exec(artifactCache.db,
+     "REPLACE INTO artifactsz(id,total)"
+     " SELECT 1, total(sz) FROM artifact", 0, 0, 0);
+  return cache_artifact_int64("SELECT total FROM artifactsz", 0);
+}
+
+/*
+** Add szChange to the total size recorded in the ARTIFACTSZ table.
+*/
+static void cache_artifact_resize(i64 szChange){
+  sqlite3_stmt *pStmt;
+  if( szChange==0 ) return;
+  pStmt = cacheStmt(artifactCache.db,
+                    "UPDATE artifactsz SET total=total+?1");
+  if( pStmt ){
+    sqlite3_bind_int64(pStmt, 1, szChange);
+    sqlite3_step(pStmt);
+    sqlite3_finalize(pStmt);
+  }
+}
+
+/*
+** Return true if the expanded-artifact cache may be written.  The cache
+** is written only when the repository itself can be written, and web
+** requests write only for users who can check in, so that reading
+** pages does not modify the cache.
+*/
+static int cache_artifact_writeable(void){
+  if( !db_is_writeable("repository") ) return 0;
+  if( g.cgiOutput && !g.perm.Write ) return 0;
+  return 1;
+}
+
+/*
+** Attempt to read the fully expanded content of artifact rid from the
+** cache into pContent, which must be empty.  Return non-zero on success
+** and zero if the cache is disabled or does not hold the artifact.
+**
+** The content is checked against the artifact hash before it is used.
+** An entry that does not match is ignored, and removed from the cache
+** if the cache may be written.
+*/
+int cache_artifact_read(int rid, Blob *pContent){
+  sqlite3_stmt *pStmt;
+  char *zUuid;
+  int sz;
+  int rc = 0;
+
+  if( cache_artifact_depth()==0 ) return 0;
+  if( !cache_artifact_info(rid, &zUuid, &sz) ) return 0;
+  pStmt = cacheStmt(artifactCache.db,
+                    "SELECT data FROM artifact WHERE uuid=?1");
+  if( pStmt ){
+    sqlite3_bind_text(pStmt, 1, zUuid, -1, SQLITE_STATIC);
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      if( sqlite3_column_bytes(pStmt, 0)==sz ){
+        blob_append(pContent, sqlite3_column_blob(pStmt, 0), sz);
+        rc = 1;
+      }else{
+        rc = -1;
+      }
+    }
+    sqlite3_finalize(pStmt);
+  }
+  if( rc>0 ){
+    Blob cksum;
+    sha1sum_blob(pContent, &cksum);
+    if( fossil_strcmp(blob_str(&cksum), zUuid)!=0 ){
+      blob_reset(pContent);
+      rc = -1;
+    }
+    blob_reset(&cksum);
+  }
+  if( rc>0 && cache_artifact_writeable() ){
+    pStmt = cacheStmt(artifactCache.db,
+                      "UPDATE artifact SET tm=?2 WHERE uuid=?1 AND tm<?2");
+    if( pStmt ){
+      sqlite3_bind_text(pStmt, 1, zUuid, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(pStmt, 2, time(0));
+      sqlite3_step(pStmt);
+      sqlite3_finalize(pStmt);
+    }
+  }else if( rc<0 && cache_artifact_writeable() ){
+    i64 szBad = cache_artifact_int64("SELECT sz FROM artifact WHERE uuid=?1",
+                                     zUuid);
+    pStmt = cacheStmt(artifactCache.db, "DELETE FROM artifact WHERE uuid=?1");
+    if( pStmt ){
+      sqlite3_bind_text(pStmt, 1, zUuid, -1, SQLITE_STATIC);
+      if( sqlite3_step(pStmt)==SQLITE_DONE
+       && sqlite3_changes(artifactCache.db)>0
+      ){
+        cache_artifact_resize(-szBad);
+      }
+      sqlite3_finalize(pStmt);
+    }
+  }
+  fossil_free(zUuid);
+  return rc>0;
+}
+
+/*
+** Save the fully expanded content of artifact rid in the cache.  The
+** least recently used entries are removed as necessary to keep the
+** total size of the cache below the "delta-cache-size" setting.
+** This routine is a no-op if the cache is disabled or may not be
+** written.
+*/
+void cache_artifact_write(int rid, Blob *pContent){
+  sqlite3_stmt *pStmt;
+  char *zUuid;
+  int sz;
+  int rc = 0;
+  i64 szTotal;
+
+  if( cache_artifact_depth()==0 ) return;
+  if( blob_size(pContent)>artifactCache.szLimit ) return;
+  if( !cache_artifact_writeable() ) return;
+  if( !cache_artifact_info(rid, &zUuid, &sz) ) return;
+  if( sz!=blob_size(pContent) ){
+    fossil_free(zUuid);
+    return;
+  }
+  sqlite3_exec(artifactCache.db, "BEGIN IMMEDIATE", 0, 0, 0);
+  szTotal = cache_artifact_total() + sz
+          - cache_artifact_int64("SELECT sz FROM artifact WHERE uuid=?1",
+                                 zUuid);
+  pStmt = cacheStmt(artifactCache.db,
+      "REPLACE INTO artifact(uuid,sz,tm,data) VALUES(?1,?2,?3,?4)");
+  if( pStmt ){
+    sqlite3_bind_text(pStmt, 1, zUuid, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 2, sz);
+    sqlite3_bind_int64(pStmt, 3, time(0));
+    sqlite3_bind_blob(pStmt, 4, blob_buffer(pContent), sz, SQLITE_STATIC);
+    rc = sqlite3_step(pStmt)==SQLITE_DONE;
+    sqlite3_finalize(pStmt);
+  }
+  while( rc && szTotal>artifactCache.szLimit ){
+    i64 szEvict = cache_artifact_int64(
+        "SELECT total(sz) FROM"
+        " (SELECT sz FROM artifact ORDER BY tm LIMIT 10)", 0);
+    if( szEvict<=0 ) break;
+    pStmt = cacheStmt(artifactCache.db,
+        "DELETE FROM artifact WHERE uuid IN"
+        " (SELECT uuid FROM artifact ORDER BY tm LIMIT 10)");
+    if( pStmt==0 ) break;
+    rc = sqlite3_step(pStmt)==SQLITE_DONE;
+    sqlite3_finalize(pStmt);
+    szTotal -= szEvict;
+  }
+  if( rc ){
+    pStmt = cacheStmt(artifactCache.db, "UPDATE artifactsz SET total=?1");
+    if( pStmt ){
+      sqlite3_bind_int64(pStmt, 1, szTotal);
+      sqlite3_step(pStmt);
+      sqlite3_finalize(pStmt);
+    }
+  }
+  sqlite3_exec(artifactCache.db, rc ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+  fossil_free(zUuid);
+}
+
+/*
+** Remove artifact rid from the expanded-artifact cache.  This must be
+** called before rid is deleted from the BLOB table, and whenever the
+** delta chain that leads to rid is shortened enough that caching the
+** expanded content is no longer worthwhile.
+*/
+void cache_artifact_forget(int rid){
+  sqlite3_stmt *pStmt;
+  char *zUuid;
+  int sz;
+
+  if( cache_artifact_depth()==0 ) return;
+  if( !cache_artifact_info(rid, &zUuid, &sz) ) return;
+  pStmt = cacheStmt(artifactCache.db, "DELETE FROM artifact WHERE uuid=?1");
+  if( pStmt ){
+    sqlite3_bind_text(pStmt, 1, zUuid, -1, SQLITE_STATIC);
+    if( sqlite3_step(pStmt)==SQLITE_DONE
+     && sqlite3_changes(artifactCache.db)>0
+    ){
+      cache_artifact_resize(-(i64)sz);
+    }
+    sqlite3_finalize(pStmt);
+  }
+  fossil_free(zUuid);
+}
+
 /*
 ** Create a cache database for the current repository if no such
 ** database already exists.
@@ -243,7 +553,8 @@ void cache_initialize(void){
 ** Usage: %fossil cache SUBCOMMAND
 **
 ** Manage the cache used for potentially expensive web pages such as
-** /zip and /tarball.   SUBCOMMAND can be:
+** /zip and /tarball, and for expanded copies of artifacts at the end of
+** long delta chains.   SUBCOMMAND can be:
 **
 **    clear        Remove all entries from the cache.
 **
@@ -257,6 +568,11 @@ void cache_initialize(void){
 ** The cache is stored in a file that is distinct from the repository
 ** but that is held in the same directory as the repository.  The cache
 ** file can be deleted in order to completely disable the cache.
+**
+** Expanded artifacts are only cached if the "delta-cache-depth"
+** setting is a positive integer.  Artifacts that are at least that many
+** deltas away from their baseline are saved, up to a total size given
+** by the "delta-cache-size" setting.
 */
 void cache_cmd(void){
   const char *zCmd;
@@ -287,7 +603,9 @@ void cache_cmd(void){
   }else if( strncmp(zCmd, "clear", nCmd)==0 ){
     db = cacheOpen(0);
     if( db ){
-      sqlite3_exec(db, "DELETE FROM cache; DELETE FROM blob; VACUUM;",0,0,0);
+      sqlite3_exec(db, "DELETE FROM cache; DELETE FROM blob;"
+                       "DELETE FROM artifact; DELETE FROM artifactsz;"
+                       "VACUUM;",0,0,0);
       sqlite3_close(db);
       fossil_print("cache cleared\n");
     }else{
@@ -323,7 +641,31 @@ void cache_cmd(void){
       fossil_free(zDbName);
     }
   }else if( strncmp(zCmd, "status", nCmd)==0 ){
-    fossil_print("TBD...\n");
+    db = cacheOpen(0);
+    if( db==0 ){
+      fossil_print("cache does not exist\n");
+    }else{
+      char *zDbName = cacheName();
+      cache_register_sizename(db);
+      pStmt = cacheStmt(db,
+           "SELECT (SELECT count(*) FROM cache),"
+           "       (SELECT sizename(total(sz)) FROM cache),"
+           "       (SELECT count(*) FROM artifact),"
+           "       (SELECT sizename(total(sz)) FROM artifact)"
+      );
+      if( pStmt && sqlite3_step(pStmt)==SQLITE_ROW ){
+        fossil_print("Web pages: %d entries, %s\n",
+           sqlite3_column_int(pStmt, 0), sqlite3_column_text(pStmt, 1));
+        fossil_print("Artifacts: %d entries, %s (min-depth: %d)\n",
+           sqlite3_column_int(pStmt, 2), sqlite3_column_text(pStmt, 3),
+           db_get_int("delta-cache-depth", 0));
+      }
+      sqlite3_finalize(pStmt);
+      sqlite3_close(db);
+      fossil_print("Cache-file: %s  Size: %lld\n",
+                   zDbName, file_size(zDbName));
+      fossil_free(zDbName);
+    }
   }else{
     fossil_fatal("Unknown subcommand \"%s\"."
                  " Should be one of: clear init list status", zCmd);
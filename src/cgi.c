@@ -36,6 +36,9 @@
 # include <sys/time.h>
 # include <sys/wait.h>
 # include <sys/select.h>
+# include <sys/mman.h>
+# include <signal.h>
+# include <errno.h>
 #endif
 #ifdef __EMX__
   typedef int socklen_t;
@@ -88,6 +91,26 @@
 static Blob cgiContent[2] = { BLOB_INITIALIZER, BLOB_INITIALIZER };
 static Blob *pContent = &cgiContent[0];
 
+/*
+** Persistent connection state.  The built-in HTTP server sets bEnable.
+** The other fields describe the current request and are set only in a
+** child forked by cgi_http_connection().
+*/
+static struct {
+  int bEnable;          /* Server: offer persistent connections */
+  int bRequest;         /* The client asked to keep the connection open */
+  int bChunked;         /* The client understands chunked transfer encoding */
+  int *pReused;         /* Set to 1 if the reply leaves the connection usable */
+} httpKeepAlive;
+
+/*
+** True while the reply is being streamed.  Set by cgi_stream_begin() and
+** reset by cgi_stream_end().
+*/
+static int cgiStreaming = 0;
+static int cgiStreamDone = 0;
+static void (*xStreamAbort)(void) = 0;
+
 /*
 ** Set the destination buffer into which to accumulate CGI content.
 */
@@ -291,10 +314,18 @@ static int is_gzippable(void){
 }
 
 /*
-** Do a normal HTTP reply
+** Return true if the reply should include a body.  HEAD requests
+** get only the header.
 */
-void cgi_reply(void){
-  int total_size;
+static int cgi_reply_has_body(void){
+  return fossil_strcmp(P("REQUEST_METHOD"),"HEAD")!=0;
+}
+
+/*
+** Write the HTTP reply header lines that come before the description
+** of the content, ending with the Content-Type line.
+*/
+static void cgi_reply_header(void){
   if( iReplyStatus<=0 ){
     iReplyStatus = 200;
     zReplyStatus = "OK";
@@ -312,9 +343,15 @@ void cgi_reply(void){
 #endif
 
   if( g.fullHttpReply ){
-    fprintf(g.httpOut, "HTTP/1.0 %d %s\r\n", iReplyStatus, zReplyStatus);
-    fprintf(g.httpOut, "Date: %s\r\n", cgi_rfc822_datestamp(time(0)));
-    fprintf(g.httpOut, "Connection: close\r\n");
+    if( httpKeepAlive.bRequest ){
+      fprintf(g.httpOut, "HTTP/1.1 %d %s\r\n", iReplyStatus, zReplyStatus);
+      fprintf(g.httpOut, "Date: %s\r\n", cgi_rfc822_datestamp(time(0)));
+      fprintf(g.httpOut, "Connection: keep-alive\r\n");
+    }else{
+      fprintf(g.httpOut, "HTTP/1.0 %d %s\r\n", iReplyStatus, zReplyStatus);
+      fprintf(g.httpOut, "Date: %s\r\n", cgi_rfc822_datestamp(time(0)));
+      fprintf(g.httpOut, "Connection: close\r\n");
+    }
     fprintf(g.httpOut, "X-UA-Compatible: IE=edge\r\n");
   }else{
     fprintf(g.httpOut, "Status: %d %s\r\n", iReplyStatus, zReplyStatus);
@@ -360,6 +397,23 @@ void cgi_reply(void){
   ** the browser, not some shared location.
   */
   fprintf(g.httpOut, "Content-Type: %s; charset=utf-8\r\n", zContentType);
+}
+
+/*
+** Do a normal HTTP reply
+*/
+void cgi_reply(void){
+  int total_size;
+
+  if( cgiStreamDone ) return;
+  if( cgiStreaming ){
+    void (*xAbort)(void) = xStreamAbort;
+    xStreamAbort = 0;
+    if( xAbort ) xAbort();
+    cgi_stream_end();
+    return;
+  }
+  cgi_reply_header();
   if( fossil_strcmp(zContentType,"application/x-fossil")==0 ){
     cgi_combine_header_and_body();
     blob_compress(&cgiContent[0], &cgiContent[0]);
@@ -384,7 +438,7 @@ void cgi_reply(void){
     total_size = 0;
   }
   fprintf(g.httpOut, "\r\n");
-  if( total_size>0 && iReplyStatus != 304 ){
+  if( total_size>0 && iReplyStatus != 304 && cgi_reply_has_body() ){
     int i, size;
     for(i=0; i<2; i++){
       size = blob_size(&cgiContent[i]);
@@ -394,6 +448,106 @@ void cgi_reply(void){
     }
   }
   fflush(g.httpOut);
+  if( httpKeepAlive.pReused && httpKeepAlive.bRequest ){
+    *httpKeepAlive.pReused = 1;
+  }
+  CGIDEBUG(("DONE\n"));
+}
+
+/*
+** Write n bytes of streamed reply content, as a chunk if chunked transfer
+** encoding is in use.
+*/
+static void cgi_stream_out(const char *z, int n){
+  if( n<=0 || !cgi_reply_has_body() ) return;
+  if( httpKeepAlive.bRequest ){
+    fprintf(g.httpOut, "%x\r\n", n);
+    fwrite(z, 1, n, g.httpOut);
+    fprintf(g.httpOut, "\r\n");
+  }else{
+    fwrite(z, 1, n, g.httpOut);
+  }
+}
+
+/*
+** Begin a streamed reply.  The reply header goes out right away, along
+** with any content accumulated so far, and content given to
+** cgi_stream_write() is sent as it is produced rather than being held
+** in memory until cgi_reply().  Use this for large replies.
+**
+** The length of a streamed reply is not known in advance.  On a
+** persistent connection from an HTTP/1.1 client the content is sent with
+** chunked transfer encoding.  Otherwise the connection is closed to mark
+** the end of the content.
+**
+** If xAbort is not NULL, it is called when cgi_reply() cuts the streamed
+** reply short, as happens after a fatal error.  It can send whatever
+** the content needs in order to end cleanly.
+*/
+void cgi_stream_begin(void (*xAbort)(void)){
+  int i;
+  if( cgiStreaming || cgiStreamDone ) return;
+  xStreamAbort = xAbort;
+  if( httpKeepAlive.bRequest && !httpKeepAlive.bChunked ){
+    httpKeepAlive.bRequest = 0;
+  }
+  cgi_reply_header();
+  cgiStreaming = 1;
+  if( is_gzippable() ){
+    fprintf(g.httpOut, "Content-Encoding: gzip\r\n");
+    fprintf(g.httpOut, "Vary: Accept-Encoding\r\n");
+    gzip_begin(0);
+    cgiStreaming = 2;
+  }
+  if( httpKeepAlive.bRequest ){
+    fprintf(g.httpOut, "Transfer-Encoding: chunked\r\n");
+  }
+  fprintf(g.httpOut, "\r\n");
+  for(i=0; i<2; i++){
+    cgi_stream_write(blob_buffer(&cgiContent[i]), blob_size(&cgiContent[i]));
+    blob_reset(&cgiContent[i]);
+  }
+}
+
+/*
+** Send n bytes of content in a streamed reply.
+*/
+void cgi_stream_write(const char *z, int n){
+  assert( cgiStreaming );
+  if( n<=0 ) return;
+  if( cgiStreaming==2 ){
+    Blob out;
+    blob_zero(&out);
+    gzip_step(z, n);
+    gzip_take_output(&out);
+    cgi_stream_out(blob_buffer(&out), blob_size(&out));
+    blob_reset(&out);
+  }else{
+    cgi_stream_out(z, n);
+  }
+}
+
+/*
+** Finish a streamed reply.  Later calls to cgi_reply() do nothing.
+*/
+void cgi_stream_end(void){
+  if( !cgiStreaming ) return;
+  if( cgiStreaming==2 ){
+    Blob out;
+    gzip_finish(&out);
+    cgi_stream_out(blob_buffer(&out), blob_size(&out));
+    blob_reset(&out);
+  }
+  if( httpKeepAlive.bRequest && cgi_reply_has_body() ){
+    fprintf(g.httpOut, "0\r\n\r\n");
+  }
+  fflush(g.httpOut);
+  cgiStreaming = 0;
+  cgiStreamDone = 1;
+  xStreamAbort = 0;
+  if( httpKeepAlive.pReused && httpKeepAlive.bRequest ){
+    *httpKeepAlive.pReused = 1;
+  }
   CGIDEBUG(("DONE\n"));
 }
 
@@ -1388,9 +1542,11 @@ void cgi_handle_http_request(const char *zIpAddr){
   if( zToken[i] ) zToken[i++] = 0;
   cgi_setenv("PATH_INFO", zToken);
   cgi_setenv("QUERY_STRING", &zToken[i]);
-  if( zIpAddr==0 &&
+  if( zIpAddr==0 && (
         getpeername(fileno(g.httpIn), (struct sockaddr*)&remoteName,
-                                &size)>=0
+                                &size)>=0 ||
+        getpeername(fileno(g.httpOut), (struct sockaddr*)&remoteName,
+                                &size)>=0)
   ){
     zIpAddr = inet_ntoa(remoteName.sin_addr);
   }
@@ -1720,6 +1876,7 @@ void cgi_handle_scgi_request(void){
 #define HTTP_SERVER_HAD_REPOSITORY 0x0004     /* Was the repository open? */
 #define HTTP_SERVER_HAD_CHECKOUT   0x0008     /* Was a checkout open? */
 #define HTTP_SERVER_REPOLIST       0x0010     /* Allow repo listing */
+#define HTTP_SERVER_KEEPALIVE      0x0020     /* Allow persistent connections */
 
 #endif /* INTERFACE */
 
@@ -1729,6 +1886,219 @@ void cgi_handle_scgi_request(void){
 */
 #define MAX_PARALLEL 2
 
+/*
+** Make the socket connection the standard input and output (and standard
+** error, unless tracing) of the current process.  Return the number of
+** errors.
+*/
+static int cgi_http_connection_to_stdio(int connection){
+  int nErr = 0;
+#if !defined(_WIN32)
+  int fd;
+  close(0);
+  fd = dup(connection);
+  if( fd!=0 ) nErr++;
+  close(1);
+  fd = dup(connection);
+  if( fd!=1 ) nErr++;
+  if( !g.fAnyTrace ){
+    close(2);
+    fd = dup(connection);
+    if( fd!=2 ) nErr++;
+  }
+  close(connection);
+#endif
+  return nErr;
+}
+
+/*
+** Limits on persistent connections.  A connection is closed after
+** MX_KEEPALIVE_REQUEST requests or after it has been idle for
+** KEEPALIVE_TIMEOUT seconds.  Idle persistent connections still hold a
+** child process, so the MAX_PARALLEL throttle is relaxed to
+** MAX_PARALLEL_KEEPALIVE when they are allowed.
+*/
+#define MX_KEEPALIVE_REQUEST   100
+#define KEEPALIVE_TIMEOUT      5
+#define MAX_PARALLEL_KEEPALIVE 16
+
+/*
+** Return the offset of the first byte past the header of the HTTP request
+** in z[0..n-1], or -1 if the header is not yet complete.
+*/
+#if !defined(_WIN32)
+static int cgi_http_header_end(const char *z, int n){
+  int i;
+  for(i=0; i<n; i++){
+    if( z[i]!='\n' ) continue;
+    if( i+1<n && z[i+1]=='\n' ) return i+2;
+    if( i+2<n && z[i+1]=='\r' && z[i+2]=='\n' ) return i+3;
+  }
+  return -1;
+}
+
+/*
+** Look for the header field zName (lower case, with trailing ":") in the
+** HTTP request header z[0..n-1].  Return a pointer to its value, which
+** is terminated by end-of-line, or NULL if the field is not present.
+*/
+static const char *cgi_http_header_field(const char *z, int n,
+                                         const char *zName){
+  int nName = (int)strlen(zName);
+  int i = 0;
+  while( i<n ){
+    if( i+nName<n && fossil_strnicmp(&z[i], zName, nName)==0 ){
+      i += nName;
+      while( i<n && (z[i]==' ' || z[i]=='\t') ) i++;
+      return &z[i];
+    }
+    while( i<n && z[i]!='\n' ) i++;
+    i++;
+  }
+  return 0;
+}
+
+/*
+** Wait up to iTimeout seconds for fd to become readable.  Return true
+** if it is readable.
+*/
+static int cgi_http_wait_readable(int fd, int iTimeout){
+  fd_set readfds;
+  struct timeval delay;
+  delay.tv_sec = iTimeout;
+  delay.tv_usec = 0;
+  FD_ZERO(&readfds);
+  FD_SET(fd, &readfds);
+  return select(fd+1, &readfds, 0, 0, &delay)>0;
+}
+#endif
+
+/*
+** Handle the socket connection for the built-in HTTP server.
+**
+** Without persistent connections, make the connection the standard input
+** and output of the current process and return so that the caller can
+** handle the one request.
+**
+** With persistent connections, this process reads requests off the
+** connection itself, one at a time, and forks a child for each one.  The
+** child gets the complete request, and nothing more, on standard input
+** through a pipe and writes its reply directly to the connection.  This
+** routine returns 0 in each child.  The parent moves on to the next
+** request, which may already be buffered if the client is pipelining,
+** as long as the child's reply left the connection usable.
+*/
+static int cgi_http_connection(int connection){
+#if !defined(_WIN32)
+  Blob in;                     /* Bytes read but not yet handed to a child */
+  int *pReused;                /* Shared with each child */
+  int nRequest = 0;            /* Number of requests handled so far */
+
+  if( !httpKeepAlive.bEnable ) return cgi_http_connection_to_stdio(connection);
+  pReused = mmap(0, sizeof(int), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANON, -1, 0);
+  if( pReused==MAP_FAILED ) return cgi_http_connection_to_stdio(connection);
+  signal(SIGPIPE, SIG_IGN);
+  blob_zero(&in);
+  while( nRequest<MX_KEEPALIVE_REQUEST ){
+    int nHdr, nBody = 0, nReq, bKeep, bChunked, i;
+    const char *z;
+    int aPipe[2];
+    int child;
+
+    /* Read the request header, and then the body */
+    while( (nHdr = cgi_http_header_end(blob_buffer(&in), blob_size(&in)))<0 ){
+      char zBuf[8192];
+      int n;
+      if( blob_size(&in)>100000 ) goto end_connection;
+      if( !cgi_http_wait_readable(connection,
+                                  nRequest ? KEEPALIVE_TIMEOUT : 60) ){
+        goto end_connection;
+      }
+      n = (int)read(connection, zBuf, sizeof(zBuf));
+      if( n<=0 ) goto end_connection;
+      blob_append(&in, zBuf, n);
+    }
+    /* HTTP/1.1 clients keep the connection by default, and older clients
+    ** only when they ask for it */
+    z = blob_buffer(&in);
+    for(i=0; z[i]!='\n'; i++){}
+    if( i>0 && z[i-1]=='\r' ) i--;
+    bChunked = i>=8 && fossil_strnicmp(&z[i-8], "HTTP/1.1", 8)==0;
+    bKeep = bChunked;
+    if( (z = cgi_http_header_field(blob_buffer(&in), nHdr, "connection:"))!=0 ){
+      if( fossil_strnicmp(z, "close", 5)==0 ) bKeep = 0;
+      if( fossil_strnicmp(z, "keep-alive", 10)==0 ) bKeep = 1;
+    }
+    if( cgi_http_header_field(blob_buffer(&in), nHdr,
+                              "transfer-encoding:")!=0 ){
+      bKeep = 0;
+    }
+    z = cgi_http_header_field(blob_buffer(&in), nHdr, "content-length:");
+    if( z ) nBody = atoi(z);
+    if( nBody<0 ) goto end_connection;
+    nReq = nHdr + nBody;
+    while( blob_size(&in)<nReq ){
+      char zBuf[65536];
+      int n;
+      if( !cgi_http_wait_readable(connection, 60) ) goto end_connection;
+      n = (int)read(connection, zBuf, sizeof(zBuf));
+      if( n<=0 ) goto end_connection;
+      blob_append(&in, zBuf, n);
+    }
+
+    /* Let a child process handle the request */
+    *pReused = 0;
+    if( pipe(aPipe) ) goto end_connection;
+    child = fork();
+    if( child<0 ){
+      close(aPipe[0]);
+      close(aPipe[1]);
+      goto end_connection;
+    }
+    if( child==0 ){
+      int nErr = 0;
+      close(aPipe[1]);
+      close(0);
+      if( dup(aPipe[0])!=0 ) nErr++;
+      close(aPipe[0]);
+      close(1);
+      if( dup(connection)!=1 ) nErr++;
+      if( !g.fAnyTrace ){
+        close(2);
+        if( dup(connection)!=2 ) nErr++;
+      }
+      close(connection);
+      blob_reset(&in);
+      httpKeepAlive.bRequest = bKeep;
+      httpKeepAlive.bChunked = bChunked;
+      httpKeepAlive.pReused = pReused;
+      return nErr;
+    }
+    close(aPipe[0]);
+    z = blob_buffer(&in);
+    while( nReq>0 ){
+      int n = (int)write(aPipe[1], z, nReq);
+      if( n<=0 ) break;
+      z += n;
+      nReq -= n;
+    }
+    close(aPipe[1]);
+    nReq = nHdr + nBody;
+    memmove(blob_buffer(&in), blob_buffer(&in)+nReq, blob_size(&in)-nReq);
+    blob_resize(&in, blob_size(&in)-nReq);
+    while( waitpid(child, 0, 0)<0 && errno==EINTR ){}
+    if( !bKeep || !*pReused ) break;
+    nRequest++;
+  }
+end_connection:
+  close(connection);
+  exit(0);
+#endif
+  /* NOT REACHED */
+  return 1;
+}
+
 /*
 ** Implement an HTTP server daemon listening on port iPort.
 **
@@ -1759,6 +2129,13 @@ int cgi_http_server(
   struct sockaddr_in inaddr;   /* The socket address */
   int opt = 1;                 /* setsockopt flag */
   int iPort = mnPort;
+  int mxParallel = MAX_PARALLEL;  /* Slow down beyond this many children */
+
+  if( (flags & (HTTP_SERVER_KEEPALIVE|HTTP_SERVER_SCGI))
+                 ==HTTP_SERVER_KEEPALIVE ){
+    httpKeepAlive.bEnable = 1;
+    mxParallel = MAX_PARALLEL_KEEPALIVE;
+  }
 
   while( iPort<=mxPort ){
     memset(&inaddr, 0, sizeof(inaddr));
@@ -1821,9 +2198,9 @@ int cgi_http_server(
     }
   }
   while( 1 ){
-    if( nchildren>MAX_PARALLEL ){
+    if( nchildren>mxParallel ){
       /* Slow down if connections are arriving too fast */
-      sleep( nchildren-MAX_PARALLEL );
+      sleep( nchildren-mxParallel );
     }
     delay.tv_sec = 60;
     delay.tv_usec = 0;
@@ -1840,20 +2217,7 @@ int cgi_http_server(
           if( child>0 ) nchildren++;
           close(connection);
         }else{
-          int nErr = 0, fd;
-          close(0);
-          fd = dup(connection);
-          if( fd!=0 ) nErr++;
-          close(1);
-          fd = dup(connection);
-          if( fd!=1 ) nErr++;
-          if( !g.fAnyTrace ){
-            close(2);
-            fd = dup(connection);
-            if( fd!=2 ) nErr++;
-          }
-          close(connection);
-          return nErr;
+          return cgi_http_connection(connection);
         }
       }
     }
@@ -70,6 +70,7 @@ void fix_private_blob_dependencies(int showWarning){
 */
 void delete_private_content(void){
   fix_private_blob_dependencies(1);
+  xfer_ihash_forget();
   db_multi_exec(
     "DELETE FROM blob WHERE rid IN private;"
     "DELETE FROM delta WHERE rid IN private;"
@@ -116,6 +117,8 @@ void delete_private_content(void){
 **    --ssl-identity FILENAME    Use the SSL identity if requested by the server
 **    --ssh-command|-c SSH       Use SSH as the "ssh" command
 **    --httpauth|-B USER:PASS    Add HTTP Basic Authorization to requests
+**    -j|--jobs N                Expand artifacts in N worker processes
+**                               while rebuilding the meta-data
 **    -u|--unversioned           Also sync unversioned content
 **    -v|--verbose               Show more statistics in output
 **
@@ -128,6 +131,7 @@ void clone_cmd(void){
   int nErr = 0;
   int urlFlags = URL_PROMPT_PW | URL_REMEMBER;
   int syncFlags = SYNC_CLONE;
+  int nJob = sync_jobs_option();
 
   /* Also clone private branches */
   if( find_option("private",0,0)!=0 ) syncFlags |= SYNC_PRIVATE;
@@ -207,6 +211,7 @@ void clone_cmd(void){
     }
     db_open_repository(g.argv[3]);
   }
+  rebuild_jobs_begin(nJob);
   db_begin_transaction();
   fossil_print("Rebuilding repository meta-data...\n");
   rebuild_db(0, 1, 0);
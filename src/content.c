@@ -21,20 +21,38 @@
 #include "content.h"
 #include <assert.h>
 
+/*
+** One entry in the artifact retrieval cache.
+**
+** Entries are found by rid through a chained hash table and are also
+** kept on a doubly-linked list ordered by most recent use, so that both
+** lookup and eviction of the least recently used entry are O(1).
+*/
+typedef struct CacheLine CacheLine;
+struct CacheLine {
+  int rid;                  /* Artifact id */
+  int nDepth;               /* Number of deltas from rid to its baseline */
+  CacheLine *pHashNext;     /* Next entry in the same hash bucket */
+  CacheLine *pNewer;        /* Next more recently used entry */
+  CacheLine *pOlder;        /* Next less recently used entry */
+  Blob content;             /* Content of the artifact */
+};
+
 /*
 ** The artifact retrieval cache
 */
 static struct {
   i64 szTotal;         /* Total size of all entries in the cache */
+  i64 szLimit;         /* Upper bound on szTotal */
+  int limitKnown;      /* True once szLimit has been read from the settings */
   int n;               /* Current number of cache entries */
-  int nAlloc;          /* Number of slots allocated in a[] */
-  int nextAge;         /* Age counter for implementing LRU */
-  struct cacheLine {   /* One instance of this for each cache entry */
-    int rid;                  /* Artifact id */
-    int age;                  /* Age.  Newer is larger */
-    Blob content;             /* Content of the artifact */
-  } *a;                /* The positive cache */
-  Bag inCache;         /* Set of artifacts currently in cache */
+  int nHash;           /* Number of buckets in aHash[] */
+  CacheLine **aHash;   /* Hash table of entries keyed by rid */
+  CacheLine *pNewest;  /* Most recently used entry */
+  CacheLine *pOldest;  /* Least recently used entry.  Evicted first */
+  int nHit;            /* content_get() calls that found rid in the cache */
+  int nMiss;           /* content_get() calls that did not */
+  int nEvict;          /* Entries removed to stay within szLimit */
 
   /*
   ** The missing artifact cache.
@@ -50,69 +68,154 @@ static struct {
 } contentCache;
 
 /*
-** Remove the oldest element from the content cache
+** Return the maximum number of bytes of artifact content that the
+** cache may hold, as determined by the "content-cache-size" setting.
 */
-static void content_cache_expire_oldest(void){
-  int i;
-  int mnAge = contentCache.nextAge;
-  int mn = -1;
-  for(i=0; i<contentCache.n; i++){
-    if( contentCache.a[i].age<mnAge ){
-      mnAge = contentCache.a[i].age;
-      mn = i;
-    }
+static i64 content_cache_limit(void){
+  if( !contentCache.limitKnown ){
+    contentCache.szLimit = db_get_int("content-cache-size", 50000000);
+    if( contentCache.szLimit<0 ) contentCache.szLimit = 0;
+    contentCache.limitKnown = 1;
+  }
+  return contentCache.szLimit;
+}
+
+/*
+** Unlink entry p from the LRU list.
+*/
+static void content_cache_unlink(CacheLine *p){
+  if( p->pNewer ){
+    p->pNewer->pOlder = p->pOlder;
+  }else{
+    contentCache.pNewest = p->pOlder;
+  }
+  if( p->pOlder ){
+    p->pOlder->pNewer = p->pNewer;
+  }else{
+    contentCache.pOldest = p->pNewer;
+  }
+  p->pNewer = p->pOlder = 0;
+}
+
+/*
+** Make entry p the most recently used entry of the LRU list.
+*/
+static void content_cache_link_newest(CacheLine *p){
+  p->pOlder = contentCache.pNewest;
+  p->pNewer = 0;
+  if( contentCache.pNewest ){
+    contentCache.pNewest->pNewer = p;
+  }else{
+    contentCache.pOldest = p;
+  }
+  contentCache.pNewest = p;
+}
+
+/*
+** Find the cache entry for rid and mark it as most recently used.
+** Return NULL if rid is not in the cache.
+*/
+static CacheLine *content_cache_find(int rid){
+  CacheLine *p = 0;
+  if( contentCache.nHash>0 ){
+    p = contentCache.aHash[(unsigned)rid % contentCache.nHash];
+    while( p && p->rid!=rid ) p = p->pHashNext;
+  }
+  if( p==0 ) return 0;
+  if( p!=contentCache.pNewest ){
+    content_cache_unlink(p);
+    content_cache_link_newest(p);
   }
-  if( mn>=0 ){
-    bag_remove(&contentCache.inCache, contentCache.a[mn].rid);
-    contentCache.szTotal -= blob_size(&contentCache.a[mn].content);
-    blob_reset(&contentCache.a[mn].content);
-    contentCache.n--;
-    contentCache.a[mn] = contentCache.a[contentCache.n];
+  return p;
+}
+
+/*
+** Remove entry p from the content cache and free it.
+*/
+static void content_cache_remove(CacheLine *p){
+  CacheLine **pp = &contentCache.aHash[(unsigned)p->rid % contentCache.nHash];
+  while( *pp!=p ) pp = &(*pp)->pHashNext;
+  *pp = p->pHashNext;
+  content_cache_unlink(p);
+  contentCache.szTotal -= blob_size(&p->content);
+  contentCache.n--;
+  blob_reset(&p->content);
+  fossil_free(p);
+}
+
+/*
+** Double the number of buckets in the content cache hash table.
+*/
+static void content_cache_rehash(void){
+  int nNew = contentCache.nHash*2 + 61;
+  CacheLine **aNew = fossil_malloc( nNew*sizeof(aNew[0]) );
+  CacheLine *p;
+  memset(aNew, 0, nNew*sizeof(aNew[0]));
+  for(p=contentCache.pOldest; p; p=p->pNewer){
+    unsigned h = (unsigned)p->rid % nNew;
+    p->pHashNext = aNew[h];
+    aNew[h] = p;
   }
+  fossil_free(contentCache.aHash);
+  contentCache.aHash = aNew;
+  contentCache.nHash = nNew;
 }
 
 /*
-** Add an entry to the content cache.
+** Add an entry to the content cache.  nDepth is the number of deltas
+** between rid and its baseline.
 **
 ** This routines hands responsibility for the artifact over to the cache.
 ** The cache will deallocate memory when it has finished with it.
 */
-void content_cache_insert(int rid, Blob *pBlob){
-  struct cacheLine *p;
-  if( contentCache.n>500 || contentCache.szTotal>50000000 ){
-    i64 szBefore;
-    do{
-      szBefore = contentCache.szTotal;
-      content_cache_expire_oldest();
-    }while( contentCache.szTotal>50000000 && contentCache.szTotal<szBefore );
+void content_cache_insert(int rid, Blob *pBlob, int nDepth){
+  CacheLine *p;
+  i64 szLimit = content_cache_limit();
+  int sz = blob_size(pBlob);
+  unsigned h;
+  if( sz>szLimit ){
+    blob_reset(pBlob);
+    return;
+  }
+  if( contentCache.nHash>0 ){
+    for(p=contentCache.aHash[(unsigned)rid % contentCache.nHash];
+        p; p=p->pHashNext){
+      if( p->rid==rid ){
+        content_cache_remove(p);
+        break;
+      }
+    }
+  }
+  while( contentCache.szTotal+sz>szLimit && contentCache.pOldest ){
+    content_cache_remove(contentCache.pOldest);
+    contentCache.nEvict++;
   }
-  if( contentCache.n>=contentCache.nAlloc ){
-    contentCache.nAlloc = contentCache.nAlloc*2 + 10;
-    contentCache.a = fossil_realloc(contentCache.a,
-                             contentCache.nAlloc*sizeof(contentCache.a[0]));
+  if( contentCache.n>=contentCache.nHash ){
+    content_cache_rehash();
   }
-  p = &contentCache.a[contentCache.n++];
+  p = fossil_malloc( sizeof(*p) );
   p->rid = rid;
-  p->age = contentCache.nextAge++;
-  contentCache.szTotal += blob_size(pBlob);
+  p->nDepth = nDepth;
   p->content = *pBlob;
   blob_zero(pBlob);
-  bag_insert(&contentCache.inCache, rid);
+  h = (unsigned)rid % contentCache.nHash;
+  p->pHashNext = contentCache.aHash[h];
+  contentCache.aHash[h] = p;
+  content_cache_link_newest(p);
+  contentCache.szTotal += sz;
+  contentCache.n++;
 }
 
 /*
 ** Clear the content cache.
 */
 void content_clear_cache(void){
-  int i;
-  for(i=0; i<contentCache.n; i++){
-    blob_reset(&contentCache.a[i].content);
+  while( contentCache.pOldest ){
+    content_cache_remove(contentCache.pOldest);
   }
   bag_clear(&contentCache.missing);
   bag_clear(&contentCache.available);
-  bag_clear(&contentCache.inCache);
-  contentCache.n = 0;
-  contentCache.szTotal = 0;
+  contentCache.limitKnown = 0;
 }
 
 /*
@@ -229,8 +332,8 @@ static int content_of_blob(int rid, Blob *pBlob){
 */
 int content_get(int rid, Blob *pBlob){
   int rc;
-  int i;
   int nextRid;
+  CacheLine *pLine;
 
   assert( g.repositoryOpen );
   blob_zero(pBlob);
@@ -242,15 +345,12 @@ int content_get(int rid, Blob *pBlob){
   }
 
   /* Look for the artifact in the cache first */
-  if( bag_find(&contentCache.inCache, rid) ){
-    for(i=0; i<contentCache.n; i++){
-      if( contentCache.a[i].rid==rid ){
-        blob_copy(pBlob, &contentCache.a[i].content);
-        contentCache.a[i].age = contentCache.nextAge++;
-        return 1;
-      }
-    }
+  if( (pLine = content_cache_find(rid))!=0 ){
+    contentCache.nHit++;
+    blob_copy(pBlob, &pLine->content);
+    return 1;
   }
+  contentCache.nMiss++;
 
   nextRid = findSrcid(rid);
   if( nextRid==0 ){
@@ -260,13 +360,15 @@ int content_get(int rid, Blob *pBlob){
     int nAlloc = 10;
     int *a = 0;
     int mx;
-    Blob delta, next;
+    int nDepth;               /* Number of deltas from rid to its baseline */
+    int mnDepth;
+    Blob next;
 
     a = fossil_malloc( sizeof(a[0])*nAlloc );
     a[0] = rid;
     a[1] = nextRid;
     n = 1;
-    while( !bag_find(&contentCache.inCache, nextRid)
+    while( (pLine = content_cache_find(nextRid))==0
         && (nextRid = findSrcid(nextRid))>0 ){
       n++;
       if( n>=nAlloc ){
@@ -279,27 +381,50 @@ int content_get(int rid, Blob *pBlob){
       a[n] = nextRid;
     }
     mx = n;
-    rc = content_get(a[n], pBlob);
+    nDepth = mx + (pLine ? pLine->nDepth : 0);
+    mnDepth = cache_artifact_depth();
+    if( mnDepth>0 && nDepth>=mnDepth && cache_artifact_read(rid, pBlob) ){
+      free(a);
+      bag_insert(&contentCache.available, rid);
+      return 1;
+    }
+    if( pLine ){
+      blob_copy(pBlob, &pLine->content);
+      rc = 1;
+    }else{
+      rc = content_of_blob(a[n], pBlob);
+    }
     n--;
     while( rc && n>=0 ){
-      rc = content_of_blob(a[n], &delta);
-      if( rc ){
-        if( blob_delta_apply(pBlob, &delta, &next)<0 ){
-          rc = 1;
+      /* Apply deltas up to the next intermediate result that should go
+      ** into the cache, which is after every 8th delta. */
+      Blob aDelta[8];
+      int nDelta = 0;
+      int iBase = a[n+1];
+      int nBaseDepth = nDepth-(n+1);
+      int toCache = (mx-n)%8==0;
+      do{
+        rc = content_of_blob(a[n], &aDelta[nDelta]);
+        if( !rc ) break;
+        nDelta++;
+        n--;
+      }while( n>=0 && (mx-n)%8!=0 );
+      if( rc && blob_delta_apply_chain(pBlob, aDelta, nDelta, &next)>=0 ){
+        if( toCache ){
+          content_cache_insert(iBase, pBlob, nBaseDepth);
         }else{
-          blob_reset(&delta);
-          if( (mx-n)%8==0 ){
-            content_cache_insert(a[n+1], pBlob);
-          }else{
-            blob_reset(pBlob);
-          }
-          *pBlob = next;
+          blob_reset(pBlob);
         }
+        *pBlob = next;
       }
-      n--;
+      while( nDelta>0 ) blob_reset(&aDelta[--nDelta]);
     }
     free(a);
-    if( !rc ) blob_reset(pBlob);
+    if( !rc ){
+      blob_reset(pBlob);
+    }else if( mnDepth>0 && nDepth>=mnDepth ){
+      cache_artifact_write(rid, pBlob);
+    }
   }
   if( rc==0 ){
     bag_insert(&contentCache.missing, rid);
@@ -358,6 +483,70 @@ void test_content_rawget_cmd(void){
   blob_write_to_file(&content, zFile);
 }
 
+/*
+** COMMAND: test-content-cache-stats
+**
+** Usage: %fossil test-content-cache-stats ?ARTIFACT-ID ...? ?OPTIONS?
+**
+** Load the named artifacts, or every artifact in the repository if
+** no artifacts are named, through the artifact retrieval cache and
+** then report cache hits, misses, evictions and memory usage.
+**
+** Options:
+**    --limit N      Use a cache size limit of N bytes instead of the
+**                   value of the "content-cache-size" setting
+**    --repeat N     Load the set of artifacts N times.  Default: 1
+*/
+void test_content_cache_stats_cmd(void){
+  const char *zLimit;
+  const char *zRepeat;
+  int nRepeat;
+  int i;
+  Blob content;
+  Bag set;
+
+  db_find_and_open_repository(OPEN_ANY_SCHEMA, 0);
+  zLimit = find_option("limit",0,1);
+  zRepeat = find_option("repeat",0,1);
+  nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  verify_all_options();
+  content_clear_cache();
+  if( zLimit ){
+    contentCache.szLimit = atoi(zLimit);
+    contentCache.limitKnown = 1;
+  }
+  bag_init(&set);
+  if( g.argc>2 ){
+    for(i=2; i<g.argc; i++){
+      int rid = name_to_rid(g.argv[i]);
+      if( rid==0 ) fossil_fatal("%s", g.zErrMsg);
+      bag_insert(&set, rid);
+    }
+  }else{
+    Stmt q;
+    db_prepare(&q, "SELECT rid FROM blob WHERE size>=0 ORDER BY rid");
+    while( db_step(&q)==SQLITE_ROW ){
+      bag_insert(&set, db_column_int(&q, 0));
+    }
+    db_finalize(&q);
+  }
+  while( nRepeat-- > 0 ){
+    int rid;
+    for(rid=bag_first(&set); rid>0; rid=bag_next(&set, rid)){
+      content_get(rid, &content);
+      blob_reset(&content);
+    }
+  }
+  fossil_print("artifacts: %d\n", bag_count(&set));
+  fossil_print("hits:      %d\n", contentCache.nHit);
+  fossil_print("misses:    %d\n", contentCache.nMiss);
+  fossil_print("evictions: %d\n", contentCache.nEvict);
+  fossil_print("entries:   %d\n", contentCache.n);
+  fossil_print("bytes:     %lld\n", contentCache.szTotal);
+  fossil_print("limit:     %lld\n", content_cache_limit());
+  bag_clear(&set);
+}
+
 /*
 ** The following flag is set to disable the automatic calls to
 ** manifest_crosslink() when a record is dephantomized.  This
@@ -716,6 +905,7 @@ void content_undelta(int rid){
       db_finalize(&s);
       blob_reset(&x);
       db_multi_exec("DELETE FROM delta WHERE rid=%d", rid);
+      cache_artifact_forget(rid);
     }
   }
 }
@@ -842,6 +1032,74 @@ void test_content_deltify_cmd(void){
   content_deltify(atoi(g.argv[2]), atoi(g.argv[3]), atoi(g.argv[4]));
 }
 
+/*
+** Change the storage of rid so that it is a delta from the artifact nUp
+** steps further up its delta chain, rather than from its current source.
+** The new delta is made by composing the stored deltas along the way, so
+** none of the artifacts in between are expanded.
+**
+** Return the rid of the new source, or 0 if rid is not at least nUp
+** deltas deep or the deltas cannot be composed.  Return -1, and leave
+** rid unchanged, if the composed delta is not enough smaller than the
+** artifact itself to be worth storing, by the same test that
+** content_deltify() uses.
+*/
+int content_compose_chain(int rid, int nUp){
+  int *aPath;
+  int srcid;
+  Blob composed, delta, next;
+  int i;
+  Stmt s1, s2;
+
+  if( nUp<2 ) return 0;
+  aPath = fossil_malloc( (nUp+1)*sizeof(aPath[0]) );
+  aPath[0] = rid;
+  for(i=1; i<=nUp; i++){
+    aPath[i] = findSrcid(aPath[i-1]);
+    if( aPath[i]<=0 ) break;
+  }
+  if( i<=nUp || !content_of_blob(aPath[nUp-1], &composed) ){
+    fossil_free(aPath);
+    return 0;
+  }
+  for(i=nUp-2; i>=0; i--){
+    int rc;
+    if( !content_of_blob(aPath[i], &delta) ){
+      blob_reset(&composed);
+      fossil_free(aPath);
+      return 0;
+    }
+    rc = blob_delta_compose(&composed, &delta, &next)>=0;
+    blob_reset(&delta);
+    blob_reset(&composed);
+    if( !rc ){
+      fossil_free(aPath);
+      return 0;
+    }
+    composed = next;
+  }
+  srcid = aPath[nUp];
+  fossil_free(aPath);
+  if( blob_size(&composed) > content_size(rid, 0)*0.75 ){
+    blob_reset(&composed);
+    return -1;
+  }
+  blob_compress(&composed, &composed);
+  db_prepare(&s1, "UPDATE blob SET content=:data WHERE rid=%d", rid);
+  db_prepare(&s2, "REPLACE INTO delta(rid,srcid)VALUES(%d,%d)",
+             rid, srcid);
+  db_bind_blob(&s1, ":data", &composed);
+  db_begin_transaction();
+  db_exec(&s1);
+  db_exec(&s2);
+  db_end_transaction(0);
+  db_finalize(&s1);
+  db_finalize(&s2);
+  blob_reset(&composed);
+  verify_before_commit(rid);
+  return srcid;
+}
+
 /*
 ** Return true if Blob p looks like it might be a parsable control artifact.
 */
@@ -1185,6 +1443,8 @@ void test_content_erase(void){
       content_undelta(db_column_int(&q,0));
     }
     db_reset(&q);
+    cache_artifact_forget(rid);
+    xfer_ihash_forget();
     db_multi_exec("DELETE FROM blob WHERE rid=%d", rid);
     db_multi_exec("DELETE FROM delta WHERE rid=%d", rid);
   }
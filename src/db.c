@@ -1666,6 +1666,7 @@ void db_close(int reportErrors){
   db_end_transaction(1);
   pStmt = 0;
   db_close_config();
+  cache_artifact_close();
 
   /* If the localdb has a lot of unused free space,
   ** then VACUUM it as we shut down.
@@ -2733,11 +2734,16 @@ const Setting aSetting[] = {
 #endif
   { "clean-glob",       0,             40, 1, 0, ""                    },
   { "clearsign",        0,              0, 0, 0, "off"                 },
+  { "content-cache-size",0,            16, 0, 0, "50000000"            },
   { "crlf-glob",        0,             40, 1, 0, ""                    },
   { "crnl-glob",        0,             40, 1, 0, ""                    },
   { "default-perms",    0,             16, 0, 0, "u"                   },
+  { "delta-cache-depth",0,             16, 0, 0, "0"                   },
+  { "delta-cache-size", 0,             16, 0, 0, "100000000"           },
+  { "delta-encoder",    0,              5, 0, 0, "1"                   },
   { "diff-binary",      0,              0, 0, 0, "on"                  },
   { "diff-command",     0,             40, 0, 0, ""                    },
+  { "diff-jobs",        0,              5, 0, 0, "0"                   },
   { "dont-push",        0,              0, 0, 0, "off"                 },
   { "dotfiles",         0,              0, 1, 0, "off"                 },
   { "editor",           0,             32, 0, 0, ""                    },
@@ -2758,6 +2764,7 @@ const Setting aSetting[] = {
   { "localauth",        0,              0, 0, 0, "off"                 },
   { "main-branch",      0,             40, 0, 0, "trunk"               },
   { "manifest",         0,              5, 1, 0, ""                    },
+  { "manifest-cache-size",0,           16, 0, 0, "20000000"            },
   { "max-loadavg",      0,             25, 0, 0, "0.0"                 },
   { "max-upload",       0,             25, 0, 0, "250000"              },
   { "mtime-changes",    0,              0, 0, 0, "on"                  },
@@ -2768,6 +2775,7 @@ const Setting aSetting[] = {
   { "proxy",            0,             32, 0, 0, "off"                 },
   { "relative-paths",   0,              0, 0, 0, "on"                  },
   { "repo-cksum",       0,              0, 0, 0, "on"                  },
+  { "scan-jobs",        0,              5, 0, 0, "0"                   },
   { "self-register",    0,              0, 0, 0, "off"                 },
   { "ssh-command",      0,             40, 0, 0, ""                    },
   { "ssl-ca-location",  0,             40, 0, 0, ""                    },
@@ -2891,6 +2899,11 @@ const Setting *db_find_setting(const char *zName, int allowPrefix){
 **                     with gpg.  When disabled (the default), commits will
 **                     be unsigned.  Default: off
 **
+**    content-cache-size
+**                     Maximum number of bytes of expanded artifact content
+**                     held in memory to speed up the reconstruction of
+**                     delta chains.  Default: 50000000
+**
 **    crlf-glob        A comma or newline-separated list of GLOB patterns for
 **     (versionable)   text files in which it is ok to have CR, CR+LF or mixed
 **                     line endings. Set to "*" to disable CR+LF checking.
@@ -2900,6 +2913,23 @@ const Setting *db_find_setting(const char *zName, int allowPrefix){
 **                     information on permissions see Users page in Server
 **                     Administration of the HTTP UI. Default: u.
 **
+**    delta-cache-depth
+**                     If a positive integer N, artifacts that are N or more
+**                     deltas away from their baseline are saved fully
+**                     expanded in the cache file, if it exists.  See
+**                     "fossil cache" for details.  Default: 0
+**
+**    delta-cache-size
+**                     Maximum total size in bytes of the expanded artifacts
+**                     saved by delta-cache-depth.  Default: 100000000
+**
+**    delta-encoder    Which delta encoder to use when storing or sending
+**                     an artifact as a delta.  1 is the original encoder.
+**                     2 indexes the source at content-defined positions
+**                     rather than fixed 16-byte blocks and usually finds
+**                     smaller deltas.  Either way the deltas can be read by
+**                     every version of Fossil.  Default: 1
+**
 **    diff-binary      If TRUE (the default), permit files that may be binary
 **                     or that match the "binary-glob" setting to be used with
 **                     external diff programs.  If FALSE, skip these files.
@@ -2907,6 +2937,12 @@ const Setting *db_find_setting(const char *zName, int allowPrefix){
 **    diff-command     External command to run when performing a diff.
 **                     If undefined, the internal text diff will be used.
 **
+**    diff-jobs        Number of worker processes used to compute the diffs
+**                     of many files at once for "diff" and for the /vdiff
+**                     and /info pages.  1 means do all of the work in the
+**                     main process.  0 means one per CPU for commands and
+**                     none for web pages.  Default: 0
+**
 **    dont-push        Prevent this repository from pushing from client to
 **                     server.  Useful when setting up a private branch.
 **
@@ -2970,6 +3006,11 @@ const Setting *db_find_setting(const char *zName, int allowPrefix){
 **                     "manifest.tags".  The SQLite and Fossil repositories
 **                     both require manifests.  Default: off.
 **
+**    manifest-cache-size
+**                     Maximum number of bytes of parsed check-in manifests
+**                     held in memory so that they are not parsed again.
+**                     Default: 20000000
+**
 **    max-loadavg      Some CPU-intensive web pages (ex: /zip, /tarball, /blame)
 **                     are disallowed if the system load average goes above this
 **                     value.  "0.0" means no limit.  This only works on unix.
@@ -3005,6 +3046,12 @@ const Setting *db_find_setting(const char *zName, int allowPrefix){
 **                     Disable on large repositories for a performance
 **                     improvement.
 **
+**    scan-jobs        Number of worker processes used to stat and hash
+**                     the files of a large checkout when looking for
+**                     changes with "status", "changes", "commit" and
+**                     similar commands.  0 means one per CPU and 1 means
+**                     do all of the work in the main process.  Default: 0
+**
 **    self-register    Allow users to register themselves through the HTTP UI.
 **                     This is useful if you want to see other names than
 **                     "Anonymous" in e.g. ticketing system. On the other hand
@@ -28,6 +28,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "delta.h"
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 /*
 ** Macros for turning debugging printfs on and off
@@ -218,16 +221,17 @@ static int digit_count(int v){
 #endif
 
 /*
-** Compute a 32-bit big-endian checksum on the N-byte buffer.  If the
-** buffer is not a multiple of 4 bytes length, compute the sum that would
-** have occurred if the buffer was padded with zeros to the next multiple
-** of four bytes.
+** Add the big-endian value of each of the nWord 4-byte words at zIn to
+** sum and return the result.  zIn must be aligned to 4 bytes.
 */
-static unsigned int checksum(const char *zIn, size_t N){
+static unsigned int checksum_words(
+  const char *zIn,
+  size_t nWord,
+  unsigned int sum
+){
   static const int byteOrderTest = 1;
   const unsigned char *z = (const unsigned char *)zIn;
-  const unsigned char *zEnd = (const unsigned char*)&zIn[N&~3];
-  unsigned sum = 0;
+  const unsigned char *zEnd = &z[nWord*4];
   assert( (z - (const unsigned char*)0)%4==0 );  /* Four-byte alignment */
   if( 0==*(char*)&byteOrderTest ){
     /* This is a big-endian machine */
@@ -237,6 +241,29 @@ static unsigned int checksum(const char *zIn, size_t N){
     }
   }else{
     /* A little-endian machine */
+#if defined(__SSE2__)
+    /* Swap the bytes of each 16-bit half-word so that each 32-bit lane
+    ** holds H + (L<<16), where H and L are the big-endian values of the
+    ** first and second halves of the word.  The checksum wants the sum
+    ** of (H<<16) + L.  Keep the lane sums in x1 and the sums of L alone
+    ** in x2.  Then (x1<<16) + x2 is the answer, modulo 2**32, because
+    ** the L<<16 terms in x1 are shifted out. */
+    if( z+16<=zEnd ){
+      __m128i x1 = _mm_setzero_si128();
+      __m128i x2 = _mm_setzero_si128();
+      unsigned int a1[4], a2[4];
+      do{
+        __m128i v = _mm_loadu_si128((const __m128i*)z);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        x1 = _mm_add_epi32(x1, v);
+        x2 = _mm_add_epi32(x2, _mm_srli_epi32(v, 16));
+        z += 16;
+      }while( z+16<=zEnd );
+      _mm_storeu_si128((__m128i*)a1, x1);
+      _mm_storeu_si128((__m128i*)a2, x2);
+      sum += ((a1[0]+a1[1]+a1[2]+a1[3])<<16) + a2[0]+a2[1]+a2[2]+a2[3];
+    }
+#endif
 #if GCC_VERSION>=4003000
     while( z<zEnd ){
       sum += __builtin_bswap32(*(unsigned*)z);
@@ -248,28 +275,42 @@ static unsigned int checksum(const char *zIn, size_t N){
       z += 4;
     }
 #else
-    unsigned sum0 = 0;
-    unsigned sum1 = 0;
-    unsigned sum2 = 0;
-    while(N >= 16){
-      sum0 += ((unsigned)z[0] + z[4] + z[8] + z[12]);
-      sum1 += ((unsigned)z[1] + z[5] + z[9] + z[13]);
-      sum2 += ((unsigned)z[2] + z[6] + z[10]+ z[14]);
-      sum  += ((unsigned)z[3] + z[7] + z[11]+ z[15]);
-      z += 16;
-      N -= 16;
-    }
-    while(N >= 4){
-      sum0 += z[0];
-      sum1 += z[1];
-      sum2 += z[2];
-      sum  += z[3];
-      z += 4;
-      N -= 4;
+    {
+      unsigned sum0 = 0;
+      unsigned sum1 = 0;
+      unsigned sum2 = 0;
+      unsigned sum3 = 0;
+      while( z+16<=zEnd ){
+        sum0 += ((unsigned)z[0] + z[4] + z[8] + z[12]);
+        sum1 += ((unsigned)z[1] + z[5] + z[9] + z[13]);
+        sum2 += ((unsigned)z[2] + z[6] + z[10]+ z[14]);
+        sum3 += ((unsigned)z[3] + z[7] + z[11]+ z[15]);
+        z += 16;
+      }
+      while( z<zEnd ){
+        sum0 += z[0];
+        sum1 += z[1];
+        sum2 += z[2];
+        sum3 += z[3];
+        z += 4;
+      }
+      sum += sum3 + (sum2 << 8) + (sum1 << 16) + (sum0 << 24);
     }
-    sum += (sum2 << 8) + (sum1 << 16) + (sum0 << 24);
 #endif
   }
+  return sum;
+}
+
+/*
+** Add the last N bytes of a buffer, where N is less than 4, to sum as if
+** they were padded with zeros to a 4-byte word.
+*/
+static unsigned int checksum_tail(
+  const char *zIn,
+  size_t N,
+  unsigned int sum
+){
+  const unsigned char *z = (const unsigned char *)zIn;
   switch(N&3){
     case 3:   sum += (z[2] << 8);
     case 2:   sum += (z[1] << 16);
@@ -279,6 +320,17 @@ static unsigned int checksum(const char *zIn, size_t N){
   return sum;
 }
 
+/*
+** Compute a 32-bit big-endian checksum on the N-byte buffer.  If the
+** buffer is not a multiple of 4 bytes length, compute the sum that would
+** have occurred if the buffer was padded with zeros to the next multiple
+** of four bytes.
+*/
+static unsigned int checksum(const char *zIn, size_t N){
+  unsigned int sum = checksum_words(zIn, N/4, 0);
+  return checksum_tail(&zIn[N&~3], N&3, sum);
+}
+
 /*
 ** Create a new delta.
 **
@@ -524,6 +576,263 @@ int delta_create(
   return zDelta - zOrigDelta;
 }
 
+/*
+** delta_create_v2() indexes about one source position in every
+** 1<<DELTA_V2_SAMPLE, chosen by the content of the bytes ending at that
+** position rather than by its offset.  The target is probed only at
+** positions chosen the same way, so a run of shared text is found
+** wherever it lies in either file.
+*/
+#define DELTA_V2_SAMPLE  3
+
+/*
+** For very large sources, sample more sparsely so that the index holds
+** no more than about this many positions.
+*/
+#define DELTA_V2_MAX_INDEX  (1<<21)
+
+/*
+** delta_create_v2() looks at no more than this many candidate matches for
+** each sampled position in the target file.  This bounds the work done
+** per byte of output on highly repetitive input.
+*/
+#define DELTA_V2_MAX_PROBE  24
+
+/*
+** delta_create_v2() uses a "gear" rolling hash: h = (h<<1) + aGear[c] for
+** each byte c.  After 32 bytes every bit of earlier input has been shifted
+** out, so h depends only on the 32 most recent bytes.  Updating it costs
+** a shift and an add per byte, which is much cheaper than hash_next().
+*/
+static u32 aGear[256];
+
+/*
+** Fill in aGear[] with pseudo-random values the first time it is needed.
+*/
+static void delta_gear_init(void){
+  if( aGear[255]==0 ){
+    u32 x = 0x2545f491;
+    int i;
+    for(i=0; i<256; i++){
+      x ^= x<<13;
+      x ^= x>>17;
+      x ^= x<<5;
+      aGear[i] = x;
+    }
+  }
+}
+
+/*
+** Return the number of bytes, up to n, at the start of a[] and b[] that
+** are the same.
+*/
+static int delta_match_fwd(const char *zA, const char *zB, int n){
+  const unsigned char *a = (const unsigned char*)zA;
+  const unsigned char *b = (const unsigned char*)zB;
+  int i = 0;
+#if defined(__SSE2__) && GCC_VERSION>=4003000
+  while( i+16<=n ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&a[i]);
+    __m128i y = _mm_loadu_si128((const __m128i*)&b[i]);
+    unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if( m!=0xffff ) return i + __builtin_ctz(~m);
+    i += 16;
+  }
+#elif GCC_VERSION>=4003000 && defined(__BYTE_ORDER__) \
+      && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+  while( i+8<=n ){
+    unsigned long long x, y;
+    memcpy(&x, &a[i], 8);
+    memcpy(&y, &b[i], 8);
+    if( x!=y ) return i + __builtin_ctzll(x^y)/8;
+    i += 8;
+  }
+#endif
+  while( i<n && a[i]==b[i] ) i++;
+  return i;
+}
+
+/*
+** Return the number of bytes, up to n, immediately before a[] and b[]
+** that are the same.
+*/
+static int delta_match_back(const char *zA, const char *zB, int n){
+  const unsigned char *a = (const unsigned char*)zA;
+  const unsigned char *b = (const unsigned char*)zB;
+  int i = 0;
+#if defined(__SSE2__) && GCC_VERSION>=4003000
+  while( i+16<=n ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&a[-i-16]);
+    __m128i y = _mm_loadu_si128((const __m128i*)&b[-i-16]);
+    unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if( m!=0xffff ) return i + __builtin_clz(~m & 0xffff) - 16;
+    i += 16;
+  }
+#elif GCC_VERSION>=4003000 && defined(__BYTE_ORDER__) \
+      && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+  while( i+8<=n ){
+    unsigned long long x, y;
+    memcpy(&x, &a[-i-8], 8);
+    memcpy(&y, &b[-i-8], 8);
+    if( x!=y ) return i + __builtin_clzll(x^y)/8;
+    i += 8;
+  }
+#endif
+  while( i<n && a[-i-1]==b[-i-1] ) i++;
+  return i;
+}
+
+/*
+** Create a new delta using the second generation encoder.
+**
+** The output uses the same format as delta_create() and is read by the
+** same delta_apply(), and the same requirements on zDelta apply.  The
+** differences are all in how matches are found:
+**
+**   *  delta_create() indexes the source only at every NHASH-th byte, so
+**      a shared run of text is missed unless it covers one of those
+**      offsets in a way that lines up with the target.  Here both files
+**      are hashed at every byte with the gear hash, and a position is
+**      indexed (in the source) or probed (in the target) whenever the
+**      DELTA_V2_SAMPLE high-order bits of the hash are zero.  Shared
+**      text is found regardless of its alignment.
+**
+**   *  Matches are extended forwards and backwards 8 or 16 bytes at a
+**      time rather than one byte at a time.
+**
+**   *  No more than DELTA_V2_MAX_PROBE candidates are looked at for each
+**      probe of the target.
+*/
+int delta_create_v2(
+  const char *zSrc,      /* The source or pattern file */
+  unsigned int lenSrc,   /* Length of the source file */
+  const char *zOut,      /* The target file */
+  unsigned int lenOut,   /* Length of the target file */
+  char *zDelta           /* Write the delta into this buffer */
+){
+  const unsigned char *uSrc = (const unsigned char*)zSrc;
+  const unsigned char *uOut = (const unsigned char*)zOut;
+  int i, y, base;
+  char *zOrigDelta = zDelta;
+  u32 h;                     /* The gear hash */
+  int nSample;               /* Sample one position in 1<<nSample */
+  int shift;                 /* 32 minus log2 of the hash table size */
+  int nEntry = 0;            /* Number of entries in aPos[] and aNext[] */
+  int nAlloc;                /* Space allocated for aPos[] and aNext[] */
+  int *aBucket;              /* Hash table.  Most recent position first */
+  int *aPos;                 /* Source position of each entry */
+  int *aNext;                /* Collision chain, by entry number */
+
+  putInt(lenOut, &zDelta);
+  *(zDelta++) = '\n';
+  if( lenSrc<=NHASH ){
+    putInt(lenOut, &zDelta);
+    *(zDelta++) = ':';
+    memcpy(zDelta, zOut, lenOut);
+    zDelta += lenOut;
+    putInt(checksum(zOut, lenOut), &zDelta);
+    *(zDelta++) = ';';
+    return zDelta - zOrigDelta;
+  }
+  delta_gear_init();
+
+  /* Index the source.  Later positions go at the front of each chain so
+  ** that the nearest candidates are looked at first. */
+  for(nSample=DELTA_V2_SAMPLE; (lenSrc>>nSample)>DELTA_V2_MAX_INDEX;
+      nSample++){}
+  for(shift=26; shift>8 && (1<<(32-shift))<(int)(lenSrc>>nSample); shift--){}
+  aBucket = fossil_malloc( (1<<(32-shift))*sizeof(int) );
+  memset(aBucket, -1, (1<<(32-shift))*sizeof(int));
+  nAlloc = (lenSrc>>nSample)*2 + 4096;
+  aPos = fossil_malloc( nAlloc*sizeof(int) );
+  aNext = fossil_malloc( nAlloc*sizeof(int) );
+  h = 0;
+  for(i=0; i<(int)lenSrc; i++){
+    /* Written without branches, because whether or not a position is
+    ** sampled is unpredictable.  Every position is stored in aPos[] and
+    ** aNext[], but only the first nEntry elements are kept.  So check
+    ** for room only once every 4096 bytes. */
+    int isSampled, hv, iPrior;
+    if( (i&4095)==0 && nEntry+4096>nAlloc ){
+      nAlloc = nAlloc*2;
+      aPos = fossil_realloc(aPos, nAlloc*sizeof(int));
+      aNext = fossil_realloc(aNext, nAlloc*sizeof(int));
+    }
+    h = (h<<1) + aGear[uSrc[i]];
+    isSampled = (h>>(32-nSample))==0;
+    hv = (h<<nSample)>>shift;
+    iPrior = aBucket[hv];
+    aPos[nEntry] = i;
+    aNext[nEntry] = iPrior;
+    aBucket[hv] = isSampled ? nEntry : iPrior;
+    nEntry += isSampled;
+  }
+
+  /* Scan the target.  Everything before zOut[base] has been encoded.
+  ** h is the hash of the bytes up to and including zOut[y]. */
+  base = 0;
+  h = 0;
+  for(y=0; y<(int)lenOut; y++){
+    int limit = DELTA_V2_MAX_PROBE;
+    int iEntry;
+    int bestCnt = 0, bestOfst = 0, bestLitsz = 0;
+    h = (h<<1) + aGear[uOut[y]];
+    if( (h>>(32-nSample))!=0 ) continue;
+    iEntry = aBucket[(h<<nSample)>>shift];
+    while( iEntry>=0 && (limit--)>0 ){
+      int iSrc = aPos[iEntry];
+      int j, k, cnt, sz;
+      iEntry = aNext[iEntry];
+      if( zSrc[iSrc]!=zOut[y] ) continue;
+      j = delta_match_fwd(&zSrc[iSrc], &zOut[y],
+             lenSrc-iSrc < lenOut-y ? lenSrc-iSrc : lenOut-y);
+      k = delta_match_back(&zSrc[iSrc], &zOut[y],
+             iSrc < y-base ? iSrc : y-base);
+      cnt = j+k;
+      if( cnt<NHASH ) continue;
+      sz = digit_count(y-base-k)+digit_count(cnt)+digit_count(iSrc-k)+3;
+      if( cnt>=sz && cnt>bestCnt ){
+        bestCnt = cnt;
+        bestOfst = iSrc-k;
+        bestLitsz = y-base-k;
+        if( y+j>=(int)lenOut ) break;
+      }
+    }
+    if( bestCnt==0 ) continue;
+    if( bestLitsz>0 ){
+      putInt(bestLitsz, &zDelta);
+      *(zDelta++) = ':';
+      memcpy(zDelta, &zOut[base], bestLitsz);
+      zDelta += bestLitsz;
+      base += bestLitsz;
+    }
+    base += bestCnt;
+    putInt(bestCnt, &zDelta);
+    *(zDelta++) = '@';
+    putInt(bestOfst, &zDelta);
+    *(zDelta++) = ',';
+
+    /* Resume the scan at zOut[base] with the hash of the bytes before it */
+    h = 0;
+    for(i=base>32 ? base-32 : 0; i<base; i++){
+      h = (h<<1) + aGear[uOut[i]];
+    }
+    y = base-1;
+  }
+  if( base<(int)lenOut ){
+    putInt(lenOut-base, &zDelta);
+    *(zDelta++) = ':';
+    memcpy(zDelta, &zOut[base], lenOut-base);
+    zDelta += lenOut-base;
+  }
+  putInt(checksum(zOut, lenOut), &zDelta);
+  *(zDelta++) = ';';
+  fossil_free(aPos);
+  fossil_free(aNext);
+  fossil_free(aBucket);
+  return zDelta - zOrigDelta;
+}
+
 /*
 ** Return the size (in bytes) of the output from applying
 ** a delta.
@@ -544,6 +853,75 @@ int delta_output_size(const char *zDelta, int lenDelta){
 }
 
 
+/*
+** Read a base-64 integer starting at z[] into *pV and return a pointer
+** to the first character past its end.  This does the same job as
+** getInt() but keeps the cursor in a local variable of the caller, where
+** the compiler can hold it in a register across the memcpy() calls of
+** delta_apply().
+*/
+static const unsigned char *delta_int(
+  const unsigned char *z,
+  unsigned int *pV
+){
+  static const signed char zValue[] = {
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,    8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, 16,   17, 18, 19, 20, 21, 22, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, 32,   33, 34, 35, -1, -1, -1, -1, 36,
+    -1, 37, 38, 39, 40, 41, 42, 43,   44, 45, 46, 47, 48, 49, 50, 51,
+    52, 53, 54, 55, 56, 57, 58, 59,   60, 61, 62, -1, -1, -1, 63, -1,
+  };
+  unsigned int v = 0;
+  int c;
+  while( (c = zValue[0x7f&*z])>=0 ){
+    v = (v<<6) + c;
+    z++;
+  }
+  *pV = v;
+  return z;
+}
+
+/*
+** delta_apply() copies its output in slices of this many bytes, and adds
+** each slice to the checksum while it is still in cache.
+*/
+#define DELTA_APPLY_SLICE 16384
+
+/*
+** The output of delta_apply() and the part of the checksum computed so
+** far.  The first nSum bytes of zOut have been added to sum.
+*/
+typedef struct DeltaOut DeltaOut;
+struct DeltaOut {
+  char *zOut;              /* The output buffer */
+  unsigned int nOut;       /* Bytes written to zOut[] so far */
+  unsigned int nSum;       /* Bytes of zOut[] in sum.  A multiple of 4 */
+  unsigned int sum;        /* Checksum of the first nSum bytes */
+};
+
+/*
+** Append cnt bytes from zFrom to the output of delta_apply().
+*/
+static void delta_out(DeltaOut *p, const char *zFrom, unsigned int cnt){
+  while( cnt>0 ){
+    unsigned int n = cnt<DELTA_APPLY_SLICE ? cnt : DELTA_APPLY_SLICE;
+    memcpy(&p->zOut[p->nOut], zFrom, n);
+    p->nOut += n;
+    zFrom += n;
+    cnt -= n;
+#ifndef FOSSIL_OMIT_DELTA_CKSUM_TEST
+    if( p->nOut - p->nSum >= 64 ){
+      unsigned int nWord = (p->nOut - p->nSum)/4;
+      p->sum = checksum_words(&p->zOut[p->nSum], nWord, p->sum);
+      p->nSum += nWord*4;
+    }
+#endif
+  }
+}
+
 /*
 ** Apply a delta.
 **
@@ -561,6 +939,9 @@ int delta_output_size(const char *zDelta, int lenDelta){
 ** malformed or intended for use with a source file other than zSrc,
 ** then this routine returns -1.
 **
+** The checksum of the output is computed as the output is written,
+** rather than in a second pass over the finished output.
+**
 ** Refer to the delta_create() documentation above for a description
 ** of the delta file format.
 */
@@ -571,33 +952,34 @@ int delta_apply(
   int lenDelta,          /* Length of the delta */
   char *zOut             /* Write the output into this preallocated buffer */
 ){
+  const unsigned char *z = (const unsigned char*)zDelta;
+  const unsigned char *zEnd = &z[lenDelta];
   unsigned int limit;
-  unsigned int total = 0;
-#ifndef FOSSIL_OMIT_DELTA_CKSUM_TEST
-  char *zOrigOut = zOut;
-#endif
+  DeltaOut out;
 
-  limit = getInt(&zDelta, &lenDelta);
-  if( *zDelta!='\n' ){
+  out.zOut = zOut;
+  out.nOut = 0;
+  out.nSum = 0;
+  out.sum = 0;
+  z = delta_int(z, &limit);
+  if( *z!='\n' ){
     /* ERROR: size integer not terminated by "\n" */
     return -1;
   }
-  zDelta++; lenDelta--;
-  while( *zDelta && lenDelta>0 ){
+  z++;
+  while( z<zEnd && *z ){
     unsigned int cnt, ofst;
-    cnt = getInt(&zDelta, &lenDelta);
-    switch( zDelta[0] ){
+    z = delta_int(z, &cnt);
+    switch( z[0] ){
       case '@': {
-        zDelta++; lenDelta--;
-        ofst = getInt(&zDelta, &lenDelta);
-        if( lenDelta>0 && zDelta[0]!=',' ){
+        z = delta_int(z+1, &ofst);
+        if( z<zEnd && z[0]!=',' ){
           /* ERROR: copy command not terminated by ',' */
           return -1;
         }
-        zDelta++; lenDelta--;
+        z++;
         DEBUG1( printf("COPY %d from %d\n", cnt, ofst); )
-        total += cnt;
-        if( total>limit ){
+        if( out.nOut+cnt>limit || out.nOut+cnt<out.nOut ){
           /* ERROR: copy exceeds output file size */
           return -1;
         }
@@ -605,42 +987,40 @@ int delta_apply(
           /* ERROR: copy extends past end of input */
           return -1;
         }
-        memcpy(zOut, &zSrc[ofst], cnt);
-        zOut += cnt;
+        delta_out(&out, &zSrc[ofst], cnt);
         break;
       }
       case ':': {
-        zDelta++; lenDelta--;
-        total += cnt;
-        if( total>limit ){
+        z++;
+        if( out.nOut+cnt>limit || out.nOut+cnt<out.nOut ){
           /* ERROR:  insert command gives an output larger than predicted */
           return -1;
         }
         DEBUG1( printf("INSERT %d\n", cnt); )
-        if( cnt>lenDelta ){
+        if( z>zEnd || cnt>(unsigned int)(zEnd-z) ){
           /* ERROR: insert count exceeds size of delta */
           return -1;
         }
-        memcpy(zOut, zDelta, cnt);
-        zOut += cnt;
-        zDelta += cnt;
-        lenDelta -= cnt;
+        delta_out(&out, (const char*)z, cnt);
+        z += cnt;
         break;
       }
       case ';': {
-        zDelta++; lenDelta--;
-        zOut[0] = 0;
+        zOut[out.nOut] = 0;
 #ifndef FOSSIL_OMIT_DELTA_CKSUM_TEST
-        if( cnt!=checksum(zOrigOut, total) ){
+        out.sum = checksum_words(&zOut[out.nSum], (out.nOut-out.nSum)/4,
+                                 out.sum);
+        out.sum = checksum_tail(&zOut[out.nOut&~3], out.nOut&3, out.sum);
+        if( cnt!=out.sum ){
           /* ERROR:  bad checksum */
           return -1;
         }
 #endif
-        if( total!=limit ){
+        if( out.nOut!=limit ){
           /* ERROR: generated size does not match predicted size */
           return -1;
         }
-        return total;
+        return out.nOut;
       }
       default: {
         /* ERROR: unknown delta operator */
@@ -712,3 +1092,273 @@ int delta_analyze(
   /* ERROR: unterminated delta */
   return -1;
 }
+
+/*
+** One command of a delta, as parsed by delta_compose().  The command
+** writes cnt bytes of output starting at output offset iOut.  For a copy
+** command those bytes come from offset ofst of the source file.  For an
+** insert command they come from offset ofst of the delta itself.
+*/
+typedef struct DeltaCmd DeltaCmd;
+struct DeltaCmd {
+  unsigned int iOut;       /* Offset in the output of the first byte */
+  unsigned int cnt;        /* Number of bytes */
+  unsigned int ofst;       /* Offset in the source, or in the delta */
+  int isCopy;              /* True for a copy.  False for an insert */
+};
+
+/*
+** A delta under construction by delta_compose().  Copies and inserts
+** are held back in pending commands so that adjacent pieces can be
+** merged into a single command.
+*/
+typedef struct DeltaWriter DeltaWriter;
+struct DeltaWriter {
+  char *z;                 /* The delta written so far */
+  unsigned int n;          /* Bytes used in z[] */
+  unsigned int nAlloc;     /* Bytes allocated for z[] */
+  char *zLit;              /* Bytes of the pending insert */
+  unsigned int nLit;       /* Number of bytes in zLit[] */
+  unsigned int nLitAlloc;  /* Bytes allocated for zLit[] */
+  unsigned int nCopy;      /* Size of the pending copy.  0 if none */
+  unsigned int iCopy;      /* Source offset of the pending copy */
+};
+
+/*
+** Make sure there is room for at least n more bytes in p->z[].
+*/
+static void delta_writer_reserve(DeltaWriter *p, unsigned int n){
+  if( p->n+n > p->nAlloc ){
+    p->nAlloc = p->nAlloc*2 + n + 100;
+    p->z = fossil_realloc(p->z, p->nAlloc);
+  }
+}
+
+/*
+** Write out any pending copy or insert command.
+*/
+static void delta_writer_flush(DeltaWriter *p){
+  char *z;
+  if( p->nCopy ){
+    delta_writer_reserve(p, 16);
+    z = &p->z[p->n];
+    putInt(p->nCopy, &z);
+    *(z++) = '@';
+    putInt(p->iCopy, &z);
+    *(z++) = ',';
+    p->n = z - p->z;
+    p->nCopy = 0;
+  }
+  if( p->nLit ){
+    delta_writer_reserve(p, p->nLit+8);
+    z = &p->z[p->n];
+    putInt(p->nLit, &z);
+    *(z++) = ':';
+    memcpy(z, p->zLit, p->nLit);
+    p->n = z + p->nLit - p->z;
+    p->nLit = 0;
+  }
+}
+
+/*
+** Add a copy of cnt bytes from offset ofst of the source.
+*/
+static void delta_writer_copy(
+  DeltaWriter *p,
+  unsigned int cnt,
+  unsigned int ofst
+){
+  if( p->nCopy && p->iCopy+p->nCopy==ofst ){
+    p->nCopy += cnt;
+    return;
+  }
+  delta_writer_flush(p);
+  p->nCopy = cnt;
+  p->iCopy = ofst;
+}
+
+/*
+** Add an insert of the cnt bytes at z.
+*/
+static void delta_writer_insert(
+  DeltaWriter *p,
+  const char *z,
+  unsigned int cnt
+){
+  if( p->nCopy ) delta_writer_flush(p);
+  if( p->nLit+cnt > p->nLitAlloc ){
+    p->nLitAlloc = p->nLitAlloc*2 + cnt + 100;
+    p->zLit = fossil_realloc(p->zLit, p->nLitAlloc);
+  }
+  memcpy(&p->zLit[p->nLit], z, cnt);
+  p->nLit += cnt;
+}
+
+/*
+** Parse the delta zDelta into an array of commands.  Write the size of
+** the output into *pnOut and the checksum into *pCksum, and return the
+** number of commands.  Store a pointer to the array, obtained from
+** fossil_malloc(), in *paCmd.  Return -1 if the delta is malformed.
+*/
+static int delta_parse(
+  const char *zDelta,
+  int lenDelta,
+  DeltaCmd **paCmd,
+  unsigned int *pnOut,
+  unsigned int *pCksum
+){
+  const unsigned char *zStart = (const unsigned char*)zDelta;
+  const unsigned char *z = zStart;
+  const unsigned char *zEnd = &z[lenDelta];
+  DeltaCmd *aCmd = 0;
+  int nCmd = 0;
+  int nAlloc = 0;
+  unsigned int limit, total = 0;
+
+  *paCmd = 0;
+  z = delta_int(z, &limit);
+  if( *z!='\n' ) return -1;
+  z++;
+  while( z<zEnd && *z ){
+    unsigned int cnt, ofst;
+    z = delta_int(z, &cnt);
+    if( z[0]==';' ){
+      if( total!=limit ) break;
+      *paCmd = aCmd;
+      *pnOut = total;
+      *pCksum = cnt;
+      return nCmd;
+    }
+    if( total+cnt>limit || total+cnt<total ) break;
+    if( nCmd>=nAlloc ){
+      nAlloc = nAlloc*2 + 64;
+      aCmd = fossil_realloc(aCmd, nAlloc*sizeof(aCmd[0]));
+    }
+    if( z[0]=='@' ){
+      z = delta_int(z+1, &ofst);
+      if( z>=zEnd || z[0]!=',' ) break;
+      z++;
+      aCmd[nCmd].isCopy = 1;
+    }else if( z[0]==':' ){
+      z++;
+      if( z>zEnd || cnt>(unsigned int)(zEnd-z) ) break;
+      ofst = z - zStart;
+      z += cnt;
+      aCmd[nCmd].isCopy = 0;
+    }else{
+      break;
+    }
+    aCmd[nCmd].iOut = total;
+    aCmd[nCmd].cnt = cnt;
+    aCmd[nCmd].ofst = ofst;
+    nCmd++;
+    total += cnt;
+  }
+  fossil_free(aCmd);
+  return -1;
+}
+
+/*
+** Combine a delta from A to B with a delta from B to C to get a delta
+** from A to C, without A, B, or C.
+**
+** Each insert of zBC goes into the result unchanged.  Each copy in zBC
+** names a range of B.  That range is found among the commands of zAB,
+** by binary search, and replaced by the pieces of those commands that
+** cover it: copies from A, or bytes inserted by zAB.  Adjacent copies
+** from consecutive ranges of A, and adjacent inserts, are merged.  The
+** checksum of C is carried over from zBC.
+**
+** Write the new delta into memory obtained from fossil_malloc() and
+** store a pointer to it in *pzOut.  The new delta is NUL-terminated.
+** Return its length, or -1 if either input is malformed.
+*/
+int delta_compose(
+  const char *zAB,       /* Delta from A to B */
+  int lenAB,             /* Length of zAB */
+  const char *zBC,       /* Delta from B to C */
+  int lenBC,             /* Length of zBC */
+  char **pzOut           /* OUT: Write the delta from A to C here */
+){
+  DeltaCmd *aAB = 0, *aBC = 0;
+  int nAB, nBC;
+  unsigned int lenB, lenC, cksumB, cksumC;
+  DeltaWriter w;
+  int i, iAB;
+  char *z;
+
+  *pzOut = 0;
+  memset(&w, 0, sizeof(w));
+  nAB = delta_parse(zAB, lenAB, &aAB, &lenB, &cksumB);
+  if( nAB<0 ) return -1;
+  nBC = delta_parse(zBC, lenBC, &aBC, &lenC, &cksumC);
+  if( nBC<0 ){
+    fossil_free(aAB);
+    return -1;
+  }
+  delta_writer_reserve(&w, lenBC + 100);
+  z = w.z;
+  putInt(lenC, &z);
+  *(z++) = '\n';
+  w.n = z - w.z;
+  iAB = 0;
+  for(i=0; i<nBC; i++){
+    unsigned int pos, nLeft;
+    if( !aBC[i].isCopy ){
+      delta_writer_insert(&w, &zBC[aBC[i].ofst], aBC[i].cnt);
+      continue;
+    }
+    pos = aBC[i].ofst;
+    nLeft = aBC[i].cnt;
+    if( pos>lenB || nLeft>lenB-pos ) goto compose_error;
+    if( nLeft==0 ) continue;
+
+    /* Find the command of zAB that writes byte pos of B.  Copies in zBC
+    ** are often in increasing order, so try the next command first. */
+    if( iAB>=nAB || aAB[iAB].iOut>pos || aAB[iAB].iOut+aAB[iAB].cnt<=pos ){
+      int lo = 0, hi = nAB-1;
+      while( lo<hi ){
+        int mid = (lo+hi+1)/2;
+        if( aAB[mid].iOut<=pos ){
+          lo = mid;
+        }else{
+          hi = mid-1;
+        }
+      }
+      iAB = lo;
+    }
+    while( nLeft>0 ){
+      DeltaCmd *p = &aAB[iAB];
+      unsigned int skip = pos - p->iOut;
+      unsigned int n = p->cnt - skip;
+      if( n>nLeft ) n = nLeft;
+      if( p->isCopy ){
+        delta_writer_copy(&w, n, p->ofst+skip);
+      }else{
+        delta_writer_insert(&w, &zAB[p->ofst+skip], n);
+      }
+      pos += n;
+      nLeft -= n;
+      if( pos>=p->iOut+p->cnt ) iAB++;
+    }
+  }
+  delta_writer_flush(&w);
+  delta_writer_reserve(&w, 16);
+  z = &w.z[w.n];
+  putInt(cksumC, &z);
+  *(z++) = ';';
+  *z = 0;
+  w.n = z - w.z;
+  fossil_free(w.zLit);
+  fossil_free(aAB);
+  fossil_free(aBC);
+  *pzOut = w.z;
+  return w.n;
+
+compose_error:
+  fossil_free(w.z);
+  fossil_free(w.zLit);
+  fossil_free(aAB);
+  fossil_free(aBC);
+  return -1;
+}
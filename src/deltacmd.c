@@ -20,12 +20,32 @@
 #include "config.h"
 #include "deltacmd.h"
 
+/*
+** The delta encoder used by blob_delta_create().  1 is the original
+** delta_create() and 2 is delta_create_v2().  0 means that the
+** "delta-encoder" setting has not been read yet.
+*/
+static int deltaEncoder = 0;
+
+/*
+** Use encoder iEncoder for all subsequent calls to blob_delta_create().
+** Pass 0 to go back to using the "delta-encoder" setting.
+*/
+void delta_set_encoder(int iEncoder){
+  deltaEncoder = iEncoder;
+}
+
 /*
 ** Create a delta that describes the change from pOriginal to pTarget
-** and put that delta in pDelta.  The pDelta blob is assumed to be
-** uninitialized.
+** and put that delta in pDelta using encoder iEncoder.  The pDelta blob
+** is assumed to be uninitialized.
 */
-int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
+static void delta_create_with(
+  int iEncoder,
+  Blob *pOriginal,
+  Blob *pTarget,
+  Blob *pDelta
+){
   const char *zOrig, *zTarg;
   int lenOrig, lenTarg;
   int len;
@@ -35,10 +55,26 @@ int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
   lenOrig = blob_size(pOriginal);
   zTarg = blob_materialize(pTarget);
   lenTarg = blob_size(pTarget);
-  blob_resize(pDelta, lenTarg+16);
+  blob_resize(pDelta, lenTarg+60);
   zRes = blob_materialize(pDelta);
-  len = delta_create(zOrig, lenOrig, zTarg, lenTarg, zRes);
+  if( iEncoder==2 ){
+    len = delta_create_v2(zOrig, lenOrig, zTarg, lenTarg, zRes);
+  }else{
+    len = delta_create(zOrig, lenOrig, zTarg, lenTarg, zRes);
+  }
   blob_resize(pDelta, len);
+}
+
+/*
+** Create a delta that describes the change from pOriginal to pTarget
+** and put that delta in pDelta.  The pDelta blob is assumed to be
+** uninitialized.
+*/
+int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
+  if( deltaEncoder==0 ){
+    deltaEncoder = g.repositoryOpen ? db_get_int("delta-encoder", 1) : 1;
+  }
+  delta_create_with(deltaEncoder, pOriginal, pTarget, pDelta);
   return 0;
 }
 
@@ -142,6 +178,101 @@ int blob_delta_apply(Blob *pOriginal, Blob *pDelta, Blob *pTarget){
   return len;
 }
 
+/*
+** Combine the delta pAB, from some artifact A to B, with the delta pBC,
+** from B to C, into a single delta from A to C.  The pAC blob is assumed
+** to be uninitialized.
+**
+** Return the length of the new delta.  Return -1 if there is an error.
+*/
+int blob_delta_compose(Blob *pAB, Blob *pBC, Blob *pAC){
+  char *z;
+  int len = delta_compose(blob_buffer(pAB), blob_size(pAB),
+                          blob_buffer(pBC), blob_size(pBC), &z);
+  blob_zero(pAC);
+  if( len>=0 ){
+    blob_append(pAC, z, len);
+    fossil_free(z);
+  }
+  return len;
+}
+
+/*
+** Apply the nDelta deltas in aDelta[] to pOriginal one after another and
+** put the final result in pTarget.
+**
+** The deltas are first composed into a single delta from pOriginal to
+** the target, which is then applied once.  This avoids writing out every
+** intermediate artifact, which matters when the artifact is large and
+** the deltas are small.  If the deltas cannot be composed, they are
+** applied one by one using two buffers in turn.
+**
+** It works ok for pTarget and pOriginal to be the same blob.  With no
+** deltas at all, the target is a copy of the original.
+**
+** Return the length of the target.  Return -1 if there is an error.
+*/
+int blob_delta_apply_chain(
+  Blob *pOriginal,
+  Blob *aDelta,
+  int nDelta,
+  Blob *pTarget
+){
+  Blob aBuf[2];
+  Blob *pIn = pOriginal;
+  Blob composed, next;
+  int len = -1;
+  int i;
+
+  if( nDelta<=0 ){
+    if( pTarget!=pOriginal ) blob_copy(pTarget, pOriginal);
+    return blob_size(pTarget);
+  }
+  if( nDelta==1 ) return blob_delta_apply(pOriginal, &aDelta[0], pTarget);
+  composed = aDelta[0];
+  for(i=1; i<nDelta; i++){
+    if( blob_delta_compose(&composed, &aDelta[i], &next)<0 ) break;
+    if( i>1 ) blob_reset(&composed);
+    composed = next;
+  }
+  if( i==nDelta ){
+    len = blob_delta_apply(pOriginal, &composed, pTarget);
+    blob_reset(&composed);
+    return len;
+  }
+  if( i>1 ) blob_reset(&composed);
+
+  blob_zero(&aBuf[0]);
+  blob_zero(&aBuf[1]);
+  for(i=0; i<nDelta; i++){
+    Blob *pOut = &aBuf[i&1];
+    int n = delta_output_size(blob_buffer(&aDelta[i]), blob_size(&aDelta[i]));
+    if( n<0 ){
+      len = -1;
+      break;
+    }
+    blob_resize(pOut, n);
+    len = delta_apply(
+       blob_buffer(pIn), blob_size(pIn),
+       blob_buffer(&aDelta[i]), blob_size(&aDelta[i]),
+       blob_buffer(pOut));
+    if( len<0 ) break;
+    pIn = pOut;
+  }
+  if( pTarget==pOriginal ){
+    blob_reset(pOriginal);
+  }
+  if( len<0 ){
+    blob_reset(&aBuf[0]);
+    blob_reset(&aBuf[1]);
+    blob_zero(pTarget);
+  }else{
+    blob_reset(&aBuf[nDelta&1]);
+    *pTarget = aBuf[(nDelta-1)&1];
+  }
+  return len;
+}
+
 /*
 ** COMMAND: test-delta-apply
 **
@@ -182,16 +313,114 @@ void delta_apply_cmd(void){
 void cmd_test_delta(void){
   Blob f1, f2;     /* Original file content */
   Blob d12, d21;   /* Deltas from f1->f2 and f2->f1 */
+  Blob d11;        /* Composition of d12 and d21 */
   Blob a1, a2;     /* Recovered file content */
+  int iEncoder;
   if( g.argc!=4 ) usage("FILE1 FILE2");
   blob_read_from_file(&f1, g.argv[2]);
   blob_read_from_file(&f2, g.argv[3]);
-  blob_delta_create(&f1, &f2, &d12);
-  blob_delta_create(&f2, &f1, &d21);
-  blob_delta_apply(&f1, &d12, &a2);
-  blob_delta_apply(&f2, &d21, &a1);
-  if( blob_compare(&f1,&a1) || blob_compare(&f2, &a2) ){
-    fossil_fatal("delta test failed");
+  for(iEncoder=1; iEncoder<=2; iEncoder++){
+    delta_create_with(iEncoder, &f1, &f2, &d12);
+    delta_create_with(iEncoder, &f2, &f1, &d21);
+    blob_delta_apply(&f1, &d12, &a2);
+    blob_delta_apply(&f2, &d21, &a1);
+    if( blob_compare(&f1,&a1) || blob_compare(&f2, &a2) ){
+      fossil_fatal("delta test failed for encoder %d", iEncoder);
+    }
+    blob_reset(&a1);
+    blob_delta_compose(&d12, &d21, &d11);
+    blob_delta_apply(&f1, &d11, &a1);
+    if( blob_compare(&f1,&a1) ){
+      fossil_fatal("delta composition test failed for encoder %d", iEncoder);
+    }
+    blob_reset(&d11);
+    blob_reset(&d12);
+    blob_reset(&d21);
+    blob_reset(&a1);
+    blob_reset(&a2);
   }
   fossil_print("ok\n");
 }
+
+/*
+** COMMAND: test-delta-bench
+**
+** Usage: %fossil test-delta-bench ?OPTIONS?
+**
+** Take pairs of artifacts that the repository stores as deltas of one
+** another and encode each pair again with every delta encoder.  Report
+** the time taken to create and to apply the deltas and their total size
+** for each encoder, and check that every delta applies correctly.
+**
+** Options:
+**   --limit N        Use no more than N pairs.  Default: 500
+**   --min-size N     Skip artifacts smaller than N bytes.  Default: 0
+**   -R REPOSITORY    Use artifacts from REPOSITORY
+*/
+void delta_bench_cmd(void){
+  const char *zLimit = find_option("limit",0,1);
+  const char *zMinSize = find_option("min-size",0,1);
+  int nLimit = zLimit ? atoi(zLimit) : 500;
+  int szMin = zMinSize ? atoi(zMinSize) : 0;
+  sqlite3_uint64 aTime[3];
+  sqlite3_uint64 aApply[3];
+  sqlite3_int64 aSize[3];
+  int aBad[3];
+  char zBad[30];
+  sqlite3_int64 nByte = 0;
+  int nPair = 0;
+  int iEncoder;
+  Stmt q;
+
+  db_find_and_open_repository(0, 0);
+  verify_all_options();
+  memset(aTime, 0, sizeof(aTime));
+  memset(aApply, 0, sizeof(aApply));
+  memset(aSize, 0, sizeof(aSize));
+  memset(aBad, 0, sizeof(aBad));
+  db_prepare(&q,
+    "SELECT delta.rid, delta.srcid FROM delta, blob"
+    " WHERE blob.rid=delta.rid AND blob.size>=%d"
+    " ORDER BY delta.rid DESC LIMIT %d", szMin, nLimit);
+  while( db_step(&q)==SQLITE_ROW ){
+    Blob src, target;
+    if( !content_get(db_column_int(&q, 1), &src) ) continue;
+    if( !content_get(db_column_int(&q, 0), &target) ){
+      blob_reset(&src);
+      continue;
+    }
+    nPair++;
+    nByte += blob_size(&target);
+    for(iEncoder=1; iEncoder<=2; iEncoder++){
+      Blob delta, out;
+      int rc;
+      int iTimer = fossil_timer_start();
+      delta_create_with(iEncoder, &src, &target, &delta);
+      aTime[iEncoder] += fossil_timer_stop(iTimer);
+      aSize[iEncoder] += blob_size(&delta);
+      iTimer = fossil_timer_start();
+      rc = blob_delta_apply(&src, &delta, &out);
+      aApply[iEncoder] += fossil_timer_stop(iTimer);
+      if( rc<0 || blob_compare(&out, &target)!=0 ){
+        aBad[iEncoder]++;
+      }
+      blob_reset(&out);
+      blob_reset(&delta);
+    }
+    blob_reset(&src);
+    blob_reset(&target);
+  }
+  db_finalize(&q);
+  fossil_print("%d pairs, %lld bytes of target\n", nPair, nByte);
+  fossil_print("%-8s %12s %12s %10s %10s  %s\n",
+               "encoder", "delta-bytes", "microsec", "MB/s", "apply-MB/s",
+               "deltas");
+  for(iEncoder=1; iEncoder<=2; iEncoder++){
+    sqlite3_uint64 usec = aTime[iEncoder] ? aTime[iEncoder] : 1;
+    sqlite3_uint64 usecApply = aApply[iEncoder] ? aApply[iEncoder] : 1;
+    sqlite3_snprintf(sizeof(zBad), zBad, "%d WRONG", aBad[iEncoder]);
+    fossil_print("%-8d %12lld %12llu %10.1f %10.1f  %s\n", iEncoder,
+                 aSize[iEncoder], aTime[iEncoder], (double)nByte/(double)usec,
+                 (double)nByte/(double)usecApply, aBad[iEncoder] ? zBad : "ok");
+  }
+}
@@ -22,6 +22,488 @@
 #include "descendants.h"
 #include <assert.h>
 
+/*
+** The reachability label of a check-in, from the CIGEN table.
+*/
+typedef struct AncestryLabel AncestryLabel;
+struct AncestryLabel {
+  int gen;        /* Larger than the gen of every parent */
+  int depth;      /* Number of check-ins on the primary-parent chain */
+  int prim;       /* Primary parent, or 0 for a root */
+  int jump;       /* Skip pointer to an earlier primary ancestor */
+};
+
+/*
+** Cached result of ancestry_available(), or -1 if not yet known.
+*/
+static int ancestryAvail = -1;
+
+/*
+** Return true if the repository has a CIGEN table.  Repositories
+** created by older versions of Fossil gain one on the next rebuild.
+*/
+int ancestry_available(void){
+  if( ancestryAvail<0 ){
+    ancestryAvail = db_table_exists("repository", "cigen");
+  }
+  return ancestryAvail;
+}
+
+/*
+** Forget the cached result of ancestry_available().  Call this after
+** the repository schema is recreated.
+*/
+void ancestry_reset(void){
+  ancestryAvail = -1;
+}
+
+/*
+** Load the label for check-in rid into *p.  Return 0 if rid has no
+** label, either because it is not a check-in or because some ancestor
+** of it is still a phantom.
+*/
+static int ancestry_label(int rid, AncestryLabel *p){
+  static Stmt q;
+  int rc;
+  db_static_prepare(&q,
+    "SELECT gen, depth, prim, jump FROM cigen WHERE rid=:rid"
+  );
+  db_bind_int(&q, ":rid", rid);
+  rc = db_step(&q)==SQLITE_ROW;
+  if( rc ){
+    p->gen = db_column_int(&q, 0);
+    p->depth = db_column_int(&q, 1);
+    p->prim = db_column_int(&q, 2);
+    p->jump = db_column_int(&q, 3);
+  }
+  db_reset(&q);
+  return rc;
+}
+
+/*
+** Try to label check-in rid.  This succeeds only if every parent of rid
+** already has a label.  Return true if rid is labeled on return.
+**
+** Jump pointers follow the skew-binary scheme: a check-in jumps either
+** to its primary parent or, when the parent's two previous jumps are
+** the same length, to the target of the parent's jump's jump.  Finding
+** the primary ancestor at any depth then takes O(log N) steps.
+*/
+static int ancestry_label_one(int rid){
+  static Stmt q, ins;
+  AncestryLabel prim, pj, pjj;
+  int nParent, nLabeled, gen, prid;
+  int depth = 1;
+  int jump = rid;
+
+  if( ancestry_label(rid, &prim) ) return 1;
+  db_static_prepare(&q,
+    "SELECT count(*), count(cigen.rid), max(cigen.gen),"
+    "       max(CASE WHEN plink.isprim THEN plink.pid END)"
+    "  FROM plink LEFT JOIN cigen ON cigen.rid=plink.pid"
+    " WHERE plink.cid=:rid"
+  );
+  db_bind_int(&q, ":rid", rid);
+  db_step(&q);
+  nParent = db_column_int(&q, 0);
+  nLabeled = db_column_int(&q, 1);
+  gen = db_column_int(&q, 2) + 1;
+  prid = db_column_int(&q, 3);
+  db_reset(&q);
+  if( nLabeled<nParent ) return 0;
+  if( prid>0 && ancestry_label(prid, &prim) ){
+    depth = prim.depth + 1;
+    jump = prid;
+    if( ancestry_label(prim.jump, &pj) && ancestry_label(pj.jump, &pjj)
+     && prim.depth-pj.depth==pj.depth-pjj.depth
+    ){
+      jump = pj.jump;
+    }
+  }else{
+    prid = 0;
+  }
+  db_static_prepare(&ins,
+    "INSERT OR REPLACE INTO cigen(rid,gen,depth,prim,jump)"
+    " VALUES(:rid,:gen,:depth,:prim,:jump)"
+  );
+  db_bind_int(&ins, ":rid", rid);
+  db_bind_int(&ins, ":gen", gen);
+  db_bind_int(&ins, ":depth", depth);
+  db_bind_int(&ins, ":prim", prid);
+  db_bind_int(&ins, ":jump", jump);
+  db_step(&ins);
+  db_reset(&ins);
+  return 1;
+}
+
+/*
+** Label check-in rid, then every descendant of rid that was only
+** waiting for rid to be labeled.  This is called for each check-in
+** that manifest_crosslink() adds to the plink table.  Check-ins usually
+** arrive after their parents, so usually only rid itself is labeled.
+*/
+void ancestry_add(int rid){
+  static Stmt q;
+  Bag pending;
+  if( !ancestry_available() ) return;
+  bag_init(&pending);
+  bag_insert(&pending, rid);
+  db_static_prepare(&q, "SELECT cid FROM plink WHERE pid=:rid");
+  while( (rid = bag_first(&pending))!=0 ){
+    bag_remove(&pending, rid);
+    if( !ancestry_label_one(rid) ) continue;
+    db_bind_int(&q, ":rid", rid);
+    while( db_step(&q)==SQLITE_ROW ){
+      int cid = db_column_int(&q, 0);
+      AncestryLabel x;
+      if( !ancestry_label(cid, &x) ) bag_insert(&pending, cid);
+    }
+    db_reset(&q);
+  }
+  bag_clear(&pending);
+}
+
+/*
+** Remove the labels of check-in rid and all of its descendants.  This
+** is done before the parents of rid are changed.
+*/
+void ancestry_forget(int rid){
+  if( !ancestry_available() ) return;
+  db_multi_exec(
+    "WITH RECURSIVE dx(rid) AS ("
+    "  VALUES(%d)"
+    "  UNION"
+    "  SELECT plink.cid FROM plink, dx WHERE plink.pid=dx.rid"
+    ")"
+    "DELETE FROM cigen WHERE rid IN dx",
+    rid
+  );
+}
+
+/*
+** Recompute the entire CIGEN table.
+*/
+void ancestry_rebuild(void){
+  Stmt q;
+  if( !ancestry_available() ) return;
+  db_multi_exec("DELETE FROM cigen");
+  db_prepare(&q,
+    "SELECT objid FROM event WHERE type='ci' ORDER BY mtime"
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    ancestry_add(db_column_int(&q, 0));
+  }
+  db_finalize(&q);
+}
+
+/*
+** Return the primary ancestor of the check-in with label *p that is
+** at the given depth.  Return 0 if there is none.
+*/
+static int ancestry_at_depth(int rid, AncestryLabel *p, int depth){
+  AncestryLabel x = *p;
+  AncestryLabel y;
+  while( x.depth>depth ){
+    if( ancestry_label(x.jump, &y) && y.depth>=depth ){
+      rid = x.jump;
+    }else if( x.prim>0 && ancestry_label(x.prim, &y) ){
+      rid = x.prim;
+    }else{
+      return 0;
+    }
+    x = y;
+  }
+  return x.depth==depth ? rid : 0;
+}
+
+/*
+** Return true if check-in aid is an ancestor of check-in rid.  A check-in
+** counts as its own ancestor.  If directOnly is true, follow only primary
+** parent links.
+**
+** When both check-ins are labeled in the CIGEN table, a generation number
+** test rejects most non-ancestors immediately and jump pointers find
+** ancestors on the primary-parent chain in O(log N) steps.  Only
+** ancestors through merges require a walk, and that walk never goes below
+** the generation of aid.  Without labels, fall back to walking plink.
+*/
+int is_an_ancestor(int aid, int rid, int directOnly){
+  AncestryLabel a, r;
+  Stmt q;
+  Bag seen, pending;
+  int rc = 0;
+
+  if( aid==rid ) return 1;
+  if( aid<=0 || rid<=0 ) return 0;
+  if( !ancestry_available()
+   || !ancestry_label(aid, &a)
+   || !ancestry_label(rid, &r)
+  ){
+    return db_exists(
+      "WITH RECURSIVE ancestor(rid) AS ("
+      "  VALUES(%d)"
+      "  UNION"
+      "  SELECT plink.pid FROM plink, ancestor"
+      "   WHERE plink.cid=ancestor.rid %s"
+      ")"
+      "SELECT 1 FROM ancestor WHERE rid=%d",
+      rid, directOnly ? "AND plink.isprim" : "", aid
+    );
+  }
+  if( a.gen>=r.gen ) return 0;
+  if( a.depth<r.depth && ancestry_at_depth(rid, &r, a.depth)==aid ) return 1;
+  if( directOnly ) return 0;
+  bag_init(&seen);
+  bag_init(&pending);
+  bag_insert(&pending, rid);
+  db_prepare(&q,
+    "SELECT plink.pid, cigen.gen FROM plink, cigen"
+    " WHERE plink.cid=:rid AND cigen.rid=plink.pid AND cigen.gen>=%d",
+    a.gen
+  );
+  while( rc==0 && (rid = bag_first(&pending))!=0 ){
+    bag_remove(&pending, rid);
+    db_bind_int(&q, ":rid", rid);
+    while( db_step(&q)==SQLITE_ROW ){
+      int pid = db_column_int(&q, 0);
+      if( bag_insert(&seen, pid) ) bag_insert(&pending, pid);
+    }
+    db_reset(&q);
+    rc = bag_find(&seen, aid);
+  }
+  db_finalize(&q);
+  bag_clear(&seen);
+  bag_clear(&pending);
+  return rc;
+}
+
+
+/*
+** Fill the LEAVES table for compute_leaves() by testing each entry of
+** the LEAF table instead of walking every descendant of iBase.  A leaf
+** belongs if it can be reached from iBase through primary links and
+** through merges within a single branch.  Most leaves are found on the
+** primary-parent chain using jump pointers.  The rest are found by a
+** walk back from the leaf that stops at the generation of iBase.
+**
+** Return 0 without doing anything if some check-in lacks a label.
+*/
+static int compute_leaves_by_ancestry(int iBase){
+  AncestryLabel base, x;
+  Stmt q;       /* Leaves that might be descendants of iBase */
+  Stmt q1;      /* Query to find parents of a check-in */
+  Stmt ins;     /* INSERT statement for a new record */
+  Bag noPath;   /* Check-ins known not to descend from iBase */
+
+  if( !ancestry_available() ) return 0;
+  if( !ancestry_label(iBase, &base) ) return 0;
+  if( db_exists("SELECT 1 FROM leaf"
+                " WHERE NOT EXISTS(SELECT 1 FROM cigen WHERE rid=leaf.rid)") ){
+    return 0;
+  }
+  db_prepare(&q,
+    "SELECT leaf.rid FROM leaf, cigen"
+    " WHERE cigen.rid=leaf.rid AND (cigen.gen>%d OR leaf.rid=%d)",
+    base.gen, iBase
+  );
+  db_prepare(&q1,
+    "SELECT plink.pid FROM plink, cigen"
+    " WHERE plink.cid=:rid"
+    "   AND cigen.rid=plink.pid AND cigen.gen>=%d"
+    "   AND (isprim"
+    "        OR coalesce((SELECT value FROM tagxref"
+                        "   WHERE tagid=%d AND rid=plink.pid), 'trunk')"
+                 "=coalesce((SELECT value FROM tagxref"
+                        "   WHERE tagid=%d AND rid=plink.cid), 'trunk'))",
+    base.gen, TAG_BRANCH, TAG_BRANCH
+  );
+  db_prepare(&ins, "INSERT OR IGNORE INTO leaves VALUES(:rid)");
+  bag_init(&noPath);
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    int isDesc = rid==iBase;
+    if( !isDesc && ancestry_label(rid, &x) && x.depth>base.depth ){
+      isDesc = ancestry_at_depth(rid, &x, base.depth)==iBase;
+    }
+    if( !isDesc ){
+      Bag seen, pending;
+      int r;
+      bag_init(&seen);
+      bag_init(&pending);
+      bag_insert(&pending, rid);
+      while( !isDesc && (r = bag_first(&pending))!=0 ){
+        bag_remove(&pending, r);
+        db_bind_int(&q1, ":rid", r);
+        while( db_step(&q1)==SQLITE_ROW ){
+          int pid = db_column_int(&q1, 0);
+          if( bag_find(&noPath, pid) ) continue;
+          if( bag_insert(&seen, pid) ) bag_insert(&pending, pid);
+        }
+        db_reset(&q1);
+        isDesc = bag_find(&seen, iBase);
+      }
+      if( !isDesc ){
+        /* None of the check-ins seen lead to iBase.  Do not walk them
+        ** again for the next leaf. */
+        for(r=bag_first(&seen); r; r=bag_next(&seen, r)){
+          bag_insert(&noPath, r);
+        }
+      }
+      bag_clear(&seen);
+      bag_clear(&pending);
+    }
+    if( isDesc ){
+      db_bind_int(&ins, ":rid", rid);
+      db_step(&ins);
+      db_reset(&ins);
+    }
+  }
+  bag_clear(&noPath);
+  db_finalize(&ins);
+  db_finalize(&q1);
+  db_finalize(&q);
+  return 1;
+}
+
+/*
+** Fill the LEAVES table for compute_leaves() by walking forward from
+** iBase to all of its descendants.  If mxVisit is positive, give up
+** after visiting that many check-ins and return 0.  Return 1 if the
+** walk was completed.
+*/
+static int compute_leaves_by_walk(int iBase, int mxVisit){
+  Bag seen;     /* Descendants seen */
+  Bag pending;  /* Unpropagated descendants */
+  Stmt q1;      /* Query to find children of a check-in */
+  Stmt isBr;    /* Query to check to see if a check-in starts a new branch */
+  Stmt ins;     /* INSERT statement for a new record */
+  int nVisit = 0;   /* Number of check-ins visited */
+
+  /* Initialize the bags. */
+  bag_init(&seen);
+  bag_init(&pending);
+  bag_insert(&pending, iBase);
+
+  /* This query returns all non-branch-merge children of check-in :rid.
+  **
+  ** If a child is a merge of a fork within the same branch, it is
+  ** returned.  Only merge children in different branches are excluded.
+  */
+  db_prepare(&q1,
+    "SELECT cid FROM plink"
+    " WHERE pid=:rid"
+    "   AND (isprim"
+    "        OR coalesce((SELECT value FROM tagxref"
+                      "   WHERE tagid=%d AND rid=plink.pid), 'trunk')"
+               "=coalesce((SELECT value FROM tagxref"
+                      "   WHERE tagid=%d AND rid=plink.cid), 'trunk'))",
+    TAG_BRANCH, TAG_BRANCH
+  );
+
+  /* This query returns a single row if check-in :rid is the first
+  ** check-in of a new branch.
+  */
+  db_prepare(&isBr,
+     "SELECT 1 FROM tagxref"
+     " WHERE rid=:rid AND tagid=%d AND tagtype=2"
+     "   AND srcid>0",
+     TAG_BRANCH
+  );
+
+  /* This statement inserts check-in :rid into the LEAVES table.
+  */
+  db_prepare(&ins, "INSERT OR IGNORE INTO leaves VALUES(:rid)");
+
+  while( bag_count(&pending) ){
+    int rid = bag_first(&pending);
+    int cnt = 0;
+    if( mxVisit>0 && ++nVisit>mxVisit ) break;
+    bag_remove(&pending, rid);
+    db_bind_int(&q1, ":rid", rid);
+    while( db_step(&q1)==SQLITE_ROW ){
+      int cid = db_column_int(&q1, 0);
+      if( bag_insert(&seen, cid) ){
+        bag_insert(&pending, cid);
+      }
+      db_bind_int(&isBr, ":rid", cid);
+      if( db_step(&isBr)==SQLITE_DONE ){
+        cnt++;
+      }
+      db_reset(&isBr);
+    }
+    db_reset(&q1);
+    if( cnt==0 && !is_a_leaf(rid) ){
+      cnt++;
+    }
+    if( cnt==0 ){
+      db_bind_int(&ins, ":rid", rid);
+      db_step(&ins);
+      db_reset(&ins);
+    }
+  }
+  db_finalize(&ins);
+  db_finalize(&isBr);
+  db_finalize(&q1);
+  bag_clear(&pending);
+  bag_clear(&seen);
+  return nVisit<=mxVisit || mxVisit<=0;
+}
+
+/*
+** Fill the LEAVES table for compute_leaves() by walking forward from
+** iBase over the in-memory check-in DAG.  This is the same walk as
+** compute_leaves_by_walk() without a query for each check-in.
+*/
+static void compute_leaves_by_dag(int iBase){
+  CiDag *pDag = cidag_get();
+  u8 *aSeen;        /* True for nodes already seen */
+  int *aPending;    /* Stack of unpropagated descendants */
+  int nPending = 0;
+  Stmt ins;         /* INSERT statement for a new record */
+  int x;
+
+  x = cidag_node(pDag, iBase);
+  if( x<0 ){
+    if( is_a_leaf(iBase) ){
+      db_multi_exec("INSERT OR IGNORE INTO leaves VALUES(%d)", iBase);
+    }
+    return;
+  }
+  aSeen = fossil_malloc( pDag->nNode );
+  memset(aSeen, 0, pDag->nNode);
+  aPending = fossil_malloc( sizeof(int)*(pDag->nNode+1) );
+  aPending[nPending++] = x;
+  aSeen[x] = 1;
+  db_prepare(&ins, "INSERT OR IGNORE INTO leaves VALUES(:rid)");
+  while( nPending>0 ){
+    int cnt = 0;
+    int isLeaf = 1;
+    int i;
+    x = aPending[--nPending];
+    for(i=pDag->aChildIdx[x]; i<pDag->aChildIdx[x+1]; i++){
+      int c = pDag->aChild[i];
+      if( pDag->aBranch[c]==pDag->aBranch[x] ){
+        isLeaf = 0;
+      }else if( !pDag->aChildPrim[i] ){
+        /* A merge into a different branch */
+        continue;
+      }
+      if( !aSeen[c] ){
+        aSeen[c] = 1;
+        aPending[nPending++] = c;
+      }
+      if( !pDag->aBrStart[c] ) cnt++;
+    }
+    if( cnt==0 && isLeaf ){
+      db_bind_int(&ins, ":rid", pDag->aRid[x]);
+      db_step(&ins);
+      db_reset(&ins);
+    }
+  }
+  db_finalize(&ins);
+  fossil_free(aPending);
+  fossil_free(aSeen);
+}
 
 /*
 ** Create a temporary table named "leaves" if it does not
@@ -60,78 +542,18 @@ void compute_leaves(int iBase, int closeMode){
   );
 
   if( iBase>0 ){
-    Bag seen;     /* Descendants seen */
-    Bag pending;  /* Unpropagated descendants */
-    Stmt q1;      /* Query to find children of a check-in */
-    Stmt isBr;    /* Query to check to see if a check-in starts a new branch */
-    Stmt ins;     /* INSERT statement for a new record */
-
-    /* Initialize the bags. */
-    bag_init(&seen);
-    bag_init(&pending);
-    bag_insert(&pending, iBase);
-
-    /* This query returns all non-branch-merge children of check-in :rid.
-    **
-    ** If a child is a merge of a fork within the same branch, it is
-    ** returned.  Only merge children in different branches are excluded.
-    */
-    db_prepare(&q1,
-      "SELECT cid FROM plink"
-      " WHERE pid=:rid"
-      "   AND (isprim"
-      "        OR coalesce((SELECT value FROM tagxref"
-                        "   WHERE tagid=%d AND rid=plink.pid), 'trunk')"
-                 "=coalesce((SELECT value FROM tagxref"
-                        "   WHERE tagid=%d AND rid=plink.cid), 'trunk'))",
-      TAG_BRANCH, TAG_BRANCH
-    );
-
-    /* This query returns a single row if check-in :rid is the first
-    ** check-in of a new branch.
-    */
-    db_prepare(&isBr,
-       "SELECT 1 FROM tagxref"
-       " WHERE rid=:rid AND tagid=%d AND tagtype=2"
-       "   AND srcid>0",
-       TAG_BRANCH
-    );
-
-    /* This statement inserts check-in :rid into the LEAVES table.
-    */
-    db_prepare(&ins, "INSERT OR IGNORE INTO leaves VALUES(:rid)");
-
-    while( bag_count(&pending) ){
-      int rid = bag_first(&pending);
-      int cnt = 0;
-      bag_remove(&pending, rid);
-      db_bind_int(&q1, ":rid", rid);
-      while( db_step(&q1)==SQLITE_ROW ){
-        int cid = db_column_int(&q1, 0);
-        if( bag_insert(&seen, cid) ){
-          bag_insert(&pending, cid);
-        }
-        db_bind_int(&isBr, ":rid", cid);
-        if( db_step(&isBr)==SQLITE_DONE ){
-          cnt++;
-        }
-        db_reset(&isBr);
-      }
-      db_reset(&q1);
-      if( cnt==0 && !is_a_leaf(rid) ){
-        cnt++;
-      }
-      if( cnt==0 ){
-        db_bind_int(&ins, ":rid", rid);
-        db_step(&ins);
-        db_reset(&ins);
+    /* The walk is cheapest when iBase has few descendants.  When it
+    ** has many, use the in-memory DAG if some earlier path computation
+    ** already loaded it, or else the CIGEN table. */
+    int mxVisit = ancestry_available() ? 1000 : 0;
+    if( !compute_leaves_by_walk(iBase, mxVisit) ){
+      db_multi_exec("DELETE FROM leaves");
+      if( cidag_is_loaded() ){
+        compute_leaves_by_dag(iBase);
+      }else if( !compute_leaves_by_ancestry(iBase) ){
+        compute_leaves_by_walk(iBase, 0);
       }
     }
-    db_finalize(&ins);
-    db_finalize(&isBr);
-    db_finalize(&q1);
-    bag_clear(&pending);
-    bag_clear(&seen);
   }else{
     db_multi_exec(
       "INSERT INTO leaves"
@@ -162,6 +584,12 @@ void compute_leaves(int iBase, int closeMode){
 /*
 ** Load the record ID rid and up to |N|-1 closest ancestors into
 ** the "ok" table.  If N is zero, no limit.
+**
+** The CIGEN labels are not used here or in compute_descendants().  Both
+** return the N check-ins nearest in time, so they must visit every
+** check-in they return in mtime order, and a generation or jump pointer
+** cannot skip any of that work.  The timeline d= and p= queries
+** rely on these routines and are unchanged for the same reason.
 */
 void compute_ancestors(int rid, int N, int directOnly){
   if( !N ){
@@ -266,6 +694,49 @@ void compute_descendants(int rid, int N){
   );
 }
 
+/*
+** COMMAND: test-ancestor
+**
+** Usage: %fossil test-ancestor ?OPTIONS? VERSION1 VERSION2
+**
+** Report whether or not VERSION1 is an ancestor of VERSION2, along with
+** the labels for both in the CIGEN table.
+**
+** Options:
+**    --direct       Follow only primary parent links
+**    --rebuild      Recompute the CIGEN table first
+*/
+void test_ancestor_cmd(void){
+  int directOnly, rebuildFlag;
+  int i, aRid[2];
+
+  db_find_and_open_repository(0,0);
+  directOnly = find_option("direct",0,0)!=0;
+  rebuildFlag = find_option("rebuild",0,0)!=0;
+  verify_all_options();
+  if( g.argc!=4 ) usage("?OPTIONS? VERSION1 VERSION2");
+  if( rebuildFlag ){
+    if( !ancestry_available() ){
+      fossil_fatal("no CIGEN table: run \"fossil rebuild\"");
+    }
+    db_begin_transaction();
+    ancestry_rebuild();
+    db_end_transaction(0);
+  }
+  for(i=0; i<2; i++){
+    AncestryLabel x;
+    aRid[i] = name_to_typed_rid(g.argv[i+2], "ci");
+    if( ancestry_available() && ancestry_label(aRid[i], &x) ){
+      fossil_print("%s: rid=%d gen=%d depth=%d prim=%d jump=%d\n",
+                   g.argv[i+2], aRid[i], x.gen, x.depth, x.prim, x.jump);
+    }else{
+      fossil_print("%s: rid=%d unlabeled\n", g.argv[i+2], aRid[i]);
+    }
+  }
+  fossil_print("%s\n", is_an_ancestor(aRid[0], aRid[1], directOnly) ?
+               "ancestor" : "not an ancestor");
+}
+
 /*
 ** COMMAND: descendants*
 **
@@ -21,6 +21,14 @@
 #include "config.h"
 #include "diff.h"
 #include <assert.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#ifdef __GNUC__
+# define GCC_VERSION (__GNUC__*1000000+__GNUC_MINOR__*1000+__GNUC_PATCHLEVEL__)
+#else
+# define GCC_VERSION 0
+#endif
 
 
 #if INTERFACE
@@ -42,6 +50,8 @@
 #define DIFF_CONTEXT_EX   (((u64)0x04)<<32) /* Use context even if zero */
 #define DIFF_NOTTOOBIG    (((u64)0x08)<<32) /* Only display if not too big */
 #define DIFF_STRIP_EOLCR  (((u64)0x10)<<32) /* Strip trailing CR */
+#define DIFF_HISTOGRAM    (((u64)0x80)<<32) /* Use the histogram algorithm */
+#define DIFF_PATIENCE     (((u64)0x100)<<32) /* Use the patience algorithm */
 
 /*
 ** These error messages are shared in multiple locations.  They are defined
@@ -116,32 +126,80 @@ struct DContext {
   DLine *aTo;        /* File on right side of the diff */
   int nTo;           /* Number of lines in aTo[] */
   int (*same_fn)(const DLine*,const DLine*); /* comparison function */
+  int eAlgo;         /* One of the DIFF_ALGO_* values below */
 };
 
+/*
+** Allowed values for DContext.eAlgo
+*/
+#define DIFF_ALGO_CLASSIC    0   /* Divide and conquer on a long match */
+#define DIFF_ALGO_HISTOGRAM  1   /* Split on the rarest common lines */
+#define DIFF_ALGO_PATIENCE   2   /* Split on lines unique in both files */
+
 /*
 ** Count the number of lines in the input string.  Include the last line
 ** in the count even if it lacks the \n terminator.  If an empty string
-** is specified, the number of lines is zero.  For the purposes of this
-** function, a string is considered empty if it contains no characters
-** -OR- it contains only NUL characters.
+** is specified, the number of lines is zero.  Return 0 if the input
+** contains any NUL characters, as it is then considered binary.
+**
+** The input is scanned 16 bytes at a time where SSE2 is available.
 */
 static int count_lines(
   const char *z,
   int n,
   int *pnLine
 ){
-  int nLine;
-  const char *zNL, *z2;
-  for(nLine=0, z2=z; (zNL = strchr(z2,'\n'))!=0; z2=zNL+1, nLine++){}
-  if( z2[0]!='\0' ){
-    nLine++;
-    do{ z2++; }while( z2[0]!='\0' );
-  }
-  if( n!=(int)(z2-z) ) return 0;
+  int nLine = 0;
+  int i = 0;
+#if defined(__SSE2__) && GCC_VERSION>=4003000
+  const __m128i vNL = _mm_set1_epi8('\n');
+  const __m128i vZero = _mm_setzero_si128();
+  while( i+16<=n ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&z[i]);
+    if( _mm_movemask_epi8(_mm_cmpeq_epi8(x, vZero)) ) return 0;
+    nLine += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, vNL)));
+    i += 16;
+  }
+#endif
+  for(; i<n; i++){
+    if( z[i]=='\n' ){
+      nLine++;
+    }else if( z[i]==0 ){
+      return 0;
+    }
+  }
+  if( n>0 && z[n-1]!='\n' ) nLine++;
   if( pnLine ) *pnLine = nLine;
   return 1;
 }
 
+/*
+** Compute the hash of a line of text of n bytes.  The text is consumed
+** eight bytes at a time rather than one byte at a time, since profiling
+** shows that hashing is a large part of the cost of break_into_lines().
+** Only the upper LENGTH_MASK_SZ bits of the result are discarded by the
+** caller, so the final step mixes the high bits down.
+*/
+static unsigned int dline_hash(const char *z, int n){
+  u64 h = 0;
+  u64 w;
+  while( n>=8 ){
+    memcpy(&w, z, 8);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    z += 8;
+    n -= 8;
+  }
+  if( n>0 ){
+    w = 0;
+    memcpy(&w, z, n);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  }
+  h ^= h>>32;
+  h *= 0xd6e8feb86659fd93ULL;
+  h ^= h>>32;
+  return (unsigned int)h;
+}
+
 /*
 ** Return an array of DLine objects containing a pointer to the
 ** start of each line and a hash of that line.  The lower
@@ -180,7 +238,7 @@ static DLine *break_into_lines(
   }
   i = 0;
   do{
-    zNL = strchr(z,'\n');
+    zNL = memchr(z, '\n', n);
     if( zNL==0 ) zNL = z+n;
     nn = (int)(zNL - z);
     if( nn>LENGTH_MASK ){
@@ -211,21 +269,29 @@ static DLine *break_into_lines(
       }
       k -= numws;
     }else{
-      for(h=0, x=s; x<k; x++){
-        h += z[x];
-        h *= 0x9e3779b1;
-      }
+      h = dline_hash(&z[s], k-s);
     }
     a[i].indent = s;
     a[i].h = h = (h<<LENGTH_MASK_SZ) | (k-s);
-    h2 = h % nLine;
-    a[i].iNext = a[h2].iHash;
-    a[h2].iHash = i+1;
+    a[i].iNext = h % nLine;   /* Hash bucket.  Linked in below */
     z += nn+1; n -= nn+1;
     i++;
   }while( zNL[0]!='\0' && zNL[1]!='\0' );
   assert( i==nLine );
 
+  /* Link each line into the hash chain of its bucket.  This is done as
+  ** a separate pass so that the buckets, which are scattered at random
+  ** over a[], can be prefetched a few lines ahead of their use.  For a
+  ** large file, a cache miss on every line would otherwise dominate. */
+  for(i=0; i<nLine; i++){
+#if GCC_VERSION>=4003000
+    if( i+16<nLine ) __builtin_prefetch(&a[a[i+16].iNext]);
+#endif
+    h2 = a[i].iNext;
+    a[i].iNext = a[h2].iHash;
+    a[h2].iHash = i+1;
+  }
+
   /* Return results */
   *pnLine = nLine;
   return a;
@@ -325,6 +391,22 @@ static void appendDiffLineno(Blob *pOut, int lnA, int lnB, int html){
   if( html ) blob_append(pOut, "</span>", -1);
 }
 
+/*
+** Number of diff chunks output so far.  Each chunk of an HTML diff gets
+** an anchor "chunkN" that is unique within the page.
+*/
+static int nDiffChunk = 0;
+
+/*
+** Return the number of diff chunks output so far, and set that number
+** to n.
+*/
+int diff_chunk_count(int n){
+  int nOld = nDiffChunk;
+  nDiffChunk = n;
+  return nOld;
+}
+
 /*
 ** Given a raw diff p[] in which the p->aEdit[] array has been filled
 ** in, compute a context diff into pOut.
@@ -347,7 +429,6 @@ static void contextDiff(
   int i, j;     /* Loop counters */
   int m;        /* Number of lines to output */
   int skip;     /* Number of lines to skip */
-  static int nChunk = 0;  /* Number of diff chunks seen so far */
   int nContext;    /* Number of lines of context */
   int showLn;      /* Show line numbers */
   int html;        /* Render as HTML */
@@ -421,7 +502,7 @@ static void contextDiff(
     ** context diff that contains line numbers, show the separator from
     ** the previous block.
     */
-    nChunk++;
+    nDiffChunk++;
     if( showLn ){
       if( !showDivider ){
         /* Do not show a top divider */
@@ -431,7 +512,9 @@ static void contextDiff(
       }else{
         blob_appendf(pOut, "%.80c\n", '.');
       }
-      if( html ) blob_appendf(pOut, "<span id=\"chunk%d\"></span>", nChunk);
+      if( html ){
+        blob_appendf(pOut, "<span id=\"chunk%d\"></span>", nDiffChunk);
+      }
     }else{
       if( html ) blob_appendf(pOut, "<span class=\"diffln\">");
       /*
@@ -1189,7 +1272,6 @@ static void sbsDiff(
   int i, j;     /* Loop counters */
   int m, ma, mb;/* Number of lines to output */
   int skip;     /* Number of lines to skip */
-  static int nChunk = 0; /* Number of chunks of diff output seen so far */
   SbsLine s;    /* Output line buffer */
   int nContext; /* Lines of context above and below each change */
   int showDivider = 0;  /* True to show the divider */
@@ -1291,9 +1373,10 @@ static void sbsDiff(
       }
     }
     showDivider = 1;
-    nChunk++;
+    nDiffChunk++;
     if( s.escHtml ){
-      blob_appendf(s.apCols[SBS_LNA], "<span id=\"chunk%d\"></span>", nChunk);
+      blob_appendf(s.apCols[SBS_LNA], "<span id=\"chunk%d\"></span>",
+                   nDiffChunk);
     }
 
     /* Show the initial common area */
@@ -1659,6 +1742,341 @@ static void diff_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
   }
 }
 
+/*
+** Lines that occur more often than this within a region are never used
+** to split that region by the histogram algorithm.
+*/
+#define HIST_MAX_CHAIN 64
+
+/*
+** The histogram and patience algorithms recurse at most this deep.
+** Deeper regions are handed to diff_step() instead.
+*/
+#define DIFF_ALGO_MAX_DEPTH 64
+
+/*
+** Working storage for the histogram and patience algorithms.
+**
+** Every line of both files is first mapped to an equivalence class,
+** so that comparing two lines afterwards is a single integer compare.
+** The per-class counters are only valid for a class whose stamp matches
+** the generation number of the region currently being examined, which
+** avoids having to clear them between regions.
+*/
+typedef struct DiffAlgo DiffAlgo;
+struct DiffAlgo {
+  DContext *p;       /* The diff being computed */
+  int *aClsFrom;     /* Equivalence class of each line in p->aFrom[] */
+  int *aClsTo;       /* Equivalence class of each line in p->aTo[] */
+  int *aNext;        /* 1+(next line in aFrom[] of the same class) */
+  int *aHead;        /* 1+(first line in aFrom[] of each class) */
+  int *aCnt;         /* Occurrences of each class in the aFrom[] region */
+  int *aStamp;       /* Generation at which aHead[] and aCnt[] were set */
+  int *aCntTo;       /* Occurrences of each class in the aTo[] region */
+  int *aStampTo;     /* Generation at which aCntTo[] was set */
+  int iGen;          /* Generation number of the current region */
+};
+
+/*
+** Assign every line in the range iS1 through iE1-1 of aFrom[] and iS2
+** through iE2-1 of aTo[] to an equivalence class and allocate the working
+** storage of pAlgo.  Lines outside of those ranges are never examined.
+*/
+static void diff_algo_init(
+  DiffAlgo *pAlgo,
+  DContext *p,
+  int iS1, int iE1,
+  int iS2, int iE2
+){
+  int nLine = (iE1-iS1) + (iE2-iS2);
+  int nBkt = nLine>0 ? nLine : 1;
+  int nCls = 0;
+  int *aBkt;                /* 1+(first class in each hash bucket) */
+  int *aChain;              /* 1+(next class in the same bucket) */
+  const DLine **aRep;       /* A representative line for each class */
+  int i;
+
+  memset(pAlgo, 0, sizeof(*pAlgo));
+  pAlgo->p = p;
+  pAlgo->aClsFrom = fossil_malloc( sizeof(int)*(p->nFrom*2+p->nTo+1) );
+  pAlgo->aClsTo = pAlgo->aClsFrom + p->nFrom;
+  pAlgo->aNext = pAlgo->aClsTo + p->nTo;
+  aBkt = fossil_malloc( sizeof(int)*(nBkt+nLine) );
+  memset(aBkt, 0, sizeof(int)*nBkt);
+  aChain = aBkt + nBkt;
+  aRep = fossil_malloc( sizeof(aRep[0])*(nLine+1) );
+  for(i=0; i<nLine; i++){
+    int iLine = i<iE1-iS1 ? iS1+i : p->nFrom+iS2+i-(iE1-iS1);
+    const DLine *pLine = iLine<p->nFrom ? &p->aFrom[iLine]
+                                        : &p->aTo[iLine-p->nFrom];
+    int iBkt = pLine->h % nBkt;
+    int c;
+    for(c=aBkt[iBkt]; c>0; c=aChain[c-1]){
+      if( p->same_fn(aRep[c-1], pLine) ) break;
+    }
+    if( c==0 ){
+      aRep[nCls] = pLine;
+      aChain[nCls] = aBkt[iBkt];
+      aBkt[iBkt] = c = ++nCls;
+    }
+    pAlgo->aClsFrom[iLine] = c-1;
+  }
+  fossil_free(aRep);
+  fossil_free(aBkt);
+  pAlgo->aHead = fossil_malloc( sizeof(int)*(nCls*5+1) );
+  pAlgo->aCnt = pAlgo->aHead + nCls;
+  pAlgo->aStamp = pAlgo->aCnt + nCls;
+  pAlgo->aCntTo = pAlgo->aStamp + nCls;
+  pAlgo->aStampTo = pAlgo->aCntTo + nCls;
+  memset(pAlgo->aStamp, 0, sizeof(int)*nCls);
+  memset(pAlgo->aStampTo, 0, sizeof(int)*nCls);
+}
+
+/*
+** Release the working storage of pAlgo.
+*/
+static void diff_algo_free(DiffAlgo *pAlgo){
+  fossil_free(pAlgo->aClsFrom);
+  fossil_free(pAlgo->aHead);
+}
+
+/*
+** Start a new region consisting of lines iS1 through iE1-1 of aFrom[].
+** Count the occurrences of each class in the region and link together
+** the lines of each class in ascending order.
+*/
+static void diff_algo_count(DiffAlgo *pAlgo, int iS1, int iE1){
+  const int *aCls = pAlgo->aClsFrom;
+  int gen = ++pAlgo->iGen;
+  int i;
+  for(i=iE1-1; i>=iS1; i--){
+    int c = aCls[i];
+    if( pAlgo->aStamp[c]!=gen ){
+      pAlgo->aStamp[c] = gen;
+      pAlgo->aCnt[c] = 0;
+      pAlgo->aHead[c] = 0;
+    }
+    pAlgo->aNext[i] = pAlgo->aHead[c];
+    pAlgo->aHead[c] = i+1;
+    pAlgo->aCnt[c]++;
+  }
+}
+
+/*
+** Find the common sequence of lines on which the histogram algorithm
+** splits the region of lines iS1 through iE1-1 of aFrom[] and iS2 through
+** iE2-1 of aTo[].  This is the sequence containing the line that occurs
+** the fewest times in aFrom[], with ties going to the longest sequence.
+** Return false if every candidate line occurs more than HIST_MAX_CHAIN
+** times.
+*/
+static int histogram_split(
+  DiffAlgo *pAlgo,
+  int iS1, int iE1,          /* Range of lines in aFrom[] */
+  int iS2, int iE2,          /* Range of lines in aTo[] */
+  int *piSX, int *piEX,      /* Write aFrom[] common segment here */
+  int *piSY, int *piEY       /* Write aTo[] common segment here */
+){
+  const int *aA = pAlgo->aClsFrom;
+  const int *aB = pAlgo->aClsTo;
+  const int *aCnt = pAlgo->aCnt;
+  int bestLen = 0;
+  int bestCnt = HIST_MAX_CHAIN;
+  int j, k;
+
+  diff_algo_count(pAlgo, iS1, iE1);
+  for(j=iS2; j<iE2; ){
+    int c = aB[j];
+    int jNext = j+1;
+    if( pAlgo->aStamp[c]==pAlgo->iGen && aCnt[c]<=bestCnt ){
+      for(k=pAlgo->aHead[c]; k>0; k=pAlgo->aNext[k-1]){
+        int iSX = k-1, iSY = j, iEX = k, iEY = j+1;
+        int rc = aCnt[c];
+        while( iSX>iS1 && iSY>iS2 && aA[iSX-1]==aB[iSY-1] ){
+          iSX--;
+          iSY--;
+          if( aCnt[aA[iSX]]<rc ) rc = aCnt[aA[iSX]];
+        }
+        while( iEX<iE1 && iEY<iE2 && aA[iEX]==aB[iEY] ){
+          if( aCnt[aA[iEX]]<rc ) rc = aCnt[aA[iEX]];
+          iEX++;
+          iEY++;
+        }
+        if( iEX-iSX>bestLen || rc<bestCnt ){
+          bestLen = iEX-iSX;
+          bestCnt = rc;
+          *piSX = iSX;
+          *piEX = iEX;
+          *piSY = iSY;
+          *piEY = iEY;
+        }
+        if( iEY>jNext ) jNext = iEY;
+      }
+    }
+    j = jNext;
+  }
+  return bestLen>0;
+}
+
+/*
+** Compute the difference between lines iS1 through iE1-1 of aFrom[] and
+** lines iS2 through iE2-1 of aTo[] using the histogram algorithm: split
+** the region on a run of common lines that are rare in aFrom[], then
+** recurse on either side.  Regions in which no line is rare enough, or
+** that are nested more than DIFF_ALGO_MAX_DEPTH deep, are handed to
+** diff_step().
+*/
+static void diff_histogram(
+  DiffAlgo *pAlgo,
+  int iS1, int iE1,
+  int iS2, int iE2,
+  int nDepth                 /* Depth of recursion */
+){
+  DContext *p = pAlgo->p;
+  const int *aA = pAlgo->aClsFrom;
+  const int *aB = pAlgo->aClsTo;
+  int nSuffix = 0;
+  int iSX, iEX, iSY, iEY;
+
+  if( nDepth>DIFF_ALGO_MAX_DEPTH ){
+    diff_step(p, iS1, iE1, iS2, iE2);
+    return;
+  }
+  while( iE1>iS1 && iE2>iS2 && aA[iE1-1]==aB[iE2-1] ){
+    iE1--;
+    iE2--;
+    nSuffix++;
+  }
+  for(;;){
+    int nPrefix = 0;
+    while( iS1<iE1 && iS2<iE2 && aA[iS1]==aB[iS2] ){
+      iS1++;
+      iS2++;
+      nPrefix++;
+    }
+    if( nPrefix ) appendTriple(p, nPrefix, 0, 0);
+    if( iS1>=iE1 || iS2>=iE2 ){
+      if( iS1<iE1 || iS2<iE2 ) appendTriple(p, 0, iE1-iS1, iE2-iS2);
+      break;
+    }
+    if( !histogram_split(pAlgo, iS1, iE1, iS2, iE2, &iSX, &iEX, &iSY, &iEY) ){
+      diff_step(p, iS1, iE1, iS2, iE2);
+      break;
+    }
+    diff_histogram(pAlgo, iS1, iSX, iS2, iSY, nDepth+1);
+    appendTriple(p, iEX-iSX, 0, 0);
+    iS1 = iEX;
+    iS2 = iEY;
+  }
+  if( nSuffix ) appendTriple(p, nSuffix, 0, 0);
+}
+
+/*
+** Compute the difference between lines iS1 through iE1-1 of aFrom[] and
+** lines iS2 through iE2-1 of aTo[] using the patience algorithm.
+**
+** The lines that occur exactly once in both regions are matched up and
+** the longest increasing subsequence of those matches is found using
+** patience sorting.  Those lines become fixed points and the gaps between
+** them are diffed recursively.  Regions without any unique common line,
+** or nested more than DIFF_ALGO_MAX_DEPTH deep, are handed to diff_step().
+*/
+static void diff_patience(
+  DiffAlgo *pAlgo,
+  int iS1, int iE1,
+  int iS2, int iE2,
+  int nDepth                 /* Depth of recursion */
+){
+  DContext *p = pAlgo->p;
+  const int *aA = pAlgo->aClsFrom;
+  const int *aB = pAlgo->aClsTo;
+  int nSuffix = 0;
+  int nPrefix = 0;
+  int nMatch = 0;            /* Number of unique common lines */
+  int *aMatch;               /* aFrom[] index of each, in aTo[] order */
+  int *aMatchTo;             /* aTo[] index of each */
+  int *aPrev;                /* Predecessor of each match in the LIS */
+  int *aTail;                /* Last match of each pile */
+  int nPile = 0;
+  int i, j, gen;
+
+  if( nDepth>DIFF_ALGO_MAX_DEPTH ){
+    diff_step(p, iS1, iE1, iS2, iE2);
+    return;
+  }
+  while( iE1>iS1 && iE2>iS2 && aA[iE1-1]==aB[iE2-1] ){
+    iE1--;
+    iE2--;
+    nSuffix++;
+  }
+  while( iS1<iE1 && iS2<iE2 && aA[iS1]==aB[iS2] ){
+    iS1++;
+    iS2++;
+    nPrefix++;
+  }
+  if( nPrefix ) appendTriple(p, nPrefix, 0, 0);
+  if( iS1>=iE1 || iS2>=iE2 ){
+    if( iS1<iE1 || iS2<iE2 ) appendTriple(p, 0, iE1-iS1, iE2-iS2);
+    if( nSuffix ) appendTriple(p, nSuffix, 0, 0);
+    return;
+  }
+
+  /* Find the lines that are unique in both regions */
+  diff_algo_count(pAlgo, iS1, iE1);
+  gen = pAlgo->iGen;
+  for(j=iS2; j<iE2; j++){
+    int c = aB[j];
+    if( pAlgo->aStampTo[c]!=gen ){
+      pAlgo->aStampTo[c] = gen;
+      pAlgo->aCntTo[c] = 0;
+    }
+    pAlgo->aCntTo[c]++;
+  }
+  aMatch = fossil_malloc( sizeof(int)*4*(iE2-iS2) );
+  aMatchTo = aMatch + (iE2-iS2);
+  aPrev = aMatchTo + (iE2-iS2);
+  aTail = aPrev + (iE2-iS2);
+  for(j=iS2; j<iE2; j++){
+    int c = aB[j];
+    if( pAlgo->aStamp[c]==gen && pAlgo->aCnt[c]==1 && pAlgo->aCntTo[c]==1 ){
+      aMatch[nMatch] = pAlgo->aHead[c]-1;
+      aMatchTo[nMatch] = j;
+      nMatch++;
+    }
+  }
+
+  /* Patience sort the matches to find the longest subsequence that
+  ** is increasing in aFrom[] */
+  for(i=0; i<nMatch; i++){
+    int lo = 0, hi = nPile;
+    while( lo<hi ){
+      int mid = (lo+hi)/2;
+      if( aMatch[aTail[mid]]<aMatch[i] ) lo = mid+1; else hi = mid;
+    }
+    aPrev[i] = lo>0 ? aTail[lo-1] : -1;
+    aTail[lo] = i;
+    if( lo==nPile ) nPile++;
+  }
+
+  if( nPile==0 ){
+    diff_step(p, iS1, iE1, iS2, iE2);
+  }else{
+    /* Reverse the chain of predecessors into aTail[] and then diff the
+    ** gaps between consecutive fixed points */
+    for(i=nPile-1, j=aTail[nPile-1]; i>=0; i--, j=aPrev[j]) aTail[i] = j;
+    for(i=0; i<nPile; i++){
+      int k = aTail[i];
+      diff_patience(pAlgo, iS1, aMatch[k], iS2, aMatchTo[k], nDepth+1);
+      appendTriple(p, 1, 0, 0);
+      iS1 = aMatch[k]+1;
+      iS2 = aMatchTo[k]+1;
+    }
+    diff_patience(pAlgo, iS1, iE1, iS2, iE2, nDepth+1);
+  }
+  fossil_free(aMatch);
+  if( nSuffix ) appendTriple(p, nSuffix, 0, 0);
+}
+
 /*
 ** Compute the differences between two files already loaded into
 ** the DContext structure.
@@ -1673,6 +2091,10 @@ static void diff_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
 **
 ** Any common text at the beginning and end of the two files is
 ** removed before starting the divide-and-conquer algorithm.
+**
+** If p->eAlgo selects the histogram or patience algorithm, that is used
+** in place of the divide-and-conquer step.  Both fall back to it for
+** regions of the files that they cannot split.
 */
 static void diff_all(DContext *p){
   int mnE, iS, iE1, iE2;
@@ -1691,7 +2113,18 @@ static void diff_all(DContext *p){
   if( iS>0 ){
     appendTriple(p, iS, 0, 0);
   }
-  diff_step(p, iS, iE1, iS, iE2);
+  if( p->eAlgo==DIFF_ALGO_CLASSIC || iS>=iE1 || iS>=iE2 ){
+    diff_step(p, iS, iE1, iS, iE2);
+  }else{
+    DiffAlgo algo;
+    diff_algo_init(&algo, p, iS, iE1, iS, iE2);
+    if( p->eAlgo==DIFF_ALGO_PATIENCE ){
+      diff_patience(&algo, iS, iE1, iS, iE2, 0);
+    }else{
+      diff_histogram(&algo, iS, iE1, iS, iE2, 0);
+    }
+    diff_algo_free(&algo);
+  }
   if( iE1<p->nFrom ){
     appendTriple(p, p->nFrom - iE1, 0, 0);
   }
@@ -1878,6 +2311,11 @@ int *text_diff(
   }else{
     c.same_fn = same_dline;
   }
+  if( diffFlags & DIFF_HISTOGRAM ){
+    c.eAlgo = DIFF_ALGO_HISTOGRAM;
+  }else if( diffFlags & DIFF_PATIENCE ){
+    c.eAlgo = DIFF_ALGO_PATIENCE;
+  }
   c.aFrom = break_into_lines(blob_str(pA_Blob), blob_size(pA_Blob),
                              &c.nFrom, diffFlags);
   c.aTo = break_into_lines(blob_str(pB_Blob), blob_size(pB_Blob),
@@ -1938,10 +2376,26 @@ int *text_diff(
   }
 }
 
+/*
+** Return the DIFF_* flag that selects the diff algorithm called zName.
+** Raise an error if there is no such algorithm.
+*/
+u64 diff_algorithm_flag(const char *zName){
+  if( fossil_strcmp(zName,"histogram")==0 ) return DIFF_HISTOGRAM;
+  if( fossil_strcmp(zName,"patience")==0 ) return DIFF_PATIENCE;
+  if( fossil_strcmp(zName,"classic")!=0 && fossil_strcmp(zName,"default")!=0 ){
+    fossil_fatal("unknown diff algorithm \"%s\": should be one of"
+                 " classic, histogram, or patience", zName);
+  }
+  return 0;
+}
+
 /*
 ** Process diff-related command-line options and return an appropriate
 ** "diffFlags" integer.
 **
+**   --algorithm NAME           Diff algorithm to use  DIFF_HISTOGRAM
+**                                                     DIFF_PATIENCE
 **   --brief                    Show filenames only    DIFF_BRIEF
 **   -c|--context N             N lines of context.    DIFF_CONTEXT_MASK
 **   --html                     Format for HTML        DIFF_HTML
@@ -1984,6 +2438,9 @@ u64 diff_options(void){
   if( find_option("noopt",0,0)!=0 ) diffFlags |= DIFF_NOOPT;
   if( find_option("invert",0,0)!=0 ) diffFlags |= DIFF_INVERT;
   if( find_option("brief",0,0)!=0 ) diffFlags |= DIFF_BRIEF;
+  if( (z = find_option("algorithm",0,1))!=0 ){
+    diffFlags |= diff_algorithm_flag(z);
+  }
   return diffFlags;
 }
 
@@ -2052,6 +2509,133 @@ void test_diff_cmd(void){
   re_free(pRe);
 }
 
+/*
+** Return true if the COPY/DELETE/INSERT triples in R[] transform the
+** nFrom lines of aFrom[] into the nTo lines of aTo[].
+*/
+static int diff_triples_ok(
+  const int *R,
+  const DLine *aFrom, int nFrom,
+  const DLine *aTo, int nTo,
+  int (*same_fn)(const DLine*,const DLine*)
+){
+  int r, k, i = 0, j = 0;
+  for(r=0; R[r] || R[r+1] || R[r+2]; r += 3){
+    if( i+R[r]>nFrom || j+R[r]>nTo ) return 0;
+    for(k=0; k<R[r]; k++, i++, j++){
+      if( !same_fn(&aFrom[i], &aTo[j]) ) return 0;
+    }
+    i += R[r+1];
+    j += R[r+2];
+  }
+  return i==nFrom && j==nTo;
+}
+
+/*
+** COMMAND: test-diff-bench
+**
+** Usage: %fossil test-diff-bench ?OPTIONS?
+**
+** Diff the versions of files in the repository against their immediate
+** predecessors using every diff algorithm.  Report the time taken to split
+** the files into lines and to compute each diff, the number of changed
+** lines and of hunks in the diffs, and check that every diff is valid.
+** The usual diff options, such as -w, apply.
+**
+** Options:
+**   --limit N        Use no more than N pairs.  Default: 500
+**   --min-size N     Skip files smaller than N bytes.  Default: 0
+**   -R REPOSITORY    Use files from REPOSITORY
+*/
+void test_diff_bench_cmd(void){
+  static const char *azAlgo[] = { "classic", "histogram", "patience" };
+  const char *zLimit = find_option("limit",0,1);
+  const char *zMinSize = find_option("min-size",0,1);
+  int nLimit = zLimit ? atoi(zLimit) : 500;
+  int szMin = zMinSize ? atoi(zMinSize) : 0;
+  u64 diffFlags;
+  int (*same_fn)(const DLine*,const DLine*);
+  sqlite3_uint64 tmSplit = 0;
+  sqlite3_uint64 aTime[3];
+  sqlite3_int64 aChng[3];
+  int aHunk[3];
+  int aBad[3];
+  char zBad[30];
+  sqlite3_int64 nByte = 0;
+  sqlite3_int64 nLine = 0;
+  int nPair = 0;
+  int i;
+  Stmt q;
+
+  db_find_and_open_repository(0, 0);
+  diffFlags = diff_options() & ~(DIFF_HISTOGRAM|DIFF_PATIENCE);
+  verify_all_options();
+  if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
+    same_fn = same_dline_ignore_allws;
+  }else{
+    same_fn = same_dline;
+  }
+  memset(aTime, 0, sizeof(aTime));
+  memset(aChng, 0, sizeof(aChng));
+  memset(aHunk, 0, sizeof(aHunk));
+  memset(aBad, 0, sizeof(aBad));
+  db_prepare(&q,
+    "SELECT DISTINCT mlink.pid, mlink.fid FROM mlink, blob"
+    " WHERE mlink.pid>0 AND mlink.fid>0 AND mlink.pid!=mlink.fid"
+    "   AND blob.rid=mlink.fid AND blob.size>=%d"
+    " ORDER BY mlink.fid DESC LIMIT %d", szMin, nLimit);
+  while( db_step(&q)==SQLITE_ROW ){
+    Blob a, b;
+    DLine *aFrom, *aTo;
+    int nFrom, nTo, iTimer;
+    if( !content_get(db_column_int(&q, 0), &a) ) continue;
+    if( !content_get(db_column_int(&q, 1), &b) ){
+      blob_reset(&a);
+      continue;
+    }
+    blob_to_utf8_no_bom(&a, 0);
+    blob_to_utf8_no_bom(&b, 0);
+    iTimer = fossil_timer_start();
+    aFrom = break_into_lines(blob_str(&a), blob_size(&a), &nFrom, diffFlags);
+    aTo = break_into_lines(blob_str(&b), blob_size(&b), &nTo, diffFlags);
+    tmSplit += fossil_timer_stop(iTimer);
+    if( aFrom && aTo ){
+      nPair++;
+      nByte += blob_size(&a) + blob_size(&b);
+      nLine += nFrom + nTo;
+      for(i=0; i<3; i++){
+        u64 f = diffFlags | diff_algorithm_flag(azAlgo[i]);
+        int *R, r;
+        iTimer = fossil_timer_start();
+        R = text_diff(&a, &b, 0, 0, f);
+        aTime[i] += fossil_timer_stop(iTimer);
+        if( R==0 ) continue;
+        for(r=0; R[r] || R[r+1] || R[r+2]; r += 3){
+          aChng[i] += R[r+1] + R[r+2];
+          if( R[r+1] || R[r+2] ) aHunk[i]++;
+        }
+        if( !diff_triples_ok(R, aFrom, nFrom, aTo, nTo, same_fn) ) aBad[i]++;
+        fossil_free(R);
+      }
+    }
+    fossil_free(aFrom);
+    fossil_free(aTo);
+    blob_reset(&a);
+    blob_reset(&b);
+  }
+  db_finalize(&q);
+  fossil_print("%d pairs, %lld bytes, %lld lines\n", nPair, nByte, nLine);
+  fossil_print("split into lines: %llu microsec, %.1f MB/s\n", tmSplit,
+               (double)nByte/(double)(tmSplit ? tmSplit : 1));
+  fossil_print("%-10s %12s %10s %8s  %s\n",
+               "algorithm", "microsec", "changed", "hunks", "diffs");
+  for(i=0; i<3; i++){
+    sqlite3_snprintf(sizeof(zBad), zBad, "%d WRONG", aBad[i]);
+    fossil_print("%-10s %12llu %10lld %8d  %s\n", azAlgo[i], aTime[i],
+                 aChng[i], aHunk[i], aBad[i] ? zBad : "ok");
+  }
+}
+
 /**************************************************************************
 ** The basic difference engine is above.  What follows is the annotation
 ** engine.  Both are in the same file since they share many components.
@@ -2112,66 +2696,123 @@ static int annotation_start(Annotator *p, Blob *pInput, u64 diffFlags){
   return 0;
 }
 
+/* Annotation flags (any DIFF flag can be used as Annotation flag as well) */
+#define ANN_FILE_VERS   (((u64)0x20)<<32) /* File vers not commit vers */
+#define ANN_FILE_ANCEST (((u64)0x40)<<32) /* Prefer checkins in the ANCESTOR */
+
 /*
-** The input pParent is the next most recent ancestor of the file
-** being annotated.  Do another step of the annotation.  Return true
-** if additional annotation is required.
+** The BLAMECACHE table holds, for versions of files that have been
+** annotated before, the artifact ID of the file version that added each
+** of its lines.  The value depends on how whitespace is compared, so
+** the table is keyed by both the file rid and the whitespace mode.
+**
+** Because it is not listed among the permanent tables, "fossil rebuild"
+** drops the BLAMECACHE table and it is recreated as needed.
+**
+** Which version is taken as the parent of another can depend on the
+** order of MLINK rows, which prefers check-ins in the ANCESTOR table,
+** and on the versions already seen in the walk.  Only versions whose
+** history does not depend on either are saved.  See annotate_file().
 */
-static int annotation_step(
-  Annotator *p,
-  Blob *pParent,
-  int iVers,
-  u64 diffFlags
-){
-  int i, j;
-  int lnTo;
-
-  /* Prepare the parent file to be diffed */
-  p->c.aFrom = break_into_lines(blob_str(pParent), blob_size(pParent),
-                                &p->c.nFrom, diffFlags);
-  if( p->c.aFrom==0 ){
-    return 1;
-  }
+static const char zBlameCacheSchema[] =
+@ CREATE TABLE IF NOT EXISTS repository.blamecache(
+@   rid INTEGER,       -- The version of the file.  BLOB.RID
+@   mode INTEGER,      -- Whitespace handling.  See blame_cache_mode()
+@   nline INTEGER,     -- Number of lines in the file
+@   origin TEXT,       -- Runs of "RID*COUNT": origin of each line
+@   PRIMARY KEY(rid,mode)
+@ ) WITHOUT ROWID;
+;
 
-  /* Compute the differences going from pParent to the file being
-  ** annotated. */
-  diff_all(&p->c);
+/*
+** Return the value of BLAMECACHE.MODE for annotation flags diffFlags.
+*/
+static int blame_cache_mode(u64 diffFlags){
+  return (int)((diffFlags & DIFF_IGNORE_ALLWS)>>24)
+       | ((diffFlags & DIFF_STRIP_EOLCR)!=0 ? 4 : 0);
+}
 
-  /* Where new lines are inserted on this difference, record the
-  ** iVers as the source of the new line.
-  */
-  for(i=lnTo=0; i<p->c.nEdit; i+=3){
-    int nCopy = p->c.aEdit[i];
-    int nIns = p->c.aEdit[i+2];
-    lnTo += nCopy;
-    for(j=0; j<nIns; j++, lnTo++){
-      if( p->aOrig[lnTo].iVers<0 ){
-        p->aOrig[lnTo].iVers = iVers;
-      }
+/*
+** Return an array holding the origin of each line of file version rid,
+** from the BLAMECACHE table, and write the number of lines into *pnLine.
+** Return NULL if it is not there.  The caller must free the array.
+*/
+static int *blame_cache_read(int rid, u64 diffFlags, int *pnLine){
+  Stmt q;
+  int *aOrigin = 0;
+  if( !db_table_exists("repository", "blamecache") ) return 0;
+  db_prepare(&q,
+     "SELECT nline, origin FROM blamecache WHERE rid=%d AND mode=%d",
+     rid, blame_cache_mode(diffFlags));
+  if( db_step(&q)==SQLITE_ROW ){
+    int nLine = db_column_int(&q, 0);
+    const char *z = db_column_text(&q, 1);
+    int i = 0;
+    aOrigin = fossil_malloc( (nLine+1)*sizeof(aOrigin[0]) );
+    while( z && z[0] ){
+      char *zEnd;
+      int x = (int)strtol(z, &zEnd, 10);
+      int n;
+      if( zEnd[0]!='*' ) break;
+      n = (int)strtol(zEnd+1, &zEnd, 10);
+      while( n-- > 0 && i<nLine ) aOrigin[i++] = x;
+      z = zEnd[0]==' ' ? zEnd+1 : zEnd;
     }
+    if( i!=nLine ){
+      fossil_free(aOrigin);
+      aOrigin = 0;
+    }
+    *pnLine = nLine;
   }
-
-  /* Clear out the diff results */
-  fossil_free(p->c.aEdit);
-  p->c.aEdit = 0;
-  p->c.nEdit = 0;
-  p->c.nEditAlloc = 0;
-
-  /* Clear out the from file */
-  free(p->c.aFrom);
-
-  /* Return no errors */
-  return 0;
+  db_finalize(&q);
+  return aOrigin;
 }
 
-
-/* Annotation flags (any DIFF flag can be used as Annotation flag as well) */
-#define ANN_FILE_VERS   (((u64)0x20)<<32) /* File vers not commit vers */
-#define ANN_FILE_ANCEST (((u64)0x40)<<32) /* Prefer checkins in the ANCESTOR */
+/*
+** Save the origin of each of the nLine lines of file version rid in
+** the BLAMECACHE table, if the repository can be written.  Web requests
+** write only for users who can check in.
+*/
+static void blame_cache_write(
+  int rid,
+  u64 diffFlags,
+  const int *aOrigin,
+  int nLine
+){
+  Blob origin;
+  int i, j;
+  if( !db_is_writeable("repository") ) return;
+  if( g.cgiOutput && !g.perm.Write ) return;
+  db_multi_exec("%s", zBlameCacheSchema/*safe-for-%s*/);
+  blob_zero(&origin);
+  for(i=0; i<nLine; i=j){
+    for(j=i+1; j<nLine && aOrigin[j]==aOrigin[i]; j++){}
+    blob_appendf(&origin, "%s%d*%d", i ? " " : "", aOrigin[i], j-i);
+  }
+  db_multi_exec(
+     "REPLACE INTO blamecache(rid,mode,nline,origin)"
+     " VALUES(%d,%d,%d,%Q)",
+     rid, blame_cache_mode(diffFlags), nLine, blob_str(&origin));
+  blob_reset(&origin);
+}
 
 /*
 ** Compute a complete annotation on a file.  The file is identified
 ** by its filename number (filename.fnid) and check-in (mlink.mid).
+**
+** The origin of each line of a version of the file is the rid of the
+** file version that added it.  The origins for the oldest version looked
+** at are known if that is the first version of the file, or if they are
+** in the BLAMECACHE table.  The origins for each newer version then
+** follow from a single diff against its parent.  Complete results are
+** saved in BLAMECACHE, so annotating a new version of a file usually
+** takes one diff against its parent.
+**
+** A version is saved only if every step from it back to the oldest
+** version is unambiguous: all MLINK rows for the file version name the
+** same parent and that parent has not been seen yet.  The origins of
+** such a version are then the same no matter which check-in the
+** annotation started from, or how MLINK rows were ordered.
 */
 static void annotate_file(
   Annotator *p,        /* The annotator */
@@ -2181,11 +2822,21 @@ static void annotate_file(
   u64 annFlags         /* Flags to alter the annotation */
 ){
   Blob toAnnotate;     /* Text of the final (mid) version of the file */
-  Blob step;           /* Text of previous revision */
+  Blob parent;         /* Text of the parent of the next version */
   int rid;             /* Artifact ID of the file being annotated */
   Stmt q;              /* Query returning all ancestor versions */
   Stmt ins;            /* Inserts into the temporary VSEEN table */
+  Stmt amb;            /* True if the parent of a version is ambiguous */
   int cnt = 0;         /* Number of versions examined */
+  int *aVersFid = 0;   /* File rid for each entry of p->aVers[] */
+  int *aFid = 0;       /* Versions to diff, newest first */
+  int nFid = 0;        /* Number of entries in aFid[] */
+  int *aOrigin = 0;    /* Origin of each line of aFid[nFid-1] */
+  int nOrigin = 0;     /* Number of entries in aOrigin[] */
+  int isComplete = 0;  /* True if aOrigin[] is known and complete */
+  int iAmbig = -1;     /* Largest aFid[] index with an ambiguous parent */
+  DContext c;          /* Diff of a version against its parent */
+  int i, j, k;
 
   /* Initialize the annotation */
   rid = db_int(0, "SELECT fid FROM mlink WHERE mid=%d AND fnid=%d",mid,fnid);
@@ -2205,6 +2856,10 @@ static void annotate_file(
   );
 
   db_prepare(&ins, "INSERT OR IGNORE INTO vseen(rid) VALUES(:rid)");
+  db_prepare(&amb,
+    "SELECT count(DISTINCT pid)>1 OR max(pid IN vseen)"
+    "  FROM mlink WHERE fid=:rid"
+  );
   db_prepare(&q,
     "SELECT (SELECT uuid FROM blob WHERE rid=mlink.fid),"
     "       (SELECT uuid FROM blob WHERE rid=mlink.mid),"
@@ -2220,22 +2875,35 @@ static void annotate_file(
          "(mlink.mid IN (SELECT rid FROM ancestor)) DESC,":""
   );
 
+  /* Walk back through the history of the file, gathering the versions
+  ** to be shown and the versions to be diffed.  The latter stop at a
+  ** version in BLAMECACHE, or at the parent of the last version shown. */
   db_bind_int(&q, ":rid", rid);
-  if( iLimit==0 ) iLimit = 1000000000;
-  while( rid && iLimit>cnt && db_step(&q)==SQLITE_ROW ){
+  aFid = fossil_malloc( sizeof(aFid[0]) );
+  aFid[nFid++] = rid;
+  aOrigin = blame_cache_read(rid, annFlags, &nOrigin);
+  isComplete = aOrigin!=0;
+  while( rid && db_step(&q)==SQLITE_ROW ){
     int prevId = db_column_int(&q, 4);
-    p->aVers = fossil_realloc(p->aVers, (p->nVers+1)*sizeof(p->aVers[0]));
-    p->aVers[p->nVers].zFUuid = fossil_strdup(db_column_text(&q, 0));
-    p->aVers[p->nVers].zMUuid = fossil_strdup(db_column_text(&q, 1));
-    p->aVers[p->nVers].zDate = fossil_strdup(db_column_text(&q, 2));
-    p->aVers[p->nVers].zUser = fossil_strdup(db_column_text(&q, 3));
-    if( p->nVers ){
-      content_get(rid, &step);
-      blob_to_utf8_no_bom(&step, 0);
-      annotation_step(p, &step, p->nVers-1, annFlags);
-      blob_reset(&step);
-    }
-    p->nVers++;
+    if( iLimit>cnt ){
+      p->aVers = fossil_realloc(p->aVers, (p->nVers+1)*sizeof(p->aVers[0]));
+      aVersFid = fossil_realloc(aVersFid, (p->nVers+1)*sizeof(aVersFid[0]));
+      p->aVers[p->nVers].zFUuid = fossil_strdup(db_column_text(&q, 0));
+      p->aVers[p->nVers].zMUuid = fossil_strdup(db_column_text(&q, 1));
+      p->aVers[p->nVers].zDate = fossil_strdup(db_column_text(&q, 2));
+      p->aVers[p->nVers].zUser = fossil_strdup(db_column_text(&q, 3));
+      aVersFid[p->nVers] = rid;
+      p->nVers++;
+    }else{
+      break;
+    }
+    if( !isComplete ){
+      db_bind_int(&amb, ":rid", rid);
+      if( db_step(&amb)==SQLITE_ROW && db_column_int(&amb, 0) ){
+        iAmbig = nFid-1;
+      }
+      db_reset(&amb);
+    }
     db_bind_int(&ins, ":rid", rid);
     db_step(&ins);
     db_reset(&ins);
@@ -2243,11 +2911,118 @@ static void annotate_file(
     rid = prevId;
     db_bind_int(&q, ":rid", prevId);
     cnt++;
+    if( !isComplete ){
+      if( rid==0 ){
+        isComplete = 1;
+      }else{
+        aFid = fossil_realloc(aFid, (nFid+1)*sizeof(aFid[0]));
+        aFid[nFid++] = rid;
+        aOrigin = blame_cache_read(rid, annFlags, &nOrigin);
+        isComplete = aOrigin!=0;
+      }
+    }
   }
+  if( cnt>iLimit ) cnt = iLimit;
   p->bLimit = iLimit==cnt;
   db_finalize(&q);
   db_finalize(&ins);
+  db_finalize(&amb);
+
+  /* Find the origins of the lines of the oldest version to be diffed.
+  ** If they are not known, the lines are not attributed to anything. */
+  memset(&c, 0, sizeof(c));
+  c.same_fn = p->c.same_fn;
+  blob_zero(&parent);
+  if( nFid>1 ){
+    content_get(aFid[nFid-1], &parent);
+    blob_to_utf8_no_bom(&parent, 0);
+    c.aFrom = break_into_lines(blob_str(&parent), blob_size(&parent),
+                               &c.nFrom, annFlags);
+  }else{
+    c.aFrom = p->c.aTo;
+    c.nFrom = p->c.nTo;
+  }
+  if( aOrigin && nOrigin!=c.nFrom ){
+    fossil_free(aOrigin);
+    aOrigin = 0;
+    isComplete = 0;
+  }
+  if( aOrigin==0 ){
+    aOrigin = fossil_malloc( (c.nFrom+1)*sizeof(aOrigin[0]) );
+    for(i=0; i<c.nFrom; i++){
+      aOrigin[i] = isComplete ? aFid[nFid-1] : 0;
+    }
+    if( isComplete && c.aFrom && iAmbig<nFid-1 ){
+      blame_cache_write(aFid[nFid-1], annFlags, aOrigin, c.nFrom);
+    }
+  }
+
+  /* Go forward from the oldest version, diffing each version against
+  ** its parent.  Lines copied from the parent keep their origin and
+  ** inserted lines get the rid of the new version. */
+  for(k=nFid-2; k>=0 && c.aFrom; k--){
+    Blob child;
+    int *aNew;
+    int lnFrom, lnTo;
+    if( k==0 ){
+      c.aTo = p->c.aTo;
+      c.nTo = p->c.nTo;
+    }else{
+      content_get(aFid[k], &child);
+      blob_to_utf8_no_bom(&child, 0);
+      c.aTo = break_into_lines(blob_str(&child), blob_size(&child),
+                               &c.nTo, annFlags);
+    }
+    if( c.aTo==0 ){
+      if( k>0 ) blob_reset(&child);
+      break;
+    }
+    diff_all(&c);
+    aNew = fossil_malloc( (c.nTo+1)*sizeof(aNew[0]) );
+    for(i=lnFrom=lnTo=0; i<c.nEdit; i+=3){
+      for(j=0; j<c.aEdit[i]; j++) aNew[lnTo++] = aOrigin[lnFrom++];
+      lnFrom += c.aEdit[i+1];
+      for(j=0; j<c.aEdit[i+2]; j++) aNew[lnTo++] = aFid[k];
+    }
+    fossil_free(aOrigin);
+    aOrigin = aNew;
+    if( isComplete && iAmbig<k ){
+      blame_cache_write(aFid[k], annFlags, aOrigin, c.nTo);
+    }
+    fossil_free(c.aEdit);
+    c.aEdit = 0;
+    c.nEdit = 0;
+    c.nEditAlloc = 0;
+    fossil_free(c.aFrom);
+    blob_reset(&parent);
+    if( k>0 ){
+      parent = child;
+      c.aFrom = c.aTo;
+      c.nFrom = c.nTo;
+    }else{
+      c.aFrom = 0;
+    }
+  }
+  if( nFid>1 && k>=0 ) fossil_free(c.aFrom);
+  blob_reset(&parent);
   db_end_transaction(0);
+
+  /* Attribute each line to one of the versions in p->aVers[], or to
+  ** none if it is older than all of them. */
+  if( k<0 && p->c.aTo ){
+    for(i=0; i<p->nOrig; i=j){
+      int iVers = -1;
+      for(k=0; k<p->nVers; k++){
+        if( aVersFid[k]==aOrigin[i] ){ iVers = k; break; }
+      }
+      for(j=i; j<p->nOrig && aOrigin[j]==aOrigin[i]; j++){
+        p->aOrig[j].iVers = iVers;
+      }
+    }
+  }
+  fossil_free(aOrigin);
+  fossil_free(aFid);
+  fossil_free(aVersFid);
 }
 
 /*
@@ -20,6 +20,14 @@
 #include "config.h"
 #include "diffcmd.h"
 #include <assert.h>
+#include <errno.h>
+#if !defined(_WIN32)
+# include <unistd.h>
+# include <fcntl.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <sys/select.h>
+#endif
 
 /*
 ** Use the right null device for the platform.
@@ -148,6 +156,456 @@ void diff_print_filenames(const char *zLeft, const char *zRight, u64 diffFlags){
   fossil_free(z);
 }
 
+/*
+** Do not start workers to compute fewer than this many diffs each.
+*/
+#define DIFF_JOB_MIN 4
+
+/*
+** Send each worker at most this many diffs ahead of the one the caller
+** is waiting for, so that only a few files and results are held in
+** memory at a time.
+*/
+#define DIFF_JOB_AHEAD 4
+
+/*
+** A diff planned by diff_jobs_plan().  It compares artifact rid1 to
+** artifact rid2, or to the file zFile2 on disk if zFile2 is not NULL.
+** An rid of zero stands for an empty file.
+*/
+struct DiffJob {
+  int rid1, rid2;      /* Artifacts to compare */
+  char *zFile2;        /* Compare rid1 to this file instead of rid2 */
+  int isDone;          /* True when out holds the result */
+  int isTaken;         /* True once diff_jobs_take() has returned it */
+  int iJob;            /* Index of the worker it was sent to, or -1 */
+  int nChunk;          /* Number of diff chunks in out */
+  Blob out;            /* The output of text_diff(), chunks counted from 1 */
+};
+
+/*
+** The state of the diffs planned and the worker processes computing
+** them.  Only one set of diffs can be in progress at a time.
+*/
+static struct {
+  struct DiffJob *aDiff;   /* Planned diffs, in order */
+  int nDiff;               /* Number of entries in aDiff[] */
+  int nAlloc;              /* Space allocated for aDiff[] */
+  int iNext;               /* Where diff_jobs_take() starts looking */
+  int iSend;               /* Next planned diff to send to a worker */
+  u64 diffFlags;           /* Flags used to compute the diffs */
+  int nJob;                /* Number of workers.  0 if none are running */
+  struct DiffWorker {
+    int pid;                 /* Process id of the worker */
+    int fdIn;                /* Send requests to the worker here */
+    int fdOut;               /* Receive results from the worker here */
+    int nPending;            /* Number of requests not yet answered */
+    int isEof;               /* The worker has finished or failed */
+    Blob in;                 /* Bytes received and not yet used */
+    int iIn;                 /* Bytes of in that have been used */
+  } *aJob;
+} diffJobs;
+
+#if !defined(_WIN32)
+/*
+** The body of a worker process.  Read requests from fdIn, each a header
+** of 1+(index of the diff) and the sizes of the two files, followed by
+** the content of both files.  A request with an index of zero ends the
+** input.  Compute each diff and write 1+(index of the diff), the size of
+** the output and the number of diff chunks in it, followed by the output,
+** to fdOut.  Never returns.
+*/
+static void diff_job_main(int fdIn, int fdOut, ReCompiled *pRe){
+  unsigned char aHdr[12];
+  Blob a, b, out;
+  while( 1 ){
+    int iDiff, nA, nB;
+    if( fossil_fd_read(fdIn, aHdr, 12) ) _exit(1);
+    iDiff = fossil_get32(aHdr);
+    if( iDiff==0 ) break;
+    nA = fossil_get32(&aHdr[4]);
+    nB = fossil_get32(&aHdr[8]);
+    blob_zero(&a);
+    blob_resize(&a, nA);
+    blob_zero(&b);
+    blob_resize(&b, nB);
+    if( fossil_fd_read(fdIn, blob_buffer(&a), nA)
+     || fossil_fd_read(fdIn, blob_buffer(&b), nB)
+    ){
+      _exit(1);
+    }
+    blob_zero(&out);
+    diff_chunk_count(0);
+    text_diff(&a, &b, &out, pRe, diffJobs.diffFlags);
+    fossil_put32(aHdr, iDiff);
+    fossil_put32(&aHdr[4], blob_size(&out));
+    fossil_put32(&aHdr[8], diff_chunk_count(0));
+    if( fossil_fd_write(fdOut, aHdr, 12)
+     || fossil_fd_write(fdOut, blob_buffer(&out), blob_size(&out))
+    ){
+      _exit(1);
+    }
+    blob_reset(&a);
+    blob_reset(&b);
+    blob_reset(&out);
+  }
+  _exit(0);
+}
+
+/*
+** Move every complete result received from worker p into its DiffJob.
+*/
+static void diff_jobs_parse(struct DiffWorker *p){
+  const unsigned char *z = (const unsigned char*)blob_buffer(&p->in);
+  int n = blob_size(&p->in);
+  while( n - p->iIn >= 12 ){
+    int iDiff = fossil_get32(&z[p->iIn]) - 1;
+    int nOut = fossil_get32(&z[p->iIn+4]);
+    if( n - p->iIn - 12 < nOut ) break;
+    if( iDiff>=0 && iDiff<diffJobs.nDiff ){
+      struct DiffJob *pDiff = &diffJobs.aDiff[iDiff];
+      blob_append(&pDiff->out, (const char*)&z[p->iIn+12], nOut);
+      pDiff->nChunk = fossil_get32(&z[p->iIn+8]);
+      pDiff->isDone = 1;
+    }
+    p->iIn += 12 + nOut;
+    p->nPending--;
+  }
+  if( p->iIn==n ){
+    blob_reset(&p->in);
+    p->iIn = 0;
+  }else if( p->iIn>=1000000 ){
+    Blob rest;
+    blob_zero(&rest);
+    blob_append(&rest, (const char*)&z[p->iIn], n - p->iIn);
+    blob_reset(&p->in);
+    p->in = rest;
+    p->iIn = 0;
+  }
+}
+
+/*
+** Wait until one of the workers has sent more results, or until file
+** descriptor fdWrite can be written if it is not negative, and read
+** whatever the workers have sent.  Return non-zero if there is nothing
+** left to wait for.
+*/
+static int diff_jobs_wait(int fdWrite){
+  fd_set readfds, writefds;
+  int i, mx = fdWrite;
+  FD_ZERO(&readfds);
+  FD_ZERO(&writefds);
+  if( fdWrite>=0 ) FD_SET(fdWrite, &writefds);
+  for(i=0; i<diffJobs.nJob; i++){
+    struct DiffWorker *p = &diffJobs.aJob[i];
+    if( p->isEof ) continue;
+    FD_SET(p->fdOut, &readfds);
+    if( p->fdOut>mx ) mx = p->fdOut;
+  }
+  if( mx<0 ) return 1;
+  if( select(mx+1, &readfds, &writefds, 0, 0)<0 ){
+    return errno!=EINTR;
+  }
+  for(i=0; i<diffJobs.nJob; i++){
+    struct DiffWorker *p = &diffJobs.aJob[i];
+    char zBuf[65536];
+    int n;
+    if( p->isEof || !FD_ISSET(p->fdOut, &readfds) ) continue;
+    n = (int)read(p->fdOut, zBuf, sizeof(zBuf));
+    if( n<=0 ){
+      if( n<0 && errno==EINTR ) continue;
+      p->isEof = 1;
+    }else{
+      blob_append(&p->in, zBuf, n);
+      diff_jobs_parse(p);
+    }
+  }
+  return 0;
+}
+
+/*
+** Send n bytes of z to worker p, reading results from all of the workers
+** while waiting, so that neither side can block the other.  Return
+** non-zero if the worker has failed.
+*/
+static int diff_jobs_send(struct DiffWorker *p, const void *z, int n){
+  const char *zz = (const char*)z;
+  while( n>0 ){
+    int m = (int)write(p->fdIn, zz, n);
+    if( m>0 ){
+      zz += m;
+      n -= m;
+    }else if( m<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) ){
+      if( p->isEof || diff_jobs_wait(p->fdIn) ) return 1;
+    }else{
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Load the two files compared by planned diff pDiff.
+*/
+static void diff_jobs_load(struct DiffJob *pDiff, Blob *pA, Blob *pB){
+  if( pDiff->rid1>0 ){
+    content_get(pDiff->rid1, pA);
+  }else{
+    blob_zero(pA);
+  }
+  blob_zero(pB);
+  if( pDiff->zFile2 ){
+    if( file_wd_size(pDiff->zFile2)>=0 ){
+      if( file_wd_islink(0) ){
+        blob_read_link(pB, pDiff->zFile2);
+      }else{
+        blob_read_from_file(pB, pDiff->zFile2);
+      }
+    }
+  }else if( pDiff->rid2>0 ){
+    content_get(pDiff->rid2, pB);
+  }
+}
+
+/*
+** Load the files of the next planned diffs and send them to whichever
+** worker has the least work outstanding.  Keep sending until the diff
+** with index iNeed has been sent and DIFF_JOB_AHEAD diffs per worker are
+** outstanding beyond the last one taken.  Once every diff has been sent,
+** tell the workers that there is no more input.
+*/
+static void diff_jobs_feed(int iNeed){
+  int j;
+  while( diffJobs.iSend<diffJobs.nDiff
+      && (diffJobs.iSend<=iNeed
+          || diffJobs.iSend<diffJobs.iNext + diffJobs.nJob*DIFF_JOB_AHEAD)
+  ){
+    struct DiffJob *pDiff = &diffJobs.aDiff[diffJobs.iSend];
+    struct DiffWorker *p = 0;
+    unsigned char aHdr[12];
+    Blob a, b;
+    for(j=0; j<diffJobs.nJob; j++){
+      struct DiffWorker *q = &diffJobs.aJob[j];
+      if( q->isEof ) continue;
+      if( p==0 || q->nPending<p->nPending ) p = q;
+    }
+    if( p==0 ) return;
+    diff_jobs_load(pDiff, &a, &b);
+    fossil_put32(aHdr, diffJobs.iSend+1);
+    fossil_put32(&aHdr[4], blob_size(&a));
+    fossil_put32(&aHdr[8], blob_size(&b));
+    pDiff->iJob = (int)(p - diffJobs.aJob);
+    diffJobs.iSend++;
+    p->nPending++;
+    if( diff_jobs_send(p, aHdr, 12)
+     || diff_jobs_send(p, blob_buffer(&a), blob_size(&a))
+     || diff_jobs_send(p, blob_buffer(&b), blob_size(&b))
+    ){
+      p->isEof = 1;
+    }
+    blob_reset(&a);
+    blob_reset(&b);
+  }
+  if( diffJobs.iSend<diffJobs.nDiff ) return;
+  for(j=0; j<diffJobs.nJob; j++){
+    struct DiffWorker *p = &diffJobs.aJob[j];
+    unsigned char aHdr[12];
+    if( p->fdIn<0 ) continue;
+    memset(aHdr, 0, sizeof(aHdr));
+    if( !p->isEof ) diff_jobs_send(p, aHdr, 12);
+    close(p->fdIn);
+    p->fdIn = -1;
+  }
+}
+
+/*
+** Return the number of worker processes that diff_jobs_start() should
+** use for nDiff diffs.
+*/
+static int diff_jobs_count(int nDiff){
+  int nJob = db_get_int("diff-jobs", 0);
+  if( nJob<=0 && g.cgiOutput ){
+    /* Do not fork a process per CPU for every web page with a diff */
+    nJob = 1;
+  }else if( nJob<=0 ){
+#if defined(_SC_NPROCESSORS_ONLN)
+    nJob = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  if( nJob>64 ) nJob = 64;
+  if( nJob>nDiff/DIFF_JOB_MIN ) nJob = nDiff/DIFF_JOB_MIN;
+  return nJob;
+}
+#endif /* !_WIN32 */
+
+/*
+** Plan a diff of artifact rid1 against artifact rid2, or against the file
+** zFile2 on disk if zFile2 is not NULL, for diff_jobs_start() to compute
+** ahead of time.  An rid of zero stands for an empty file.
+*/
+void diff_jobs_plan(int rid1, int rid2, const char *zFile2){
+  struct DiffJob *pDiff;
+  if( diffJobs.nDiff>=diffJobs.nAlloc ){
+    diffJobs.nAlloc = diffJobs.nAlloc*2 + 20;
+    diffJobs.aDiff = fossil_realloc(diffJobs.aDiff,
+                                    sizeof(diffJobs.aDiff[0])*diffJobs.nAlloc);
+  }
+  pDiff = &diffJobs.aDiff[diffJobs.nDiff++];
+  memset(pDiff, 0, sizeof(*pDiff));
+  pDiff->rid1 = rid1;
+  pDiff->rid2 = rid2;
+  pDiff->zFile2 = zFile2 ? fossil_strdup(zFile2) : 0;
+  blob_zero(&pDiff->out);
+}
+
+/*
+** Start computing the planned diffs with text_diff() in worker processes,
+** per the "diff-jobs" setting.  If there are too few diffs to be worth
+** it, or no workers can be started, do nothing and let every diff be
+** computed in the main process.
+**
+** The main process loads the files of each diff, in the order planned,
+** and sends them to whichever worker has the least work outstanding, so
+** that decompressing the artifacts overlaps with computing the diffs.
+** Only a few diffs per worker are sent ahead of the one that the caller
+** takes next.  The workers never touch the database.
+*/
+void diff_jobs_start(u64 diffFlags, ReCompiled *pRe){
+#if !defined(_WIN32)
+  int nJob = diff_jobs_count(diffJobs.nDiff);
+  int i, j;
+  diffJobs.diffFlags = diffFlags;
+  diffJobs.iNext = 0;
+  diffJobs.iSend = 0;
+  if( nJob<2 ) return;
+  diffJobs.aJob = fossil_malloc( sizeof(diffJobs.aJob[0])*nJob );
+  memset(diffJobs.aJob, 0, sizeof(diffJobs.aJob[0])*nJob);
+  fflush(stdout);
+  fflush(stderr);
+  for(i=0; i<nJob; i++){
+    struct DiffWorker *p = &diffJobs.aJob[i];
+    int aIn[2], aOut[2];
+    if( pipe(aIn) ) break;
+    if( pipe(aOut) ){
+      close(aIn[0]);
+      close(aIn[1]);
+      break;
+    }
+    p->pid = fork();
+    if( p->pid==0 ){
+      for(j=0; j<i; j++){
+        close(diffJobs.aJob[j].fdIn);
+        close(diffJobs.aJob[j].fdOut);
+      }
+      close(aIn[1]);
+      close(aOut[0]);
+      diff_job_main(aIn[0], aOut[1], pRe);
+    }
+    close(aIn[0]);
+    close(aOut[1]);
+    if( p->pid<0 ){
+      close(aIn[1]);
+      close(aOut[0]);
+      break;
+    }
+    p->fdIn = aIn[1];
+    p->fdOut = aOut[0];
+    fcntl(p->fdIn, F_SETFL, fcntl(p->fdIn, F_GETFL) | O_NONBLOCK);
+    blob_zero(&p->in);
+  }
+  diffJobs.nJob = i;
+  if( i==0 ){
+    fossil_free(diffJobs.aJob);
+    diffJobs.aJob = 0;
+    return;
+  }
+
+  diff_jobs_feed(-1);
+#endif
+}
+
+/*
+** If the diff of artifact rid1 against rid2 or the file zFile2 was planned
+** and has been computed by a worker with the given diffFlags, append its
+** output to pOut and return true.  Otherwise return false, and the caller
+** must compute the diff itself.
+*/
+int diff_jobs_take(
+  int rid1,
+  int rid2,
+  const char *zFile2,
+  u64 diffFlags,
+  Blob *pOut
+){
+  int i, k, iBase;
+  struct DiffJob *pDiff = 0;
+  if( diffJobs.nJob==0 || diffFlags!=diffJobs.diffFlags ) return 0;
+  for(k=0; k<diffJobs.nDiff; k++){
+    i = (diffJobs.iNext + k) % diffJobs.nDiff;
+    pDiff = &diffJobs.aDiff[i];
+    if( !pDiff->isTaken && pDiff->rid1==rid1 && pDiff->rid2==rid2
+     && fossil_strcmp(pDiff->zFile2, zFile2)==0
+    ){
+      break;
+    }
+  }
+  if( k>=diffJobs.nDiff ) return 0;
+#if !defined(_WIN32)
+  diff_jobs_feed(i);
+  while( !pDiff->isDone ){
+    if( i>=diffJobs.iSend || diffJobs.aJob[pDiff->iJob].isEof ) return 0;
+    if( diff_jobs_wait(-1) ) return 0;
+  }
+#endif
+  pDiff->isTaken = 1;
+  diffJobs.iNext = i+1;
+#if !defined(_WIN32)
+  diff_jobs_feed(-1);
+#endif
+  iBase = diff_chunk_count(0);
+  diff_chunk_count(iBase + pDiff->nChunk);
+  if( iBase>0 && (diffFlags & DIFF_HTML)!=0 ){
+    /* Renumber the chunk anchors as if the diff had been computed here */
+    const char *z = blob_str(&pDiff->out);
+    const char *zMark;
+    while( (zMark = strstr(z, "<span id=\"chunk"))!=0 ){
+      zMark += 15;
+      blob_append(pOut, z, (int)(zMark - z));
+      blob_appendf(pOut, "%d", atoi(zMark) + iBase);
+      for(z=zMark; fossil_isdigit(z[0]); z++){}
+    }
+    blob_append(pOut, z, -1);
+  }else{
+    blob_append(pOut, blob_buffer(&pDiff->out), blob_size(&pDiff->out));
+  }
+  blob_reset(&pDiff->out);
+  return 1;
+}
+
+/*
+** Stop the workers and forget every planned diff.
+*/
+void diff_jobs_finish(void){
+  int i;
+#if !defined(_WIN32)
+  for(i=0; i<diffJobs.nJob; i++){
+    struct DiffWorker *p = &diffJobs.aJob[i];
+    int status;
+    if( p->fdIn>=0 ) close(p->fdIn);
+    close(p->fdOut);
+    while( waitpid(p->pid, &status, 0)<0 && errno==EINTR ){}
+    blob_reset(&p->in);
+  }
+#endif
+  fossil_free(diffJobs.aJob);
+  for(i=0; i<diffJobs.nDiff; i++){
+    fossil_free(diffJobs.aDiff[i].zFile2);
+    blob_reset(&diffJobs.aDiff[i].out);
+  }
+  fossil_free(diffJobs.aDiff);
+  memset(&diffJobs, 0, sizeof(diffJobs));
+}
+
 /*
 ** Show the difference between two files, one in memory and one on disk.
 **
@@ -371,6 +829,7 @@ static void diff_against_disk(
   Blob sql;
   Stmt q;
   int asNewFile;            /* Treat non-existant files as empty files */
+  int iPass;                /* 0 to plan the diffs, 1 to output them */
 
   asNewFile = (diffFlags & DIFF_VERBOSE)!=0;
   vid = db_lget_int("checkout", 0);
@@ -415,67 +874,104 @@ static void diff_against_disk(
   }
   db_prepare(&q, "%s", blob_sql_text(&sql));
   blob_reset(&sql);
-  while( db_step(&q)==SQLITE_ROW ){
-    const char *zPathname = db_column_text(&q,0);
-    int isDeleted = db_column_int(&q, 1);
-    int isChnged = db_column_int(&q,2);
-    int isNew = db_column_int(&q,3);
-    int srcid = db_column_int(&q, 4);
-    int isLink = db_column_int(&q, 5);
-    const char *zFullName;
-    int showDiff = 1;
-    Blob fname;
 
-    if( !file_dir_match(pFileDir, zPathname) ) continue;
-    if( determine_exec_relative_option(0) ){
-      blob_zero(&fname);
-      file_relative_name(zPathname, &fname, 1);
-    }else{
-      blob_set(&fname, g.zLocalRoot);
-      blob_append(&fname, zPathname, -1);
+  /* Make two passes over the changed files.  The first only plans the
+  ** diffs, so that diff_jobs_start() can compute them in parallel.  The
+  ** second outputs everything in order.  Skip the first pass if the
+  ** diffs will not be computed by the internal diff logic. */
+  for(iPass=(zDiffCmd || (diffFlags & DIFF_BRIEF)); iPass<2; iPass++){
+    if( iPass==1 ){
+      db_reset(&q);
+      diff_jobs_start(diffFlags, 0);
     }
-    zFullName = blob_str(&fname);
-    if( isDeleted ){
-      fossil_print("DELETED  %s\n", zPathname);
-      if( !asNewFile ){ showDiff = 0; zFullName = NULL_DEVICE; }
-    }else if( file_access(zFullName, F_OK) ){
-      fossil_print("MISSING  %s\n", zPathname);
-      if( !asNewFile ){ showDiff = 0; }
-    }else if( isNew ){
-      fossil_print("ADDED    %s\n", zPathname);
-      srcid = 0;
-      if( !asNewFile ){ showDiff = 0; }
-    }else if( isChnged==3 ){
-      fossil_print("ADDED_BY_MERGE %s\n", zPathname);
-      srcid = 0;
-      if( !asNewFile ){ showDiff = 0; }
-    }else if( isChnged==5 ){
-      fossil_print("ADDED_BY_INTEGRATE %s\n", zPathname);
-      srcid = 0;
-      if( !asNewFile ){ showDiff = 0; }
-    }
-    if( showDiff ){
-      Blob content;
-      int isBin;
-      if( !isLink != !file_wd_islink(zFullName) ){
-        diff_print_index(zPathname, diffFlags);
-        diff_print_filenames(zPathname, zPathname, diffFlags);
-        fossil_print("%s",DIFF_CANNOT_COMPUTE_SYMLINK);
-        continue;
-      }
-      if( srcid>0 ){
-        content_get(srcid, &content);
+    while( db_step(&q)==SQLITE_ROW ){
+      const char *zPathname = db_column_text(&q,0);
+      int isDeleted = db_column_int(&q, 1);
+      int isChnged = db_column_int(&q,2);
+      int isNew = db_column_int(&q,3);
+      int srcid = db_column_int(&q, 4);
+      int isLink = db_column_int(&q, 5);
+      const char *zFullName;
+      const char *zChange = 0;
+      int showDiff = 1;
+      Blob fname;
+
+      if( !file_dir_match(pFileDir, zPathname) ) continue;
+      if( determine_exec_relative_option(0) ){
+        blob_zero(&fname);
+        file_relative_name(zPathname, &fname, 1);
       }else{
-        blob_zero(&content);
+        blob_set(&fname, g.zLocalRoot);
+        blob_append(&fname, zPathname, -1);
       }
-      isBin = fIncludeBinary ? 0 : looks_like_binary(&content);
-      diff_print_index(zPathname, diffFlags);
-      diff_file(&content, isBin, zFullName, zPathname, zDiffCmd,
-                zBinGlob, fIncludeBinary, diffFlags);
-      blob_reset(&content);
+      zFullName = blob_str(&fname);
+      if( isDeleted ){
+        zChange = "DELETED ";
+        if( !asNewFile ){ showDiff = 0; zFullName = NULL_DEVICE; }
+      }else if( file_access(zFullName, F_OK) ){
+        zChange = "MISSING ";
+        if( !asNewFile ){ showDiff = 0; }
+      }else if( isNew ){
+        zChange = "ADDED   ";
+        srcid = 0;
+        if( !asNewFile ){ showDiff = 0; }
+      }else if( isChnged==3 ){
+        zChange = "ADDED_BY_MERGE";
+        srcid = 0;
+        if( !asNewFile ){ showDiff = 0; }
+      }else if( isChnged==5 ){
+        zChange = "ADDED_BY_INTEGRATE";
+        srcid = 0;
+        if( !asNewFile ){ showDiff = 0; }
+      }
+      if( zChange && iPass==1 ){
+        fossil_print("%s %s\n", zChange, zPathname);
+      }
+      if( showDiff ){
+        Blob content, out;
+        int isBin;
+        if( !isLink != !file_wd_islink(zFullName) ){
+          if( iPass==1 ){
+            diff_print_index(zPathname, diffFlags);
+            diff_print_filenames(zPathname, zPathname, diffFlags);
+            fossil_print("%s",DIFF_CANNOT_COMPUTE_SYMLINK);
+          }
+          blob_reset(&fname);
+          continue;
+        }
+        if( iPass==0 ){
+          diff_jobs_plan(srcid, 0, zFullName);
+          blob_reset(&fname);
+          continue;
+        }
+        diff_print_index(zPathname, diffFlags);
+        blob_zero(&out);
+        if( zDiffCmd==0 && (diffFlags & DIFF_BRIEF)==0
+         && diff_jobs_take(srcid, 0, zFullName, diffFlags, &out)
+        ){
+          if( blob_size(&out) ){
+            diff_print_filenames(zPathname,
+                file_wd_size(zFullName)<0 ? NULL_DEVICE : zPathname,
+                diffFlags);
+            fossil_print("%s\n", blob_str(&out));
+          }
+        }else{
+          if( srcid>0 ){
+            content_get(srcid, &content);
+          }else{
+            blob_zero(&content);
+          }
+          isBin = fIncludeBinary ? 0 : looks_like_binary(&content);
+          diff_file(&content, isBin, zFullName, zPathname, zDiffCmd,
+                    zBinGlob, fIncludeBinary, diffFlags);
+          blob_reset(&content);
+        }
+        blob_reset(&out);
+      }
+      blob_reset(&fname);
     }
-    blob_reset(&fname);
   }
+  diff_jobs_finish();
   db_finalize(&q);
   db_end_transaction(1);  /* ROLLBACK */
 }
@@ -517,7 +1013,7 @@ static void diff_against_undo(
 
 /*
 ** Show the difference between two files identified by ManifestFile
-** entries.
+** entries.  If iPass is zero, only plan the diff for diff_jobs_start().
 **
 ** Use the internal diff logic if zDiffCmd is NULL.  Otherwise call the
 ** command zDiffCmd to do the diffing.
@@ -527,6 +1023,7 @@ static void diff_against_undo(
 ** will be skipped in addition to files that may contain binary content.
 */
 static void diff_manifest_entry(
+  int iPass,
   struct ManifestFile *pFrom,
   struct ManifestFile *pTo,
   const char *zDiffCmd,
@@ -534,9 +1031,9 @@ static void diff_manifest_entry(
   int fIncludeBinary,
   u64 diffFlags
 ){
-  Blob f1, f2;
+  Blob f1, f2, out;
   int isBin1, isBin2;
-  int rid;
+  int rid1, rid2;
   const char *zName;
   if( pFrom ){
     zName = pFrom->zName;
@@ -546,16 +1043,27 @@ static void diff_manifest_entry(
     zName = DIFF_NO_NAME;
   }
   if( diffFlags & DIFF_BRIEF ) return;
+  rid1 = pFrom ? uuid_to_rid(pFrom->zUuid, 0) : 0;
+  rid2 = pTo ? uuid_to_rid(pTo->zUuid, 0) : 0;
+  if( iPass==0 ){
+    diff_jobs_plan(rid1, rid2, 0);
+    return;
+  }
   diff_print_index(zName, diffFlags);
+  blob_zero(&out);
+  if( zDiffCmd==0 && diff_jobs_take(rid1, rid2, 0, diffFlags, &out) ){
+    diff_print_filenames(zName, zName, diffFlags);
+    fossil_print("%s\n", blob_str(&out));
+    blob_reset(&out);
+    return;
+  }
   if( pFrom ){
-    rid = uuid_to_rid(pFrom->zUuid, 0);
-    content_get(rid, &f1);
+    content_get(rid1, &f1);
   }else{
     blob_zero(&f1);
   }
   if( pTo ){
-    rid = uuid_to_rid(pTo->zUuid, 0);
-    content_get(rid, &f2);
+    content_get(rid2, &f2);
   }else{
     blob_zero(&f2);
   }
@@ -589,59 +1097,65 @@ static void diff_two_versions(
   Manifest *pFrom, *pTo;
   ManifestFile *pFromFile, *pToFile;
   int asNewFlag = (diffFlags & DIFF_VERBOSE)!=0 ? 1 : 0;
+  int iPass;
 
   pFrom = manifest_get_by_name(zFrom, 0);
-  manifest_file_rewind(pFrom);
-  pFromFile = manifest_file_next(pFrom,0);
   pTo = manifest_get_by_name(zTo, 0);
-  manifest_file_rewind(pTo);
-  pToFile = manifest_file_next(pTo,0);
-
-  while( pFromFile || pToFile ){
-    int cmp;
-    if( pFromFile==0 ){
-      cmp = +1;
-    }else if( pToFile==0 ){
-      cmp = -1;
-    }else{
-      cmp = fossil_strcmp(pFromFile->zName, pToFile->zName);
-    }
-    if( cmp<0 ){
-      if( file_dir_match(pFileDir, pFromFile->zName) ){
-        fossil_print("DELETED %s\n", pFromFile->zName);
-        if( asNewFlag ){
-          diff_manifest_entry(pFromFile, 0, zDiffCmd, zBinGlob,
-                              fIncludeBinary, diffFlags);
-        }
+
+  /* As in diff_against_disk(), the first pass only plans the diffs */
+  for(iPass=(zDiffCmd || (diffFlags & DIFF_BRIEF)); iPass<2; iPass++){
+    if( iPass==1 ) diff_jobs_start(diffFlags, 0);
+    manifest_file_rewind(pFrom);
+    pFromFile = manifest_file_next(pFrom,0);
+    manifest_file_rewind(pTo);
+    pToFile = manifest_file_next(pTo,0);
+    while( pFromFile || pToFile ){
+      int cmp;
+      if( pFromFile==0 ){
+        cmp = +1;
+      }else if( pToFile==0 ){
+        cmp = -1;
+      }else{
+        cmp = fossil_strcmp(pFromFile->zName, pToFile->zName);
       }
-      pFromFile = manifest_file_next(pFrom,0);
-    }else if( cmp>0 ){
-      if( file_dir_match(pFileDir, pToFile->zName) ){
-        fossil_print("ADDED   %s\n", pToFile->zName);
-        if( asNewFlag ){
-          diff_manifest_entry(0, pToFile, zDiffCmd, zBinGlob,
-                              fIncludeBinary, diffFlags);
+      if( cmp<0 ){
+        if( file_dir_match(pFileDir, pFromFile->zName) ){
+          if( iPass ) fossil_print("DELETED %s\n", pFromFile->zName);
+          if( asNewFlag ){
+            diff_manifest_entry(iPass, pFromFile, 0, zDiffCmd, zBinGlob,
+                                fIncludeBinary, diffFlags);
+          }
         }
-      }
-      pToFile = manifest_file_next(pTo,0);
-    }else if( fossil_strcmp(pFromFile->zUuid, pToFile->zUuid)==0 ){
-      /* No changes */
-      (void)file_dir_match(pFileDir, pFromFile->zName); /* Record name usage */
-      pFromFile = manifest_file_next(pFrom,0);
-      pToFile = manifest_file_next(pTo,0);
-    }else{
-      if( file_dir_match(pFileDir, pToFile->zName) ){
-        if( diffFlags & DIFF_BRIEF ){
-          fossil_print("CHANGED %s\n", pFromFile->zName);
-        }else{
-          diff_manifest_entry(pFromFile, pToFile, zDiffCmd, zBinGlob,
-                              fIncludeBinary, diffFlags);
+        pFromFile = manifest_file_next(pFrom,0);
+      }else if( cmp>0 ){
+        if( file_dir_match(pFileDir, pToFile->zName) ){
+          if( iPass ) fossil_print("ADDED   %s\n", pToFile->zName);
+          if( asNewFlag ){
+            diff_manifest_entry(iPass, 0, pToFile, zDiffCmd, zBinGlob,
+                                fIncludeBinary, diffFlags);
+          }
+        }
+        pToFile = manifest_file_next(pTo,0);
+      }else if( fossil_strcmp(pFromFile->zUuid, pToFile->zUuid)==0 ){
+        /* No changes */
+        (void)file_dir_match(pFileDir, pFromFile->zName); /* Record usage */
+        pFromFile = manifest_file_next(pFrom,0);
+        pToFile = manifest_file_next(pTo,0);
+      }else{
+        if( file_dir_match(pFileDir, pToFile->zName) ){
+          if( diffFlags & DIFF_BRIEF ){
+            fossil_print("CHANGED %s\n", pFromFile->zName);
+          }else{
+            diff_manifest_entry(iPass, pFromFile, pToFile, zDiffCmd,
+                                zBinGlob, fIncludeBinary, diffFlags);
+          }
         }
+        pFromFile = manifest_file_next(pFrom,0);
+        pToFile = manifest_file_next(pTo,0);
       }
-      pFromFile = manifest_file_next(pFrom,0);
-      pToFile = manifest_file_next(pTo,0);
     }
   }
+  diff_jobs_finish();
   manifest_destroy(pFrom);
   manifest_destroy(pTo);
 }
@@ -788,6 +1302,11 @@ const char *diff_get_binary_glob(void){
 ** The "-N" or "--new-file" option causes the complete text of added or
 ** deleted files to be displayed.
 **
+** The "--algorithm" option selects how the internal diff logic matches up
+** lines.  The "histogram" and "patience" algorithms split the files on
+** lines that are rare or unique, which is faster on large files with many
+** changes and often shows moved blocks of code more clearly.
+**
 ** The "--diff-binary" option enables or disables the inclusion of binary files
 ** when using an external diff program.
 **
@@ -796,6 +1315,8 @@ const char *diff_get_binary_glob(void){
 ** This option overrides the "binary-glob" setting.
 **
 ** Options:
+**   --algorithm NAME           Diff algorithm: "classic" (the default),
+**                              "histogram", or "patience"
 **   --binary PATTERN           Treat files that match the glob PATTERN as binary
 **   --branch BRANCH            Show diff of all changes on BRANCH
 **   --brief                    Show filenames only
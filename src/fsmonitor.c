@@ -0,0 +1,744 @@
+/*
+** Copyright (c) 2026 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This file implements the "fossil fsmonitor" command.  The monitor is a
+** background process that uses inotify to watch every directory of a
+** checkout and appends the name of each file that changes to a journal
+** file in the root of the checkout.  vfile_check_signature() reads that
+** journal so that it only needs to look at files that have actually
+** changed since the previous check, rather than at every file in the
+** checkout.
+**
+** The journal is a text file.  The first line is a header:
+**
+**      fsmonitor 2 PID TOKEN DIR
+**
+** where PID is the process id of the monitor, TOKEN is a random string
+** that changes every time the journal is restarted, and DIR is a private
+** directory outside of the checkout that the monitor also watches.  Each
+** following line is one of:
+**
+**      NAME        The file NAME changed
+**      NAME/       Anything at or below directory NAME might have changed
+**      *           Events were lost.  Every file must be checked.
+**
+** Before it reads the journal, a client renames a FIFO into DIR.  All
+** inotify events reach the monitor in order, so by the time the monitor
+** sees the FIFO appear, every change that the client made before then
+** is in the journal.  The monitor writes "TOKEN OFFSET" to the FIFO, and
+** the client reads the journal up to OFFSET.
+**
+** The local VVAR table remembers the TOKEN and the byte offset within
+** the journal up to which changes have already been applied to VFILE.
+*/
+#include "config.h"
+#include "fsmonitor.h"
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#if defined(__linux__)
+# include <unistd.h>
+# include <signal.h>
+# include <fcntl.h>
+# include <dirent.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/wait.h>
+# include <sys/inotify.h>
+# include <poll.h>
+# define FSMONITOR_ENABLED 1
+#else
+# define FSMONITOR_ENABLED 0
+#endif
+
+/*
+** Name of the journal, relative to the root of the checkout.  This is
+** also listed by fossil_reserved_name().
+*/
+#define FSMON_JOURNAL  ".fslckout-fsmonitor"
+
+/*
+** When the journal grows larger than this many bytes, the monitor starts
+** it over with a new token.  The next check after that is a full scan.
+*/
+#define FSMON_JOURNAL_MAX  (4*1024*1024)
+
+/*
+** How long a client waits, in milliseconds, for the monitor to answer
+** before giving up and doing a full scan.
+*/
+#define FSMON_SYNC_TIMEOUT  2000
+
+#if FSMONITOR_ENABLED
+/*
+** State of the monitor process.
+*/
+static struct {
+  int fdNotify;              /* The inotify file descriptor */
+  int fdJournal;             /* Open journal, or -1 */
+  char *zRoot;               /* Root of the checkout, with trailing "/" */
+  char *zCookieDir;          /* Private directory where clients put FIFOs */
+  int wdCookie;              /* Watch descriptor of zCookieDir */
+  char **azDir;              /* Directory name for each watch descriptor */
+  int nDir;                  /* Number of slots in azDir[] */
+  const char **azReserved;   /* Reserved names in the checkout root */
+  int nReserved;             /* Number of entries in azReserved[] */
+  i64 szJournal;             /* Current size of the journal */
+  Blob lastLine;             /* The most recent journal line */
+  char zToken[20];           /* Token for the current journal */
+  volatile int stopFlag;     /* Set by signal handler to stop the monitor */
+} fsmon;
+
+/*
+** Signal handler that causes the monitor to shut down.
+*/
+static void fsmon_stop_handler(int sig){
+  fsmon.stopFlag = 1;
+}
+
+/*
+** Start a new journal with a new token.
+*/
+static void fsmon_journal_restart(void){
+  unsigned char aRand[8];
+  char *zHdr;
+  int i;
+  sqlite3_randomness(sizeof(aRand), aRand);
+  for(i=0; i<8; i++){
+    sqlite3_snprintf(3, &fsmon.zToken[i*2], "%02x", aRand[i]);
+  }
+  if( fsmon.fdJournal<0 ){
+    char *zJournal = mprintf("%s" FSMON_JOURNAL, fsmon.zRoot);
+    fsmon.fdJournal = open(zJournal, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if( fsmon.fdJournal<0 ) fossil_fatal("cannot open %s", zJournal);
+    fossil_free(zJournal);
+  }
+  if( ftruncate(fsmon.fdJournal, 0) ){
+    fossil_fatal("cannot truncate the fsmonitor journal");
+  }
+  zHdr = mprintf("fsmonitor 2 %d %s %s\n", (int)getpid(), fsmon.zToken,
+                 fsmon.zCookieDir);
+  fsmon.szJournal = strlen(zHdr);
+  if( write(fsmon.fdJournal, zHdr, fsmon.szJournal)!=fsmon.szJournal ){
+    fossil_fatal("cannot write the fsmonitor journal");
+  }
+  fossil_free(zHdr);
+  blob_reset(&fsmon.lastLine);
+}
+
+/*
+** Append zLine and a newline to the journal, unless it repeats the most
+** recent line.
+*/
+static void fsmon_emit(const char *zLine){
+  int n = (int)strlen(zLine);
+  char *z;
+  if( blob_size(&fsmon.lastLine)==n
+   && memcmp(blob_buffer(&fsmon.lastLine), zLine, n)==0 ){
+    return;
+  }
+  if( fsmon.szJournal+n+1 > FSMON_JOURNAL_MAX ){
+    fsmon_journal_restart();
+  }
+  if( strchr(zLine, '\n') ) zLine = "*";
+  z = mprintf("%s\n", zLine);
+  n = (int)strlen(z);
+  if( write(fsmon.fdJournal, z, n)==n ){
+    fsmon.szJournal += n;
+  }
+  fossil_free(z);
+  blob_reset(&fsmon.lastLine);
+  blob_append(&fsmon.lastLine, zLine, -1);
+}
+
+/*
+** Add watches on directory zRel and on every directory beneath it.
+** zRel is relative to the root of the checkout and is either an empty
+** string or ends with "/".  Symbolic links are not followed.
+*/
+static void fsmon_watch_tree(const char *zRel){
+  char *zPath = mprintf("%s%s", fsmon.zRoot, zRel);
+  const unsigned int mask =
+      IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+      IN_ONLYDIR | IN_DONT_FOLLOW;
+  int wd;
+  DIR *d;
+  struct dirent *pEntry;
+
+  wd = inotify_add_watch(fsmon.fdNotify, zPath, mask);
+  if( wd<0 ){
+    if( errno==ENOSPC ){
+      fossil_fatal("too many directories to watch: raise the value of"
+                   " /proc/sys/fs/inotify/max_user_watches");
+    }
+    if( zRel[0]==0 ) fossil_fatal("cannot watch %s", zPath);
+    fossil_free(zPath);
+    return;
+  }
+  if( wd>=fsmon.nDir ){
+    int nNew = wd*2 + 64;
+    fsmon.azDir = fossil_realloc(fsmon.azDir, sizeof(char*)*nNew);
+    memset(&fsmon.azDir[fsmon.nDir], 0, sizeof(char*)*(nNew-fsmon.nDir));
+    fsmon.nDir = nNew;
+  }
+  fossil_free(fsmon.azDir[wd]);
+  fsmon.azDir[wd] = fossil_strdup(zRel);
+  d = opendir(zPath);
+  while( d && (pEntry = readdir(d))!=0 ){
+    const char *zName = pEntry->d_name;
+    char *zSub;
+    struct stat st;
+    if( zName[0]=='.' && (zName[1]==0 || (zName[1]=='.' && zName[2]==0)) ){
+      continue;
+    }
+    zSub = mprintf("%s%s", zPath, zName);
+    if( lstat(zSub, &st)==0 && S_ISDIR(st.st_mode) ){
+      char *zSubRel = mprintf("%s%s/", zRel, zName);
+      fsmon_watch_tree(zSubRel);
+      fossil_free(zSubRel);
+    }
+    fossil_free(zSub);
+  }
+  if( d ) closedir(d);
+  fossil_free(zPath);
+}
+
+/*
+** Return the index of zName in the list of reserved names of the
+** checkout root, or -1 if it is not reserved.
+*/
+static int fsmon_reserved(const char *zName){
+  int i;
+  for(i=0; i<fsmon.nReserved; i++){
+    if( fossil_strcmp(zName, fsmon.azReserved[i])==0 ) return i;
+  }
+  return -1;
+}
+
+/*
+** A client has renamed the FIFO zName into the cookie directory.  Every
+** change that the client made before that has been journaled by now, so
+** tell the client how far into the journal it must read.  A client that
+** has already given up is ignored.
+*/
+static void fsmon_answer(const char *zName){
+  char *zFifo = mprintf("%s/%s", fsmon.zCookieDir, zName);
+  int fd = open(zFifo, O_WRONLY|O_NONBLOCK);
+  if( fd>=0 ){
+    char *zReply = mprintf("%s %lld\n", fsmon.zToken, fsmon.szJournal);
+    int n = (int)strlen(zReply);
+    if( write(fd, zReply, n)!=n ){
+      /* The client stopped waiting.  It will do a full scan. */
+    }
+    fossil_free(zReply);
+    close(fd);
+  }
+  fossil_free(zFifo);
+}
+
+/*
+** Deal with a single inotify event.  Return non-zero if the monitor
+** should shut down.
+*/
+static int fsmon_event(const struct inotify_event *pEv){
+  const char *zDir;
+  char *zPath;
+  if( pEv->mask & IN_Q_OVERFLOW ){
+    fsmon_emit("*");
+    return 0;
+  }
+  if( pEv->wd==fsmon.wdCookie ){
+    if( (pEv->mask & IN_MOVED_TO) && pEv->len>0 && pEv->name[0]!='.' ){
+      fsmon_answer(pEv->name);
+    }
+    return 0;
+  }
+  if( pEv->wd<0 || pEv->wd>=fsmon.nDir || fsmon.azDir[pEv->wd]==0 ){
+    return 0;
+  }
+  zDir = fsmon.azDir[pEv->wd];
+  if( pEv->mask & IN_IGNORED ){
+    fossil_free(fsmon.azDir[pEv->wd]);
+    fsmon.azDir[pEv->wd] = 0;
+    return 0;
+  }
+  if( pEv->len==0 || pEv->name[0]==0 ){
+    /* An event on a watched directory itself */
+    if( pEv->mask & (IN_DELETE_SELF|IN_MOVE_SELF) ){
+      if( zDir[0]==0 ) return 1;
+      fsmon_emit(zDir);
+    }
+    return 0;
+  }
+  if( zDir[0]==0 && fsmon_reserved(pEv->name)>=0 ){
+    /* One of Fossil's own files in the root of the checkout */
+    if( pEv->mask & (IN_DELETE|IN_MOVED_FROM) ){
+      /* The journal or the checkout database went away, which means
+      ** that "fossil close" or "fossil fsmonitor stop" is running */
+      if( fossil_strcmp(pEv->name, FSMON_JOURNAL)==0
+       || fossil_strcmp(pEv->name, ".fslckout")==0
+       || fossil_strcmp(pEv->name, "_FOSSIL_")==0
+       || fossil_strcmp(pEv->name, ".fos")==0 ){
+        return 1;
+      }
+    }
+    return 0;
+  }
+  zPath = mprintf("%s%s", zDir, pEv->name);
+  if( pEv->mask & IN_ISDIR ){
+    if( pEv->mask & (IN_CREATE|IN_MOVED_TO) ){
+      char *zRel = mprintf("%s/", zPath);
+      fsmon_watch_tree(zRel);
+      fsmon_emit(zRel);
+      fossil_free(zRel);
+    }else if( pEv->mask & (IN_DELETE|IN_MOVED_FROM) ){
+      char *zRel = mprintf("%s/", zPath);
+      fsmon_emit(zRel);
+      fossil_free(zRel);
+    }
+  }else{
+    fsmon_emit(zPath);
+  }
+  fossil_free(zPath);
+  return 0;
+}
+
+/*
+** Body of the monitor process.  Watch the checkout rooted at zRoot until
+** told to stop.  If isDaemon is true, detach from the terminal once the
+** watches are in place.
+*/
+static void fsmon_main(const char *zRoot, int isDaemon){
+  char aBuf[16384];
+  struct sigaction sa;
+  char *zJournal;
+  const char *zTmp;
+  DIR *d;
+  int i;
+
+  fsmon.fdJournal = -1;
+  blob_zero(&fsmon.lastLine);
+  fsmon.zRoot = fossil_strdup(zRoot);
+  fsmon.fdNotify = inotify_init();
+  if( fsmon.fdNotify<0 ) fossil_fatal("inotify is not available");
+  fsmon_watch_tree("");
+  zTmp = getenv("TMPDIR");
+  fsmon.zCookieDir = mprintf("%s/fossil-fsmonitor-XXXXXX",
+                             zTmp && zTmp[0] ? zTmp : "/tmp");
+  if( mkdtemp(fsmon.zCookieDir)==0 ){
+    fossil_fatal("cannot create %s", fsmon.zCookieDir);
+  }
+  fsmon.wdCookie = inotify_add_watch(fsmon.fdNotify, fsmon.zCookieDir,
+                                     IN_MOVED_TO | IN_ONLYDIR);
+  if( fsmon.wdCookie<0 ) fossil_fatal("cannot watch %s", fsmon.zCookieDir);
+  fsmon.stopFlag = 0;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = fsmon_stop_handler;
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGHUP, &sa, 0);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, 0);
+  if( isDaemon ){
+    int fd = open("/dev/null", O_RDWR);
+    if( fd>=0 ){
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+      if( fd>2 ) close(fd);
+    }
+  }
+  fsmon_journal_restart();
+  while( !fsmon.stopFlag ){
+    ssize_t n = read(fsmon.fdNotify, aBuf, sizeof(aBuf));
+    if( n<=0 ){
+      if( n<0 && errno==EINTR ) continue;
+      break;
+    }
+    for(i=0; i<n; ){
+      const struct inotify_event *pEv = (const struct inotify_event*)&aBuf[i];
+      if( fsmon_event(pEv) ) fsmon.stopFlag = 1;
+      i += sizeof(struct inotify_event) + pEv->len;
+    }
+  }
+  zJournal = mprintf("%s" FSMON_JOURNAL, fsmon.zRoot);
+  unlink(zJournal);
+  fossil_free(zJournal);
+  d = opendir(fsmon.zCookieDir);
+  if( d ){
+    struct dirent *pEntry;
+    while( (pEntry = readdir(d))!=0 ){
+      char *zFifo;
+      if( pEntry->d_name[0]=='.'
+       && (pEntry->d_name[1]==0 || fossil_strcmp(pEntry->d_name, "..")==0)
+      ){
+        continue;
+      }
+      zFifo = mprintf("%s/%s", fsmon.zCookieDir, pEntry->d_name);
+      unlink(zFifo);
+      fossil_free(zFifo);
+    }
+    closedir(d);
+  }
+  rmdir(fsmon.zCookieDir);
+  exit(0);
+}
+#endif /* FSMONITOR_ENABLED */
+
+/*
+** Read the journal header of the checkout.  Return the process id of
+** the monitor if it is still running, and write its token into zToken.
+** If pDir is not NULL, write the name of its cookie directory into it.
+** Return 0 if no monitor is running.
+*/
+static int fsmon_read_header(FILE *in, char *zToken, Blob *pDir){
+  char zLine[FILENAME_MAX+100];
+  int pid = 0;
+  int n = 0;
+  if( in==0 ) return 0;
+  rewind(in);
+  if( fgets(zLine, sizeof(zLine), in)==0
+   || sscanf(zLine, "fsmonitor 2 %d %18s %n", &pid, zToken, &n)!=2
+   || pid<=0 || n==0 ){
+    return 0;
+  }
+#if FSMONITOR_ENABLED
+  if( kill(pid, 0) && errno==ESRCH ) return 0;
+#endif
+  if( pDir ){
+    int len = (int)strlen(&zLine[n]);
+    if( len>0 && zLine[n+len-1]=='\n' ) len--;
+    blob_zero(pDir);
+    blob_append(pDir, &zLine[n], len);
+  }
+  return pid;
+}
+
+#if FSMONITOR_ENABLED
+/*
+** Ask the monitor whose cookie directory is zDir and whose journal has
+** token zToken how far into its journal a reader must go to see every
+** change made so far.  Return that offset, or -1 if the monitor does not
+** answer in time or has since restarted its journal.
+*/
+static i64 fsmon_sync(const char *zDir, const char *zToken){
+  unsigned int r;
+  char zNonce[40];
+  char zReply[100];
+  char zCheck[20];
+  long long int iTo;
+  char *zTemp;
+  char *zFifo;
+  int fd;
+  int n = 0;
+  i64 iResult = -1;
+
+  sqlite3_randomness(sizeof(r), &r);
+  sqlite3_snprintf(sizeof(zNonce), zNonce, "%d-%x", (int)getpid(), r);
+  zTemp = mprintf("%s/.%s", zDir, zNonce);
+  zFifo = mprintf("%s/%s", zDir, zNonce);
+  if( mkfifo(zTemp, 0600)==0 ){
+    /* Open the FIFO before the monitor can see it, so that the monitor
+    ** never has to wait for the reader. */
+    fd = open(zTemp, O_RDONLY|O_NONBLOCK);
+    if( fd>=0 && rename(zTemp, zFifo)==0 ){
+      struct pollfd p;
+      p.fd = fd;
+      p.events = POLLIN;
+      while( n<(int)sizeof(zReply)-1 ){
+        int m;
+        if( poll(&p, 1, FSMON_SYNC_TIMEOUT)<=0 ) break;
+        m = (int)read(fd, &zReply[n], sizeof(zReply)-1-n);
+        if( m<=0 ) break;
+        n += m;
+        if( zReply[n-1]=='\n' ) break;
+      }
+      zReply[n] = 0;
+      if( sscanf(zReply, "%18s %lld", zCheck, &iTo)==2
+       && fossil_strcmp(zCheck, zToken)==0
+      ){
+        iResult = iTo;
+      }
+      unlink(zFifo);
+    }
+    if( fd>=0 ) close(fd);
+    unlink(zTemp);
+  }
+  fossil_free(zTemp);
+  fossil_free(zFifo);
+  return iResult;
+}
+#endif
+
+/*
+** Information about the journal that is carried from fsmonitor_begin()
+** to fsmonitor_end().
+*/
+static struct {
+  int isValid;               /* True if the fields below are set */
+  char zToken[20];           /* Token of the journal */
+  i64 iOffset;               /* Journal offset that VFILE is now current to */
+} fsmonCheck;
+
+/*
+** Get ready to check the files of the current checkout for changes.
+**
+** If a monitor is running and the VFILE table is known to be current up
+** to some point in its journal, then fill the temporary table FSMON_DIRTY
+** with the names of all files that might have changed since then and
+** return true.  The caller need only check those files plus any files
+** whose VFILE entries are not in their usual state.
+**
+** Return false if all files must be checked.  If a monitor is running,
+** remember where in its journal the check begins, so that the next call
+** to fsmonitor_end() can record that VFILE is current up to there.
+*/
+int fsmonitor_begin(void){
+#if FSMONITOR_ENABLED
+  char *zJournal;
+  char zToken[20];
+  char zCheck[20];
+  char *zState;
+  FILE *in;
+  i64 iFrom, iTo;
+  Blob dir;
+  Blob tail;
+  int useJournal = 0;
+
+  fsmonCheck.isValid = 0;
+  zJournal = mprintf("%s" FSMON_JOURNAL, g.zLocalRoot);
+  in = fossil_fopen(zJournal, "rb");
+  fossil_free(zJournal);
+  if( fsmon_read_header(in, zToken, &dir)==0 ){
+    if( in ) fclose(in);
+    return 0;
+  }
+  iFrom = ftell(in);
+  zState = db_lget("fsmonitor-state", 0);
+  if( zState ){
+    char zOld[20];
+    long long int iOld;
+    if( sscanf(zState, "%18s %lld", zOld, &iOld)==2
+     && fossil_strcmp(zOld, zToken)==0 && iOld>=iFrom ){
+      iFrom = iOld;
+      useJournal = 1;
+    }
+    fossil_free(zState);
+  }
+
+  /* Wait for the monitor to journal every change made before now */
+  iTo = fsmon_sync(blob_str(&dir), zToken);
+  blob_reset(&dir);
+  if( iTo<0 ){
+    fclose(in);
+    return 0;
+  }
+  fsmonCheck.isValid = 1;
+  memcpy(fsmonCheck.zToken, zToken, sizeof(zToken));
+  fsmonCheck.iOffset = iTo;
+  if( !useJournal || iTo<iFrom ){
+    fclose(in);
+    return 0;
+  }
+
+  /* Read the part of the journal written since VFILE was last current */
+  blob_zero(&tail);
+  if( fseek(in, iFrom, SEEK_SET)==0 ){
+    blob_resize(&tail, (int)(iTo-iFrom));
+    if( fread(blob_buffer(&tail), 1, blob_size(&tail), in)
+           !=(size_t)blob_size(&tail) ){
+      useJournal = 0;
+    }
+  }else{
+    useJournal = 0;
+  }
+  if( fsmon_read_header(in, zCheck, 0)==0 || fossil_strcmp(zCheck, zToken) ){
+    /* The journal was restarted while it was being read */
+    fsmonCheck.isValid = 0;
+    useJournal = 0;
+  }
+  fclose(in);
+  if( !useJournal ){
+    blob_reset(&tail);
+    return 0;
+  }
+
+  /* Load the names of changed files into FSMON_DIRTY */
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS fsmon_dirty(x TEXT PRIMARY KEY);"
+    "DELETE FROM fsmon_dirty;"
+  );
+  {
+    Stmt ins;
+    Blob line;
+    db_prepare(&ins, "INSERT OR IGNORE INTO fsmon_dirty VALUES(:x)");
+    while( blob_line(&tail, &line) ){
+      const char *zLine = blob_buffer(&line);
+      int n = blob_size(&line) - 1;
+      if( n<=0 ) continue;
+      if( n==1 && zLine[0]=='*' ){
+        fsmonCheck.isValid = 1;
+        useJournal = 0;
+        break;
+      }
+      if( zLine[n-1]=='/' ){
+        char *zDir = mprintf("%.*s", n, zLine);
+        db_multi_exec(
+          "INSERT OR IGNORE INTO fsmon_dirty"
+          " SELECT pathname FROM vfile WHERE substr(pathname,1,%d)=%Q",
+          n, zDir);
+        fossil_free(zDir);
+      }else{
+        char *zName = mprintf("%.*s", n, zLine);
+        db_bind_text(&ins, ":x", zName);
+        db_step(&ins);
+        db_reset(&ins);
+        fossil_free(zName);
+      }
+    }
+    db_finalize(&ins);
+  }
+  blob_reset(&tail);
+  return useJournal;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Record that VFILE is current up to the journal offset found by the
+** most recent fsmonitor_begin().
+*/
+void fsmonitor_end(void){
+  if( fsmonCheck.isValid ){
+    char *zState = mprintf("%s %lld", fsmonCheck.zToken, fsmonCheck.iOffset);
+    db_lset("fsmonitor-state", zState);
+    fossil_free(zState);
+    fsmonCheck.isValid = 0;
+  }
+}
+
+/*
+** COMMAND: fsmonitor
+**
+** Usage: %fossil fsmonitor SUBCOMMAND ?OPTIONS?
+**
+** Run a background process that watches the current checkout for changes
+** to files, so that commands such as "status", "changes" and "commit" only
+** need to look at files that have changed instead of at every file in the
+** checkout.  Only available on Linux, where it uses inotify.
+**
+** Subcommands:
+**
+**    start          Start the monitor for the current checkout.
+**
+**                   Options:
+**                      --foreground    Do not detach.  Run until killed.
+**
+**    status         Report whether or not a monitor is running.
+**
+**    stop           Stop the monitor.
+**
+** The monitor stops on its own when the checkout is closed.  Whenever the
+** monitor loses track of events, or is not running, commands fall back to
+** looking at every file.  Changes made to the targets of symbolic links
+** that point outside of the checkout are not noticed.
+*/
+void fsmonitor_cmd(void){
+  const char *zCmd;
+  int nCmd;
+  char *zJournal;
+  char zToken[20];
+  FILE *in;
+  int pid;
+
+  db_must_be_within_tree();
+  zCmd = g.argc>=3 ? g.argv[2] : "x";
+  nCmd = (int)strlen(zCmd);
+  zJournal = mprintf("%s" FSMON_JOURNAL, g.zLocalRoot);
+  in = fossil_fopen(zJournal, "rb");
+  pid = fsmon_read_header(in, zToken, 0);
+  if( in ) fclose(in);
+  if( strncmp(zCmd, "start", nCmd)==0 ){
+#if FSMONITOR_ENABLED
+    int isForeground = find_option("foreground",0,0)!=0;
+    char *zRoot;
+    const char *z;
+    int i, nWait;
+    pid_t child;
+    verify_all_options();
+    if( pid ) fossil_fatal("fsmonitor is already running as process %d", pid);
+    zRoot = fossil_strdup(g.zLocalRoot);
+    for(i=0; (z = fossil_reserved_name(i, 0))!=0; i++){
+      fsmon.azReserved = fossil_realloc(fsmon.azReserved,
+                                        sizeof(char*)*(i+1));
+      fsmon.azReserved[i] = fossil_strdup(z);
+    }
+    fsmon.nReserved = i;
+    db_close(1);
+    if( isForeground ) fsmon_main(zRoot, 0);
+    fflush(stdout);
+    child = fork();
+    if( child<0 ) fossil_fatal("cannot fork");
+    if( child==0 ){
+      setsid();
+      fsmon_main(zRoot, 1);
+    }
+    for(nWait=0; nWait<30000; nWait+=10){
+      int status;
+      if( waitpid(child, &status, WNOHANG)==child ){
+        fossil_fatal("fsmonitor failed to start");
+      }
+      in = fossil_fopen(zJournal, "rb");
+      pid = fsmon_read_header(in, zToken, 0);
+      if( in ) fclose(in);
+      if( pid==child ) break;
+      sqlite3_sleep(10);
+    }
+    if( pid!=child ) fossil_fatal("fsmonitor did not start");
+    fossil_print("fsmonitor started as process %d\n", pid);
+#else
+    fossil_fatal("fsmonitor is not supported on this platform");
+#endif
+  }else if( strncmp(zCmd, "status", nCmd)==0 ){
+    verify_all_options();
+    if( pid ){
+      fossil_print("fsmonitor is running as process %d\n", pid);
+      fossil_print("journal size: %lld bytes\n", file_size(zJournal));
+    }else{
+      fossil_print("fsmonitor is not running\n");
+    }
+  }else if( strncmp(zCmd, "stop", nCmd)==0 ){
+    verify_all_options();
+    if( pid==0 ){
+      fossil_print("fsmonitor is not running\n");
+    }else{
+#if FSMONITOR_ENABLED
+      int nWait;
+      kill(pid, SIGTERM);
+      for(nWait=0; nWait<5000 && file_size(zJournal)>=0; nWait+=10){
+        sqlite3_sleep(10);
+      }
+#endif
+      fossil_print("fsmonitor stopped\n");
+    }
+  }else{
+    usage("start|status|stop");
+  }
+  fossil_free(zJournal);
+}
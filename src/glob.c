@@ -87,9 +87,138 @@ char *glob_expr(const char *zVal, const char *zGlobList){
 struct Glob {
   int nPattern;        /* Number of patterns */
   char **azPattern;    /* Array of pointers to patterns */
+  int nNode;           /* Number of entries in aNode[] */
+  GlobNode *aNode;     /* Tries of literal patterns.  See glob_compile() */
+  int nOther;          /* Number of entries in aOther[] */
+  GlobOther *aOther;   /* Patterns that the tries cannot handle */
+};
+
+/*
+** A node of one of the tries in a compiled Glob.  Children of a node
+** are a linked list through iNext.  Pattern numbers are 1-based and
+** 0 means "none".
+*/
+struct GlobNode {
+  unsigned char c;     /* The character that leads to this node */
+  int iChild;          /* First child node, or 0 */
+  int iNext;           /* Next sibling node, or 0 */
+  int iFull;           /* Pattern that matches if the string ends here */
+  int iPart;           /* Pattern that matches if the string gets here */
+};
+
+/*
+** A pattern that is matched with sqlite3_strglob().  Before doing that,
+** the literal text before its first wildcard and after its last "*" is
+** compared directly, and the longest run of literal text in the middle
+** is searched for.  Only the first of these is done for a pattern with
+** a character class.
+*/
+struct GlobOther {
+  int iPattern;        /* 1-based index of the pattern */
+  int nHead;           /* Bytes of literal text at the start of the pattern */
+  int nTail;           /* Bytes of literal text at the end, or -1 */
+  int iMust;           /* Offset in the pattern of a literal to search for */
+  int nMust;           /* Bytes in that literal.  0 if none */
 };
 #endif /* INTERFACE */
 
+/*
+** True if character c has a special meaning in a glob pattern.
+*/
+#define GLOB_SPECIAL(c)  ((c)=='*' || (c)=='?' || (c)=='[')
+
+/*
+** Return the child of node iNode in pGlob that is reached by character
+** c, adding it if it does not exist and bAdd is true.  Return 0 if it
+** does not exist and bAdd is false.
+*/
+static int glob_child(Glob *pGlob, int iNode, unsigned char c, int bAdd){
+  int i;
+  for(i=pGlob->aNode[iNode].iChild; i; i=pGlob->aNode[i].iNext){
+    if( pGlob->aNode[i].c==c ) return i;
+  }
+  if( !bAdd ) return 0;
+  i = pGlob->nNode++;
+  pGlob->aNode = fossil_realloc(pGlob->aNode, pGlob->nNode*sizeof(GlobNode));
+  memset(&pGlob->aNode[i], 0, sizeof(GlobNode));
+  pGlob->aNode[i].c = c;
+  pGlob->aNode[i].iNext = pGlob->aNode[iNode].iChild;
+  pGlob->aNode[iNode].iChild = i;
+  return i;
+}
+
+/*
+** Prepare the patterns of pGlob for glob_match().
+**
+** Most patterns in practice are a literal name, a literal prefix
+** followed by "*", or "*" followed by a literal suffix.  These go into
+** two tries so that glob_match() tests all of them in one pass over the
+** string, however many there are.  aNode[0] is the root of a trie
+** on the characters of literal and prefix patterns.  aNode[1] is the
+** root of a trie on the characters of suffix patterns read backwards.
+** All other patterns are listed in aOther[].
+*/
+static void glob_compile(Glob *pGlob){
+  int i, j, k, n;
+  pGlob->nNode = 2;
+  pGlob->aNode = fossil_malloc( 2*sizeof(GlobNode) );
+  memset(pGlob->aNode, 0, 2*sizeof(GlobNode));
+  for(i=0; i<pGlob->nPattern; i++){
+    const unsigned char *z = (const unsigned char*)pGlob->azPattern[i];
+    int nSpecial = 0;
+    int iNode;
+    GlobOther *pOther;
+    n = (int)strlen((const char*)z);
+    for(j=0; j<n; j++){
+      if( GLOB_SPECIAL(z[j]) ) nSpecial++;
+    }
+    if( nSpecial==0 || (nSpecial==1 && z[n-1]=='*') ){
+      /* A literal name, or a literal prefix followed by "*" */
+      int *piMatch;
+      if( nSpecial ) n--;
+      for(iNode=0, j=0; j<n; j++) iNode = glob_child(pGlob, iNode, z[j], 1);
+      piMatch = nSpecial ? &pGlob->aNode[iNode].iPart
+                         : &pGlob->aNode[iNode].iFull;
+      if( *piMatch==0 ) *piMatch = i+1;
+      continue;
+    }
+    if( nSpecial==1 && z[0]=='*' ){
+      /* A "*" followed by a literal suffix */
+      for(iNode=1, j=n-1; j>0; j--) iNode = glob_child(pGlob, iNode, z[j], 1);
+      if( pGlob->aNode[iNode].iPart==0 ) pGlob->aNode[iNode].iPart = i+1;
+      continue;
+    }
+    pGlob->aOther = fossil_realloc(pGlob->aOther,
+                                   (pGlob->nOther+1)*sizeof(GlobOther));
+    pOther = &pGlob->aOther[pGlob->nOther++];
+    pOther->iPattern = i+1;
+    for(j=0; j<n && !GLOB_SPECIAL(z[j]); j++){}
+    pOther->nHead = j;
+    pOther->nTail = -1;
+    pOther->iMust = pOther->nMust = 0;
+    if( strchr((const char*)z, '[')!=0 ){
+      /* A character class can contain "*", "?" and "]", so only the
+      ** text before the first special character is known to be literal.
+      ** Leave the rest to sqlite3_strglob(). */
+      continue;
+    }
+    for(k=n; k>0 && !GLOB_SPECIAL(z[k-1]); k--){}
+    if( k>0 && z[k-1]=='*' ) pOther->nTail = n-k;
+    while( j<k ){
+      if( GLOB_SPECIAL(z[j]) ){
+        j++;
+      }else{
+        int iStart = j;
+        while( j<n && !GLOB_SPECIAL(z[j]) ) j++;
+        if( j-iStart>pOther->nMust && j<k ){
+          pOther->iMust = iStart;
+          pOther->nMust = j-iStart;
+        }
+      }
+    }
+  }
+}
+
 /*
 ** zPatternList is a comma-separated list of glob patterns.  Parse up
 ** that list and use it to create a new Glob object.
@@ -137,9 +266,27 @@ Glob *glob_create(const char *zPatternList){
     z[i] = 0;
     z += i+1;
   }
+  glob_compile(p);
   return p;
 }
 
+/*
+** Return true if the n-byte string z contains the nNeedle bytes at
+** zNeedle.
+*/
+static int glob_contains(
+  const char *z, int n,
+  const char *zNeedle, int nNeedle
+){
+  const char *zEnd;
+  if( nNeedle>n ) return 0;
+  zEnd = &z[n-nNeedle];
+  for(; z<=zEnd; z++){
+    if( z[0]==zNeedle[0] && memcmp(z, zNeedle, nNeedle)==0 ) return 1;
+  }
+  return 0;
+}
+
 /*
 ** Return true (non-zero) if zString matches any of the patterns in
 ** the Glob.  The value returned is actually a 1-based index of the pattern
@@ -148,12 +295,60 @@ Glob *glob_create(const char *zPatternList){
 ** A NULL glob matches nothing.
 */
 int glob_match(Glob *pGlob, const char *zString){
-  int i;
+  const unsigned char *z = (const unsigned char*)zString;
+  const GlobNode *aNode;
+  int iBest = 0;     /* Lowest numbered pattern matched so far */
+  int i, n, iNode;
   if( pGlob==0 ) return 0;
-  for(i=0; i<pGlob->nPattern; i++){
-    if( sqlite3_strglob(pGlob->azPattern[i], zString)==0 ) return i+1;
+  aNode = pGlob->aNode;
+  n = (int)strlen(zString);
+
+  /* Literal names and prefixes */
+  iNode = 0;
+  for(i=0; 1; i++){
+    int iPart = aNode[iNode].iPart;
+    if( iPart && (iBest==0 || iPart<iBest) ) iBest = iPart;
+    if( i==n ){
+      int iFull = aNode[iNode].iFull;
+      if( iFull && (iBest==0 || iFull<iBest) ) iBest = iFull;
+      break;
+    }
+    iNode = glob_child(pGlob, iNode, z[i], 0);
+    if( iNode==0 ) break;
   }
-  return 0;
+
+  /* Literal suffixes */
+  iNode = 1;
+  for(i=n; 1; i--){
+    int iPart = aNode[iNode].iPart;
+    if( iPart && (iBest==0 || iPart<iBest) ) iBest = iPart;
+    if( i==0 ) break;
+    iNode = glob_child(pGlob, iNode, z[i-1], 0);
+    if( iNode==0 ) break;
+  }
+
+  /* Everything else, in order, while they could still beat iBest */
+  for(i=0; i<pGlob->nOther; i++){
+    const GlobOther *pOther = &pGlob->aOther[i];
+    const char *zPattern;
+    if( iBest && pOther->iPattern>iBest ) break;
+    zPattern = pGlob->azPattern[pOther->iPattern-1];
+    if( pOther->nHead>n
+     || memcmp(zPattern, zString, pOther->nHead)!=0 ){
+      continue;
+    }
+    if( pOther->nTail>=0 && (pOther->nTail>n
+     || memcmp(&zPattern[strlen(zPattern)-pOther->nTail],
+               &zString[n-pOther->nTail], pOther->nTail)!=0) ){
+      continue;
+    }
+    if( pOther->nMust>1 && !glob_contains(zString, n,
+                             &zPattern[pOther->iMust], pOther->nMust) ){
+      continue;
+    }
+    if( sqlite3_strglob(zPattern, zString)==0 ) return pOther->iPattern;
+  }
+  return iBest;
 }
 
 /*
@@ -162,6 +357,8 @@ int glob_match(Glob *pGlob, const char *zString){
 void glob_free(Glob *pGlob){
   if( pGlob ){
     fossil_free(pGlob->azPattern);
+    fossil_free(pGlob->aNode);
+    fossil_free(pGlob->aOther);
     fossil_free(pGlob);
   }
 }
@@ -55,7 +55,6 @@ struct GraphRow {
   int mergeUpto;              /* Draw the mergeOut rail up to this level */
   u64 mergeDown;              /* Draw merge lines up from bottom of graph */
 
-  u64 railInUse;              /* Mask of occupied rails at this row */
 };
 
 /* Context while building a graph
@@ -70,6 +69,7 @@ struct GraphContext {
   int nRow;                  /* Number of rows */
   int nHash;                 /* Number of slots in apHash[] */
   GraphRow **apHash;         /* Hash table of GraphRow objects.  Key: rid */
+  u64 *aInUse;               /* aInUse[i]: mask of rails occupied at row i */
 };
 
 #endif
@@ -108,6 +108,7 @@ static void graph_clear(GraphContext *p){
   for(i=0; i<p->nBranch; i++) free(p->azBranch[i]);
   free(p->azBranch);
   free(p->apHash);
+  free(p->aInUse);
   memset(p, 0, sizeof(*p));
   p->nErr = 1;
 }
@@ -222,16 +223,13 @@ static int findFreeRail(
   int top, int btm,        /* Span of rows for which the rail is needed */
   int iNearto              /* Find rail nearest to this rail */
 ){
-  GraphRow *pRow;
   int i;
   int iBest = 0;
   int iBestDist = 9999;
   u64 inUseMask = 0;
-  for(pRow=p->pFirst; pRow && pRow->idx<top; pRow=pRow->pNext){}
-  while( pRow && pRow->idx<=btm ){
-    inUseMask |= pRow->railInUse;
-    pRow = pRow->pNext;
-  }
+  if( top<1 ) top = 1;
+  if( btm>p->nRow ) btm = p->nRow;
+  for(i=top; i<=btm; i++) inUseMask |= p->aInUse[i];
   for(i=0; i<32; i++){
     if( (inUseMask & BIT(i))==0 ){
       int dist;
@@ -251,28 +249,34 @@ static int findFreeRail(
   return iBest;
 }
 
+/*
+** Mark rail iRail as occupied on rows top through btm, inclusive.
+*/
+static void markRail(GraphContext *p, int iRail, int top, int btm){
+  u64 mask = BIT(iRail);
+  int i;
+  if( top<1 ) top = 1;
+  if( btm>p->nRow ) btm = p->nRow;
+  for(i=top; i<=btm; i++) p->aInUse[i] |= mask;
+}
+
 /*
 ** Assign all children of node pBottom to the same rail as pBottom.
 */
-static void assignChildrenToRail(GraphRow *pBottom){
+static void assignChildrenToRail(GraphContext *p, GraphRow *pBottom){
   int iRail = pBottom->iRail;
   GraphRow *pCurrent;
   GraphRow *pPrior;
-  u64 mask = ((u64)1)<<iRail;
 
-  pBottom->railInUse |= mask;
+  markRail(p, iRail, pBottom->idx, pBottom->idx);
   pPrior = pBottom;
   for(pCurrent=pBottom->pChild; pCurrent; pCurrent=pCurrent->pChild){
     assert( pPrior->idx > pCurrent->idx );
     assert( pCurrent->iRail<0 );
     pCurrent->iRail = iRail;
-    pCurrent->railInUse |= mask;
     pPrior->aiRiser[iRail] = pCurrent->idx;
-    while( pPrior->idx > pCurrent->idx ){
-      pPrior->railInUse |= mask;
-      pPrior = pPrior->pPrev;
-      assert( pPrior!=0 );
-    }
+    markRail(p, iRail, pCurrent->idx, pPrior->idx);
+    pPrior = pCurrent;
   }
 }
 
@@ -285,7 +289,6 @@ static void createMergeRiser(
   GraphRow *pChild
 ){
   int u;
-  u64 mask;
   GraphRow *pLoop;
 
   if( pParent->mergeOut<0 ){
@@ -302,11 +305,10 @@ static void createMergeRiser(
       int iTarget = pParent->iRail;
       pParent->mergeOut = findFreeRail(p, pChild->idx, pParent->idx-1, iTarget);
       pParent->mergeUpto = pChild->idx;
-      mask = BIT(pParent->mergeOut);
       for(pLoop=pChild->pNext; pLoop && pLoop->rid!=pParent->rid;
-           pLoop=pLoop->pNext){
-        pLoop->railInUse |= mask;
-      }
+           pLoop=pLoop->pNext){}
+      markRail(p, pParent->mergeOut, pChild->idx+1,
+               pLoop ? pLoop->idx-1 : p->nRow);
     }
   }
   pChild->mergeIn[pParent->mergeOut] = 1;
@@ -330,13 +332,9 @@ static void find_max_rail(GraphContext *p){
 /*
 ** Draw a riser from pRow to the top of the graph
 */
-static void riser_to_top(GraphRow *pRow){
-  u64 mask = BIT(pRow->iRail);
+static void riser_to_top(GraphContext *p, GraphRow *pRow){
   pRow->aiRiser[pRow->iRail] = 0;
-  while( pRow ){
-    pRow->railInUse |= mask;
-    pRow = pRow->pPrev;
-  }
+  markRail(p, pRow->iRail, 1, pRow->idx);
 }
 
 
@@ -349,9 +347,8 @@ static void riser_to_top(GraphRow *pRow){
 ** to the bottom of the screen are omitted.
 */
 void graph_finish(GraphContext *p, int omitDescenders){
-  GraphRow *pRow, *pDesc, *pDup, *pLoop, *pParent;
+  GraphRow *pRow, *pDesc, *pDup, *pParent;
   int i, j;
-  u64 mask;
   int hasDup = 0;      /* True if one or more isDup entries */
   const char *zTrunk;
 
@@ -367,6 +364,7 @@ void graph_finish(GraphContext *p, int omitDescenders){
   /* Initialize all rows */
   p->nHash = p->nRow*2 + 1;
   p->apHash = safeMalloc( sizeof(p->apHash[0])*p->nHash );
+  p->aInUse = safeMalloc( sizeof(p->aInUse[0])*(p->nRow+1) );
   for(pRow=p->pFirst; pRow; pRow=pRow->pNext){
     if( pRow->pNext ) pRow->pNext->pPrev = pRow;
     pRow->iRail = -1;
@@ -468,14 +466,11 @@ void graph_finish(GraphContext *p, int omitDescenders){
           pRow->iRail = ++p->mxRail;
         }
         if( p->mxRail>=GR_MAX_RAIL ) return;
-        mask = BIT(pRow->iRail);
         if( !omitDescenders ){
           pRow->bDescender = pRow->nParent>0;
-          for(pLoop=pRow; pLoop; pLoop=pLoop->pNext){
-            pLoop->railInUse |= mask;
-          }
+          markRail(p, pRow->iRail, pRow->idx, p->nRow);
         }
-        assignChildrenToRail(pRow);
+        assignChildrenToRail(p, pRow);
       }
     }
   }
@@ -488,7 +483,7 @@ void graph_finish(GraphContext *p, int omitDescenders){
     if( pRow->iRail>=0 ){
       if( pRow->pChild==0 && !pRow->timeWarp ){
         if( !omitDescenders && count_nonbranch_children(pRow->rid)!=0 ){
-          riser_to_top(pRow);
+          riser_to_top(p, pRow);
         }
       }
       continue;
@@ -502,7 +497,7 @@ void graph_finish(GraphContext *p, int omitDescenders){
       if( pParent==0 ){
         pRow->iRail = ++p->mxRail;
         if( p->mxRail>=GR_MAX_RAIL ) return;
-        pRow->railInUse = BIT(pRow->iRail);
+        p->aInUse[pRow->idx] = BIT(pRow->iRail);
         continue;
       }
       if( pParent->idx>pRow->idx ){
@@ -518,25 +513,22 @@ void graph_finish(GraphContext *p, int omitDescenders){
         if( iDownRail<1 ) iDownRail = ++p->mxRail;
         pRow->iRail = ++p->mxRail;
         if( p->mxRail>=GR_MAX_RAIL ) return;
-        pRow->railInUse = BIT(pRow->iRail);
+        p->aInUse[pRow->idx] = BIT(pRow->iRail);
         pParent->aiRiser[iDownRail] = pRow->idx;
-        mask = BIT(iDownRail);
-        for(pLoop=p->pFirst; pLoop; pLoop=pLoop->pNext){
-          pLoop->railInUse |= mask;
-        }
+        markRail(p, iDownRail, 1, p->nRow);
       }
     }
-    mask = BIT(pRow->iRail);
-    pRow->railInUse |= mask;
+    markRail(p, pRow->iRail, pRow->idx, pRow->idx);
     if( pRow->pChild ){
-      assignChildrenToRail(pRow);
+      assignChildrenToRail(p, pRow);
     }else if( !omitDescenders && count_nonbranch_children(pRow->rid)!=0 ){
-      riser_to_top(pRow);
+      riser_to_top(p, pRow);
     }
     if( pParent ){
-      for(pLoop=pParent->pPrev; pLoop && pLoop!=pRow; pLoop=pLoop->pPrev){
-        pLoop->railInUse |= mask;
-      }
+      /* The rail runs from pParent up to pRow, or to the top of the graph
+      ** if pRow is below pParent. */
+      markRail(p, pRow->iRail, pParent->idx>pRow->idx ? pRow->idx+1 : 1,
+               pParent->idx-1);
     }
   }
 
@@ -561,12 +553,9 @@ void graph_finish(GraphContext *p, int omitDescenders){
           if( p->mxRail>=GR_MAX_RAIL ) return;
           mergeRiserFrom[iMrail] = parentRid;
         }
-        mask = BIT(iMrail);
         pRow->mergeIn[iMrail] = 1;
-        pRow->mergeDown |= mask;
-        for(pLoop=pRow->pNext; pLoop; pLoop=pLoop->pNext){
-          pLoop->railInUse |= mask;
-        }
+        pRow->mergeDown |= BIT(iMrail);
+        markRail(p, iMrail, pRow->idx+1, p->nRow);
       }else{
         /* Merge from an on-screen node */
         createMergeRiser(p, pDesc, pRow);
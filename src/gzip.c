@@ -105,6 +105,18 @@ void gzip_step(const char *pIn, int nIn){
   fossil_free(zOutBuf);
 }
 
+/*
+** Append the compressed output produced so far to pOut, and remove it
+** from the gzip file under construction.  This lets a large gzip file
+** be sent out incrementally instead of being held in memory until
+** gzip_finish().
+*/
+void gzip_take_output(Blob *pOut){
+  assert( gzip.eState>0 );
+  blob_append(pOut, blob_buffer(&gzip.out), blob_size(&gzip.out));
+  blob_reset(&gzip.out);
+}
+
 /*
 ** Finish the gzip file and put the content in *pOut
 */
@@ -18,6 +18,12 @@
 ** This file contains code that implements the client-side HTTP protocol
 */
 #include "config.h"
+#if defined(FOSSIL_ENABLE_MINIZ)
+#  define MINIZ_HEADER_FILE_ONLY
+#  include "miniz.c"
+#else
+#  include <zlib.h>
+#endif
 #include "http.h"
 #include <assert.h>
 
@@ -192,6 +198,109 @@ char *prompt_for_httpauth_creds(void){
   return zHttpAuth;
 }
 
+/*
+** State of a streamed reply.  A server that is sent "pragma stream-reply"
+** may answer with content type application/x-fossil-stream: a single
+** zlib stream with no Content-Length, flushed as the server produces
+** it.  The reply is uncompressed into the reply blob only as the caller
+** asks for more of it through http_reply_line() and http_reply_need(),
+** so that cards can be processed while the rest of the reply is still
+** in flight.
+*/
+static struct {
+  Blob *pReply;         /* The reply being received, or NULL */
+  int isDone;           /* No more content will be added to pReply */
+  int isTruncated;      /* The reply ended early or was corrupt */
+  z_stream stream;      /* The decompressor */
+} httpStream;
+
+/*
+** Read more of a streamed reply from the server and append it to the
+** reply blob.
+*/
+static void http_stream_more(void){
+  char zIn[16384];
+  char zOut[65536];
+  int nIn;
+  int rc;
+
+  if( httpStream.isDone ) return;
+  nIn = transport_receive(&g.url, zIn, sizeof(zIn));
+  if( nIn<=0 ){
+    httpStream.isDone = 1;
+    httpStream.isTruncated = 1;
+    return;
+  }
+  httpStream.stream.next_in = (unsigned char*)zIn;
+  httpStream.stream.avail_in = nIn;
+  do{
+    httpStream.stream.next_out = (unsigned char*)zOut;
+    httpStream.stream.avail_out = sizeof(zOut);
+    rc = inflate(&httpStream.stream, Z_NO_FLUSH);
+    if( rc!=Z_OK && rc!=Z_STREAM_END && rc!=Z_BUF_ERROR ){
+      httpStream.isDone = 1;
+      httpStream.isTruncated = 1;
+      return;
+    }
+    blob_append(httpStream.pReply, zOut,
+                sizeof(zOut) - httpStream.stream.avail_out);
+    if( rc==Z_STREAM_END ){
+      httpStream.isDone = 1;
+      return;
+    }
+  }while( httpStream.stream.avail_in>0 || httpStream.stream.avail_out==0 );
+}
+
+/*
+** Extract the next line of the reply pReply into pLine, reading more of
+** the reply from the server first if it is streamed.  Return the number
+** of bytes in the line, or zero at the end of the reply.
+**
+** When the reply is streamed, pLine holds a copy of the line, since
+** reading more of the reply can move the reply buffer.
+*/
+int http_reply_line(Blob *pReply, Blob *pLine){
+  Blob line;
+  int n;
+  if( httpStream.pReply!=pReply ) return blob_line(pReply, pLine);
+  while( !httpStream.isDone
+      && memchr(blob_buffer(pReply)+pReply->iCursor, '\n',
+                blob_size(pReply)-pReply->iCursor)==0 ){
+    http_stream_more();
+  }
+  n = blob_line(pReply, &line);
+  blob_zero(pLine);
+  blob_append(pLine, blob_buffer(&line), n);
+  return n;
+}
+
+/*
+** Make sure that at least n more bytes of the reply pReply are available
+** to be read, if the reply is streamed and the server sends that many.
+** This is a no-op for any other blob.
+*/
+void http_reply_need(Blob *pReply, int n){
+  if( httpStream.pReply!=pReply ) return;
+  while( !httpStream.isDone && blob_size(pReply)-pReply->iCursor<n ){
+    http_stream_more();
+  }
+}
+
+/*
+** Finish with the reply pReply.  If the reply was streamed, close the
+** connection to the server.  Return non-zero if a streamed reply ended
+** early or was corrupt.
+*/
+int http_reply_end(Blob *pReply){
+  int rc;
+  if( httpStream.pReply!=pReply ) return 0;
+  rc = httpStream.isTruncated;
+  inflateEnd(&httpStream.stream);
+  memset(&httpStream, 0, sizeof(httpStream));
+  transport_close(&g.url);
+  return rc;
+}
+
 /*
 ** Sign the content in pSend, compress it, and send it to the server
 ** via HTTP or HTTPS.  Get a reply, uncompress the reply, and store the reply
@@ -215,6 +324,7 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
   int i;                /* Loop counter */
   int isError = 0;      /* True if the reply is an error message */
   int isCompressed = 1; /* True if the reply is compressed */
+  int isStream = 0;     /* True if the reply is streamed */
 
   if( transport_open(&g.url) ){
     fossil_warning("%s", transport_errmsg(&g.url));
@@ -349,7 +459,11 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
       g.zHttpAuth = get_httpauth();
       return http_exchange(pSend, pReply, useLogin, maxRedirect);
     }else if( fossil_strnicmp(zLine, "content-type: ", 14)==0 ){
-      if( fossil_strnicmp(&zLine[14], "application/x-fossil-debug", -1)==0 ){
+      if( fossil_strnicmp(&zLine[14],
+                          "application/x-fossil-stream", -1)==0 ){
+        isStream = 1;
+      }else if( fossil_strnicmp(&zLine[14],
+                          "application/x-fossil-debug", -1)==0 ){
         isCompressed = 0;
       }else if( fossil_strnicmp(&zLine[14],
                           "application/x-fossil-uncompressed", -1)==0 ){
@@ -359,7 +473,7 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
       }
     }
   }
-  if( iLength<0 ){
+  if( iLength<0 && !isStream ){
     fossil_warning("server did not reply");
     goto write_err;
   }
@@ -368,6 +482,21 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
     goto write_err;
   }
 
+  /*
+  ** A streamed reply is read as the caller processes it.  The connection
+  ** stays open until http_reply_end().
+  */
+  if( isStream ){
+    blob_zero(pReply);
+    memset(&httpStream, 0, sizeof(httpStream));
+    if( inflateInit(&httpStream.stream)!=Z_OK ){
+      fossil_warning("cannot uncompress the reply");
+      goto write_err;
+    }
+    httpStream.pReply = pReply;
+    return 0;
+  }
+
   /*
   ** Extract the reply payload that follows the header
   */
@@ -333,6 +333,17 @@ void render_checkin_context(int rid, int parentsOnly){
 }
 
 
+/*
+** Return the flags that append_diff() passes to text_diff().
+*/
+static u64 append_diff_flags(u64 diffFlags){
+  if( diffFlags & DIFF_SIDEBYSIDE ){
+    return diffFlags | DIFF_HTML | DIFF_NOTTOOBIG;
+  }else{
+    return diffFlags | DIFF_LINENO | DIFF_HTML | DIFF_NOTTOOBIG;
+  }
+}
+
 /*
 ** Append the difference between artifacts to the output
 */
@@ -342,37 +353,49 @@ static void append_diff(
   u64 diffFlags,        /* Diff formatting flags */
   ReCompiled *pRe       /* Only show change matching this regex */
 ){
-  int fromid;
-  int toid;
+  int fromid = zFrom ? uuid_to_rid(zFrom, 0) : 0;
+  int toid = zTo ? uuid_to_rid(zTo, 0) : 0;
   Blob from, to, out;
-  if( zFrom ){
-    fromid = uuid_to_rid(zFrom, 0);
-    content_get(fromid, &from);
-  }else{
-    blob_zero(&from);
-  }
-  if( zTo ){
-    toid = uuid_to_rid(zTo, 0);
-    content_get(toid, &to);
-  }else{
-    blob_zero(&to);
-  }
   blob_zero(&out);
+  if( !diff_jobs_take(fromid, toid, 0, append_diff_flags(diffFlags), &out) ){
+    if( zFrom ){
+      content_get(fromid, &from);
+    }else{
+      blob_zero(&from);
+    }
+    if( zTo ){
+      content_get(toid, &to);
+    }else{
+      blob_zero(&to);
+    }
+    text_diff(&from, &to, &out, pRe, append_diff_flags(diffFlags));
+    blob_reset(&from);
+    blob_reset(&to);
+  }
   if( diffFlags & DIFF_SIDEBYSIDE ){
-    text_diff(&from, &to, &out, pRe, diffFlags | DIFF_HTML | DIFF_NOTTOOBIG);
     @ %s(blob_str(&out))
   }else{
-    text_diff(&from, &to, &out, pRe,
-           diffFlags | DIFF_LINENO | DIFF_HTML | DIFF_NOTTOOBIG);
     @ <pre class="udiff">
     @ %s(blob_str(&out))
     @ </pre>
   }
-  blob_reset(&from);
-  blob_reset(&to);
   blob_reset(&out);
 }
 
+/*
+** Plan the diff that append_file_change_line() will show between zOld
+** and zNew, so that diff_jobs_start() can compute it ahead of time.
+*/
+static void plan_file_change_diff(
+  const char *zOld,     /* blob.uuid before change.  NULL for added files */
+  const char *zNew      /* blob.uuid after change.  NULL for deletes */
+){
+  if( fossil_strcmp(zOld, zNew)!=0 ){
+    diff_jobs_plan(zOld ? uuid_to_rid(zOld, 0) : 0,
+                   zNew ? uuid_to_rid(zNew, 0) : 0, 0);
+  }
+}
+
 /*
 ** Write a line of web-page output that shows changes that have occurred
 ** to a file between two check-ins.
@@ -768,6 +791,14 @@ void ci_page(void){
     " ORDER BY name /*sort*/",
     rid, rid
   );
+  if( diffFlags ){
+    /* Plan the diffs first, so that they can be computed in parallel */
+    while( db_step(&q3)==SQLITE_ROW ){
+      plan_file_change_diff(db_column_text(&q3,2), db_column_text(&q3,3));
+    }
+    db_reset(&q3);
+    diff_jobs_start(append_diff_flags(diffFlags), pRe);
+  }
   while( db_step(&q3)==SQLITE_ROW ){
     const char *zName = db_column_text(&q3,0);
     int mperm = db_column_int(&q3, 1);
@@ -777,6 +808,7 @@ void ci_page(void){
     append_file_change_line(zName, zOld, zNew, zOldName, diffFlags,pRe,mperm);
   }
   db_finalize(&q3);
+  diff_jobs_finish();
   append_diff_javascript(sideBySide);
   style_footer();
 }
@@ -1021,6 +1053,7 @@ void vdiff_page(void){
   const char *zVerbose;
   const char *zGlob;
   ReCompiled *pRe = 0;
+  int iPass;
   login_check_credentials();
   if( !g.perm.Read ){ login_needed(g.anon.Read); return; }
   login_anonymous_available();
@@ -1112,47 +1145,65 @@ void vdiff_page(void){
     @<hr /><p>
   }
 
-  manifest_file_rewind(pFrom);
-  pFileFrom = manifest_file_next(pFrom, 0);
-  manifest_file_rewind(pTo);
-  pFileTo = manifest_file_next(pTo, 0);
-  while( pFileFrom || pFileTo ){
-    int cmp;
-    if( pFileFrom==0 ){
-      cmp = +1;
-    }else if( pFileTo==0 ){
-      cmp = -1;
-    }else{
-      cmp = fossil_strcmp(pFileFrom->zName, pFileTo->zName);
-    }
-    if( cmp<0 ){
-      if( !zGlob || sqlite3_strglob(zGlob, pFileFrom->zName)==0 ){
-        append_file_change_line(pFileFrom->zName,
-                                pFileFrom->zUuid, 0, 0, diffFlags, pRe, 0);
+  /* If diffs are shown, make a first pass over the files that only plans
+  ** the diffs, so that they can be computed in parallel */
+  for(iPass=(diffFlags==0); iPass<2; iPass++){
+    if( iPass==1 && diffFlags ){
+      diff_jobs_start(append_diff_flags(diffFlags), pRe);
+    }
+    manifest_file_rewind(pFrom);
+    pFileFrom = manifest_file_next(pFrom, 0);
+    manifest_file_rewind(pTo);
+    pFileTo = manifest_file_next(pTo, 0);
+    while( pFileFrom || pFileTo ){
+      int cmp;
+      const char *zName = 0;      /* Name of a changed file */
+      const char *zOld = 0;       /* Its old artifact, if any */
+      const char *zNew = 0;       /* Its new artifact, if any */
+      int mperm = 0;
+      if( pFileFrom==0 ){
+        cmp = +1;
+      }else if( pFileTo==0 ){
+        cmp = -1;
+      }else{
+        cmp = fossil_strcmp(pFileFrom->zName, pFileTo->zName);
       }
-      pFileFrom = manifest_file_next(pFrom, 0);
-    }else if( cmp>0 ){
-      if( !zGlob || sqlite3_strglob(zGlob, pFileTo->zName)==0 ){
-        append_file_change_line(pFileTo->zName,
-                                0, pFileTo->zUuid, 0, diffFlags, pRe,
-                                manifest_file_mperm(pFileTo));
+      if( cmp<0 ){
+        if( !zGlob || sqlite3_strglob(zGlob, pFileFrom->zName)==0 ){
+          zName = pFileFrom->zName;
+          zOld = pFileFrom->zUuid;
+        }
+        pFileFrom = manifest_file_next(pFrom, 0);
+      }else if( cmp>0 ){
+        if( !zGlob || sqlite3_strglob(zGlob, pFileTo->zName)==0 ){
+          zName = pFileTo->zName;
+          zNew = pFileTo->zUuid;
+          mperm = manifest_file_mperm(pFileTo);
+        }
+        pFileTo = manifest_file_next(pTo, 0);
+      }else if( fossil_strcmp(pFileFrom->zUuid, pFileTo->zUuid)==0 ){
+        pFileFrom = manifest_file_next(pFrom, 0);
+        pFileTo = manifest_file_next(pTo, 0);
+      }else{
+        if(!zGlob || (sqlite3_strglob(zGlob, pFileFrom->zName)==0
+                  || sqlite3_strglob(zGlob, pFileTo->zName)==0) ){
+          zName = pFileFrom->zName;
+          zOld = pFileFrom->zUuid;
+          zNew = pFileTo->zUuid;
+          mperm = manifest_file_mperm(pFileTo);
+        }
+        pFileFrom = manifest_file_next(pFrom, 0);
+        pFileTo = manifest_file_next(pTo, 0);
       }
-      pFileTo = manifest_file_next(pTo, 0);
-    }else if( fossil_strcmp(pFileFrom->zUuid, pFileTo->zUuid)==0 ){
-      pFileFrom = manifest_file_next(pFrom, 0);
-      pFileTo = manifest_file_next(pTo, 0);
-    }else{
-      if(!zGlob || (sqlite3_strglob(zGlob, pFileFrom->zName)==0
-                || sqlite3_strglob(zGlob, pFileTo->zName)==0) ){
-        append_file_change_line(pFileFrom->zName,
-                                pFileFrom->zUuid,
-                                pFileTo->zUuid, 0, diffFlags, pRe,
-                                manifest_file_mperm(pFileTo));
+      if( zName==0 ) continue;
+      if( iPass==0 ){
+        plan_file_change_diff(zOld, zNew);
+      }else{
+        append_file_change_line(zName, zOld, zNew, 0, diffFlags, pRe, mperm);
       }
-      pFileFrom = manifest_file_next(pFrom, 0);
-      pFileTo = manifest_file_next(pTo, 0);
     }
   }
+  diff_jobs_finish();
   manifest_destroy(pFrom);
   manifest_destroy(pTo);
   append_diff_javascript(sideBySide);
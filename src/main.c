@@ -2296,6 +2296,9 @@ static int binaryOnPath(const char *zBinary){
 **   --localauth         enable automatic login for requests from localhost
 **   --localhost         listen on 127.0.0.1 only (always true for "ui")
 **   --https             signal a request coming in via https
+**   --keepalive         Keep connections from HTTP/1.1 clients open for
+**                       more requests, and send large replies such as
+**                       tarballs as they are generated.  Unix only.
 **   --nojail            Drop root privileges but do not enter the chroot jail
 **   --nossl             signal that no SSL connections are available
 **   --notfound URL      Redirect
@@ -2359,6 +2362,7 @@ void cmd_webserver(void){
   zAltBase = find_option("baseurl", 0, 1);
   fCreate = find_option("create",0,0)!=0;
   if( find_option("scgi", 0, 0)!=0 ) flags |= HTTP_SERVER_SCGI;
+  if( find_option("keepalive", 0, 0)!=0 ) flags |= HTTP_SERVER_KEEPALIVE;
   if( zAltBase ){
     set_base_url(zAltBase);
   }
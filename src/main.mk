@@ -50,6 +50,7 @@ SRC = \
   $(SRCDIR)/finfo.c \
   $(SRCDIR)/foci.c \
   $(SRCDIR)/fshell.c \
+  $(SRCDIR)/fsmonitor.c \
   $(SRCDIR)/fusefs.c \
   $(SRCDIR)/glob.c \
   $(SRCDIR)/graph.c \
@@ -225,6 +226,7 @@ TRANS_SRC = \
   $(OBJDIR)/finfo_.c \
   $(OBJDIR)/foci_.c \
   $(OBJDIR)/fshell_.c \
+  $(OBJDIR)/fsmonitor_.c \
   $(OBJDIR)/fusefs_.c \
   $(OBJDIR)/glob_.c \
   $(OBJDIR)/graph_.c \
@@ -349,6 +351,7 @@ OBJ = \
  $(OBJDIR)/finfo.o \
  $(OBJDIR)/foci.o \
  $(OBJDIR)/fshell.o \
+ $(OBJDIR)/fsmonitor.o \
  $(OBJDIR)/fusefs.o \
  $(OBJDIR)/glob.o \
  $(OBJDIR)/graph.o \
@@ -634,6 +637,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/mak
 	$(OBJDIR)/finfo_.c:$(OBJDIR)/finfo.h \
 	$(OBJDIR)/foci_.c:$(OBJDIR)/foci.h \
 	$(OBJDIR)/fshell_.c:$(OBJDIR)/fshell.h \
+	$(OBJDIR)/fsmonitor_.c:$(OBJDIR)/fsmonitor.h \
 	$(OBJDIR)/fusefs_.c:$(OBJDIR)/fusefs.h \
 	$(OBJDIR)/glob_.c:$(OBJDIR)/glob.h \
 	$(OBJDIR)/graph_.c:$(OBJDIR)/graph.h \
@@ -1008,6 +1012,14 @@ $(OBJDIR)/fshell.o:	$(OBJDIR)/fshell_.c $(OBJDIR)/fshell.h $(SRCDIR)/config.h
 
 $(OBJDIR)/fshell.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/fsmonitor_.c:	$(SRCDIR)/fsmonitor.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/fsmonitor.c >$@
+
+$(OBJDIR)/fsmonitor.o:	$(OBJDIR)/fsmonitor_.c $(OBJDIR)/fsmonitor.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/fsmonitor.o -c $(OBJDIR)/fsmonitor_.c
+
+$(OBJDIR)/fsmonitor.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/fusefs_.c:	$(SRCDIR)/fusefs.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/fusefs.c >$@
 
@@ -56,6 +56,7 @@ set src {
   finfo
   foci
   fshell
+  fsmonitor
   fusefs
   glob
   graph
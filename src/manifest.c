@@ -116,14 +116,43 @@ struct Manifest {
 #endif
 
 /*
-** A cache of parsed manifests.  This reduces the number of
-** calls to manifest_parse() when doing a rebuild.
+** One entry in the cache of parsed check-in manifests.
+**
+** As with the artifact content cache, entries are found by rid through
+** a chained hash table and kept on a doubly-linked list ordered by most
+** recent use.
+*/
+typedef struct ManifestCacheLine ManifestCacheLine;
+struct ManifestCacheLine {
+  Manifest *p;                   /* The parsed manifest */
+  i64 sz;                        /* Bytes of memory used by p */
+  ManifestCacheLine *pHashNext;  /* Next entry in the same hash bucket */
+  ManifestCacheLine *pNewer;     /* Next more recently used entry */
+  ManifestCacheLine *pOlder;     /* Next less recently used entry */
+};
+
+/*
+** A cache of parsed check-in manifests.  This reduces the number of
+** calls to manifest_parse() when doing a rebuild, and lets commands and
+** web pages that look at the same large check-ins or their baselines
+** more than once parse each of them only once.
+**
+** A Manifest handed out by manifest_get() belongs to the caller and is
+** not in the cache.  manifest_destroy() puts it back.
 */
-#define MX_MANIFEST_CACHE 6
 static struct {
-  int nxAge;
-  int aAge[MX_MANIFEST_CACHE];
-  Manifest *apManifest[MX_MANIFEST_CACHE];
+  i64 szTotal;         /* Total size of all entries in the cache */
+  i64 szLimit;         /* Upper bound on szTotal */
+  int limitKnown;      /* True once szLimit has been read from the settings */
+  int n;               /* Current number of cache entries */
+  int nHash;           /* Number of buckets in aHash[] */
+  ManifestCacheLine **aHash;   /* Hash table of entries keyed by rid */
+  ManifestCacheLine *pNewest;  /* Most recently used entry */
+  ManifestCacheLine *pOldest;  /* Least recently used entry.  Evicted first */
+  int nParse;          /* Calls to manifest_parse(), including repeats */
+  int nHit;            /* Lookups that found the manifest in cache */
+  int nMiss;           /* Lookups that did not */
+  int nEvict;          /* Entries removed to stay within szLimit */
 } manifestCache;
 
 /*
@@ -133,80 +162,217 @@ static struct {
 static int manifest_crosslink_busy = 0;
 
 /*
-** Clear the memory allocated in a manifest object
+** Free the memory allocated in a manifest object.  A baseline held by
+** the manifest goes back into the manifest cache.
+*/
+static void manifest_free(Manifest *p){
+  blob_reset(&p->content);
+  fossil_free(p->aFile);
+  fossil_free(p->azParent);
+  fossil_free(p->azCChild);
+  fossil_free(p->aTag);
+  fossil_free(p->aField);
+  fossil_free(p->aCherrypick);
+  if( p->pBaseline ) manifest_destroy(p->pBaseline);
+  memset(p, 0, sizeof(*p));
+  fossil_free(p);
+}
+
+/*
+** Release a manifest object obtained from manifest_get() or
+** manifest_parse().  Check-in manifests are kept in the manifest cache
+** for reuse.  Everything else is freed.
 */
 void manifest_destroy(Manifest *p){
   if( p ){
-    blob_reset(&p->content);
-    fossil_free(p->aFile);
-    fossil_free(p->azParent);
-    fossil_free(p->azCChild);
-    fossil_free(p->aTag);
-    fossil_free(p->aField);
-    fossil_free(p->aCherrypick);
-    if( p->pBaseline ) manifest_destroy(p->pBaseline);
-    memset(p, 0, sizeof(*p));
-    fossil_free(p);
+    if( p->rid>0 && p->type==CFTYPE_MANIFEST ){
+      manifest_cache_insert(p);
+    }else{
+      manifest_free(p);
+    }
+  }
+}
+
+/*
+** Return the maximum number of bytes of parsed manifests that the
+** cache may hold, as determined by the "manifest-cache-size" setting.
+*/
+static i64 manifest_cache_limit(void){
+  if( !manifestCache.limitKnown ){
+    manifestCache.szLimit = db_get_int("manifest-cache-size", 20000000);
+    if( manifestCache.szLimit<0 ) manifestCache.szLimit = 0;
+    manifestCache.limitKnown = 1;
+  }
+  return manifestCache.szLimit;
+}
+
+/*
+** Return the number of bytes of memory used by manifest p, not
+** counting its baseline.
+*/
+static i64 manifest_cache_size(Manifest *p){
+  return sizeof(*p) + blob_size(&p->content)
+       + p->nFileAlloc*sizeof(p->aFile[0])
+       + p->nParentAlloc*sizeof(p->azParent[0])
+       + p->nCChildAlloc*sizeof(p->azCChild[0])
+       + p->nTagAlloc*sizeof(p->aTag[0])
+       + p->nFieldAlloc*sizeof(p->aField[0])
+       + p->nCherrypick*sizeof(p->aCherrypick[0]);
+}
+
+/*
+** Unlink entry pLine from the LRU list.
+*/
+static void manifest_cache_unlink(ManifestCacheLine *pLine){
+  if( pLine->pNewer ){
+    pLine->pNewer->pOlder = pLine->pOlder;
+  }else{
+    manifestCache.pNewest = pLine->pOlder;
+  }
+  if( pLine->pOlder ){
+    pLine->pOlder->pNewer = pLine->pNewer;
+  }else{
+    manifestCache.pOldest = pLine->pNewer;
+  }
+  pLine->pNewer = pLine->pOlder = 0;
+}
+
+/*
+** Remove entry pLine from the manifest cache and return the manifest
+** it holds.  The caller becomes responsible for the manifest.
+*/
+static Manifest *manifest_cache_remove(ManifestCacheLine *pLine){
+  Manifest *p = pLine->p;
+  ManifestCacheLine **pp;
+  pp = &manifestCache.aHash[(unsigned)p->rid % manifestCache.nHash];
+  while( *pp!=pLine ) pp = &(*pp)->pHashNext;
+  *pp = pLine->pHashNext;
+  manifest_cache_unlink(pLine);
+  manifestCache.szTotal -= pLine->sz;
+  manifestCache.n--;
+  fossil_free(pLine);
+  return p;
+}
+
+/*
+** Double the number of buckets in the manifest cache hash table.
+*/
+static void manifest_cache_rehash(void){
+  int nNew = manifestCache.nHash*2 + 61;
+  ManifestCacheLine **aNew = fossil_malloc( nNew*sizeof(aNew[0]) );
+  ManifestCacheLine *pLine;
+  memset(aNew, 0, nNew*sizeof(aNew[0]));
+  for(pLine=manifestCache.pOldest; pLine; pLine=pLine->pNewer){
+    unsigned h = (unsigned)pLine->p->rid % nNew;
+    pLine->pHashNext = aNew[h];
+    aNew[h] = pLine;
+  }
+  fossil_free(manifestCache.aHash);
+  manifestCache.aHash = aNew;
+  manifestCache.nHash = nNew;
+}
+
+/*
+** Return the cache entry for rid, or NULL if there is none.
+*/
+static ManifestCacheLine *manifest_cache_lookup(int rid){
+  ManifestCacheLine *pLine = 0;
+  if( manifestCache.nHash>0 ){
+    pLine = manifestCache.aHash[(unsigned)rid % manifestCache.nHash];
+    while( pLine && pLine->p->rid!=rid ) pLine = pLine->pHashNext;
   }
+  return pLine;
 }
 
 /*
-** Add an element to the manifest cache using LRU replacement.
+** Add a manifest and its baseline to the manifest cache, evicting the
+** least recently used entries as needed to stay within the size limit.
+** The baseline is detached and cached separately, so that it is shared
+** by all the delta-manifests that use it.
+**
+** This routines hands responsibility for the manifest over to the cache.
 */
 void manifest_cache_insert(Manifest *p){
   while( p ){
-    int i;
     Manifest *pBaseline = p->pBaseline;
+    ManifestCacheLine *pLine;
+    i64 sz;
+    unsigned h;
     p->pBaseline = 0;
-    for(i=0; i<MX_MANIFEST_CACHE; i++){
-      if( manifestCache.apManifest[i]==0 ) break;
+    sz = manifest_cache_size(p);
+    if( p->rid<=0 || p->type!=CFTYPE_MANIFEST || sz>manifest_cache_limit() ){
+      manifest_free(p);
+      p = pBaseline;
+      continue;
     }
-    if( i>=MX_MANIFEST_CACHE ){
-      int oldest = 0;
-      int oldestAge = manifestCache.aAge[0];
-      for(i=1; i<MX_MANIFEST_CACHE; i++){
-        if( manifestCache.aAge[i]<oldestAge ){
-          oldest = i;
-          oldestAge = manifestCache.aAge[i];
-        }
-      }
-      manifest_destroy(manifestCache.apManifest[oldest]);
-      i = oldest;
+    if( (pLine = manifest_cache_lookup(p->rid))!=0 ){
+      manifest_free(manifest_cache_remove(pLine));
+    }
+    while( manifestCache.szTotal+sz>manifestCache.szLimit
+        && manifestCache.pOldest ){
+      manifest_free(manifest_cache_remove(manifestCache.pOldest));
+      manifestCache.nEvict++;
+    }
+    if( manifestCache.n>=manifestCache.nHash ){
+      manifest_cache_rehash();
     }
-    manifestCache.aAge[i] = ++manifestCache.nxAge;
-    manifestCache.apManifest[i] = p;
+    pLine = fossil_malloc( sizeof(*pLine) );
+    pLine->p = p;
+    pLine->sz = sz;
+    h = (unsigned)p->rid % manifestCache.nHash;
+    pLine->pHashNext = manifestCache.aHash[h];
+    manifestCache.aHash[h] = pLine;
+    pLine->pOlder = manifestCache.pNewest;
+    pLine->pNewer = 0;
+    if( manifestCache.pNewest ){
+      manifestCache.pNewest->pNewer = pLine;
+    }else{
+      manifestCache.pOldest = pLine;
+    }
+    manifestCache.pNewest = pLine;
+    manifestCache.szTotal += sz;
+    manifestCache.n++;
     p = pBaseline;
   }
 }
 
 /*
-** Try to extract a line from the manifest cache. Return 1 if found.
-** Return 0 if not found.
+** Remove the manifest for rid from the cache and return it, rewound
+** as if it had just been parsed.  Return NULL if it is not in the cache.
 */
 static Manifest *manifest_cache_find(int rid){
-  int i;
+  ManifestCacheLine *pLine = manifest_cache_lookup(rid);
   Manifest *p;
-  for(i=0; i<MX_MANIFEST_CACHE; i++){
-    if( manifestCache.apManifest[i] && manifestCache.apManifest[i]->rid==rid ){
-      p = manifestCache.apManifest[i];
-      manifestCache.apManifest[i] = 0;
-      return p;
-    }
+  if( pLine==0 ){
+    manifestCache.nMiss++;
+    return 0;
   }
-  return 0;
+  manifestCache.nHit++;
+  p = manifest_cache_remove(pLine);
+  p->iFile = 0;
+  return p;
+}
+
+/*
+** Write the number of calls to manifest_parse(), including repeated
+** parses of the same artifact, into *pnParse and the number of manifests
+** taken from the cache instead into *pnHit.
+*/
+void manifest_cache_counts(int *pnParse, int *pnHit){
+  *pnParse = manifestCache.nParse;
+  *pnHit = manifestCache.nHit;
 }
 
 /*
 ** Clear the manifest cache.
 */
 void manifest_cache_clear(void){
-  int i;
-  for(i=0; i<MX_MANIFEST_CACHE; i++){
-    if( manifestCache.apManifest[i] ){
-      manifest_destroy(manifestCache.apManifest[i]);
-    }
+  while( manifestCache.pOldest ){
+    manifest_free(manifest_cache_remove(manifestCache.pOldest));
   }
-  memset(&manifestCache, 0, sizeof(manifestCache));
+  fossil_free(manifestCache.aHash);
+  manifestCache.aHash = 0;
+  manifestCache.nHash = 0;
 }
 
 #ifdef FOSSIL_DONT_VERIFY_MANIFEST_MD5SUM
@@ -380,6 +546,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
   ** if that is not the case for this artifact.
   */
   if( !isRepeat ) g.parseCnt[0]++;
+  manifestCache.nParse++;
   z = blob_materialize(pContent);
   n = blob_size(pContent);
   if( n<=0 || z[n-1]!='\n' ){
@@ -408,10 +575,10 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
     return 0;
   }
 
-  /* Store the UUID (before modifying the blob) only for error
-  ** reporting purposes.
+  /* An artifact without an rid has no hash to look up, so store the
+  ** hash (before modifying the blob) only for error reporting purposes.
   */
-  sha1sum_blob(pContent, &bUuid);
+  if( rid==0 && pErr ) sha1sum_blob(pContent, &bUuid);
 
   /* Allocate a Manifest object to hold the parsed control artifact.
   */
@@ -957,9 +1124,18 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
   return p;
 
 manifest_syntax_error:
-  if(bUuid.nUsed){
+  if( bUuid.nUsed ){
     blob_appendf(pErr, "manifest [%.40s] ", blob_str(&bUuid));
     blob_reset(&bUuid);
+  }else if( rid>0 && pErr ){
+    /* The artifact hash is only needed here, so look it up rather than
+    ** computing it for every parse.  The content has been modified by
+    ** now, so it cannot be hashed. */
+    char *zHash = rid_to_uuid(rid);
+    if( zHash ){
+      blob_appendf(pErr, "manifest [%.40s] ", zHash);
+      fossil_free(zHash);
+    }
   }
   if( zErr ){
     blob_appendf(pErr, "line %d: %s", lineNo, zErr);
@@ -1046,6 +1222,75 @@ void manifest_test_parse_cmd(void){
   }
 }
 
+/*
+** COMMAND: test-manifest-cache-stats
+**
+** Usage: %fossil test-manifest-cache-stats ?CHECK-IN ...? ?OPTIONS?
+**
+** Load the named check-ins, or every check-in in the repository if none
+** are named, through the manifest cache and walk their file lists.  Then
+** report the number of parses, cache hits, misses, evictions and memory
+** usage.
+**
+** Options:
+**    --limit N      Use a cache size limit of N bytes instead of the
+**                   value of the "manifest-cache-size" setting
+**    --repeat N     Load the set of check-ins N times.  Default: 1
+*/
+void test_manifest_cache_stats_cmd(void){
+  const char *zLimit;
+  const char *zRepeat;
+  int nRepeat;
+  int i;
+  Bag set;
+
+  db_find_and_open_repository(OPEN_ANY_SCHEMA, 0);
+  zLimit = find_option("limit",0,1);
+  zRepeat = find_option("repeat",0,1);
+  nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  verify_all_options();
+  manifest_cache_clear();
+  if( zLimit ){
+    manifestCache.szLimit = atoi(zLimit);
+    manifestCache.limitKnown = 1;
+  }
+  bag_init(&set);
+  if( g.argc>2 ){
+    for(i=2; i<g.argc; i++){
+      int rid = name_to_typed_rid(g.argv[i], "ci");
+      if( rid==0 ) fossil_fatal("no such check-in: %s", g.argv[i]);
+      bag_insert(&set, rid);
+    }
+  }else{
+    Stmt q;
+    db_prepare(&q, "SELECT objid FROM event WHERE type='ci' ORDER BY objid");
+    while( db_step(&q)==SQLITE_ROW ){
+      bag_insert(&set, db_column_int(&q, 0));
+    }
+    db_finalize(&q);
+  }
+  manifestCache.nParse = 0;
+  while( nRepeat-- > 0 ){
+    int rid;
+    for(rid=bag_first(&set); rid>0; rid=bag_next(&set, rid)){
+      Manifest *p = manifest_get(rid, CFTYPE_MANIFEST, 0);
+      if( p==0 ) continue;
+      manifest_file_rewind(p);
+      while( manifest_file_next(p, 0) ){}
+      manifest_destroy(p);
+    }
+  }
+  fossil_print("check-ins: %d\n", bag_count(&set));
+  fossil_print("parses:    %d\n", manifestCache.nParse);
+  fossil_print("hits:      %d\n", manifestCache.nHit);
+  fossil_print("misses:    %d\n", manifestCache.nMiss);
+  fossil_print("evictions: %d\n", manifestCache.nEvict);
+  fossil_print("entries:   %d\n", manifestCache.n);
+  fossil_print("bytes:     %lld\n", manifestCache.szTotal);
+  fossil_print("limit:     %lld\n", manifest_cache_limit());
+  bag_clear(&set);
+}
+
 /*
 ** Fetch the baseline associated with the delta-manifest p.
 ** Return 0 on success.  If unable to parse the baseline,
@@ -1579,6 +1824,7 @@ static int manifest_add_checkin_linkages(
        pid, rid, i==0, p->rDate, zBaseId/*safe-for-%s*/);
     if( i==0 ) parentid = pid;
   }
+  ancestry_add(rid);
   add_mlink(parentid, 0, rid, p, 1);
   if( nParent>1 ){
     /* Change MLINK.PID from 0 to -1 for files that are added by merge. */
@@ -1611,6 +1857,31 @@ static int manifest_add_checkin_linkages(
   return parentid;
 }
 
+/*
+** Run the tag propagations that manifest_crosslink() deferred while
+** a manifest_crosslink_begin()/manifest_crosslink_end() batch is open.
+**
+** Tags of the parent of each new check-in are pushed down to its
+** children.  Doing this once per parent after a run of check-ins has
+** been crosslinked, rather than once per check-in, means each pass sees
+** all of the new children, and a propagation stops as soon as it reaches
+** a check-in that already carries the tag.
+**
+** The queue is flushed before any artifact that changes tags or
+** parentage of existing check-ins is processed, so the result is the
+** same as propagating immediately.
+*/
+static void manifest_crosslink_propagate(void){
+  Stmt q;
+  if( !manifest_crosslink_busy ) return;
+  db_prepare(&q, "SELECT rid FROM pending_tagprop ORDER BY seq");
+  while( db_step(&q)==SQLITE_ROW ){
+    tag_propagate_all(db_column_int(&q, 0));
+  }
+  db_finalize(&q);
+  db_multi_exec("DELETE FROM pending_tagprop");
+}
+
 /*
 ** There exists a "parent" tag against checkin rid that has value zValue.
 ** If value is well-formed (meaning that it is a list of UUIDs), then use
@@ -1641,6 +1912,9 @@ void manifest_reparent_checkin(int rid, const char *zValue){
     p = manifest_get(rid, CFTYPE_MANIFEST, 0);
   }
   if( p!=0 ){
+    manifest_crosslink_propagate();
+    ancestry_forget(rid);
+    cidag_reset();
     db_multi_exec(
        "DELETE FROM plink WHERE cid=%d;"
        "DELETE FROM mlink WHERE mid=%d;",
@@ -1667,6 +1941,10 @@ void manifest_crosslink_begin(void){
   db_begin_transaction();
   db_multi_exec(
      "CREATE TEMP TABLE pending_tkt(uuid TEXT UNIQUE);"
+     "CREATE TEMP TABLE pending_tagprop("
+     "  seq INTEGER PRIMARY KEY,"    /* Order in which rid was queued */
+     "  rid INTEGER UNIQUE"          /* Propagate tags from this check-in */
+     ");"
      "CREATE TEMP TABLE time_fudge("
      "  mid INTEGER PRIMARY KEY,"    /* The rid of a manifest */
      "  m1 REAL,"                    /* The timestamp on mid */
@@ -1706,6 +1984,7 @@ int manifest_crosslink_end(int flags){
       zScript = xfer_ticket_code();
     }
   }
+  manifest_crosslink_propagate();
   db_prepare(&q,
      "SELECT rid, value FROM tagxref"
      " WHERE tagid=%d AND tagtype=1",
@@ -1717,6 +1996,11 @@ int manifest_crosslink_end(int flags){
     manifest_reparent_checkin(rid, zValue);
   }
   db_finalize(&q);
+
+  /* Reparenting above flushes the tag propagation queue again, so it is
+  ** dropped only once the reparenting is done. */
+  manifest_crosslink_propagate();
+  db_multi_exec("DROP TABLE pending_tagprop");
   db_prepare(&q, "SELECT uuid FROM pending_tkt");
   while( db_step(&q)==SQLITE_ROW ){
     const char *zUuid = db_column_text(&q, 0);
@@ -1954,12 +2238,20 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
     return 0;
   }
   db_begin_transaction();
+  cidag_reset();
   if( p->type==CFTYPE_MANIFEST ){
+    static Stmt hasMlink;
+    int isLinked;
     if( permitHooks ){
       zScript = xfer_commit_code();
       zUuid = db_text(0, "SELECT uuid FROM blob WHERE rid=%d", rid);
     }
-    if( !db_exists("SELECT 1 FROM mlink WHERE mid=%d", rid) ){
+    db_static_prepare(&hasMlink, "SELECT 1 FROM mlink WHERE mid=:rid");
+    db_bind_int(&hasMlink, ":rid", rid);
+    isLinked = db_step(&hasMlink)==SQLITE_ROW;
+    db_reset(&hasMlink);
+    if( !isLinked ){
+      static Stmt lastCom;
       char *zCom;
       parentid = manifest_add_checkin_linkages(rid,p,p->nParent,p->azParent);
       search_doc_touch('c', rid, 0);
@@ -1981,8 +2273,13 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
         TAG_USER, rid,
         TAG_COMMENT, rid, p->rDate
       );
-      zCom = db_text(0, "SELECT coalesce(ecomment, comment) FROM event"
-                        " WHERE rowid=last_insert_rowid()");
+      db_static_prepare(&lastCom,
+        "SELECT coalesce(ecomment, comment) FROM event"
+        " WHERE rowid=last_insert_rowid()"
+      );
+      zCom = db_step(&lastCom)==SQLITE_ROW ?
+                 fossil_strdup(db_column_text(&lastCom, 0)) : 0;
+      db_reset(&lastCom);
       wiki_extract_links(zCom, rid, 0, p->rDate, 1, WIKI_INLINE);
       fossil_free(zCom);
 
@@ -2017,6 +2314,7 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
    || p->type==CFTYPE_MANIFEST
    || p->type==CFTYPE_EVENT
   ){
+    if( p->type!=CFTYPE_MANIFEST ) manifest_crosslink_propagate();
     for(i=0; i<p->nTag; i++){
       int tid;
       int type;
@@ -2039,7 +2337,18 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
       }
     }
     if( parentid ){
-      tag_propagate_all(parentid);
+      if( manifest_crosslink_busy && !permitHooks ){
+        /* Defer to manifest_crosslink_propagate() */
+        static Stmt ins;
+        db_static_prepare(&ins,
+          "INSERT OR IGNORE INTO pending_tagprop(rid) VALUES(:rid)"
+        );
+        db_bind_int(&ins, ":rid", parentid);
+        db_step(&ins);
+        db_reset(&ins);
+      }else{
+        tag_propagate_all(parentid);
+      }
     }
   }
   if( p->type==CFTYPE_WIKI ){
@@ -393,7 +393,11 @@ void merge_cmd(void){
   if( load_vfile_from_rid(pid) && !forceMissingFlag ){
     fossil_fatal("missing content, unable to merge");
   }
-  if( zPivot ){
+  if( zPivot && ancestry_available() && !is_an_ancestor(pid, vid, 0) ){
+    /* Skip the walk below when the CIGEN labels show that P is not an
+    ** ancestor of V at all.  Without labels the check is another walk. */
+    vAncestor = 'n';
+  }else if( zPivot ){
     vAncestor = db_exists(
       "WITH RECURSIVE ancestor(id) AS ("
       "  VALUES(%d)"
@@ -94,6 +94,8 @@ void moderation_disapprove(int objid){
       content_undelta(ridUser);
     }
     db_finalize(&q);
+    cache_artifact_forget(rid);
+    xfer_ihash_forget();
     db_multi_exec(
       "DELETE FROM blob WHERE rid=%d;"
       "DELETE FROM delta WHERE rid=%d;"
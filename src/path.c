@@ -36,8 +36,275 @@ struct PathNode {
   } u;
   PathNode *pAll;        /* List of all nodes */
 };
+
+/*
+** A compact in-memory copy of the check-in DAG, loaded from the PLINK,
+** EVENT, and TAGXREF tables.  Nodes are numbered from 0.  The parents
+** of node i are aParent[aParentIdx[i]] through aParent[aParentIdx[i+1]-1]
+** in order of increasing rid, and likewise for children.  This is the
+** same order in which the plink indexes return them.
+*/
+struct CiDag {
+  int nNode;            /* Number of nodes */
+  int mxRid;            /* Largest rid that aIdx[] covers */
+  int *aIdx;            /* aIdx[rid]-1 is the node for rid.  0 for none */
+  int *aRid;            /* The rid for each node */
+  int nRidAlloc;        /* Space allocated for aRid[] */
+  double *aMtime;       /* event.mtime for each node.  0.0 if unknown */
+  int *aBranch;         /* Branch of each node.  0 means "trunk" */
+  u8 *aBrStart;         /* True if the node is the first on a new branch */
+  int *aParentIdx;      /* Start of each node's parents in aParent[] */
+  int *aParent;         /* Parent nodes */
+  u8 *aParentPrim;      /* True if aParent[] entry is the primary parent */
+  int *aChildIdx;       /* Start of each node's children in aChild[] */
+  int *aChild;          /* Child nodes */
+  u8 *aChildPrim;       /* True if the node is the child's primary parent */
+  int nBranch;          /* Number of distinct branch names */
+};
 #endif
 
+/*
+** The DAG for the current repository, if it has been loaded.
+*/
+static CiDag *pCiDag = 0;
+
+/*
+** One plink entry while the DAG is being loaded.
+*/
+struct CiDagEdge {
+  int a, b;             /* Sort key: (pid,cid) or (cid,pid) */
+  int isPrim;           /* True for a primary parent link */
+};
+
+/*
+** qsort() comparison function for CiDagEdge.
+*/
+static int cidag_edge_cmp(const void *pA, const void *pB){
+  const struct CiDagEdge *x = (const struct CiDagEdge*)pA;
+  const struct CiDagEdge *y = (const struct CiDagEdge*)pB;
+  if( x->a!=y->a ) return x->a<y->a ? -1 : 1;
+  if( x->b!=y->b ) return x->b<y->b ? -1 : 1;
+  return 0;
+}
+
+/*
+** Return the node for rid in the DAG, adding a new node if rid is not
+** already there.
+*/
+static int cidag_add_node(CiDag *p, int rid){
+  if( rid<=0 || rid>p->mxRid ) return -1;
+  if( p->aIdx[rid]==0 ){
+    if( p->nNode>=p->nRidAlloc ){
+      p->nRidAlloc = p->nRidAlloc*2 + 1000;
+      p->aRid = fossil_realloc(p->aRid, sizeof(int)*p->nRidAlloc);
+    }
+    p->aRid[p->nNode] = rid;
+    p->aIdx[rid] = ++p->nNode;
+  }
+  return p->aIdx[rid]-1;
+}
+
+/*
+** Fill in the adjacency lists aIdx[] and aNode[] from the edges in
+** aEdge[], which are sorted on their "a" field.  The entries of aNode[]
+** are the node numbers for the "b" field of each edge.
+*/
+static void cidag_fill(
+  CiDag *p,
+  struct CiDagEdge *aEdge,
+  int nEdge,
+  int *aIdx,
+  int *aNode,
+  u8 *aPrim
+){
+  int i;
+  memset(aIdx, 0, sizeof(aIdx[0])*(p->nNode+1));
+  for(i=0; i<nEdge; i++) aIdx[p->aIdx[aEdge[i].a]]++;
+  for(i=0; i<p->nNode; i++) aIdx[i+1] += aIdx[i];
+  for(i=0; i<nEdge; i++){
+    aNode[i] = p->aIdx[aEdge[i].b]-1;
+    aPrim[i] = (u8)aEdge[i].isPrim;
+  }
+}
+
+/*
+** Hash function for branch names.
+*/
+static unsigned int cidag_strhash(const char *z){
+  unsigned int h = 0;
+  while( *z ) h = (h<<3) ^ h ^ (unsigned char)*(z++);
+  return h;
+}
+
+/*
+** Load the check-in DAG of the current repository.
+*/
+static CiDag *cidag_load(void){
+  CiDag *p;
+  Stmt q;
+  struct CiDagEdge *aEdge = 0;
+  int nEdge = 0, nAlloc = 0;
+  int i, nBranch = 0;
+  int nHash = 0;          /* Slots in the branch name hash table */
+  char **azHash = 0;      /* Branch names */
+  int *aHashId = 0;       /* Branch number for each name in azHash[] */
+
+  p = fossil_malloc( sizeof(*p) );
+  memset(p, 0, sizeof(*p));
+  p->mxRid = db_int(0, "SELECT max(rid) FROM blob");
+  p->aIdx = fossil_malloc( sizeof(int)*(p->mxRid+1) );
+  memset(p->aIdx, 0, sizeof(int)*(p->mxRid+1));
+
+  /* Check-ins, then any parents that are still phantoms */
+  db_prepare(&q, "SELECT objid FROM event WHERE type='ci'");
+  while( db_step(&q)==SQLITE_ROW ){
+    cidag_add_node(p, db_column_int(&q, 0));
+  }
+  db_finalize(&q);
+  db_prepare(&q, "SELECT pid, cid, isprim FROM plink");
+  while( db_step(&q)==SQLITE_ROW ){
+    int pid = db_column_int(&q, 0);
+    int cid = db_column_int(&q, 1);
+    if( cidag_add_node(p, pid)<0 || cidag_add_node(p, cid)<0 ) continue;
+    if( nEdge>=nAlloc ){
+      nAlloc = nAlloc*2 + 1000;
+      aEdge = fossil_realloc(aEdge, sizeof(aEdge[0])*nAlloc);
+    }
+    aEdge[nEdge].a = pid;
+    aEdge[nEdge].b = cid;
+    aEdge[nEdge].isPrim = db_column_int(&q, 2)!=0;
+    nEdge++;
+  }
+  db_finalize(&q);
+
+  p->aMtime = fossil_malloc( sizeof(double)*p->nNode );
+  p->aBranch = fossil_malloc( sizeof(int)*p->nNode );
+  p->aBrStart = fossil_malloc( p->nNode );
+  memset(p->aMtime, 0, sizeof(double)*p->nNode);
+  memset(p->aBranch, 0, sizeof(int)*p->nNode);
+  memset(p->aBrStart, 0, p->nNode);
+  db_prepare(&q, "SELECT objid, mtime FROM event WHERE type='ci'");
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    p->aMtime[p->aIdx[rid]-1] = db_column_double(&q, 1);
+  }
+  db_finalize(&q);
+
+  /* Branch names are numbered in a small hash table, with "trunk" as 0 */
+  db_prepare(&q,
+    "SELECT rid, coalesce(value,'trunk'), tagtype=2 AND srcid>0 FROM tagxref"
+    " WHERE tagid=%d",
+    TAG_BRANCH
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    const char *zBr = db_column_text(&q, 1);
+    unsigned int h = 0;
+    int x;
+    if( rid<=0 || rid>p->mxRid || p->aIdx[rid]==0 ) continue;
+    x = p->aIdx[rid]-1;
+    p->aBrStart[x] = (u8)db_column_int(&q, 2);
+    if( fossil_strcmp(zBr, "trunk")==0 ) continue;
+    if( nBranch*2>=nHash ){
+      char **azOld = azHash;
+      int *aOld = aHashId;
+      int nOld = nHash;
+      nHash = nHash ? nHash*2 : 64;
+      azHash = fossil_malloc( sizeof(char*)*nHash );
+      aHashId = fossil_malloc( sizeof(int)*nHash );
+      memset(azHash, 0, sizeof(char*)*nHash);
+      for(i=0; i<nOld; i++){
+        if( azOld[i]==0 ) continue;
+        for(h=cidag_strhash(azOld[i])%nHash; azHash[h]; h=(h+1)%nHash){}
+        azHash[h] = azOld[i];
+        aHashId[h] = aOld[i];
+      }
+      fossil_free(azOld);
+      fossil_free(aOld);
+    }
+    for(h=cidag_strhash(zBr)%nHash; azHash[h]; h=(h+1)%nHash){
+      if( strcmp(azHash[h], zBr)==0 ) break;
+    }
+    if( azHash[h]==0 ){
+      azHash[h] = fossil_strdup(zBr);
+      aHashId[h] = ++nBranch;
+    }
+    p->aBranch[x] = aHashId[h];
+  }
+  db_finalize(&q);
+  for(i=0; i<nHash; i++) fossil_free(azHash[i]);
+  fossil_free(azHash);
+  fossil_free(aHashId);
+  p->nBranch = nBranch+1;
+
+  /* Children, sorted by (pid,cid), and parents, sorted by (cid,pid) */
+  p->aChildIdx = fossil_malloc( sizeof(int)*(p->nNode+1) );
+  p->aChild = fossil_malloc( sizeof(int)*(nEdge+1) );
+  p->aChildPrim = fossil_malloc( nEdge+1 );
+  qsort(aEdge, nEdge, sizeof(aEdge[0]), cidag_edge_cmp);
+  cidag_fill(p, aEdge, nEdge, p->aChildIdx, p->aChild, p->aChildPrim);
+  for(i=0; i<nEdge; i++){
+    int t = aEdge[i].a;
+    aEdge[i].a = aEdge[i].b;
+    aEdge[i].b = t;
+  }
+  p->aParentIdx = fossil_malloc( sizeof(int)*(p->nNode+1) );
+  p->aParent = fossil_malloc( sizeof(int)*(nEdge+1) );
+  p->aParentPrim = fossil_malloc( nEdge+1 );
+  qsort(aEdge, nEdge, sizeof(aEdge[0]), cidag_edge_cmp);
+  cidag_fill(p, aEdge, nEdge, p->aParentIdx, p->aParent, p->aParentPrim);
+  fossil_free(aEdge);
+  return p;
+}
+
+/*
+** Return the check-in DAG for the current repository, loading it on the
+** first call.  The DAG stays in memory until cidag_reset() is called.
+*/
+CiDag *cidag_get(void){
+  if( pCiDag==0 ) pCiDag = cidag_load();
+  return pCiDag;
+}
+
+/*
+** Return true if the in-memory DAG is already loaded, so that using it
+** costs nothing extra.
+*/
+int cidag_is_loaded(void){
+  return pCiDag!=0;
+}
+
+/*
+** Discard the in-memory DAG.  This must be called whenever the PLINK
+** table or the branch tags change.
+*/
+void cidag_reset(void){
+  CiDag *p = pCiDag;
+  if( p==0 ) return;
+  pCiDag = 0;
+  fossil_free(p->aIdx);
+  fossil_free(p->aRid);
+  fossil_free(p->aMtime);
+  fossil_free(p->aBranch);
+  fossil_free(p->aBrStart);
+  fossil_free(p->aParentIdx);
+  fossil_free(p->aParent);
+  fossil_free(p->aParentPrim);
+  fossil_free(p->aChildIdx);
+  fossil_free(p->aChild);
+  fossil_free(p->aChildPrim);
+  fossil_free(p);
+}
+
+/*
+** Return the node for check-in rid in DAG p, or -1 if rid is not part
+** of the DAG.
+*/
+int cidag_node(CiDag *p, int rid){
+  if( rid<=0 || rid>p->mxRid ) return -1;
+  return p->aIdx[rid]-1;
+}
+
 /*
 ** Local variables for this module
 */
@@ -108,6 +375,93 @@ static void path_reverse_path(void){
   assert( p==path.pStart );
 }
 
+/*
+** Number of check-ins that path_shortest() and path_common_ancestor()
+** visit using PLINK queries before they switch to the in-memory DAG.
+** Loading the DAG costs more than a short walk.
+*/
+#define PATH_DAG_MIN 1000
+
+/*
+** Allowed values for the mFlags argument to path_links().
+*/
+#define PATH_CHILDREN  0x01     /* Links to children */
+#define PATH_PARENTS   0x02     /* Links to parents */
+#define PATH_PRIMARY   0x04     /* Only primary parent links */
+
+/*
+** The check-ins linked to one check-in, as found by path_links().
+*/
+typedef struct PathLinks PathLinks;
+struct PathLinks {
+  int n;                /* Number of links */
+  int nAlloc;           /* Space allocated for aRid[] and aFromIsParent[] */
+  int *aRid;            /* The check-in at the other end of each link */
+  u8 *aFromIsParent;    /* True if the link is to a child */
+};
+
+/*
+** Append one link to pL.
+*/
+static void path_links_append(PathLinks *pL, int rid, int fromIsParent){
+  if( pL->n>=pL->nAlloc ){
+    pL->nAlloc = pL->nAlloc*2 + 20;
+    pL->aRid = fossil_realloc(pL->aRid, sizeof(int)*pL->nAlloc);
+    pL->aFromIsParent = fossil_realloc(pL->aFromIsParent, pL->nAlloc);
+  }
+  pL->aRid[pL->n] = rid;
+  pL->aFromIsParent[pL->n] = (u8)fromIsParent;
+  pL->n++;
+}
+
+/*
+** Load pL with the check-ins linked to rid, children first and then
+** parents, each in order of increasing rid.  Use the DAG pDag if it is
+** not NULL.  Otherwise run the query pQ, which has a :rid parameter and
+** returns the same links as (rid,fromIsParent) rows.
+*/
+static void path_links(
+  PathLinks *pL,        /* Write the links here */
+  CiDag *pDag,          /* The in-memory DAG, or NULL */
+  Stmt *pQ,             /* Query to use if pDag is NULL */
+  int rid,              /* Find links of this check-in */
+  int mFlags            /* PATH_* flags */
+){
+  int x, i;
+  pL->n = 0;
+  if( pDag==0 ){
+    db_bind_int(pQ, ":rid", rid);
+    while( db_step(pQ)==SQLITE_ROW ){
+      path_links_append(pL, db_column_int(pQ, 0), db_column_int(pQ, 1));
+    }
+    db_reset(pQ);
+    return;
+  }
+  x = cidag_node(pDag, rid);
+  if( x<0 ) return;
+  if( mFlags & PATH_CHILDREN ){
+    for(i=pDag->aChildIdx[x]; i<pDag->aChildIdx[x+1]; i++){
+      if( (mFlags & PATH_PRIMARY)!=0 && !pDag->aChildPrim[i] ) continue;
+      path_links_append(pL, pDag->aRid[pDag->aChild[i]], 1);
+    }
+  }
+  if( mFlags & PATH_PARENTS ){
+    for(i=pDag->aParentIdx[x]; i<pDag->aParentIdx[x+1]; i++){
+      if( (mFlags & PATH_PRIMARY)!=0 && !pDag->aParentPrim[i] ) continue;
+      path_links_append(pL, pDag->aRid[pDag->aParent[i]], 0);
+    }
+  }
+}
+
+/*
+** Release the memory used by pL.
+*/
+static void path_links_reset(PathLinks *pL){
+  fossil_free(pL->aRid);
+  fossil_free(pL->aFromIsParent);
+  memset(pL, 0, sizeof(*pL));
+}
+
 /*
 ** Compute the shortest path from iFrom to iTo
 **
@@ -127,8 +481,12 @@ PathNode *path_shortest(
   int oneWayOnly      /* Parent->child only if true */
 ){
   Stmt s;
+  CiDag *pDag;
+  PathLinks links;
   PathNode *pPrev;
   PathNode *p;
+  int mFlags;
+  int i;
 
   path_reset();
   path.pStart = path_new_node(iFrom, 0, 0);
@@ -138,48 +496,55 @@ PathNode *path_shortest(
   }
   if( oneWayOnly && directOnly ){
     db_prepare(&s,
-        "SELECT cid, 1 FROM plink WHERE pid=:pid AND isprim"
+        "SELECT cid, 1 FROM plink WHERE pid=:rid AND isprim"
     );
   }else if( oneWayOnly ){
     db_prepare(&s,
-        "SELECT cid, 1 FROM plink WHERE pid=:pid "
+        "SELECT cid, 1 FROM plink WHERE pid=:rid "
     );
   }else if( directOnly ){
     db_prepare(&s,
-        "SELECT cid, 1 FROM plink WHERE pid=:pid AND isprim "
+        "SELECT cid, 1 FROM plink WHERE pid=:rid AND isprim "
         "UNION ALL "
-        "SELECT pid, 0 FROM plink WHERE cid=:pid AND isprim"
+        "SELECT pid, 0 FROM plink WHERE cid=:rid AND isprim"
     );
   }else{
     db_prepare(&s,
-        "SELECT cid, 1 FROM plink WHERE pid=:pid "
+        "SELECT cid, 1 FROM plink WHERE pid=:rid "
         "UNION ALL "
-        "SELECT pid, 0 FROM plink WHERE cid=:pid"
+        "SELECT pid, 0 FROM plink WHERE cid=:rid"
     );
   }
+  mFlags = PATH_CHILDREN | (oneWayOnly ? 0 : PATH_PARENTS)
+         | (directOnly ? PATH_PRIMARY : 0);
+  pDag = cidag_is_loaded() ? cidag_get() : 0;
+  memset(&links, 0, sizeof(links));
   while( path.pCurrent ){
     path.nStep++;
     pPrev = path.pCurrent;
     path.pCurrent = 0;
     while( pPrev ){
-      db_bind_int(&s, ":pid", pPrev->rid);
-      while( db_step(&s)==SQLITE_ROW ){
-        int cid = db_column_int(&s, 0);
-        int isParent = db_column_int(&s, 1);
+      if( pDag==0 && bag_count(&path.seen)>PATH_DAG_MIN ){
+        pDag = cidag_get();
+      }
+      path_links(&links, pDag, &s, pPrev->rid, mFlags);
+      for(i=0; i<links.n; i++){
+        int cid = links.aRid[i];
         if( bag_find(&path.seen, cid) ) continue;
-        p = path_new_node(cid, pPrev, isParent);
+        p = path_new_node(cid, pPrev, links.aFromIsParent[i]);
         if( cid==iTo ){
           db_finalize(&s);
+          path_links_reset(&links);
           path.pEnd = p;
           path_reverse_path();
           return path.pStart;
         }
       }
-      db_reset(&s);
       pPrev = pPrev->u.pPeer;
     }
   }
   db_finalize(&s);
+  path_links_reset(&links);
   path_reset();
   return 0;
 }
@@ -196,6 +561,32 @@ PathNode *path_midpoint(void){
   return p;
 }
 
+/*
+** COMMAND: test-cidag
+**
+** Usage: %fossil test-cidag ?--repeat N?
+**
+** Load the in-memory check-in DAG N times (default 1) and report its
+** size and the CPU time taken for each load.
+*/
+void test_cidag_cmd(void){
+  const char *zRepeat;
+  int i, n;
+  db_find_and_open_repository(0,0);
+  zRepeat = find_option("repeat",0,1);
+  n = zRepeat ? atoi(zRepeat) : 1;
+  verify_all_options();
+  for(i=0; i<n; i++){
+    int iTimer = fossil_timer_start();
+    CiDag *p;
+    cidag_reset();
+    p = cidag_get();
+    fossil_print("%d nodes, %d links, %d branches loaded in %.3fms\n",
+                 p->nNode, p->aChildIdx[p->nNode], p->nBranch,
+                 fossil_timer_stop(iTimer)/1000.0);
+  }
+}
+
 /*
 ** COMMAND: test-shortest-path
 **
@@ -246,9 +637,12 @@ void shortest_path_test_cmd(void){
 */
 int path_common_ancestor(int iMe, int iYou){
   Stmt s;
+  CiDag *pDag;
+  PathLinks links;
   PathNode *pPrev;
   PathNode *p;
   Bag me, you;
+  int i;
 
   if( iMe==iYou ) return iMe;
   if( iMe==0 || iYou==0 ) return 0;
@@ -256,7 +650,9 @@ int path_common_ancestor(int iMe, int iYou){
   path.pStart = path_new_node(iMe, 0, 0);
   path.pStart->isPrim = 1;
   path.pEnd = path_new_node(iYou, 0, 0);
-  db_prepare(&s, "SELECT pid FROM plink WHERE cid=:cid");
+  db_prepare(&s, "SELECT pid, 0 FROM plink WHERE cid=:rid");
+  pDag = cidag_is_loaded() ? cidag_get() : 0;
+  memset(&links, 0, sizeof(links));
   bag_init(&me);
   bag_insert(&me, iMe);
   bag_init(&you);
@@ -265,9 +661,12 @@ int path_common_ancestor(int iMe, int iYou){
     pPrev = path.pCurrent;
     path.pCurrent = 0;
     while( pPrev ){
-      db_bind_int(&s, ":cid", pPrev->rid);
-      while( db_step(&s)==SQLITE_ROW ){
-        int pid = db_column_int(&s, 0);
+      if( pDag==0 && bag_count(&path.seen)>PATH_DAG_MIN ){
+        pDag = cidag_get();
+      }
+      path_links(&links, pDag, &s, pPrev->rid, PATH_PARENTS);
+      for(i=0; i<links.n; i++){
+        int pid = links.aRid[i];
         if( bag_find(pPrev->isPrim ? &you : &me, pid) ){
           /* pid is the common ancestor */
           PathNode *pNext;
@@ -284,6 +683,9 @@ int path_common_ancestor(int iMe, int iYou){
           path.pEnd = pPrev;
           path_reverse_path();
           db_finalize(&s);
+          path_links_reset(&links);
+          bag_clear(&me);
+          bag_clear(&you);
           return pid;
         }else if( bag_find(&path.seen, pid) ){
           /* pid is just an alternative path on one of the legs */
@@ -293,11 +695,13 @@ int path_common_ancestor(int iMe, int iYou){
         p->isPrim = pPrev->isPrim;
         bag_insert(pPrev->isPrim ? &me : &you, pid);
       }
-      db_reset(&s);
       pPrev = pPrev->u.pPeer;
     }
   }
   db_finalize(&s);
+  path_links_reset(&links);
+  bag_clear(&me);
+  bag_clear(&you);
   path_reset();
   return 0;
 }
@@ -102,6 +102,7 @@ int purge_artifact_list(
 ){
   int peid = 0;                 /* New purgeevent ID */
   Stmt q;                       /* General-use prepared statement */
+  int reLabel;                  /* True if surviving check-ins lose parents */
   char *z;
 
   assert( g.repositoryOpen );   /* Main database must already be open */
@@ -177,12 +178,23 @@ int purge_artifact_list(
 
   /* Remove the artifacts being purged.  Also remove all references to those
   ** artifacts from the secondary tables. */
+  if( cache_artifact_depth()>0 ){
+    db_prepare(&q, "SELECT rid FROM \"%w\"", zTab);
+    while( db_step(&q)==SQLITE_ROW ){
+      cache_artifact_forget(db_column_int(&q, 0));
+    }
+    db_finalize(&q);
+  }
+  xfer_ihash_forget();
   db_multi_exec("DELETE FROM blob WHERE rid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM delta WHERE rid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM delta WHERE srcid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM event WHERE objid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM private WHERE rid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM mlink WHERE mid IN \"%w\"", zTab);
+  reLabel = db_exists("SELECT 1 FROM plink"
+                      " WHERE pid IN \"%w\" AND cid NOT IN \"%w\"",
+                      zTab, zTab);
   db_multi_exec("DELETE FROM plink WHERE pid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM plink WHERE cid IN \"%w\"", zTab);
   db_multi_exec("DELETE FROM leaf WHERE rid IN \"%w\"", zTab);
@@ -195,6 +207,14 @@ int purge_artifact_list(
                 "    OR origid IN \"%w\"", zTab, zTab, zTab);
   db_multi_exec("DELETE FROM backlink WHERE srctype=0 AND srcid IN \"%w\"",
                 zTab);
+  db_multi_exec("DROP TABLE IF EXISTS repository.blamecache");
+  cidag_reset();
+  manifest_cache_clear();
+  if( reLabel ){
+    ancestry_rebuild();
+  }else if( ancestry_available() ){
+    db_multi_exec("DELETE FROM cigen WHERE rid IN \"%w\"", zTab);
+  }
   db_multi_exec(
     "CREATE TEMP TABLE \"%w_tickets\" AS"
     " SELECT DISTINCT tkt_uuid FROM ticket WHERE tkt_id IN"
@@ -21,6 +21,12 @@
 #include "rebuild.h"
 #include <assert.h>
 #include <errno.h>
+#if !defined(_WIN32)
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <sys/select.h>
+#endif
 
 /*
 ** Make changes to the stable part of the schema (the part that is not
@@ -169,6 +175,36 @@ static Bag bagDone;         /* Bag of records rebuilt */
 static char *zFNameFormat;  /* Format string for filenames on deconstruct */
 static int prefixLength;    /* Length of directory prefix for deconstruct */
 
+/*
+** Worker processes for "fossil rebuild --jobs N".
+**
+** Each worker is handed a share of the roots of the delta trees.  It
+** expands every artifact in those trees, which is where a rebuild spends
+** most of its CPU time, and sends the artifacts back to the main process
+** through a pipe.  The main process remains the only writer to the
+** database.  It takes the artifacts in exactly the order a serial rebuild
+** would produce them and does the crosslinking.
+*/
+static struct {
+  int nJob;                 /* Number of workers.  0 for a serial rebuild */
+  int fdOut;                /* In a worker: pipe to the main process */
+  i64 nBuffered;            /* Bytes received but not yet crosslinked */
+  struct RebuildJob {
+    int pid;                  /* Process ID of the worker */
+    int fdRoot;               /* Send the worker its delta tree roots here */
+    int fdArtifact;           /* Receive expanded artifacts here */
+    Blob in;                  /* Data received from the worker */
+    int iIn;                  /* Bytes of in already used */
+    int isEof;                /* Worker has closed its end of the pipe */
+  } *aJob;
+} rebuildJobs;
+
+/*
+** Stop reading ahead from workers once this many bytes of artifacts
+** are waiting to be crosslinked.
+*/
+#define REBUILD_JOB_BUFFER 50000000
+
 
 /*
 ** Draw the percent-complete message.
@@ -198,6 +234,29 @@ static void rebuild_step_done(int rid){
   }
 }
 
+/*
+** In a worker, send the expanded artifact rid to the main process.  The
+** size is the value of blob.size, which the main process corrects if
+** needed.  The content buffer is cleared.  An rid of zero marks the end
+** of a delta tree.
+*/
+static void rebuild_job_send(int rid, int size, Blob *pContent){
+#if !defined(_WIN32)
+  unsigned char aHdr[12];
+  int n = pContent ? blob_size(pContent) : 0;
+  fossil_put32(aHdr, rid);
+  fossil_put32(&aHdr[4], size);
+  fossil_put32(&aHdr[8], n);
+  if( fossil_fd_write(rebuildJobs.fdOut, aHdr, 12)
+   || (n>0 && fossil_fd_write(rebuildJobs.fdOut, blob_buffer(pContent), n))
+  ){
+    /* The main process has gone away */
+    exit(1);
+  }
+  if( pContent ) blob_reset(pContent);
+#endif
+}
+
 /*
 ** Rebuild cross-referencing information for the artifact
 ** rid with content pBase and all of its descendants.  This
@@ -224,7 +283,7 @@ static void rebuild_step(int rid, int size, Blob *pBase){
   while( rid>0 ){
 
     /* Fix up the "blob.size" field if needed. */
-    if( size!=blob_size(pBase) ){
+    if( size!=blob_size(pBase) && rebuildJobs.fdOut==0 ){
       db_multi_exec(
          "UPDATE blob SET size=%d WHERE rid=%d", blob_size(pBase), rid
       );
@@ -250,7 +309,10 @@ static void rebuild_step(int rid, int size, Blob *pBase){
       blob_copy(&copy, pBase);
       pUse = &copy;
     }
-    if( zFNameFormat==0 ){
+    if( rebuildJobs.fdOut ){
+      /* We are a worker for "fossil rebuild --jobs" */
+      rebuild_job_send(rid, size, pUse);
+    }else if( zFNameFormat==0 ){
       /* We are doing "fossil rebuild" */
       manifest_crosslink(rid, pUse, MC_NONE);
     }else{
@@ -298,6 +360,272 @@ static void rebuild_step(int rid, int size, Blob *pBase){
   }
 }
 
+#if !defined(_WIN32)
+/*
+** The body of a worker process for "fossil rebuild --jobs".  Receive
+** the roots of delta trees on fdRoot and send back every artifact in
+** those trees, in the order that rebuild_step() visits them, on fdOut.
+** Never returns.
+*/
+static void rebuild_job_main(int fdRoot, int fdOut, const char *zRepo){
+  int *aRoot = 0;
+  int nRoot = 0, nAlloc = 0;
+  int i;
+  unsigned char aMsg[8];
+
+  rebuildJobs.nJob = 0;
+  rebuildJobs.fdOut = fdOut;
+  ttyOutput = 0;
+  db_open_repository(zRepo);
+
+  /* Hold a read transaction until finished, so that the main process
+  ** cannot commit changes to the artifacts underneath this worker. */
+  db_begin_transaction();
+  db_int(0, "SELECT rid FROM blob LIMIT 1");
+  if( fossil_fd_write(fdOut, "R", 1) ) exit(1);
+
+  while( 1 ){
+    if( fossil_fd_read(fdRoot, aMsg, 8) ) exit(1);
+    if( fossil_get32(aMsg)==0 ) break;
+    if( nRoot+2>nAlloc ){
+      nAlloc = nAlloc*2 + 200;
+      aRoot = fossil_realloc(aRoot, sizeof(aRoot[0])*nAlloc);
+    }
+    aRoot[nRoot++] = fossil_get32(aMsg);
+    aRoot[nRoot++] = fossil_get32(&aMsg[4]);
+  }
+  close(fdRoot);
+  for(i=0; i<nRoot; i+=2){
+    Blob content;
+    content_get(aRoot[i], &content);
+    rebuild_step(aRoot[i], aRoot[i+1], &content);
+    rebuild_job_send(0, 0, 0);
+  }
+  fossil_free(aRoot);
+  db_close(0);
+  exit(0);
+}
+
+/*
+** Start nJob worker processes for "fossil rebuild --jobs".  This must be
+** called while no transaction is open.  The repository is closed and
+** reopened around the fork() so that the workers do not share a
+** database connection with the main process.
+*/
+static void rebuild_jobs_start(int nJob){
+  char *zRepo = fossil_strdup(g.zRepositoryName);
+  int i, j;
+  rebuildJobs.aJob = fossil_malloc( sizeof(rebuildJobs.aJob[0])*nJob );
+  memset(rebuildJobs.aJob, 0, sizeof(rebuildJobs.aJob[0])*nJob );
+  db_close(1);
+  fflush(stdout);
+  for(i=0; i<nJob; i++){
+    struct RebuildJob *p = &rebuildJobs.aJob[i];
+    int aRoot[2], aArtifact[2];
+    if( pipe(aRoot) ) break;
+    if( pipe(aArtifact) ){
+      close(aRoot[0]);
+      close(aRoot[1]);
+      break;
+    }
+    p->pid = fork();
+    if( p->pid==0 ){
+      for(j=0; j<i; j++){
+        close(rebuildJobs.aJob[j].fdRoot);
+        close(rebuildJobs.aJob[j].fdArtifact);
+      }
+      close(aRoot[1]);
+      close(aArtifact[0]);
+      rebuild_job_main(aRoot[0], aArtifact[1], zRepo);
+    }
+    close(aRoot[0]);
+    close(aArtifact[1]);
+    if( p->pid<0 ){
+      close(aRoot[1]);
+      close(aArtifact[0]);
+      break;
+    }
+    p->fdRoot = aRoot[1];
+    p->fdArtifact = aArtifact[0];
+    blob_zero(&p->in);
+  }
+  rebuildJobs.nJob = i;
+
+  /* Wait for every worker to begin its read transaction */
+  for(i=0; i<rebuildJobs.nJob; i++){
+    char c;
+    if( fossil_fd_read(rebuildJobs.aJob[i].fdArtifact, &c, 1) ){
+      fossil_fatal("rebuild worker %d failed to start",
+                   rebuildJobs.aJob[i].pid);
+    }
+  }
+  db_open_repository(zRepo);
+  fossil_free(zRepo);
+
+  /* The workers hold read locks until they finish.  Do not wait on them
+  ** when the page cache wants to spill, but keep the changes in memory. */
+  sqlite3_busy_timeout(g.db, 0);
+}
+
+/*
+** Make sure at least nNeed unused bytes have been received from worker p,
+** reading ahead from the other workers as well while waiting, up to
+** REBUILD_JOB_BUFFER bytes.
+*/
+static void rebuild_job_fill(struct RebuildJob *p, int nNeed){
+  while( blob_size(&p->in) - p->iIn < nNeed ){
+    fd_set readfds;
+    int i, mx = 0;
+    if( p->isEof ){
+      fossil_fatal("rebuild worker %d failed", p->pid);
+    }
+    FD_ZERO(&readfds);
+    for(i=0; i<rebuildJobs.nJob; i++){
+      struct RebuildJob *q = &rebuildJobs.aJob[i];
+      if( q->isEof ) continue;
+      if( q!=p && rebuildJobs.nBuffered>=REBUILD_JOB_BUFFER ) continue;
+      FD_SET(q->fdArtifact, &readfds);
+      if( q->fdArtifact>mx ) mx = q->fdArtifact;
+    }
+    if( select(mx+1, &readfds, 0, 0, 0)<0 ){
+      if( errno==EINTR ) continue;
+      fossil_fatal("select() failed during rebuild");
+    }
+    for(i=0; i<rebuildJobs.nJob; i++){
+      struct RebuildJob *q = &rebuildJobs.aJob[i];
+      char zBuf[65536];
+      int n;
+      if( q->isEof || !FD_ISSET(q->fdArtifact, &readfds) ) continue;
+      n = (int)read(q->fdArtifact, zBuf, sizeof(zBuf));
+      if( n<=0 ){
+        q->isEof = 1;
+      }else{
+        blob_append(&q->in, zBuf, n);
+        rebuildJobs.nBuffered += n;
+      }
+    }
+  }
+}
+
+/*
+** Receive the next artifact from worker p.  Return its rid, or 0 at the
+** end of a delta tree.
+*/
+static int rebuild_job_receive(struct RebuildJob *p, int *pSize, Blob *pOut){
+  const unsigned char *z;
+  int rid, n;
+  rebuild_job_fill(p, 12);
+  z = (const unsigned char*)blob_buffer(&p->in) + p->iIn;
+  rid = fossil_get32(z);
+  *pSize = fossil_get32(&z[4]);
+  n = fossil_get32(&z[8]);
+  p->iIn += 12;
+  rebuild_job_fill(p, n);
+  blob_zero(pOut);
+  blob_append(pOut, blob_buffer(&p->in) + p->iIn, n);
+  p->iIn += n;
+  rebuildJobs.nBuffered -= 12 + n;
+  if( p->iIn>=1000000 || p->iIn==blob_size(&p->in) ){
+    n = blob_size(&p->in) - p->iIn;
+    memmove(blob_buffer(&p->in), blob_buffer(&p->in) + p->iIn, n);
+    blob_resize(&p->in, n);
+    p->iIn = 0;
+  }
+  return rid;
+}
+
+/*
+** Wait for the workers to exit, and go back to a serial rebuild.
+*/
+static void rebuild_jobs_finish(void){
+  int i;
+  for(i=0; i<rebuildJobs.nJob; i++){
+    struct RebuildJob *p = &rebuildJobs.aJob[i];
+    int status = 0;
+    close(p->fdArtifact);
+    blob_reset(&p->in);
+    while( waitpid(p->pid, &status, 0)<0 && errno==EINTR ){}
+    if( !WIFEXITED(status) || WEXITSTATUS(status)!=0 ){
+      fossil_fatal("rebuild worker %d failed", p->pid);
+    }
+  }
+  fossil_free(rebuildJobs.aJob);
+  memset(&rebuildJobs, 0, sizeof(rebuildJobs));
+  sqlite3_busy_timeout(g.db, 5000);
+}
+#endif
+
+/*
+** Crosslink the delta trees whose roots are given by pQuery, using the
+** workers to expand the artifacts.  Artifacts are crosslinked in the
+** same order as the serial loop in rebuild_db().  The workers exit
+** when done.
+*/
+static void rebuild_jobs_run(Stmt *pQuery){
+#if !defined(_WIN32)
+  int nRoot = 0;
+  int i;
+  unsigned char aMsg[8];
+
+  /* Deal out the roots to the workers */
+  while( db_step(pQuery)==SQLITE_ROW ){
+    int rid = db_column_int(pQuery, 0);
+    int size = db_column_int(pQuery, 1);
+    struct RebuildJob *p;
+    if( size<0 ) continue;
+    p = &rebuildJobs.aJob[nRoot%rebuildJobs.nJob];
+    fossil_put32(aMsg, rid);
+    fossil_put32(&aMsg[4], size);
+    if( fossil_fd_write(p->fdRoot, aMsg, 8) ){
+      fossil_fatal("rebuild worker %d failed", p->pid);
+    }
+    nRoot++;
+  }
+  memset(aMsg, 0, sizeof(aMsg));
+  for(i=0; i<rebuildJobs.nJob; i++){
+    fossil_fd_write(rebuildJobs.aJob[i].fdRoot, aMsg, 8);
+    close(rebuildJobs.aJob[i].fdRoot);
+  }
+
+  /* Crosslink the artifacts of each tree in turn */
+  for(i=0; i<nRoot; i++){
+    struct RebuildJob *p = &rebuildJobs.aJob[i%rebuildJobs.nJob];
+    Blob content;
+    int rid, size;
+    while( (rid = rebuild_job_receive(p, &size, &content))!=0 ){
+      if( size!=blob_size(&content) ){
+        db_multi_exec(
+           "UPDATE blob SET size=%d WHERE rid=%d", blob_size(&content), rid
+        );
+      }
+      manifest_crosslink(rid, &content, MC_NONE);
+      assert( blob_is_reset(&content) );
+      rebuild_step_done(rid);
+    }
+    blob_reset(&content);
+  }
+  rebuild_jobs_finish();
+#endif
+}
+
+/*
+** Expand artifacts in nJob worker processes during the next call to
+** rebuild_db().  This must be called while no transaction is open.  It
+** does nothing if nJob is less than two, or on Windows.
+*/
+void rebuild_jobs_begin(int nJob){
+#if !defined(_WIN32)
+  if( nJob>1 ){
+    /* The workers must see the artifacts as they will be after the
+    ** shunned ones are removed, so do that first. */
+    db_begin_transaction();
+    shun_artifacts();
+    db_end_transaction(0);
+    rebuild_jobs_start(nJob);
+  }
+#endif
+}
+
 /*
 ** Check to see if the "sym-trunk" tag exists.  If not, create it
 ** and attach it to the very first check-in.
@@ -360,6 +688,7 @@ int rebuild_db(int randomize, int doOut, int doClustering){
     free(zTable);
   }
   db_multi_exec("%s", zRepositorySchema2/*safe-for-%s*/);
+  ancestry_reset();
   ticket_create_table(0);
   shun_artifacts();
 
@@ -390,13 +719,17 @@ int rebuild_db(int randomize, int doOut, int doClustering){
      "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid)"
   );
   manifest_crosslink_begin();
-  while( db_step(&s)==SQLITE_ROW ){
-    int rid = db_column_int(&s, 0);
-    int size = db_column_int(&s, 1);
-    if( size>=0 ){
-      Blob content;
-      content_get(rid, &content);
-      rebuild_step(rid, size, &content);
+  if( rebuildJobs.nJob>0 ){
+    rebuild_jobs_run(&s);
+  }else{
+    while( db_step(&s)==SQLITE_ROW ){
+      int rid = db_column_int(&s, 0);
+      int size = db_column_int(&s, 1);
+      if( size>=0 ){
+        Blob content;
+        content_get(rid, &content);
+        rebuild_step(rid, size, &content);
+      }
     }
   }
   db_finalize(&s);
@@ -495,6 +828,183 @@ void extra_deltification(void){
 }
 
 
+/*
+** One artifact in a delta chain, as seen by compress_delta_chains().
+*/
+typedef struct ChainNode ChainNode;
+struct ChainNode {
+  int rid;            /* The artifact */
+  int iSrc;           /* Index of its delta source.  -1 for the root */
+  int depth;          /* Number of deltas from the root */
+  int root;           /* rid of the root of its chain */
+  int newDepth;       /* Depth after the chains are compressed */
+  int nUp;            /* New source is this far up.  0 for full text */
+};
+
+/*
+** Sort an array of indexes into the ChainNode array aChainSort by rid.
+*/
+static ChainNode *aChainSort;
+static int chain_rid_cmp(const void *a, const void *b){
+  return aChainSort[*(int*)a].rid - aChainSort[*(int*)b].rid;
+}
+
+/*
+** Rewrite the delta table so that no artifact is more than mxDepth deltas
+** from an artifact stored in full.
+**
+** Only trees of deltas deeper than mxDepth are changed.  Within such a
+** tree an artifact at depth k uses skip-deltas in some base b: its new
+** source is the ancestor at depth k-p, where p is the place value of the
+** lowest non-zero digit of k written in base b.  The new depth is then
+** the sum of the digits of k.  Of the bases that keep every depth no more
+** than mxDepth, the largest is used, because that makes the fewest deltas
+** that span many versions.  The new deltas are made by composing the old
+** ones, with content_compose_chain(), not by expanding the artifacts.  An
+** artifact that still ends up too deep, or whose composed delta would be
+** too large to be worthwhile, is stored in full.
+*/
+static void compress_delta_chains(int mxDepth){
+  Stmt q;
+  ChainNode *a = 0;
+  int *aByRid;
+  int n = 0, nAlloc = 0;
+  int i, j, k;
+  int nTree = 0, nCompose = 0, nFull = 0, nFail = 0;
+  int mxOld = 0, mxNew = 0;
+  i64 szBefore, szAfter;
+
+  db_multi_exec(
+    "CREATE TEMP TABLE chain(rid INTEGER PRIMARY KEY, srcid INT,"
+    "                        depth INT, root INT);"
+    "WITH RECURSIVE d(rid,srcid,depth,root) AS ("
+    "  SELECT rid, 0, 0, rid FROM blob"
+    "   WHERE rid IN (SELECT srcid FROM delta)"
+    "     AND rid NOT IN (SELECT rid FROM delta)"
+    "  UNION ALL"
+    "  SELECT delta.rid, delta.srcid, d.depth+1, d.root FROM delta, d"
+    "   WHERE delta.srcid=d.rid"
+    ")"
+    "INSERT INTO chain SELECT * FROM d;"
+    "DELETE FROM chain WHERE root NOT IN"
+    "  (SELECT root FROM chain GROUP BY root HAVING max(depth)>%d);",
+    mxDepth
+  );
+  szBefore = db_int64(0, "SELECT sum(length(content)) FROM blob"
+                         " WHERE rid IN (SELECT rid FROM chain)");
+  db_prepare(&q, "SELECT rid, srcid, depth, root FROM chain"
+                 " ORDER BY root, depth");
+  while( db_step(&q)==SQLITE_ROW ){
+    if( n>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      a = fossil_realloc(a, nAlloc*sizeof(a[0]));
+    }
+    a[n].rid = db_column_int(&q, 0);
+    a[n].iSrc = db_column_int(&q, 1);  /* Changed to an index below */
+    a[n].depth = db_column_int(&q, 2);
+    a[n].root = db_column_int(&q, 3);
+    a[n].newDepth = a[n].depth;
+    a[n].nUp = 1;
+    if( a[n].depth>mxOld ) mxOld = a[n].depth;
+    n++;
+  }
+  db_finalize(&q);
+
+  /* Replace the srcid of each node by the index of its source */
+  aByRid = fossil_malloc( (n+1)*sizeof(aByRid[0]) );
+  for(i=0; i<n; i++) aByRid[i] = i;
+  aChainSort = a;
+  qsort(aByRid, n, sizeof(aByRid[0]), chain_rid_cmp);
+  for(i=0; i<n; i++){
+    int lo = 0, hi = n-1, srcid = a[i].iSrc;
+    a[i].iSrc = -1;
+    if( a[i].depth==0 ) continue;
+    while( lo<=hi ){
+      int mid = (lo+hi)/2;
+      int x = a[aByRid[mid]].rid;
+      if( x==srcid ){
+        a[i].iSrc = aByRid[mid];
+        break;
+      }else if( x<srcid ){
+        lo = mid+1;
+      }else{
+        hi = mid-1;
+      }
+    }
+  }
+  fossil_free(aByRid);
+
+  /* Choose the new source of each node.  The nodes of each tree are
+  ** together and in order of increasing depth. */
+  for(i=0; i<n; i=j){
+    int mx = 0, base;
+    for(j=i; j<n && a[j].root==a[i].root; j++){
+      if( a[j].depth>mx ) mx = a[j].depth;
+    }
+    nTree++;
+    for(base=mx; base>2; base--){
+      int nDigit = 0;
+      for(k=mx; k>0; k/=base) nDigit++;
+      if( (base-1)*nDigit<=mxDepth ) break;
+    }
+    for(k=i; k<j; k++){
+      int p, x, d = a[k].depth;
+      if( d==0 ){
+        a[k].newDepth = 0;
+        continue;
+      }
+      for(p=1; (d/p)%base==0; p*=base){}
+      for(x=k, a[k].nUp=0; a[k].nUp<p && a[x].iSrc>=0; a[k].nUp++){
+        x = a[x].iSrc;
+      }
+      a[k].newDepth = a[x].newDepth + 1;
+      if( a[k].newDepth>mxDepth ){
+        a[k].newDepth = 0;
+        a[k].nUp = 0;
+      }
+      if( a[k].newDepth>mxNew ) mxNew = a[k].newDepth;
+    }
+  }
+
+  /* Rewrite the deltas deepest first, so that the deltas along the path
+  ** to the new source have not yet been changed. */
+  for(i=n-1; i>=0; i--){
+    if( a[i].depth==0 ) continue;
+    if( a[i].nUp==0 ){
+      content_undelta(a[i].rid);
+      nFull++;
+    }else if( a[i].nUp>1 ){
+      int rc = content_compose_chain(a[i].rid, a[i].nUp);
+      if( rc>0 ){
+        nCompose++;
+      }else if( rc<0 ){
+        /* Descendants only become shallower than planned */
+        content_undelta(a[i].rid);
+        nFull++;
+      }else{
+        nFail++;
+      }
+    }
+  }
+  fossil_free(a);
+  szAfter = db_int64(0, "SELECT sum(length(content)) FROM blob"
+                        " WHERE rid IN (SELECT rid FROM chain)");
+  db_multi_exec("DROP TABLE chain;");
+  fossil_print("%d delta chains deeper than %d.  Maximum depth was %d.\n",
+               nTree, mxDepth, mxOld);
+  if( nTree>0 ){
+    fossil_print(
+      "%d deltas composed, %d artifacts stored in full.  "
+      "The deepest of these chains is now %d.\n"
+      "Storage for these chains went from %lld to %lld bytes.\n",
+      nCompose, nFull, mxNew, szBefore, szAfter);
+  }
+  if( nFail>0 ){
+    fossil_warning("%d deltas could not be composed and were left as is",
+                   nFail);
+  }
+}
+
 /* Reconstruct the private table.  The private table contains the rid
 ** of every manifest that is tagged with "private" and every file that
 ** is not used by a manifest that is not private.
@@ -527,11 +1037,16 @@ static void reconstruct_private_table(void){
 **   --analyze         Run ANALYZE on the database after rebuilding
 **   --cluster         Compute clusters for unclustered artifacts
 **   --compress        Strive to make the database as small as possible
+**   --compress-chains N  Skip the rebuilding step.  Rewrite deltas so that
+**                     no artifact is more than N deltas from an artifact
+**                     that is stored in full
 **   --compress-only   Skip the rebuilding step. Do --compress only
 **   --deanalyze       Remove ANALYZE tables from the database
 **   --force           Force the rebuild to complete even if errors are seen
 **   --ifneeded        Only do the rebuild if it would change the schema version
 **   --index           Always add in the full-text search index
+**   --jobs N          Expand artifacts in N worker processes while the
+**                     main process updates the database.  Unix only.
 **   --noverify        Skip the verification of changes to the BLOB table
 **   --noindex         Always omit the full-text search index
 **   --pagesize N      Set the database pagesize to N. (512..65536 and power of 2)
@@ -562,6 +1077,10 @@ void rebuild_database(void){
   int optIndex;
   int optIfNeeded;
   int compressOnlyFlag;
+  int nJob = 0;
+  const char *zJobs;
+  int mxChain = 0;
+  const char *zChains;
 
   omitVerify = find_option("noverify",0,0)!=0;
   forceFlag = find_option("force","f",0)!=0;
@@ -578,6 +1097,21 @@ void rebuild_database(void){
   optIfNeeded = find_option("ifneeded",0,0)!=0;
   compressOnlyFlag = find_option("compress-only",0,0)!=0;
   if( compressOnlyFlag ) runCompress = runVacuum = 1;
+  zChains = find_option("compress-chains",0,1);
+  if( zChains ){
+    mxChain = atoi(zChains);
+    if( mxChain<1 ){
+      fossil_fatal("the maximum chain depth must be at least 1");
+    }
+    compressOnlyFlag = 1;
+  }
+  zJobs = find_option("jobs","j",1);
+  if( zJobs ){
+    nJob = atoi(zJobs);
+    if( nJob<1 || nJob>256 ){
+      fossil_fatal("the number of jobs must be between 1 and 256");
+    }
+  }
   if( zPagesize ){
     newPagesize = atoi(zPagesize);
     if( newPagesize<512 || newPagesize>65536
@@ -607,6 +1141,7 @@ void rebuild_database(void){
   /* We should be done with options.. */
   verify_all_options();
 
+  if( !compressOnlyFlag ) rebuild_jobs_begin(nJob);
   db_begin_transaction();
   if( !compressOnlyFlag ){
     search_drop_index();
@@ -632,6 +1167,9 @@ void rebuild_database(void){
       extra_deltification();
       runVacuum = 1;
     }
+    if( mxChain ){
+      compress_delta_chains(mxChain);
+    }
     if( omitVerify ) verify_cancel();
     db_end_transaction(0);
     if( runCompress ) fossil_print("done\n");
@@ -674,12 +1212,16 @@ void rebuild_database(void){
     };
     int i;
     int subtotal = 0;
+    int nParse, nHit;
     for(i=0; i<count(aStat); i++){
       int k = aStat[i].idx;
       fossil_print("%-15s %6d\n", aStat[i].zLabel, g.parseCnt[k]);
       if( k>0 ) subtotal += g.parseCnt[k];
     }
     fossil_print("%-15s %6d\n", "Other:", g.parseCnt[CFTYPE_ANY] - subtotal);
+    manifest_cache_counts(&nParse, &nHit);
+    fossil_print("%-15s %6d\n", "Reparsed:", nParse - g.parseCnt[CFTYPE_ANY]);
+    fossil_print("%-15s %6d\n", "Cache hits:", nHit);
   }
 }
 
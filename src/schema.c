@@ -292,6 +292,22 @@ const char zRepositorySchema2[] =
 @ --
 @ CREATE TABLE leaf(rid INTEGER PRIMARY KEY);
 @
+@ -- Reachability labels for check-ins, used to answer "is X an ancestor
+@ -- of Y" without walking the plink table.  GEN is larger than the GEN of
+@ -- every parent, so an ancestor always has a smaller GEN than its
+@ -- descendants.  DEPTH, PRIM, and JUMP describe the chain of primary
+@ -- parents: JUMP points to an earlier check-in on that chain chosen so
+@ -- that any primary ancestor can be reached in a logarithmic number of
+@ -- steps.  A check-in is only labeled once all of its parents are.
+@ --
+@ CREATE TABLE cigen(
+@   rid INTEGER PRIMARY KEY,        -- The check-in
+@   gen INTEGER,                    -- One more than the largest parent GEN
+@   depth INTEGER,                  -- Number of check-ins on primary chain
+@   prim INTEGER,                   -- Primary parent.  0 for a root
+@   jump INTEGER                    -- Skip pointer along primary chain
+@ );
+@
 @ -- Events used to generate a timeline
 @ --
 @ CREATE TABLE event(
@@ -6,14 +6,38 @@
 #include "sha1.h"
 
 #ifdef FOSSIL_ENABLE_SSL
+# include <openssl/opensslv.h>
+# include <openssl/evp.h>
+# define SHA1_OPENSSL 1
+# if OPENSSL_VERSION_NUMBER<0x10100000L
+#  define EVP_MD_CTX_new EVP_MD_CTX_create
+#  define EVP_MD_CTX_free EVP_MD_CTX_destroy
+# endif
+#endif
 
-# include <openssl/sha.h>
-# define SHA1Context SHA_CTX
-# define SHA1Init SHA1_Init
-# define SHA1Update SHA1_Update
-# define SHA1Final(a,b) SHA1_Final(b,a)
-
-#else
+/*
+** Hardware SHA1 instructions are used when the compiler can generate
+** them and the CPU running fossil has them.  On x86 these are the SHA
+** extensions (SHA-NI), and AVX2 is used to hash several buffers at once.
+** On 64-bit ARM these are the ARMv8 cryptography extensions.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && (defined(__clang__) || __GNUC__>=5)
+# define SHA1_X86 1
+# include <immintrin.h>
+# include <cpuid.h>
+#endif
+#if defined(__aarch64__) \
+    && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+# define SHA1_ARMV8 1
+# include <arm_neon.h>
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__) \
+    && !defined(__clang__) && __GNUC__>=8
+# define SHA1_ARMV8 2
+# include <arm_neon.h>
+# include <sys/auxv.h>
+# include <asm/hwcap.h>
+#endif
 
 /*
 ** The SHA1 implementation below is adapted from:
@@ -30,6 +54,9 @@ struct SHA1Context {
   unsigned int state[5];
   unsigned int count[2];
   unsigned char buffer[64];
+#ifdef SHA1_OPENSSL
+  EVP_MD_CTX *pEvp;             /* Whole message hashed by OpenSSL, or NULL */
+#endif
 };
 
 /*
@@ -144,7 +171,500 @@ void SHA1Transform(unsigned int state[5], const unsigned char buffer[64])
   state[3] += d;
   state[4] += e;
 }
+#undef a
+#undef b
+#undef c
+#undef d
+#undef e
+
+
+/*
+** Run the portable SHA1Transform() over nBlock 64-byte blocks.
+*/
+static void sha1_compress_portable(
+  unsigned int state[5],
+  const unsigned char *data,
+  unsigned int nBlock
+){
+  while( nBlock-- ){
+    SHA1Transform(state, data);
+    data += 64;
+  }
+}
+
+#ifdef SHA1_OPENSSL
+/*
+** OpenSSL has no supported interface for running single blocks through
+** SHA1 (SHA1_Transform() is deprecated as of OpenSSL 3.0), so when it is
+** the backend in use, whole messages are hashed through its EVP
+** interface instead.  OpenSSL chooses its own SIMD code for the CPU.
+** The message digest is looked up only once.
+*/
+static const EVP_MD *sha1_openssl_md(void){
+  static const EVP_MD *pMd = 0;
+  if( pMd==0 ){
+#if OPENSSL_VERSION_NUMBER>=0x30000000L
+    pMd = EVP_MD_fetch(0, "SHA1", 0);
+    if( pMd==0 ) pMd = EVP_sha1();
+#else
+    pMd = EVP_sha1();
+#endif
+  }
+  return pMd;
+}
+
+/*
+** One EVP context is kept between hashes, so that hashing many small
+** messages does not allocate a new context for each of them.
+*/
+static EVP_MD_CTX *pSha1SpareEvp = 0;
+#endif
+
+#ifdef SHA1_X86
+/*
+** One group of four rounds using the SHA-NI instructions.  Ein holds E
+** for these rounds plus the next message words, and Eout receives the
+** value of ABCD from which E of the next group is derived.
+*/
+#define SHANI_ROUNDS(Ein,Eout,M,f) \
+    Ein = _mm_sha1nexte_epu32(Ein, M); \
+    Eout = ABCD; \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ein, f);
+
+/*
+** Run nBlock 64-byte blocks through SHA1 using the x86 SHA extensions.
+*/
+__attribute__((target("sha,sse4.1")))
+static void sha1_compress_shani(
+  unsigned int state[5],
+  const unsigned char *data,
+  unsigned int nBlock
+){
+  __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+  __m128i MSG0, MSG1, MSG2, MSG3;
+  const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL,
+                                      0x08090a0b0c0d0e0fULL);
+
+  ABCD = _mm_loadu_si128((const __m128i*)state);
+  E0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+
+  while( nBlock-- ){
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    /* Rounds 0-15 take the message words directly */
+    MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), MASK);
+    E0 = _mm_add_epi32(E0, MSG0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data+16)), MASK);
+    SHANI_ROUNDS(E1, E0, MSG1, 0);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+    MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data+32)), MASK);
+    SHANI_ROUNDS(E0, E1, MSG2, 0);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data+48)), MASK);
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    SHANI_ROUNDS(E1, E0, MSG3, 0);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 16-67 expand the message as they go */
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    SHANI_ROUNDS(E0, E1, MSG0, 0);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    SHANI_ROUNDS(E1, E0, MSG1, 1);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    SHANI_ROUNDS(E0, E1, MSG2, 1);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    SHANI_ROUNDS(E1, E0, MSG3, 1);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    SHANI_ROUNDS(E0, E1, MSG0, 1);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    SHANI_ROUNDS(E1, E0, MSG1, 1);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    SHANI_ROUNDS(E0, E1, MSG2, 2);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    SHANI_ROUNDS(E1, E0, MSG3, 2);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    SHANI_ROUNDS(E0, E1, MSG0, 2);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    SHANI_ROUNDS(E1, E0, MSG1, 2);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    SHANI_ROUNDS(E0, E1, MSG2, 2);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    SHANI_ROUNDS(E1, E0, MSG3, 3);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    SHANI_ROUNDS(E0, E1, MSG0, 3);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    /* Rounds 68-79 use the last of the expanded message */
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    SHANI_ROUNDS(E1, E0, MSG1, 3);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    SHANI_ROUNDS(E0, E1, MSG2, 3);
+
+    SHANI_ROUNDS(E1, E0, MSG3, 3);
+
+    /* Add this block into the state */
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+    data += 64;
+  }
+
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+  _mm_storeu_si128((__m128i*)state, ABCD);
+  state[4] = (unsigned int)_mm_extract_epi32(E0, 3);
+}
+
+/*
+** Helpers for the AVX2 code, which hashes 8 independent buffers at once
+** with one buffer in each 32-bit lane.
+*/
+#define AVX2_ROL(x,k) \
+    _mm256_or_si256(_mm256_slli_epi32(x,k), _mm256_srli_epi32(x,32-(k)))
+#define AVX2_ROUND(a,b,c,d,e,f,k,w) \
+    e = _mm256_add_epi32(e, _mm256_add_epi32(AVX2_ROL(a,5), \
+          _mm256_add_epi32(f, _mm256_add_epi32(k, w)))); \
+    b = AVX2_ROL(b,30);
 
+/*
+** Run one 64-byte block for each of 8 buffers through SHA1.  aState[i]
+** holds word i of the state of all 8 buffers and apBlock[j] is the next
+** block of buffer j.
+*/
+__attribute__((target("avx2")))
+static void sha1_compress_avx2_x8(
+  unsigned int aState[5][8],
+  const unsigned char *apBlock[8]
+){
+  __m256i a, b, c, d, e, w[16], f, k;
+  __m256i a0, b0, c0, d0, e0;
+  int i;
+
+  a = a0 = _mm256_loadu_si256((const __m256i*)aState[0]);
+  b = b0 = _mm256_loadu_si256((const __m256i*)aState[1]);
+  c = c0 = _mm256_loadu_si256((const __m256i*)aState[2]);
+  d = d0 = _mm256_loadu_si256((const __m256i*)aState[3]);
+  e = e0 = _mm256_loadu_si256((const __m256i*)aState[4]);
+  for(i=0; i<16; i++){
+    int j;
+    unsigned int x[8];
+    for(j=0; j<8; j++){
+      const unsigned char *z = &apBlock[j][i*4];
+      x[j] = ((unsigned)z[0]<<24) | (z[1]<<16) | (z[2]<<8) | z[3];
+    }
+    w[i] = _mm256_loadu_si256((const __m256i*)x);
+  }
+  for(i=0; i<80; i++){
+    __m256i t;
+    if( i>=16 ){
+      t = _mm256_xor_si256(_mm256_xor_si256(w[(i+13)&15], w[(i+8)&15]),
+                           _mm256_xor_si256(w[(i+2)&15], w[i&15]));
+      w[i&15] = AVX2_ROL(t,1);
+    }
+    if( i<20 ){
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      k = _mm256_set1_epi32(0x5A827999);
+    }else if( i<40 ){
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32(0x6ED9EBA1);
+    }else if( i<60 ){
+      f = _mm256_or_si256(_mm256_and_si256(b, c),
+                          _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      k = _mm256_set1_epi32((int)0x8F1BBCDC);
+    }else{
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32((int)0xCA62C1D6);
+    }
+    AVX2_ROUND(a,b,c,d,e,f,k,w[i&15]);
+    t = e; e = d; d = c; c = b; b = a; a = t;
+  }
+  _mm256_storeu_si256((__m256i*)aState[0], _mm256_add_epi32(a, a0));
+  _mm256_storeu_si256((__m256i*)aState[1], _mm256_add_epi32(b, b0));
+  _mm256_storeu_si256((__m256i*)aState[2], _mm256_add_epi32(c, c0));
+  _mm256_storeu_si256((__m256i*)aState[3], _mm256_add_epi32(d, d0));
+  _mm256_storeu_si256((__m256i*)aState[4], _mm256_add_epi32(e, e0));
+}
+
+/*
+** Return true if the CPU has the SHA extensions, and also the SSSE3 and
+** SSE4.1 instructions used alongside them.
+*/
+static int sha1_have_shani(void){
+  unsigned int a, b, c, d;
+  if( !__get_cpuid(1, &a, &b, &c, &d) ) return 0;
+  if( (c & (1<<9))==0 || (c & (1<<19))==0 ) return 0;
+  if( __get_cpuid_max(0, 0)<7 ) return 0;
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b & (1<<29))!=0;
+}
+
+/*
+** Return true if the CPU has AVX2 and the operating system saves the
+** AVX registers.
+*/
+static int sha1_have_avx2(void){
+  unsigned int a, b, c, d, lo, hi;
+  if( !__get_cpuid(1, &a, &b, &c, &d) ) return 0;
+  if( (c & (1<<27))==0 || (c & (1<<28))==0 ) return 0;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  if( (lo & 6)!=6 ) return 0;
+  if( __get_cpuid_max(0, 0)<7 ) return 0;
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b & (1<<5))!=0;
+}
+#endif /* SHA1_X86 */
+
+#ifdef SHA1_ARMV8
+/*
+** One group of four rounds using the ARMv8 SHA1 instructions.
+*/
+#define ARMV8_ROUNDS(Ein,Eout,op,T) \
+    Eout = vsha1h_u32(vgetq_lane_u32(ABCD, 0)); \
+    ABCD = op(ABCD, Ein, T);
+
+/*
+** Run nBlock 64-byte blocks through SHA1 using the ARMv8 cryptography
+** extensions.
+*/
+#if SHA1_ARMV8==2
+__attribute__((target("+crypto")))
+#endif
+static void sha1_compress_armv8(
+  unsigned int state[5],
+  const unsigned char *data,
+  unsigned int nBlock
+){
+  uint32x4_t ABCD, ABCD_SAVE, TMP0, TMP1, MSG0, MSG1, MSG2, MSG3;
+  uint32x4_t K0 = vdupq_n_u32(0x5A827999);
+  uint32x4_t K1 = vdupq_n_u32(0x6ED9EBA1);
+  uint32x4_t K2 = vdupq_n_u32(0x8F1BBCDC);
+  uint32x4_t K3 = vdupq_n_u32(0xCA62C1D6);
+  uint32_t E0, E0_SAVE, E1;
+
+  ABCD = vld1q_u32(state);
+  E0 = state[4];
+  while( nBlock-- ){
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+    MSG0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    MSG1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+16)));
+    MSG2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+32)));
+    MSG3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data+48)));
+    TMP0 = vaddq_u32(MSG0, K0);
+    TMP1 = vaddq_u32(MSG1, K0);
+
+    ARMV8_ROUNDS(E0, E1, vsha1cq_u32, TMP0);           /* 0-3 */
+    TMP0 = vaddq_u32(MSG2, K0);
+    MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+    ARMV8_ROUNDS(E1, E0, vsha1cq_u32, TMP1);           /* 4-7 */
+    TMP1 = vaddq_u32(MSG3, K0);
+    MSG0 = vsha1su1q_u32(MSG0, MSG3);
+    MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+    ARMV8_ROUNDS(E0, E1, vsha1cq_u32, TMP0);           /* 8-11 */
+    TMP0 = vaddq_u32(MSG0, K0);
+    MSG1 = vsha1su1q_u32(MSG1, MSG0);
+    MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+    ARMV8_ROUNDS(E1, E0, vsha1cq_u32, TMP1);           /* 12-15 */
+    TMP1 = vaddq_u32(MSG1, K1);
+    MSG2 = vsha1su1q_u32(MSG2, MSG1);
+    MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+    ARMV8_ROUNDS(E0, E1, vsha1cq_u32, TMP0);           /* 16-19 */
+    TMP0 = vaddq_u32(MSG2, K1);
+    MSG3 = vsha1su1q_u32(MSG3, MSG2);
+    MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 20-23 */
+    TMP1 = vaddq_u32(MSG3, K1);
+    MSG0 = vsha1su1q_u32(MSG0, MSG3);
+    MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+    ARMV8_ROUNDS(E0, E1, vsha1pq_u32, TMP0);           /* 24-27 */
+    TMP0 = vaddq_u32(MSG0, K1);
+    MSG1 = vsha1su1q_u32(MSG1, MSG0);
+    MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 28-31 */
+    TMP1 = vaddq_u32(MSG1, K1);
+    MSG2 = vsha1su1q_u32(MSG2, MSG1);
+    MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+    ARMV8_ROUNDS(E0, E1, vsha1pq_u32, TMP0);           /* 32-35 */
+    TMP0 = vaddq_u32(MSG2, K2);
+    MSG3 = vsha1su1q_u32(MSG3, MSG2);
+    MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 36-39 */
+    TMP1 = vaddq_u32(MSG3, K2);
+    MSG0 = vsha1su1q_u32(MSG0, MSG3);
+    MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+    ARMV8_ROUNDS(E0, E1, vsha1mq_u32, TMP0);           /* 40-43 */
+    TMP0 = vaddq_u32(MSG0, K2);
+    MSG1 = vsha1su1q_u32(MSG1, MSG0);
+    MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+    ARMV8_ROUNDS(E1, E0, vsha1mq_u32, TMP1);           /* 44-47 */
+    TMP1 = vaddq_u32(MSG1, K2);
+    MSG2 = vsha1su1q_u32(MSG2, MSG1);
+    MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+    ARMV8_ROUNDS(E0, E1, vsha1mq_u32, TMP0);           /* 48-51 */
+    TMP0 = vaddq_u32(MSG2, K2);
+    MSG3 = vsha1su1q_u32(MSG3, MSG2);
+    MSG0 = vsha1su0q_u32(MSG0, MSG1, MSG2);
+
+    ARMV8_ROUNDS(E1, E0, vsha1mq_u32, TMP1);           /* 52-55 */
+    TMP1 = vaddq_u32(MSG3, K3);
+    MSG0 = vsha1su1q_u32(MSG0, MSG3);
+    MSG1 = vsha1su0q_u32(MSG1, MSG2, MSG3);
+
+    ARMV8_ROUNDS(E0, E1, vsha1mq_u32, TMP0);           /* 56-59 */
+    TMP0 = vaddq_u32(MSG0, K3);
+    MSG1 = vsha1su1q_u32(MSG1, MSG0);
+    MSG2 = vsha1su0q_u32(MSG2, MSG3, MSG0);
+
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 60-63 */
+    TMP1 = vaddq_u32(MSG1, K3);
+    MSG2 = vsha1su1q_u32(MSG2, MSG1);
+    MSG3 = vsha1su0q_u32(MSG3, MSG0, MSG1);
+
+    ARMV8_ROUNDS(E0, E1, vsha1pq_u32, TMP0);           /* 64-67 */
+    TMP0 = vaddq_u32(MSG2, K3);
+    MSG3 = vsha1su1q_u32(MSG3, MSG2);
+
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 68-71 */
+    TMP1 = vaddq_u32(MSG3, K3);
+
+    ARMV8_ROUNDS(E0, E1, vsha1pq_u32, TMP0);           /* 72-75 */
+    ARMV8_ROUNDS(E1, E0, vsha1pq_u32, TMP1);           /* 76-79 */
+
+    E0 += E0_SAVE;
+    ABCD = vaddq_u32(ABCD_SAVE, ABCD);
+    data += 64;
+  }
+  vst1q_u32(state, ABCD);
+  state[4] = E0;
+}
+
+/*
+** Return true if the CPU has the ARMv8 SHA1 instructions.
+*/
+static int sha1_have_armv8(void){
+#if SHA1_ARMV8==2
+  return (getauxval(AT_HWCAP) & HWCAP_SHA1)!=0;
+#else
+  return 1;
+#endif
+}
+#endif /* SHA1_ARMV8 */
+
+/*
+** The ways of running blocks through SHA1 that this build knows about,
+** fastest first.  The first one that the CPU supports is used.
+*/
+static const struct Sha1Backend {
+  const char *zName;            /* Name shown by test-sha1-bench */
+  void (*xCompress)(unsigned int*, const unsigned char*, unsigned int);
+                                /* NULL to hash whole messages with OpenSSL */
+  int (*xAvailable)(void);      /* True if usable.  NULL for always */
+  int isHardware;               /* Uses dedicated SHA1 instructions */
+} aSha1Backend[] = {
+#ifdef SHA1_X86
+  { "sha-ni",      sha1_compress_shani,    sha1_have_shani,  1 },
+#endif
+#ifdef SHA1_ARMV8
+  { "armv8-ce",    sha1_compress_armv8,    sha1_have_armv8,  1 },
+#endif
+#ifdef SHA1_OPENSSL
+  { "openssl",     0,                      0,                0 },
+#endif
+  { "portable",    sha1_compress_portable, 0,                0 },
+};
+
+/*
+** The backend in use, chosen by the first call to sha1_backend().
+*/
+static const struct Sha1Backend *pSha1Backend = 0;
+
+/*
+** Return true if backend p can be used on this CPU.
+*/
+static int sha1_backend_available(const struct Sha1Backend *p){
+  return p->xAvailable==0 || p->xAvailable();
+}
+
+/*
+** Choose the backend to use, if that has not been done already.
+*/
+static const struct Sha1Backend *sha1_backend(void){
+  if( pSha1Backend==0 ){
+    int i;
+    for(i=0; !sha1_backend_available(&aSha1Backend[i]); i++){}
+    pSha1Backend = &aSha1Backend[i];
+  }
+  return pSha1Backend;
+}
+
+/*
+** Run nBlock 64-byte blocks through SHA1, updating state.
+*/
+static void sha1_compress(
+  unsigned int state[5],
+  const unsigned char *data,
+  unsigned int nBlock
+){
+  sha1_backend()->xCompress(state, data, nBlock);
+}
 
 /*
  * SHA1Init - Initialize new context
@@ -157,6 +677,19 @@ static void SHA1Init(SHA1Context *context){
     context->state[3] = 0x10325476;
     context->state[4] = 0xC3D2E1F0;
     context->count[0] = context->count[1] = 0;
+#ifdef SHA1_OPENSSL
+    context->pEvp = 0;
+    if( sha1_backend()->xCompress==0 ){
+        if( pSha1SpareEvp ){
+            context->pEvp = pSha1SpareEvp;
+            pSha1SpareEvp = 0;
+        }else{
+            context->pEvp = EVP_MD_CTX_new();
+            if( context->pEvp==0 ) fossil_fatal("out of memory");
+        }
+        EVP_DigestInit_ex(context->pEvp, sha1_openssl_md(), 0);
+    }
+#endif
 }
 
 
@@ -170,15 +703,23 @@ static void SHA1Update(
 ){
     unsigned int i, j;
 
+#ifdef SHA1_OPENSSL
+    if( context->pEvp ){
+        EVP_DigestUpdate(context->pEvp, data, len);
+        return;
+    }
+#endif
     j = context->count[0];
     if ((context->count[0] += len << 3) < j)
         context->count[1] += (len>>29)+1;
     j = (j >> 3) & 63;
     if ((j + len) > 63) {
         (void)memcpy(&context->buffer[j], data, (i = 64-j));
-        SHA1Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64)
-            SHA1Transform(context->state, &data[i]);
+        sha1_compress(context->state, context->buffer, 1);
+        if( i + 63 < len ){
+            sha1_compress(context->state, &data[i], (len - i)/64);
+            i += (len - i) & ~63;
+        }
         j = 0;
     } else {
         i = 0;
@@ -191,16 +732,30 @@ static void SHA1Update(
  * Add padding and return the message digest.
  */
 static void SHA1Final(SHA1Context *context, unsigned char digest[20]){
-    unsigned int i;
+    static const unsigned char padding[64] = { 0200 };
+    unsigned int i, j;
     unsigned char finalcount[8];
 
+#ifdef SHA1_OPENSSL
+    if( context->pEvp ){
+        unsigned char zDigest[20];
+        EVP_DigestFinal_ex(context->pEvp, zDigest, 0);
+        if( pSha1SpareEvp==0 ){
+            pSha1SpareEvp = context->pEvp;
+        }else{
+            EVP_MD_CTX_free(context->pEvp);
+        }
+        context->pEvp = 0;
+        if( digest ) memcpy(digest, zDigest, 20);
+        return;
+    }
+#endif
     for (i = 0; i < 8; i++) {
         finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)]
          >> ((3-(i & 3)) * 8) ) & 255); /* Endian independent */
     }
-    SHA1Update(context, (const unsigned char *)"\200", 1);
-    while ((context->count[0] & 504) != 448)
-        SHA1Update(context, (const unsigned char *)"\0", 1);
+    j = (context->count[0] >> 3) & 63;
+    SHA1Update(context, padding, j < 56 ? 56 - j : 120 - j);
     SHA1Update(context, finalcount, 8);  /* Should cause a SHA1Transform() */
 
     if (digest) {
@@ -209,7 +764,6 @@ static void SHA1Final(SHA1Context *context, unsigned char digest[20]){
                 ((context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
     }
 }
-#endif
 
 
 /*
@@ -347,6 +901,122 @@ int sha1sum_blob(const Blob *pIn, Blob *pCksum){
   return 0;
 }
 
+/*
+** Store the checksum given by state, the final SHA1 state of some input,
+** in pCksum, which is assumed to be uninitialized.
+*/
+static void sha1_state_to_blob(const unsigned int state[5], Blob *pCksum){
+  unsigned char zResult[20];
+  int i;
+  for(i=0; i<20; i++){
+    zResult[i] = (unsigned char)((state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
+  }
+  blob_zero(pCksum);
+  blob_resize(pCksum, 40);
+  DigestToBase16(zResult, blob_buffer(pCksum));
+}
+
+#ifdef SHA1_X86
+/*
+** Compute the SHA1 checksums of the n blobs in aIn[] eight at a time
+** using AVX2.  Each of eight lanes works through one blob, taking the
+** next blob when it finishes, so blobs of different sizes are fine.
+*/
+static void sha1_multi_avx2(int n, const Blob *aIn, Blob *aCksum){
+  static const unsigned char aIdle[64];
+  unsigned int aState[5][8];
+  const unsigned char *apBlock[8];
+  struct {
+    int iJob;                  /* Index into aIn[] or -1 if the lane is idle */
+    const unsigned char *z;    /* Next full block of the input */
+    unsigned int nFull;        /* Number of full blocks left */
+    unsigned char aTail[128];  /* The final one or two blocks, padded */
+    unsigned int nTail;        /* Number of blocks in aTail[] */
+    unsigned int iTail;        /* Number of blocks of aTail[] used so far */
+  } aLane[8];
+  int iNext = 0;
+  int nActive = 0;
+  int i;
+
+  for(i=0; i<8; i++) aLane[i].iJob = -1;
+  while( 1 ){
+    /* Give a new blob to each idle lane */
+    for(i=0; i<8 && iNext<n; i++){
+      unsigned int sz, r;
+      sqlite3_uint64 nBit;
+      int j;
+      if( aLane[i].iJob>=0 ) continue;
+      sz = blob_size(&aIn[iNext]);
+      r = sz & 63;
+      aLane[i].iJob = iNext;
+      aLane[i].z = (const unsigned char*)blob_buffer(&aIn[iNext]);
+      aLane[i].nFull = sz/64;
+      memset(aLane[i].aTail, 0, sizeof(aLane[i].aTail));
+      memcpy(aLane[i].aTail, aLane[i].z + sz - r, r);
+      aLane[i].aTail[r] = 0x80;
+      aLane[i].nTail = r<56 ? 1 : 2;
+      aLane[i].iTail = 0;
+      nBit = ((sqlite3_uint64)sz)<<3;
+      for(j=0; j<8; j++){
+        aLane[i].aTail[aLane[i].nTail*64-1-j] = (unsigned char)(nBit>>(j*8));
+      }
+      aState[0][i] = 0x67452301;
+      aState[1][i] = 0xEFCDAB89;
+      aState[2][i] = 0x98BADCFE;
+      aState[3][i] = 0x10325476;
+      aState[4][i] = 0xC3D2E1F0;
+      iNext++;
+      nActive++;
+    }
+    if( nActive==0 ) break;
+
+    /* Run the next block of every lane */
+    for(i=0; i<8; i++){
+      if( aLane[i].iJob<0 ){
+        apBlock[i] = aIdle;
+      }else if( aLane[i].nFull>0 ){
+        apBlock[i] = aLane[i].z;
+        aLane[i].z += 64;
+        aLane[i].nFull--;
+      }else{
+        apBlock[i] = &aLane[i].aTail[64*aLane[i].iTail++];
+      }
+    }
+    sha1_compress_avx2_x8(aState, apBlock);
+
+    /* Collect the checksums of finished blobs */
+    for(i=0; i<8; i++){
+      unsigned int state[5];
+      int j;
+      if( aLane[i].iJob<0 || aLane[i].iTail<aLane[i].nTail ) continue;
+      for(j=0; j<5; j++) state[j] = aState[j][i];
+      sha1_state_to_blob(state, &aCksum[aLane[i].iJob]);
+      aLane[i].iJob = -1;
+      nActive--;
+    }
+  }
+}
+#endif
+
+/*
+** Compute the SHA1 checksums of the n blobs in aIn[] and store them in
+** aCksum[], which are assumed to be uninitialized.  This is faster than
+** sha1sum_blob() on each one when the CPU can hash several buffers in
+** parallel but has no dedicated SHA1 instructions.
+*/
+void sha1sum_blobs(int n, const Blob *aIn, Blob *aCksum){
+  int i;
+#ifdef SHA1_X86
+  if( n>1 && !sha1_backend()->isHardware && sha1_have_avx2() ){
+    sha1_multi_avx2(n, aIn, aCksum);
+    return;
+  }
+#endif
+  for(i=0; i<n; i++){
+    sha1sum_blob(&aIn[i], &aCksum[i]);
+  }
+}
+
 /*
 ** Compute the SHA1 checksum of a zero-terminated string.  The
 ** result is held in memory obtained from mprintf().
@@ -390,7 +1060,6 @@ char *sha1_shared_secret(
   unsigned char zResult[20];
   char zDigest[41];
 
-  SHA1Init(&ctx);
   if( zProjCode==0 ){
     if( zProjectId==0 ){
       zProjectId = db_get("project-code", 0);
@@ -404,6 +1073,7 @@ char *sha1_shared_secret(
     }
     zProjCode = zProjectId;
   }
+  SHA1Init(&ctx);
   SHA1Update(&ctx, (unsigned char*)zProjCode, strlen(zProjCode));
   SHA1Update(&ctx, (unsigned char*)"/", 1);
   SHA1Update(&ctx, (unsigned char*)zLogin, strlen(zLogin));
@@ -448,6 +1118,96 @@ void sha1_shared_secret_sql_function(
                       fossil_free);
 }
 
+/*
+** COMMAND: test-sha1-bench
+**
+** Usage: %fossil test-sha1-bench ?OPTIONS?
+**
+** Measure the speed of each SHA1 implementation that this build of
+** fossil has and that this CPU supports, after checking that each one
+** computes the same checksums as the portable C implementation.  The
+** implementation marked with "*" is the one used by fossil.
+**
+** Options:
+**   --size N       Size of each buffer hashed.  Default: 65536
+**   --count N      Number of buffers hashed.  Default: 1000
+*/
+void sha1_bench_cmd(void){
+  const struct Sha1Backend *pDefault = sha1_backend();
+  const char *zSize = find_option("size",0,1);
+  const char *zCount = find_option("count",0,1);
+  int sz = zSize ? atoi(zSize) : 65536;
+  int nBuf = zCount ? atoi(zCount) : 1000;
+  Blob *aIn, *aRef, *aOut;
+  unsigned char *zData;
+  int i, j, k;
+
+  verify_all_options();
+  if( sz<1 || nBuf<1 ) usage("?--size N? ?--count N?");
+  zData = fossil_malloc(sz + nBuf);
+  for(i=0; i<sz+nBuf; i++) zData[i] = (unsigned char)(i*7 + (i>>11));
+  aIn = fossil_malloc(sizeof(Blob)*nBuf*3);
+  aRef = &aIn[nBuf];
+  aOut = &aRef[nBuf];
+  for(i=0; i<nBuf; i++){
+    /* Buffers of different sizes and alignments, up to sz bytes */
+    blob_init(&aIn[i], (const char*)&zData[i], sz - (i*37)%(sz<64?sz:64));
+  }
+
+  /* The reference checksums, from the portable code */
+  pSha1Backend = &aSha1Backend[count(aSha1Backend)-1];
+  for(i=0; i<nBuf; i++) sha1sum_blob(&aIn[i], &aRef[i]);
+
+  fossil_print("%-10s %s %12s  %s\n", "SHA1", " ", "MB/s", "checksums");
+  for(k=0; k<=count(aSha1Backend); k++){
+    const char *zName;
+    sqlite3_int64 nByte = 0;
+    sqlite3_uint64 usec;
+    int nBad = 0;
+    int iTimer;
+    char zBad[30];
+    if( k<count(aSha1Backend) ){
+      if( !sha1_backend_available(&aSha1Backend[k]) ) continue;
+      zName = aSha1Backend[k].zName;
+      pSha1Backend = &aSha1Backend[k];
+    }else{
+#ifdef SHA1_X86
+      if( !sha1_have_avx2() ) continue;
+      zName = "avx2-x8";
+#else
+      continue;
+#endif
+    }
+    iTimer = fossil_timer_start();
+    if( k<count(aSha1Backend) ){
+      for(i=0; i<nBuf; i++) sha1sum_blob(&aIn[i], &aOut[i]);
+    }else{
+#ifdef SHA1_X86
+      sha1_multi_avx2(nBuf, aIn, aOut);
+#endif
+    }
+    usec = fossil_timer_stop(iTimer);
+    for(i=0; i<nBuf; i++){
+      nByte += blob_size(&aIn[i]);
+      if( blob_compare(&aOut[i], &aRef[i]) ) nBad++;
+      blob_reset(&aOut[i]);
+    }
+    if( usec==0 ) usec = 1;
+    sqlite3_snprintf(sizeof(zBad), zBad, "%d WRONG", nBad);
+    fossil_print("%-10s %s %12.1f  %s\n", zName,
+                 k<count(aSha1Backend) && &aSha1Backend[k]==pDefault ? "*":" ",
+                 (double)nByte/(double)usec,
+                 nBad ? zBad : "ok");
+  }
+  pSha1Backend = pDefault;
+  for(j=0; j<nBuf; j++){
+    blob_reset(&aIn[j]);
+    blob_reset(&aRef[j]);
+  }
+  fossil_free(aIn);
+  fossil_free(zData);
+}
+
 /*
 ** COMMAND: sha1sum*
 **
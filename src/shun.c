@@ -285,6 +285,14 @@ void shun_artifacts(void){
     content_undelta(srcid);
   }
   db_finalize(&q);
+  if( cache_artifact_depth()>0 ){
+    db_prepare(&q, "SELECT rid FROM toshun");
+    while( db_step(&q)==SQLITE_ROW ){
+      cache_artifact_forget(db_column_int(&q, 0));
+    }
+    db_finalize(&q);
+  }
+  xfer_ihash_forget();
   db_multi_exec(
      "DELETE FROM delta WHERE rid IN toshun;"
      "DELETE FROM blob WHERE rid IN toshun;"
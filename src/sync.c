@@ -114,6 +114,22 @@ int autosync_loop(int flags, int nTries, int doPrompt){
   return rc;
 }
 
+/*
+** Process the -j|--jobs N option of clone, pull and sync, and return N,
+** or zero if the option is omitted.
+*/
+int sync_jobs_option(void){
+  const char *zJobs = find_option("jobs","j",1);
+  int nJob = 0;
+  if( zJobs ){
+    nJob = atoi(zJobs);
+    if( nJob<1 || nJob>256 ){
+      fossil_fatal("the number of jobs must be between 1 and 256");
+    }
+  }
+  return nJob;
+}
+
 /*
 ** This routine processes the command-line argument for push, pull,
 ** and sync.  If a command-line argument is given, that is the URL
@@ -147,6 +163,7 @@ static void process_sync_args(
     if( find_option("verily",0,0)!=0 ){
       *pSyncFlags |= SYNC_RESYNC;
     }
+    verify_set_jobs(sync_jobs_option());
   }
   if( find_option("private",0,0)!=0 ){
     *pSyncFlags |= SYNC_PRIVATE;
@@ -212,6 +229,8 @@ static void process_sync_args(
 **                              if required by the remote website
 **   --from-parent-project      Pull content from the parent project
 **   --ipv4                     Use only IPv4, not IPv6
+**   -j|--jobs N                Verify received artifacts in N worker
+**                              processes
 **   --once                     Do not remember URL for subsequent syncs
 **   --proxy PROXY              Use the specified HTTP proxy
 **   --private                  Pull private branches too
@@ -302,6 +321,8 @@ void push_cmd(void){
 **   -B|--httpauth USER:PASS    Credentials for the simple HTTP auth protocol,
 **                              if required by the remote website
 **   --ipv4                     Use only IPv4, not IPv6
+**   -j|--jobs N                Verify received artifacts in N worker
+**                              processes
 **   --once                     Do not remember URL for subsequent syncs
 **   --proxy PROXY              Use the specified HTTP proxy
 **   --private                  Sync private branches too
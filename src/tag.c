@@ -40,9 +40,11 @@ static void tag_propagate(
   double mtime         /* Timestamp on the tag */
 ){
   PQueue queue;        /* Queue of check-ins to be tagged */
-  Stmt s;              /* Query the children of :pid to which to propagate */
-  Stmt ins;            /* INSERT INTO tagxref */
-  Stmt eventupdate;    /* UPDATE event */
+  static Stmt s;       /* Query the children of :pid to which to propagate */
+  static Stmt ins;     /* INSERT INTO tagxref */
+  static Stmt del;     /* DELETE FROM tagxref */
+  static Stmt eventupdate;  /* UPDATE event */
+  Stmt *pChng;         /* Either ins or del, depending on tagType */
 
   assert( tagType==0 || tagType==2 );
   pqueuex_init(&queue);
@@ -51,35 +53,46 @@ static void tag_propagate(
   /* Query for children of :pid to which to propagate the tag.
   ** Three returns:  (1) rid of the child.  (2) timestamp of child.
   ** (3) True to propagate or false to block.
+  **
+  ** This routine runs once for every check-in that is crosslinked, so
+  ** all statements are prepared once and the tag is passed in through
+  ** parameters.
   */
-  db_prepare(&s,
+  db_static_prepare(&s,
      "SELECT cid, plink.mtime,"
-     "       coalesce(srcid=0 AND tagxref.mtime<:mtime, %d) AS doit"
-     "  FROM plink LEFT JOIN tagxref ON cid=rid AND tagid=%d"
-     " WHERE pid=:pid AND isprim",
-     tagType==2, tagid
+     "       coalesce(srcid=0 AND tagxref.mtime<:mtime, :dflt) AS doit"
+     "  FROM plink LEFT JOIN tagxref ON cid=rid AND tagid=:tagid"
+     " WHERE pid=:pid AND isprim"
   );
   db_bind_double(&s, ":mtime", mtime);
+  db_bind_int(&s, ":dflt", tagType==2);
+  db_bind_int(&s, ":tagid", tagid);
 
   if( tagType==2 ){
     /* Set the propagated tag marker on check-in :rid */
-    db_prepare(&ins,
+    db_static_prepare(&ins,
        "REPLACE INTO tagxref(tagid, tagtype, srcid, origid, value, mtime, rid)"
-       "VALUES(%d,2,0,%d,%Q,:mtime,:rid)",
-       tagid, origId, zValue
+       "VALUES(:tagid,2,0,:origid,:value,:mtime,:rid)"
     );
+    db_bind_int(&ins, ":tagid", tagid);
+    db_bind_int(&ins, ":origid", origId);
+    db_bind_text(&ins, ":value", zValue);
     db_bind_double(&ins, ":mtime", mtime);
+    pChng = &ins;
   }else{
     /* Remove all references to the tag from check-in :rid */
     zValue = 0;
-    db_prepare(&ins,
-       "DELETE FROM tagxref WHERE tagid=%d AND rid=:rid", tagid
+    db_static_prepare(&del,
+       "DELETE FROM tagxref WHERE tagid=:tagid AND rid=:rid"
     );
+    db_bind_int(&del, ":tagid", tagid);
+    pChng = &del;
   }
   if( tagid==TAG_BGCOLOR ){
-    db_prepare(&eventupdate,
-      "UPDATE event SET bgcolor=%Q WHERE objid=:rid", zValue
+    db_static_prepare(&eventupdate,
+      "UPDATE event SET bgcolor=:value WHERE objid=:rid"
     );
+    db_bind_text(&eventupdate, ":value", zValue);
   }
   while( (pid = pqueuex_extract(&queue, 0))!=0 ){
     db_bind_int(&s, ":pid", pid);
@@ -89,9 +102,9 @@ static void tag_propagate(
         int cid = db_column_int(&s, 0);
         double mtime = db_column_double(&s, 1);
         pqueuex_insert(&queue, cid, mtime, 0);
-        db_bind_int(&ins, ":rid", cid);
-        db_step(&ins);
-        db_reset(&ins);
+        db_bind_int(pChng, ":rid", cid);
+        db_step(pChng);
+        db_reset(pChng);
         if( tagid==TAG_BGCOLOR ){
           db_bind_int(&eventupdate, ":rid", cid);
           db_step(&eventupdate);
@@ -105,23 +118,18 @@ static void tag_propagate(
     db_reset(&s);
   }
   pqueuex_clear(&queue);
-  db_finalize(&ins);
-  db_finalize(&s);
-  if( tagid==TAG_BGCOLOR ){
-    db_finalize(&eventupdate);
-  }
 }
 
 /*
 ** Propagate all propagatable tags in pid to the children of pid.
 */
 void tag_propagate_all(int pid){
-  Stmt q;
-  db_prepare(&q,
+  static Stmt q;
+  db_static_prepare(&q,
      "SELECT tagid, tagtype, mtime, value, origid FROM tagxref"
-     " WHERE rid=%d",
-     pid
+     " WHERE rid=:pid"
   );
+  db_bind_int(&q, ":pid", pid);
   while( db_step(&q)==SQLITE_ROW ){
     int tagid = db_column_int(&q, 0);
     int tagtype = db_column_int(&q, 1);
@@ -131,7 +139,7 @@ void tag_propagate_all(int pid){
     if( tagtype==1 ) tagtype = 0;
     tag_propagate(pid, tagid, tagtype, origid, zValue, mtime);
   }
-  db_finalize(&q);
+  db_reset(&q);
 }
 
 /*
@@ -36,6 +36,7 @@ static struct tarball_t {
   char *zPrevDir;           /* Name of directory for previous entry */
   int nPrevDirAlloc;        /* size of zPrevDir */
   Blob pax;                 /* PAX data */
+  int bStream;              /* Send the tarball out as it is built */
 } tball;
 
 
@@ -50,6 +51,8 @@ static struct tarball_t {
 ** Begin the process of generating a tarball.
 **
 ** Initialize the GZIP compressor and the table of directory names.
+** If tball.bStream is set, also start the streamed HTTP reply that
+** will carry the tarball.
 */
 static void tar_begin(sqlite3_int64 mTime){
   assert( tball.aHdr==0 );
@@ -71,6 +74,19 @@ static void tar_begin(sqlite3_int64 mTime){
   db_multi_exec(
     "CREATE TEMP TABLE dir(name UNIQUE);"
   );
+  if( tball.bStream ) cgi_stream_begin(0);
+}
+
+/*
+** When streaming, send out the compressed output accumulated so far.
+*/
+static void tar_flush(void){
+  Blob out;
+  if( !tball.bStream ) return;
+  blob_zero(&out);
+  gzip_take_output(&out);
+  cgi_stream_write(blob_buffer(&out), blob_size(&out));
+  blob_reset(&out);
 }
 
 
@@ -405,13 +421,22 @@ static void tar_add_file(
 
 /*
 ** Finish constructing the tarball.  Put the content of the tarball
-** in Blob pOut.
+** in Blob pOut, or finish the streamed reply if tball.bStream is set.
 */
 static void tar_finish(Blob *pOut){
   db_multi_exec("DROP TABLE dir");
   gzip_step(tball.zSpaces, 512);
   gzip_step(tball.zSpaces, 512);
-  gzip_finish(pOut);
+  if( tball.bStream ){
+    Blob out;
+    gzip_finish(&out);
+    cgi_stream_write(blob_buffer(&out), blob_size(&out));
+    blob_reset(&out);
+    cgi_stream_end();
+    tball.bStream = 0;
+  }else{
+    gzip_finish(pOut);
+  }
   fossil_free(tball.aHdr);
   tball.aHdr = 0;
   fossil_free(tball.zPrevDir);
@@ -458,6 +483,10 @@ void test_tarball_cmd(void){
 ** If the RID object does not exist in the repository, then
 ** pTar is zeroed.
 **
+** If pTar is NULL, the tarball is sent to the HTTP client as it is
+** built using cgi_stream_begin(), rather than accumulated in memory.
+** The caller must set the content type first.
+**
 ** zDir is a "synthetic" subdirectory which all files get
 ** added to as part of the tarball. It may be 0 or an empty string, in
 ** which case it is ignored. The intention is to create a tarball which
@@ -467,7 +496,7 @@ void test_tarball_cmd(void){
 */
 void tarball_of_checkin(
   int rid,             /* The RID of the checkin from which to form a tarball */
-  Blob *pTar,          /* Write the tarball into this blob */
+  Blob *pTar,          /* Write the tarball into this blob, or NULL to stream */
   const char *zDir,    /* Directory prefix for all file added to tarball */
   Glob *pInclude,      /* Only add files matching this pattern */
   Glob *pExclude       /* Exclude files matching this pattern */
@@ -482,9 +511,10 @@ void tarball_of_checkin(
 
   content_get(rid, &mfile);
   if( blob_size(&mfile)==0 ){
-    blob_zero(pTar);
+    if( pTar ) blob_zero(pTar);
     return;
   }
+  tball.bStream = pTar==0;
   blob_zero(&hash);
   blob_zero(&filename);
 
@@ -563,6 +593,7 @@ void tarball_of_checkin(
         zName = blob_str(&filename);
         tar_add_file(zName, &file, manifest_file_mperm(pFile), mTime);
         blob_reset(&file);
+        tar_flush();
       }
     }
   }else{
@@ -749,15 +780,20 @@ void tarball_page(void){
     return;
   }
   blob_zero(&tarball);
+  cgi_set_content_type("application/x-compressed");
   if( cache_read(&tarball, zKey)==0 ){
-    tarball_of_checkin(rid, &tarball, zName, pInclude, pExclude);
-    cache_write(&tarball, zKey);
+    if( cache_exists() ){
+      tarball_of_checkin(rid, &tarball, zName, pInclude, pExclude);
+      cache_write(&tarball, zKey);
+    }else{
+      /* Nothing to cache the tarball in, so send it as it is built */
+      tarball_of_checkin(rid, 0, zName, pInclude, pExclude);
+    }
   }
   glob_free(pInclude);
   glob_free(pExclude);
   fossil_free(zName);
   fossil_free(zRid);
   blob_reset(&cacheKey);
-  cgi_set_content(&tarball);
-  cgi_set_content_type("application/x-compressed");
+  if( blob_size(&tarball)>0 ) cgi_set_content(&tarball);
 }
@@ -44,6 +44,11 @@ struct Th_Interp {
   Th_Hash *paCmd;     /* Table of registered commands */
   Th_Frame *pFrame;   /* Current execution frame */
   int isListMode;     /* True if thSplitList() should operate in "list" mode */
+  Th_Hash *paProg;    /* Cache of compiled programs, keyed by script text */
+  int nProgByte;      /* Bytes currently used by paProg */
+  int mxProgByte;     /* Maximum bytes to use for paProg */
+  int nProgHit;       /* Number of scripts found in paProg */
+  int nProgMiss;      /* Number of scripts that had to be compiled */
 };
 
 /*
@@ -863,38 +868,127 @@ static int thSplitList(
 }
 
 /*
-** Evaluate the th1 script contained in the string (zProgram, nProgram)
-** in the current stack frame.
+** A th1 script that has been split into commands and words. Once a
+** script has been compiled into one of these, it may be run any number
+** of times without being tokenized again: only the words that require
+** variable, command or escape substitution are processed at run time.
+** Words enclosed in {} and words that contain no special characters
+** are stored already substituted.
+**
+** Compiled programs are cached in the Th_Interp.paProg hash table, keyed
+** by the text of the script. All offsets are relative to the start of
+** that text, so a program may be run against any copy of the script.
 */
-static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
+typedef struct Th_Program Th_Program;
+typedef struct Th_ProgCmd Th_ProgCmd;
+typedef struct Th_ProgWord Th_ProgWord;
+
+struct Th_ProgWord {
+  int iWord;                  /* Offset of the unsubstituted word */
+  int nWord;                  /* Size of the unsubstituted word in bytes */
+  int iLit;                   /* Offset in zLit of the literal value, or -1 */
+  int nLit;                   /* Size of the literal value in bytes */
+};
+struct Th_ProgCmd {
+  int iFirst;                 /* Offset of the command text */
+  int nText;                  /* Size of the command text in bytes */
+  int iArg;                   /* Index of the first word in aWord[] */
+  int nArg;                   /* Number of words in the command */
+};
+struct Th_Program {
+  int nRef;                   /* Number of references to this structure */
+  int nByte;                  /* Bytes allocated, for cache accounting */
+  int nCmd;                   /* Number of entries in aCmd[] */
+  int parseError;             /* True if a parse error follows aCmd[] */
+  Th_ProgCmd *aCmd;           /* Commands, in the order they are run */
+  Th_ProgWord *aWord;         /* Words of all commands */
+  char *zLit;                 /* Values of literal words, nul-terminated */
+};
+
+/*
+** Default number of bytes of script text and compiled programs to keep
+** in the Th_Interp.paProg cache.
+*/
+#define TH_PROGRAM_CACHE_SIZE (1024*1024)
+
+/*
+** Split the word (zWord, nWord) as thSubstWord() would. If the
+** substituted value can be determined without evaluating anything,
+** set (*pzLit, *pnLit) to it and return true. Otherwise return false.
+*/
+static int thLiteralWord(
+  const char *zWord,
+  int nWord,
+  const char **pzLit,
+  int *pnLit
+){
+  int i;
+  if( nWord>1 && (zWord[0]=='{' && zWord[nWord-1]=='}') ){
+    *pzLit = &zWord[1];
+    *pnLit = nWord-2;
+    return 1;
+  }
+  if( nWord>1 && (zWord[0]=='"' && zWord[nWord-1]=='"') ){
+    zWord++;
+    nWord -= 2;
+  }
+  for(i=0; i<nWord; i++){
+    if( zWord[i]=='\\' || zWord[i]=='[' || zWord[i]=='$' ) return 0;
+  }
+  *pzLit = zWord;
+  *pnLit = nWord;
+  return 1;
+}
+
+/*
+** Compile the th1 script (zProgram, nProgram). This never fails: if
+** the script contains a parse error, the commands that precede the
+** error are compiled and Th_Program.parseError is set so that the
+** error is reported once they have run, as thEvalLocal() always has.
+** The interpreter result is not modified.
+*/
+static Th_Program *thCompile(
+  Th_Interp *interp,
+  const char *zProgram,
+  int nProgram
+){
+  Th_Program *p;
+  Buffer cmdbuf;
+  Buffer wordbuf;
+  Buffer litbuf;
+  int nCmd = 0;
+  int nArg = 0;
   int rc = TH_OK;
   const char *zInput = zProgram;
   int nInput = nProgram;
+  char *zSaved;
+  int nSaved;
+  char *zMem;
 
+  zSaved = Th_TakeResult(interp, &nSaved);
+  thBufferInit(&cmdbuf);
+  thBufferInit(&wordbuf);
+  thBufferInit(&litbuf);
+
+  /* Find the extent of each command and then split it into words, using
+  ** the same rules as the command parser and thSplitList().
+  */
   while( rc==TH_OK && nInput ){
-    Th_HashEntry *pEntry;
-    int nSpace;
+    Th_ProgCmd cmd;
     const char *zFirst;
+    const char *zWord;
+    int nSpace;
+    int nList;
 
-    char **argv;
-    int *argl;
-    int argc;
-
-    assert(nInput>=0);
-
-    /* Skip a semi-colon */
     if( *zInput==';' ){
       zInput++;
       nInput--;
     }
-
-    /* Skip past leading white-space. */
     thNextSpace(interp, zInput, nInput, &nSpace);
     zInput += nSpace;
     nInput -= nSpace;
     zFirst = zInput;
 
-    /* Check for a comment. If found, skip to the end of the line. */
     if( zInput[0]=='#' ){
       while( !thEndOfLine(zInput, nInput) ){
         zInput++;
@@ -902,10 +996,6 @@ static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
       }
       continue;
     }
-
-    /* Gobble up input a word at a time until the end of the command
-    ** (a semi-colon or end of line).
-    */
     while( rc==TH_OK && *zInput!=';' && !thEndOfLine(zInput, nInput) ){
       int nWord=0;
       thNextSpace(interp, zInput, nInput, &nSpace);
@@ -913,15 +1003,228 @@ static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
       zInput += (nSpace+nWord);
       nInput -= (nSpace+nWord);
     }
-    if( rc!=TH_OK ) continue;
+    if( rc!=TH_OK ) break;
+
+    cmd.iFirst = (int)(zFirst-zProgram);
+    cmd.nText = (int)(zInput-zFirst);
+    cmd.iArg = nArg;
+    cmd.nArg = 0;
+    zWord = zFirst;
+    nList = cmd.nText;
+    while( nList>0 ){
+      Th_ProgWord word;
+      const char *zLit;
+      int nWord;
+      thNextSpace(interp, zWord, nList, &nWord);
+      zWord += nWord;
+      nList -= nWord;
+      rc = thNextWord(interp, zWord, nList, &nWord, 0);
+      if( rc!=TH_OK ) break;
+      if( nWord>0 ){
+        word.iWord = (int)(zWord-zProgram);
+        word.nWord = nWord;
+        word.iLit = -1;
+        word.nLit = 0;
+        if( thLiteralWord(zWord, nWord, &zLit, &word.nLit) ){
+          word.iLit = litbuf.nBuf;
+          thBufferWrite(interp, &litbuf, zLit, word.nLit);
+          thBufferWrite(interp, &litbuf, "\0", 1);
+        }
+        thBufferWrite(interp, &wordbuf, (const char *)&word, sizeof(word));
+        cmd.nArg++;
+      }
+      zWord += nWord;
+      nList -= nWord;
+    }
+    if( rc!=TH_OK ) break;
+    if( cmd.nArg>0 ){
+      thBufferWrite(interp, &cmdbuf, (const char *)&cmd, sizeof(cmd));
+      nArg += cmd.nArg;
+      nCmd++;
+    }
+  }
+
+  zMem = Th_Malloc(interp,
+      sizeof(Th_Program) + cmdbuf.nBuf + wordbuf.nBuf + litbuf.nBuf + 1
+  );
+  p = (Th_Program *)zMem;
+  p->nRef = 1;
+  p->nByte = sizeof(Th_Program) + cmdbuf.nBuf + wordbuf.nBuf + litbuf.nBuf;
+  p->nCmd = nCmd;
+  p->parseError = (rc!=TH_OK);
+  p->aCmd = (Th_ProgCmd *)&p[1];
+  p->aWord = (Th_ProgWord *)&p->aCmd[nCmd];
+  p->zLit = (char *)&p->aWord[nArg];
+  if( cmdbuf.nBuf ) memcpy(p->aCmd, cmdbuf.zBuf, cmdbuf.nBuf);
+  if( wordbuf.nBuf ) memcpy(p->aWord, wordbuf.zBuf, wordbuf.nBuf);
+  if( litbuf.nBuf ) memcpy(p->zLit, litbuf.zBuf, litbuf.nBuf);
+  thBufferFree(interp, &cmdbuf);
+  thBufferFree(interp, &wordbuf);
+  thBufferFree(interp, &litbuf);
+
+  Th_SetResult(interp, 0, 0);
+  interp->zResult = zSaved;
+  interp->nResult = nSaved;
+  return p;
+}
 
-    /* Split the command into an array of words. This call also does
-    ** substitution of each individual word.
+/*
+** Release a reference to a compiled program.
+*/
+static void thProgramUnref(Th_Interp *interp, Th_Program *p){
+  p->nRef--;
+  if( p->nRef<=0 ){
+    Th_Free(interp, p);
+  }
+}
+
+/*
+** Hash iteration callback used to empty the program cache.
+*/
+static int thFreeProgram(Th_HashEntry *pEntry, void *pContext){
+  Th_Interp *interp = (Th_Interp *)pContext;
+  thProgramUnref(interp, (Th_Program *)pEntry->pData);
+  Th_Free(interp, pEntry);
+  return 1;
+}
+
+/*
+** Discard all compiled programs held by the cache. Programs that are
+** currently running remain valid until they finish.
+*/
+static void thProgramCacheReset(Th_Interp *interp){
+  if( interp->paProg ){
+    Th_HashIterate(interp, interp->paProg, thFreeProgram, (void *)interp);
+    Th_Free(interp, interp->paProg);
+    interp->paProg = 0;
+  }
+  interp->nProgByte = 0;
+}
+
+/*
+** Return a compiled program for the script (zProgram, nProgram), from
+** the cache if possible. The caller must release the returned reference
+** using thProgramUnref().
+*/
+static Th_Program *thProgramFind(
+  Th_Interp *interp,
+  const char *zProgram,
+  int nProgram
+){
+  Th_HashEntry *pEntry;
+  Th_Program *p;
+  int nByte;
+
+  if( interp->paProg ){
+    pEntry = Th_HashFind(interp, interp->paProg, zProgram, nProgram, 0);
+    if( pEntry ){
+      p = (Th_Program *)pEntry->pData;
+      p->nRef++;
+      interp->nProgHit++;
+      return p;
+    }
+  }
+  interp->nProgMiss++;
+  p = thCompile(interp, zProgram, nProgram);
+  nByte = p->nByte + nProgram + (int)sizeof(Th_HashEntry);
+  if( nByte>interp->mxProgByte ){
+    return p;
+  }
+  if( interp->nProgByte+nByte>interp->mxProgByte ){
+    thProgramCacheReset(interp);
+  }
+  if( interp->paProg==0 ){
+    interp->paProg = Th_HashNew(interp);
+  }
+  pEntry = Th_HashFind(interp, interp->paProg, zProgram, nProgram, 1);
+  pEntry->pData = (void *)p;
+  p->nRef++;
+  interp->nProgByte += nByte;
+  return p;
+}
+
+/*
+** Set the maximum number of bytes used to cache compiled programs.
+** A value of zero disables the cache.
+*/
+void Th_SetProgramCacheSize(Th_Interp *interp, int mxByte){
+  thProgramCacheReset(interp);
+  interp->mxProgByte = mxByte>0 ? mxByte : 0;
+}
+
+/*
+** Report on the program cache. Any of the output pointers may be NULL.
+*/
+void Th_ProgramCacheStats(
+  Th_Interp *interp,
+  int *pnHit,                 /* OUT: Number of scripts found in the cache */
+  int *pnMiss,                /* OUT: Number of scripts compiled */
+  int *pnByte                 /* OUT: Bytes currently used by the cache */
+){
+  if( pnHit ) *pnHit = interp->nProgHit;
+  if( pnMiss ) *pnMiss = interp->nProgMiss;
+  if( pnByte ) *pnByte = interp->nProgByte;
+}
+
+/*
+** Evaluate the th1 script contained in the string (zProgram, nProgram)
+** in the current stack frame.
+*/
+static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
+  int rc = TH_OK;
+  int iCmd;
+  Th_Program *pProg;
+
+  pProg = thProgramFind(interp, zProgram, nProgram);
+  for(iCmd=0; rc==TH_OK && iCmd<pProg->nCmd; iCmd++){
+    const Th_ProgCmd *pCmd = &pProg->aCmd[iCmd];
+    const Th_ProgWord *aWord = &pProg->aWord[pCmd->iArg];
+    const char *zFirst = &zProgram[pCmd->iFirst];
+    Th_HashEntry *pEntry;
+    Buffer strbuf;
+    const char **argv;
+    int *argl;
+    int *aOff;
+    int argc = pCmd->nArg;
+    int i;
+
+    /* Substitute each word that is not a literal. The values are
+    ** accumulated in strbuf, which may be reallocated as it grows, so
+    ** aOff[] records where each one starts until all are done.
     */
-    rc = thSplitList(interp, zFirst, zInput-zFirst, &argv, &argl, &argc);
-    if( rc!=TH_OK ) continue;
+    argv = (const char **)Th_Malloc(interp,
+        (sizeof(char*) + sizeof(int)*2) * argc
+    );
+    argl = (int *)&argv[argc];
+    aOff = &argl[argc];
+    thBufferInit(&strbuf);
+    for(i=0; rc==TH_OK && i<argc; i++){
+      if( aWord[i].iLit>=0 ){
+        argv[i] = &pProg->zLit[aWord[i].iLit];
+        argl[i] = aWord[i].nLit;
+        aOff[i] = -1;
+      }else{
+        rc = thSubstWord(interp, &zProgram[aWord[i].iWord], aWord[i].nWord);
+        if( rc==TH_OK ){
+          const char *zRes = Th_GetResult(interp, &argl[i]);
+          aOff[i] = strbuf.nBuf;
+          thBufferWrite(interp, &strbuf, zRes, argl[i]);
+          thBufferWrite(interp, &strbuf, "\0", 1);
+        }
+      }
+    }
+
+    if( rc==TH_OK ){
+      for(i=0; i<argc; i++){
+        if( aOff[i]>=0 ) argv[i] = &strbuf.zBuf[aOff[i]];
+      }
 
-    if( argc>0 ){
+      /* Commands that do not set a result leave the value of their last
+      ** word in place, as they did when every word was substituted.
+      */
+      if( aOff[argc-1]<0 ){
+        Th_SetResult(interp, argv[argc-1], argl[argc-1]);
+      }
 
       /* Look up the command name in the command hash-table. */
       pEntry = Th_HashFind(interp, interp->paCmd, argv[0], argl[0], 0);
@@ -933,8 +1236,7 @@ static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
       /* Call the command procedure. */
       if( rc==TH_OK ){
         Th_Command *p = (Th_Command *)(pEntry->pData);
-        const char **azArg = (const char **)argv;
-        rc = p->xProc(interp, p->pContext, argc, azArg, argl);
+        rc = p->xProc(interp, p->pContext, argc, argv, argl);
       }
 
       /* If an error occurred, add this command to the stack trace report. */
@@ -948,7 +1250,7 @@ static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
         if( TH_OK==Th_GetVar(interp, (char *)"::th_stack_trace", -1) ){
           zStack = Th_TakeResult(interp, &nStack);
         }
-        Th_ListAppend(interp, &zStack, &nStack, zFirst, zInput-zFirst);
+        Th_ListAppend(interp, &zStack, &nStack, zFirst, pCmd->nText);
         Th_SetVar(interp, (char *)"::th_stack_trace", -1, zStack, nStack);
         Th_SetResult(interp, zRes, nRes);
         Th_Free(interp, zRes);
@@ -956,9 +1258,16 @@ static int thEvalLocal(Th_Interp *interp, const char *zProgram, int nProgram){
       }
     }
 
-    Th_Free(interp, argv);
+    Th_Free(interp, (void *)argv);
+    thBufferFree(interp, &strbuf);
   }
 
+  /* Any parse error is reported only after the commands before it ran. */
+  if( rc==TH_OK && pProg->parseError ){
+    Th_SetResult(interp, "parse error", -1);
+    rc = TH_ERROR;
+  }
+  thProgramUnref(interp, pProg);
   return rc;
 }
 
@@ -1816,6 +2125,9 @@ void Th_DeleteInterp(Th_Interp *interp){
   Th_HashIterate(interp, interp->paCmd, thFreeCommand, (void *)interp);
   Th_HashDelete(interp, interp->paCmd);
 
+  /* Delete any cached compiled programs. */
+  thProgramCacheReset(interp);
+
   /* Delete the interpreter structure itself. */
   Th_Free(interp, (void *)interp);
 }
@@ -1831,6 +2143,7 @@ Th_Interp * Th_CreateInterp(Th_Vtab *pVtab){
   memset(p, 0, sizeof(Th_Interp));
   p->pVtab = pVtab;
   p->paCmd = Th_HashNew(p);
+  p->mxProgByte = TH_PROGRAM_CACHE_SIZE;
   thPushFrame(p, (Th_Frame *)&p[1]);
   thInitialize(p);
 
@@ -41,6 +41,14 @@ void Th_DeleteInterp(Th_Interp *);
 */
 int Th_Eval(Th_Interp *interp, int iFrame, const char *zProg, int nProg);
 
+/*
+** Scripts are compiled once and the result cached, keyed by the script
+** text. Set the size of that cache in bytes (zero to disable it) and
+** report its hit, miss and size counters.
+*/
+void Th_SetProgramCacheSize(Th_Interp *, int);
+void Th_ProgramCacheStats(Th_Interp *, int *, int *, int *);
+
 /*
 ** Evaluate a TH expression. The result is stored in the
 ** interpreter result.
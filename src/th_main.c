@@ -2524,7 +2524,11 @@ void test_th_render(void){
 **
 **     --cgi                Include a CGI response header in the output
 **     --http               Include an HTTP response header in the output
+**     --cache-size N       Cache at most N bytes of compiled scripts
+**     --no-cache           Do not cache compiled scripts
 **     --open-config        Open the configuration database
+**     --repeat N           Evaluate SCRIPT N times and report timing and
+**                          compiled script cache statistics
 **     --set-anon-caps      Set anonymous login capabilities
 **     --set-user-caps      Set user login capabilities
 **     --th-trace           Trace TH1 execution (for debugging purposes)
@@ -2533,7 +2537,14 @@ void test_th_eval(void){
   int rc;
   const char *zRc;
   int forceCgi, fullHttpReply;
+  int noCache, nRepeat = 1;
+  const char *zRepeat;
+  const char *zCacheSize;
   Th_InitTraceLog();
+  noCache = find_option("no-cache", 0, 0)!=0;
+  zCacheSize = find_option("cache-size", 0, 1);
+  zRepeat = find_option("repeat", 0, 1);
+  if( zRepeat ) nRepeat = atoi(zRepeat);
   forceCgi = find_option("cgi", 0, 0)!=0;
   fullHttpReply = find_option("http", 0, 0)!=0;
   if( fullHttpReply ) forceCgi = 1;
@@ -2556,9 +2567,32 @@ void test_th_eval(void){
     usage("script");
   }
   Th_FossilInit(TH_INIT_DEFAULT);
-  rc = Th_Eval(g.interp, 0, g.argv[2], -1);
-  zRc = Th_ReturnCodeName(rc, 1);
-  fossil_print("%s%s%s\n", zRc, zRc ? ": " : "", Th_GetResult(g.interp, 0));
+  if( noCache ){
+    Th_SetProgramCacheSize(g.interp, 0);
+  }else if( zCacheSize ){
+    Th_SetProgramCacheSize(g.interp, atoi(zCacheSize));
+  }
+  if( zRepeat ){
+    int i, nHit, nMiss, nByte;
+    int iTimer = fossil_timer_start();
+    sqlite3_uint64 nUs;
+    rc = TH_OK;
+    for(i=0; i<nRepeat; i++){
+      rc = Th_Eval(g.interp, 0, g.argv[2], -1);
+    }
+    nUs = fossil_timer_stop(iTimer);
+    zRc = Th_ReturnCodeName(rc, 1);
+    fossil_print("%s%s%s\n", zRc, zRc ? ": " : "", Th_GetResult(g.interp, 0));
+    Th_ProgramCacheStats(g.interp, &nHit, &nMiss, &nByte);
+    fossil_print("%d evaluations in %.3f ms (%.3f us each)\n",
+                 nRepeat, nUs/1000.0, nRepeat>0 ? (double)nUs/nRepeat : 0.0);
+    fossil_print("script cache: %d hits, %d misses, %d bytes\n",
+                 nHit, nMiss, nByte);
+  }else{
+    rc = Th_Eval(g.interp, 0, g.argv[2], -1);
+    zRc = Th_ReturnCodeName(rc, 1);
+    fossil_print("%s%s%s\n", zRc, zRc ? ": " : "", Th_GetResult(g.interp, 0));
+  }
   Th_PrintTraceLog();
   if( forceCgi ) cgi_reply();
 }
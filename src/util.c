@@ -381,6 +381,56 @@ int is_valid_fd(int fd){
 #endif
 }
 
+#if !defined(_WIN32)
+/*
+** Write all n bytes of z to file descriptor fd, retrying after short
+** writes and interrupted system calls.  Return non-zero if that is not
+** possible.  Used on the pipes between a process and the worker
+** processes that it forks.
+*/
+int fossil_fd_write(int fd, const void *z, int n){
+  const char *zz = (const char*)z;
+  while( n>0 ){
+    int m = (int)write(fd, zz, n);
+    if( m<0 && errno==EINTR ) continue;
+    if( m<=0 ) return 1;
+    zz += m;
+    n -= m;
+  }
+  return 0;
+}
+
+/*
+** Read exactly n bytes from file descriptor fd into z.  Return non-zero
+** if that is not possible.
+*/
+int fossil_fd_read(int fd, void *z, int n){
+  char *zz = (char*)z;
+  while( n>0 ){
+    int m = (int)read(fd, zz, n);
+    if( m<0 && errno==EINTR ) continue;
+    if( m<=0 ) return 1;
+    zz += m;
+    n -= m;
+  }
+  return 0;
+}
+#endif
+
+/*
+** Encode and decode the 32-bit big-endian integers used in messages
+** between a process and its workers.
+*/
+void fossil_put32(unsigned char *z, int v){
+  z[0] = (v>>24)&0xff;
+  z[1] = (v>>16)&0xff;
+  z[2] = (v>>8)&0xff;
+  z[3] = v&0xff;
+}
+int fossil_get32(const unsigned char *z){
+  return (z[0]<<24) | (z[1]<<16) | (z[2]<<8) | z[3];
+}
+
 /*
 ** Returns TRUE if zSym is exactly UUID_SIZE bytes long and contains
 ** only lower-case ASCII hexadecimal values.
@@ -27,34 +27,67 @@
 #include "config.h"
 #include "verify.h"
 #include <assert.h>
+#include <errno.h>
+#if !defined(_WIN32)
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <sys/select.h>
+#endif
 
 /*
-** Load the record identify by rid.  Make sure we can reproduce it
-** without error.
+** Number of records whose hashes verify_rids() computes together.
+*/
+#define VERIFY_BATCH 8
+
+/*
+** Load the n records identified by aRid[].  Make sure we can reproduce
+** them without error.  The hashes are computed all at once, since that
+** can be faster than one at a time.
 **
 ** Panic if anything goes wrong.  If this procedure returns it means
 ** that everything is OK.
 */
-static void verify_rid(int rid){
-  Blob uuid, hash, content;
-  if( content_size(rid, 0)<0 ){
-    return;  /* No way to verify phantoms */
-  }
-  blob_zero(&uuid);
-  db_blob(&uuid, "SELECT uuid FROM blob WHERE rid=%d", rid);
-  if( blob_size(&uuid)!=UUID_SIZE ){
-    fossil_fatal("not a valid rid: %d", rid);
+static void verify_rids(int n, const int *aRid){
+  Blob aUuid[VERIFY_BATCH], aHash[VERIFY_BATCH], aContent[VERIFY_BATCH];
+  int aLoaded[VERIFY_BATCH];
+  int i, nLoaded = 0;
+  assert( n<=VERIFY_BATCH );
+  for(i=0; i<VERIFY_BATCH; i++) blob_zero(&aContent[i]);
+  for(i=0; i<n; i++){
+    int rid = aRid[i];
+    if( content_size(rid, 0)<0 ){
+      continue;  /* No way to verify phantoms */
+    }
+    blob_zero(&aUuid[nLoaded]);
+    db_blob(&aUuid[nLoaded], "SELECT uuid FROM blob WHERE rid=%d", rid);
+    if( blob_size(&aUuid[nLoaded])!=UUID_SIZE ){
+      fossil_fatal("not a valid rid: %d", rid);
+    }
+    if( content_get(rid, &aContent[nLoaded]) ){
+      aLoaded[nLoaded++] = rid;
+    }else{
+      blob_reset(&aUuid[nLoaded]);
+    }
   }
-  if( content_get(rid, &content) ){
-    sha1sum_blob(&content, &hash);
-    blob_reset(&content);
-    if( blob_compare(&uuid, &hash) ){
+  sha1sum_blobs(nLoaded, aContent, aHash);
+  for(i=0; i<nLoaded; i++){
+    if( blob_compare(&aUuid[i], &aHash[i]) ){
       fossil_fatal("hash of rid %d (%b) does not match its uuid (%b)",
-                    rid, &hash, &uuid);
+                    aLoaded[i], &aHash[i], &aUuid[i]);
     }
-    blob_reset(&hash);
+    blob_reset(&aContent[i]);
+    blob_reset(&aHash[i]);
+    blob_reset(&aUuid[i]);
   }
-  blob_reset(&uuid);
+}
+
+/*
+** Load the record identify by rid.  Make sure we can reproduce it
+** without error.
+*/
+static void verify_rid(int rid){
+  verify_rids(1, &rid);
 }
 
 /*
@@ -64,6 +97,287 @@ static void verify_rid(int rid){
 static Bag toVerify;
 static int inFinalVerify = 0;
 
+/*
+** Number of worker processes used to verify records at commit.  Zero or
+** one means verify them in this process.
+*/
+static int nVerifyJob = 0;
+
+/*
+** Do not start workers to verify fewer than this many records.
+*/
+#define VERIFY_JOB_MIN 100
+
+#if !defined(_WIN32)
+/*
+** The body of a worker process.  Read records from fdIn, each a header
+** of RID, SRCID, a flag that is true if the record is to be verified and
+** the size of the content, followed by the UUID and the compressed
+** content as stored in the BLOB table.  A record with a SRCID of zero
+** begins a new delta tree.  Otherwise the record is a delta against a
+** record on the path from the root of the current tree, which is kept
+** expanded.  An RID of zero ends the input.
+**
+** Write the RID of the first record whose hash does not match its UUID,
+** or zero, to fdOut.  Never returns.
+*/
+static void verify_job_main(int fdIn, int fdOut){
+  struct {
+    int rid;
+    Blob content;
+  } *aPath = 0;
+  int nPath = 0, nAlloc = 0;
+  int badRid = 0;
+  unsigned char aHdr[16];
+  char zUuid[UUID_SIZE];
+  Blob in, content, hash;
+
+  while( 1 ){
+    int rid, srcid, vfy, n;
+    if( fossil_fd_read(fdIn, aHdr, 16) ) _exit(1);
+    rid = fossil_get32(aHdr);
+    if( rid==0 ) break;
+    srcid = fossil_get32(&aHdr[4]);
+    vfy = fossil_get32(&aHdr[8]);
+    n = fossil_get32(&aHdr[12]);
+    blob_zero(&in);
+    blob_resize(&in, n);
+    if( fossil_fd_read(fdIn, zUuid, UUID_SIZE)
+     || fossil_fd_read(fdIn, blob_buffer(&in), n)
+    ){
+      _exit(1);
+    }
+    if( badRid ){
+      blob_reset(&in);
+      continue;
+    }
+    while( nPath>0 && aPath[nPath-1].rid!=srcid ){
+      blob_reset(&aPath[--nPath].content);
+    }
+    if( blob_uncompress(&in, &content) ){
+      badRid = rid;
+      blob_reset(&in);
+      continue;
+    }
+    blob_reset(&in);
+    if( srcid ){
+      Blob full;
+      int rc;
+      if( nPath==0 ){
+        badRid = rid;
+        blob_reset(&content);
+        continue;
+      }
+      rc = blob_delta_apply(&aPath[nPath-1].content, &content, &full);
+      blob_reset(&content);
+      if( rc<0 ){
+        badRid = rid;
+        continue;
+      }
+      content = full;
+    }
+    if( vfy ){
+      sha1sum_blob(&content, &hash);
+      if( memcmp(blob_buffer(&hash), zUuid, UUID_SIZE)!=0 ) badRid = rid;
+      blob_reset(&hash);
+    }
+    if( nPath>=nAlloc ){
+      nAlloc = nAlloc*2 + 20;
+      aPath = fossil_realloc(aPath, sizeof(aPath[0])*nAlloc);
+    }
+    aPath[nPath].rid = rid;
+    aPath[nPath].content = content;
+    nPath++;
+  }
+  fossil_put32(aHdr, badRid);
+  if( fossil_fd_write(fdOut, aHdr, 4) ) _exit(1);
+  _exit(0);
+}
+
+/*
+** Send the delta tree rooted at rid to the worker on file descriptor fd,
+** parents before children.  Only records in the VNODE table are sent.
+** A record without content, and any record that depends on it, cannot
+** be verified and is skipped.  Return non-zero if the worker has failed.
+*/
+static int verify_job_send_tree(int fd, int rid){
+  Stmt q, qChild;
+  int *aStack;
+  int nStack = 0, nAlloc = 2;
+  int rc = 0;
+  aStack = fossil_malloc( sizeof(aStack[0])*nAlloc );
+  aStack[nStack++] = rid;
+  aStack[nStack++] = 0;
+  db_prepare(&q,
+    "SELECT uuid, content, vfy FROM blob JOIN vnode USING(rid)"
+    " WHERE rid=:rid AND size>=0"
+  );
+  db_prepare(&qChild,
+    "SELECT delta.rid FROM delta JOIN vnode USING(rid) WHERE srcid=:rid"
+  );
+  while( nStack>0 && rc==0 ){
+    int srcid = aStack[--nStack];
+    unsigned char aHdr[16];
+    Blob content;
+    rid = aStack[--nStack];
+    db_bind_int(&q, ":rid", rid);
+    if( db_step(&q)!=SQLITE_ROW || db_column_bytes(&q, 0)!=UUID_SIZE ){
+      db_reset(&q);
+      continue;
+    }
+    db_ephemeral_blob(&q, 1, &content);
+    fossil_put32(aHdr, rid);
+    fossil_put32(&aHdr[4], srcid);
+    fossil_put32(&aHdr[8], db_column_int(&q, 2));
+    fossil_put32(&aHdr[12], blob_size(&content));
+    rc = fossil_fd_write(fd, aHdr, 16)
+      || fossil_fd_write(fd, db_column_text(&q, 0), UUID_SIZE)
+      || fossil_fd_write(fd, blob_buffer(&content), blob_size(&content));
+    db_reset(&q);
+    db_bind_int(&qChild, ":rid", rid);
+    while( db_step(&qChild)==SQLITE_ROW ){
+      if( nStack+2>nAlloc ){
+        nAlloc *= 2;
+        aStack = fossil_realloc(aStack, sizeof(aStack[0])*nAlloc);
+      }
+      aStack[nStack++] = db_column_int(&qChild, 0);
+      aStack[nStack++] = rid;
+    }
+    db_reset(&qChild);
+  }
+  db_finalize(&q);
+  db_finalize(&qChild);
+  fossil_free(aStack);
+  return rc;
+}
+
+/*
+** Verify every record in toVerify using nVerifyJob worker processes.
+**
+** The records to be verified and the records they are deltas against
+** are gathered into the VNODE table and sent to the workers one delta
+** tree at a time.  The workers decompress, apply deltas and compute
+** hashes.  If a worker reports a bad record, that record is verified
+** again here by verify_rid(), which reports the error.
+*/
+static void verify_jobs_run(void){
+  struct {
+    int pid;
+    int fdIn;
+    int fdOut;
+  } *aJob;
+  int nJob, i, rid;
+  Stmt q;
+
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS vnode(rid INTEGER PRIMARY KEY, vfy);"
+    "DELETE FROM vnode;"
+  );
+  rid = bag_first(&toVerify);
+  while( rid>0 ){
+    db_multi_exec("INSERT INTO vnode VALUES(%d,1)", rid);
+    rid = bag_next(&toVerify, rid);
+  }
+  db_multi_exec(
+    "INSERT OR IGNORE INTO vnode"
+    " WITH RECURSIVE src(rid) AS ("
+    "   SELECT rid FROM vnode"
+    "   UNION SELECT delta.srcid FROM delta, src WHERE delta.rid=src.rid"
+    " )"
+    " SELECT rid, 0 FROM src"
+  );
+
+  aJob = fossil_malloc( sizeof(aJob[0])*nVerifyJob );
+  fflush(stdout);
+  fflush(stderr);
+  for(nJob=0; nJob<nVerifyJob; nJob++){
+    int aIn[2], aOut[2];
+    if( pipe(aIn) ) break;
+    if( pipe(aOut) ){
+      close(aIn[0]);
+      close(aIn[1]);
+      break;
+    }
+    aJob[nJob].pid = fork();
+    if( aJob[nJob].pid==0 ){
+      for(i=0; i<nJob; i++){
+        close(aJob[i].fdIn);
+        close(aJob[i].fdOut);
+      }
+      close(aIn[1]);
+      close(aOut[0]);
+      verify_job_main(aIn[0], aOut[1]);
+    }
+    close(aIn[0]);
+    close(aOut[1]);
+    if( aJob[nJob].pid<0 ){
+      close(aIn[1]);
+      close(aOut[0]);
+      break;
+    }
+    aJob[nJob].fdIn = aIn[1];
+    aJob[nJob].fdOut = aOut[0];
+  }
+  if( nJob==0 ){
+    fossil_fatal("unable to start workers to verify artifacts");
+  }
+
+  /* Send each delta tree to whichever worker is ready for more */
+  db_prepare(&q,
+    "SELECT rid FROM vnode"
+    " WHERE NOT EXISTS(SELECT 1 FROM delta WHERE delta.rid=vnode.rid)"
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    fd_set writefds;
+    int mx = 0;
+    FD_ZERO(&writefds);
+    for(i=0; i<nJob; i++){
+      FD_SET(aJob[i].fdIn, &writefds);
+      if( aJob[i].fdIn>mx ) mx = aJob[i].fdIn;
+    }
+    while( select(mx+1, 0, &writefds, 0, 0)<0 ){
+      if( errno!=EINTR ) fossil_fatal("select() failed during verify");
+    }
+    for(i=0; !FD_ISSET(aJob[i].fdIn, &writefds); i++){}
+    if( verify_job_send_tree(aJob[i].fdIn, db_column_int(&q, 0)) ){
+      fossil_fatal("verify worker %d failed", aJob[i].pid);
+    }
+  }
+  db_finalize(&q);
+
+  /* Collect the results */
+  for(i=0; i<nJob; i++){
+    unsigned char aMsg[16];
+    int status = 0;
+    memset(aMsg, 0, sizeof(aMsg));
+    if( fossil_fd_write(aJob[i].fdIn, aMsg, 16)==0 ){
+      close(aJob[i].fdIn);
+      if( fossil_fd_read(aJob[i].fdOut, aMsg, 4)==0 ){
+        rid = fossil_get32(aMsg);
+        if( rid>0 ) verify_rid(rid);
+      }
+    }else{
+      close(aJob[i].fdIn);
+    }
+    close(aJob[i].fdOut);
+    while( waitpid(aJob[i].pid, &status, 0)<0 && errno==EINTR ){}
+    if( !WIFEXITED(status) || WEXITSTATUS(status)!=0 ){
+      fossil_fatal("verify worker %d failed", aJob[i].pid);
+    }
+  }
+  fossil_free(aJob);
+  db_multi_exec("DROP TABLE vnode");
+}
+#endif
+
+/*
+** Use nJob worker processes to verify records before each commit, when
+** there are enough of them.
+*/
+void verify_set_jobs(int nJob){
+  nVerifyJob = nJob;
+}
+
 /*
 ** This routine is called just prior to each commit operation.
 **
@@ -74,10 +388,24 @@ static int verify_at_commit(void){
   int rid;
   content_clear_cache();
   inFinalVerify = 1;
-  rid = bag_first(&toVerify);
-  while( rid>0 ){
-    verify_rid(rid);
-    rid = bag_next(&toVerify, rid);
+#if !defined(_WIN32)
+  if( nVerifyJob>1 && bag_count(&toVerify)>=VERIFY_JOB_MIN ){
+    verify_jobs_run();
+  }else
+#endif
+  {
+    int aRid[VERIFY_BATCH];
+    int n = 0;
+    rid = bag_first(&toVerify);
+    while( rid>0 ){
+      aRid[n++] = rid;
+      if( n==VERIFY_BATCH ){
+        verify_rids(n, aRid);
+        n = 0;
+      }
+      rid = bag_next(&toVerify, rid);
+    }
+    verify_rids(n, aRid);
   }
   bag_clear(&toVerify);
   inFinalVerify = 0;
@@ -114,10 +442,14 @@ void verify_cancel(void){
 ** COMMAND: test-verify-all
 **
 ** Verify all records in the repository.
+**
+** Options:
+**   -j|--jobs N     Verify in N worker processes
 */
 void verify_all_cmd(void){
   Stmt q;
   int cnt = 0;
+  verify_set_jobs(sync_jobs_option());
   db_must_be_within_tree();
   db_prepare(&q, "SELECT rid FROM blob");
   while( db_step(&q)==SQLITE_ROW ){
@@ -20,7 +20,17 @@
 #include "config.h"
 #include "vfile.h"
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
+#if !defined(_WIN32)
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/wait.h>
+# if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+#endif
 
 /*
 ** The input is guaranteed to be a 40-character well-formed UUID.
@@ -137,6 +147,156 @@ int load_vfile_from_rid(int vid){
 
 #endif /* INTERFACE */
 
+#if INTERFACE
+/*
+** The hashMode field of a VFileProbe entry tells vfile_probe() how much
+** work to do on the file beyond finding its size, mtime and permissions.
+*/
+#define VPROBE_STAT       0   /* Only stat() the file */
+#define VPROBE_HASH       1   /* SHA1 the file if its size is unchanged */
+#define VPROBE_HASH_MTIME 2   /* As VPROBE_HASH but only if the mtime moved */
+
+/*
+** One file to be examined by vfile_probe().  The caller fills in the
+** first group of fields and vfile_probe() fills in the rest.
+*/
+struct VFileProbe {
+  char *zName;               /* Full pathname of the file */
+  i64 origSize;              /* Size of the checked-in version */
+  i64 oldMtime;              /* Mtime recorded in VFILE */
+  int hashMode;              /* One of the VPROBE_* values */
+  /* Results */
+  int isDone;                /* True if the fields below are valid */
+  i64 size;                  /* Current size, or -1 if the file is missing */
+  i64 mtime;                 /* Current mtime */
+  int perm;                  /* Current PERM_* value */
+  int isFile;                /* True for an ordinary file or symlink */
+  int hasCksum;              /* True if zCksum holds the SHA1 of the file */
+  char zCksum[UUID_SIZE+1];  /* SHA1 of the current content */
+};
+#endif /* INTERFACE */
+
+/*
+** Do not fork a worker for vfile_probe() unless it will have at least
+** this many files to look at.  Below that the fork() costs more than
+** it saves.
+*/
+#define VPROBE_JOB_MIN  250
+
+/*
+** Examine a single file for vfile_probe().
+*/
+static void vfile_probe_one(VFileProbe *p){
+  p->size = file_wd_size(p->zName);
+  p->mtime = file_wd_mtime(0);
+  p->isFile = file_wd_isfile_or_link(0);
+  p->hasCksum = 0;
+#ifndef _WIN32
+  p->perm = file_wd_perm(p->zName);
+#else
+  p->perm = PERM_REG;
+#endif
+  switch( p->hashMode ){
+    case VPROBE_HASH_MTIME:
+      if( p->mtime==p->oldMtime && p->isFile ) break;
+      /* Fall through */
+    case VPROBE_HASH: {
+      Blob cksum;
+      if( p->size!=p->origSize ) break;
+      blob_zero(&cksum);
+      if( sha1sum_file(p->zName, &cksum)==0 && blob_size(&cksum)==UUID_SIZE ){
+        memcpy(p->zCksum, blob_buffer(&cksum), UUID_SIZE+1);
+        p->hasCksum = 1;
+      }
+      blob_reset(&cksum);
+      break;
+    }
+  }
+  p->isDone = 1;
+}
+
+/*
+** Return the number of worker processes that vfile_probe() should use
+** for a scan of nFile files.
+*/
+static int vfile_probe_jobs(int nFile){
+  int nJob = db_get_int("scan-jobs", 0);
+#ifndef _WIN32
+  if( nJob<=0 ){
+#if defined(_SC_NPROCESSORS_ONLN)
+    nJob = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+#endif
+  if( nJob>64 ) nJob = 64;
+  if( nJob>nFile/VPROBE_JOB_MIN ) nJob = nFile/VPROBE_JOB_MIN;
+  return nJob<1 ? 1 : nJob;
+}
+
+/*
+** Examine the n files in a[].  Large scans are divided among worker
+** processes per the "scan-jobs" setting.  Each worker takes every
+** nJob-th entry and writes its results into an array of shared memory.
+** The workers only touch the filesystem, never the database.  Any entry
+** that a worker did not finish is redone in the main process, so the
+** results are the same no matter how many workers are used.
+*/
+void vfile_probe(int n, VFileProbe *a){
+  int i;
+#ifndef _WIN32
+  int nJob = vfile_probe_jobs(n);
+  if( nJob>1 ){
+    size_t nByte = sizeof(a[0])*n;
+    VFileProbe *aOut;
+    pid_t *aPid;
+    int j;
+    aOut = mmap(0, nByte, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+                -1, 0);
+    if( aOut!=MAP_FAILED ){
+      aPid = fossil_malloc( sizeof(aPid[0])*nJob );
+      memcpy(aOut, a, nByte);
+      fflush(stdout);
+      for(j=0; j<nJob; j++){
+        aPid[j] = fork();
+        if( aPid[j]==0 ){
+          for(i=j; i<n; i+=nJob) vfile_probe_one(&aOut[i]);
+          _exit(0);
+        }
+        if( aPid[j]<0 ) break;
+      }
+      nJob = j;
+      for(j=0; j<nJob; j++){
+        int status;
+        while( waitpid(aPid[j], &status, 0)<0 && errno==EINTR ){}
+      }
+      fossil_free(aPid);
+      memcpy(a, aOut, nByte);
+      munmap(aOut, nByte);
+    }
+  }
+#endif
+  for(i=0; i<n; i++){
+    if( !a[i].isDone ) vfile_probe_one(&a[i]);
+  }
+}
+
+/*
+** Write the SHA1 checksum of the file described by p into pCksum, which
+** must not be initialized.  Use the checksum found by vfile_probe() if
+** there is one, else compute it now.  An unreadable file gets an empty
+** checksum.
+*/
+static void vfile_probe_cksum(VFileProbe *p, Blob *pCksum){
+  if( p->hasCksum ){
+    blob_init(pCksum, p->zCksum, UUID_SIZE);
+  }else{
+    blob_zero(pCksum);
+    if( sha1sum_file(p->zName, pCksum) ){
+      blob_reset(pCksum);
+    }
+  }
+}
+
 /*
 ** Look at every VFILE entry with the given vid and update VFILE.CHNGED field
 ** according to whether or not the file has changed.
@@ -169,22 +329,84 @@ int load_vfile_from_rid(int vid){
 ** If the mtime is used, it is used only to determine if files are the same.
 ** If the mtime of a file has changed, we still examine the on-disk content
 ** to see whether or not the edit was a null-edit.
+**
+** All of the stat() and SHA1 work is done up front by vfile_probe(), which
+** may spread it over several processes.  The VFILE changes are then made
+** in a single pass within one transaction.
+**
+** If "fossil fsmonitor" is running, only files that it reports as changed,
+** plus those whose VFILE entries are not in their usual state, are looked
+** at.  That is skipped for --sha1sum and for CKSIG_SETMTIME.
 */
 void vfile_check_signature(int vid, unsigned int cksigFlags){
   int nErr = 0;
-  Stmt q;
+  Stmt q, upd;
   Blob fileCksum, origCksum;
   int useMtime = (cksigFlags & CKSIG_SHA1)==0
                     && db_get_boolean("mtime-changes", 1);
+  struct CksigRow {
+    int id, rid, isDeleted, chnged, origPerm;
+    char *zUuid;
+  } *aRow = 0;
+  VFileProbe *aProbe = 0;
+  int nRow = 0, nAlloc = 0, i;
+  const char *zFilter = "";
 
   db_begin_transaction();
+  if( (cksigFlags & (CKSIG_SHA1|CKSIG_SETMTIME))==0
+   && vid==db_lget_int("checkout", 0)
+   && fsmonitor_begin()
+  ){
+    zFilter = "AND (chnged OR deleted OR vfile.rid=0 OR origname NOTNULL"
+              "     OR coalesce(mtime,0)=0 OR pathname IN fsmon_dirty)";
+  }
   db_prepare(&q, "SELECT id, %Q || pathname,"
                  "       vfile.mrid, deleted, chnged, uuid, size, mtime,"
                  "      CASE WHEN isexe THEN %d WHEN islink THEN %d ELSE %d END"
                  "  FROM vfile LEFT JOIN blob ON vfile.mrid=blob.rid"
-                 " WHERE vid=%d ", g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
-                 vid);
+                 " WHERE vid=%d %s", g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
+                 vid, zFilter /*safe-for-%s*/);
   while( db_step(&q)==SQLITE_ROW ){
+    struct CksigRow *pRow;
+    VFileProbe *pProbe;
+    if( nRow>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      aRow = fossil_realloc(aRow, sizeof(aRow[0])*nAlloc);
+      aProbe = fossil_realloc(aProbe, sizeof(aProbe[0])*nAlloc);
+    }
+    pRow = &aRow[nRow];
+    pProbe = &aProbe[nRow];
+    nRow++;
+    memset(pProbe, 0, sizeof(*pProbe));
+    pRow->id = db_column_int(&q, 0);
+    pRow->rid = db_column_int(&q, 2);
+    pRow->isDeleted = db_column_int(&q, 3);
+    pRow->chnged = db_column_int(&q, 4);
+    pRow->zUuid = db_column_type(&q, 5)==SQLITE_NULL ? 0 :
+                      fossil_strdup(db_column_text(&q, 5));
+    pRow->origPerm = db_column_int(&q, 8);
+    pProbe->zName = fossil_strdup(db_column_text(&q, 1));
+    pProbe->origSize = db_column_int64(&q, 6);
+    pProbe->oldMtime = db_column_int64(&q, 7);
+    if( pRow->chnged==0 && (pRow->isDeleted || pRow->rid==0) ){
+      pProbe->hashMode = VPROBE_STAT;
+    }else if( pRow->chnged==0 || pRow->chnged==2 || pRow->chnged==4 ){
+      pProbe->hashMode = useMtime ? VPROBE_HASH_MTIME : VPROBE_HASH;
+    }else if( pRow->chnged==1 && pRow->rid!=0 && !pRow->isDeleted ){
+      pProbe->hashMode = VPROBE_HASH;
+    }else{
+      pProbe->hashMode = VPROBE_STAT;
+    }
+  }
+  db_finalize(&q);
+
+  /* Do all of the stat() and sha1sum work, possibly in parallel */
+  vfile_probe(nRow, aProbe);
+
+  db_prepare(&upd, "UPDATE vfile SET mtime=:mtime, chnged=:chnged"
+                   " WHERE id=:id");
+  for(i=0; i<nRow; i++){
+    VFileProbe *pProbe = &aProbe[i];
     int id, rid, isDeleted;
     const char *zName;
     int chnged = 0;
@@ -198,23 +420,23 @@ void vfile_check_signature(int vid, unsigned int cksigFlags){
     i64 origSize;
     i64 currentSize;
 
-    id = db_column_int(&q, 0);
-    zName = db_column_text(&q, 1);
-    rid = db_column_int(&q, 2);
-    isDeleted = db_column_int(&q, 3);
-    oldChnged = chnged = db_column_int(&q, 4);
-    oldMtime = db_column_int64(&q, 7);
-    origSize = db_column_int64(&q, 6);
-    currentSize = file_wd_size(zName);
-    currentMtime = file_wd_mtime(0);
+    id = aRow[i].id;
+    zName = pProbe->zName;
+    rid = aRow[i].rid;
+    isDeleted = aRow[i].isDeleted;
+    oldChnged = chnged = aRow[i].chnged;
+    oldMtime = pProbe->oldMtime;
+    origSize = pProbe->origSize;
+    currentSize = pProbe->size;
+    currentMtime = pProbe->mtime;
 #ifndef _WIN32
-    origPerm = db_column_int(&q, 8);
-    currentPerm = file_wd_perm(zName);
+    origPerm = aRow[i].origPerm;
+    currentPerm = pProbe->perm;
 #endif
     if( chnged==0 && (isDeleted || rid==0) ){
       /* "fossil rm" or "fossil add" always change the file */
       chnged = 1;
-    }else if( !file_wd_isfile_or_link(0) && currentSize>=0 ){
+    }else if( !pProbe->isFile && currentSize>=0 ){
       if( cksigFlags & CKSIG_ENOTFILE ){
         fossil_warning("not an ordinary file: %s", zName);
         nErr++;
@@ -231,10 +453,8 @@ void vfile_check_signature(int vid, unsigned int cksigFlags){
       /* File is believed to have changed but it is the same size.
       ** Double check that it really has changed by looking at content. */
       assert( origSize==currentSize );
-      db_ephemeral_blob(&q, 5, &origCksum);
-      if( sha1sum_file(zName, &fileCksum) ){
-        blob_zero(&fileCksum);
-      }
+      blob_init(&origCksum, aRow[i].zUuid, -1);
+      vfile_probe_cksum(pProbe, &fileCksum);
       if( blob_compare(&fileCksum, &origCksum)==0 ) chnged = 0;
       blob_reset(&origCksum);
       blob_reset(&fileCksum);
@@ -245,10 +465,8 @@ void vfile_check_signature(int vid, unsigned int cksigFlags){
       ** if --sha1sum is used, check to see if they have been edited by
       ** looking at their SHA1 sum */
       assert( origSize==currentSize );
-      db_ephemeral_blob(&q, 5, &origCksum);
-      if( sha1sum_file(zName, &fileCksum) ){
-        blob_zero(&fileCksum);
-      }
+      blob_init(&origCksum, aRow[i].zUuid, -1);
+      vfile_probe_cksum(pProbe, &fileCksum);
       if( blob_compare(&fileCksum, &origCksum) ){
         chnged = 1;
       }
@@ -282,12 +500,22 @@ void vfile_check_signature(int vid, unsigned int cksigFlags){
     }
 #endif
     if( currentMtime!=oldMtime || chnged!=oldChnged ){
-      db_multi_exec("UPDATE vfile SET mtime=%lld, chnged=%d WHERE id=%d",
-                    currentMtime, chnged, id);
+      db_bind_int64(&upd, ":mtime", currentMtime);
+      db_bind_int(&upd, ":chnged", chnged);
+      db_bind_int(&upd, ":id", id);
+      db_step(&upd);
+      db_reset(&upd);
     }
   }
-  db_finalize(&q);
+  db_finalize(&upd);
+  for(i=0; i<nRow; i++){
+    fossil_free(aProbe[i].zName);
+    fossil_free(aRow[i].zUuid);
+  }
+  fossil_free(aProbe);
+  fossil_free(aRow);
   if( nErr ) fossil_fatal("abort due to prior errors");
+  fsmonitor_end();
   db_end_transaction(0);
 }
 
@@ -731,6 +959,22 @@ void vfile_aggregate_checksum_disk(int vid, Blob *pOut){
       " ORDER BY if_selected(id, pathname, origname) /*scan*/",
       g.zLocalRoot, vid
   );
+
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+  /* The checksum itself must be computed serially, but first ask the OS
+  ** to start reading every file into its cache, so that the disk reads
+  ** overlap with the hashing below. */
+  while( db_step(&q)==SQLITE_ROW ){
+    int fd;
+    if( db_column_int(&q, 3)==0 ) continue;
+    fd = open(db_column_text(&q, 0), O_RDONLY);
+    if( fd<0 ) continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+  db_reset(&q);
+#endif
+
   md5sum_init();
   while( db_step(&q)==SQLITE_ROW ){
     const char *zFullpath = db_column_text(&q, 0);
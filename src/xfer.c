@@ -18,6 +18,12 @@
 ** This file contains code to implement the file transfer protocol.
 */
 #include "config.h"
+#if defined(FOSSIL_ENABLE_MINIZ)
+#  define MINIZ_HEADER_FILE_ONLY
+#  include "miniz.c"
+#else
+#  include <zlib.h>
+#endif
 #include "xfer.h"
 
 #include <time.h>
@@ -48,12 +54,102 @@ struct Xfer {
   int nDeltaRcvd;     /* Number of deltas received */
   int nDanglingFile;  /* Number of dangling deltas received */
   int mxSend;         /* Stop sending "file" when pOut reaches this size */
+  int nOutSent;       /* Bytes of pOut already sent by xfer_stream_flush() */
   int resync;         /* Send igot cards for all holdings */
   u8 syncPrivate;     /* True to enable syncing private content */
   u8 nextIsPrivate;   /* If true, next "file" received is a private */
+  u8 streamReply;     /* 1: client accepts a streamed reply.  2: streaming */
+  u8 streamLevel;     /* Compression level of the streamed reply */
+  u8 ihash;           /* Using "pragma ihash" digests instead of igot lists */
   time_t maxTime;     /* Time when this transfer should be finished */
 };
 
+/*
+** A server sends its reply to a client that asked for it with
+** "pragma stream-reply" as a single zlib stream, in pieces of about
+** this many uncompressed bytes, instead of holding the whole reply in
+** memory.  A reply that is never this large is sent the usual way.
+*/
+#define XFER_STREAM_CHUNK 65536
+
+/*
+** The compressor for a streamed reply, and the transfer whose reply is
+** being streamed.
+*/
+static z_stream xferStream;
+static Xfer *pStreamXfer = 0;
+static void xfer_stream_abort(void);
+
+/*
+** Return the number of bytes of reply generated so far, including any
+** that have already been sent.
+*/
+static int xfer_out_size(Xfer *pXfer){
+  return pXfer->nOutSent + blob_size(pXfer->pOut);
+}
+
+/*
+** If the reply is being streamed, compress and send what has been
+** generated so far, once there is enough of it.  If isFinal is true,
+** send everything and finish the reply.
+**
+** The first piece of the reply is sent only when it reaches
+** XFER_STREAM_CHUNK bytes.  A reply that is finished before then is not
+** streamed at all.
+*/
+static void xfer_stream_flush(Xfer *pXfer, int isFinal){
+  char zBuf[16384];
+  Blob out;
+  int isFirst = 0;
+
+  if( pXfer->streamReply==0 ) return;
+  if( pXfer->streamReply==1 ){
+    if( isFinal || blob_size(pXfer->pOut)<XFER_STREAM_CHUNK ) return;
+    memset(&xferStream, 0, sizeof(xferStream));
+    if( deflateInit(&xferStream, pXfer->streamLevel ? pXfer->streamLevel
+                                    : Z_DEFAULT_COMPRESSION)!=Z_OK ){
+      pXfer->streamReply = 0;
+      return;
+    }
+    cgi_set_content_type("application/x-fossil-stream");
+    pXfer->streamReply = 2;
+    pStreamXfer = pXfer;
+    isFirst = 1;
+  }else if( !isFinal && blob_size(pXfer->pOut)<XFER_STREAM_CHUNK ){
+    return;
+  }
+  blob_zero(&out);
+  xferStream.next_in = (unsigned char*)blob_buffer(pXfer->pOut);
+  xferStream.avail_in = blob_size(pXfer->pOut);
+  do{
+    xferStream.next_out = (unsigned char*)zBuf;
+    xferStream.avail_out = sizeof(zBuf);
+    deflate(&xferStream, isFinal ? Z_FINISH : Z_SYNC_FLUSH);
+    blob_append(&out, zBuf, sizeof(zBuf) - xferStream.avail_out);
+  }while( xferStream.avail_out==0 );
+  pXfer->nOutSent += blob_size(pXfer->pOut);
+  blob_reset(pXfer->pOut);
+  if( isFirst ) cgi_stream_begin(xfer_stream_abort);
+  cgi_stream_write(blob_buffer(&out), blob_size(&out));
+  blob_reset(&out);
+  if( isFinal ){
+    deflateEnd(&xferStream);
+    pXfer->streamReply = 0;
+    pStreamXfer = 0;
+    cgi_stream_end();
+  }
+}
+
+/*
+** Called by cgi_reply() if a fatal error occurs while the reply is being
+** streamed.  Send the rest of the reply, which includes the error
+** message, and finish the zlib stream so that the client sees a well
+** formed reply rather than a truncated one.
+*/
+static void xfer_stream_abort(void){
+  if( pStreamXfer ) xfer_stream_flush(pStreamXfer, 1);
+}
+
 
 /*
 ** The input blob contains a UUID.  Convert it into a record ID.
@@ -141,6 +237,7 @@ static void xfer_accept_file(
   }
   blob_zero(&content);
   blob_zero(&hash);
+  http_reply_need(pXfer->pIn, n);
   blob_extract(pXfer->pIn, n, &content);
   if( !cloneFlag && uuid_is_shunned(blob_str(&pXfer->aToken[1])) ){
     /* Ignore files that have been shunned */
@@ -264,6 +361,7 @@ static void xfer_accept_compressed_file(
     return;
   }
   blob_zero(&content);
+  http_reply_need(pXfer->pIn, szC);
   blob_extract(pXfer->pIn, szC, &content);
   if( uuid_is_shunned(blob_str(&pXfer->aToken[1])) ){
     /* Ignore files that have been shunned */
@@ -334,6 +432,7 @@ static void xfer_accept_unversioned_file(Xfer *pXfer, int isWriter){
   blob_init(&hash, 0, 0);
   blob_init(&x, 0, 0);
   if( sz>0 && (flags & 0x0005)==0 ){
+    http_reply_need(pXfer->pIn, sz);
     blob_extract(pXfer->pIn, sz, &content);
     nullContent = 0;
     sha1sum_blob(&content, &hash);
@@ -543,7 +642,7 @@ static void send_file(Xfer *pXfer, int rid, Blob *pUuid, int nativeDelta){
     return;
   }
   if( (pXfer->maxTime != -1 && time(NULL) >= pXfer->maxTime) ||
-       pXfer->mxSend<=blob_size(pXfer->pOut) ){
+       pXfer->mxSend<=xfer_out_size(pXfer) ){
     const char *zFormat = isPriv ? "igot %b 1\n" : "igot %b\n";
     blob_appendf(pXfer->pOut, zFormat /*works-like:"%b"*/, pUuid);
     pXfer->nIGotSent++;
@@ -575,6 +674,7 @@ static void send_file(Xfer *pXfer, int rid, Blob *pUuid, int nativeDelta){
   }
   remote_has(rid);
   blob_reset(&uuid);
+  xfer_stream_flush(pXfer, 0);
 #if 0
   if( blob_buffer(pXfer->pOut)[blob_size(pXfer->pOut)-1]!='\n' ){
     blob_append(pXfer->pOut, "\n", 1);
@@ -644,6 +744,7 @@ static void send_compressed_file(Xfer *pXfer, int rid){
     }
   }
   db_reset(&q1);
+  xfer_stream_flush(pXfer, 0);
 }
 
 /*
@@ -662,7 +763,7 @@ static void send_unversioned_file(
 ){
   Stmt q1;
 
-  if( blob_size(pXfer->pOut)>=pXfer->mxSend ) noContent = 1;
+  if( xfer_out_size(pXfer)>=pXfer->mxSend ) noContent = 1;
   if( noContent ){
     db_prepare(&q1,
       "SELECT mtime, hash, encoding, sz FROM unversioned WHERE name=%Q",
@@ -678,7 +779,7 @@ static void send_unversioned_file(
   if( db_step(&q1)==SQLITE_ROW ){
     sqlite3_int64 mtime = db_column_int64(&q1, 0);
     const char *zHash = db_column_text(&q1, 1);
-    if( blob_size(pXfer->pOut)>=pXfer->mxSend ){
+    if( xfer_out_size(pXfer)>=pXfer->mxSend ){
       /* If we have already reached the send size limit, send a (short)
       ** uvigot card rather than a uvfile card.  This only happens on the
       ** server side.  The uvigot card will provoke the client to resend
@@ -930,6 +1031,7 @@ static int send_private(Xfer *pXfer){
     while( db_step(&q)==SQLITE_ROW ){
       blob_appendf(pXfer->pOut, "igot %s 1\n", db_column_text(&q,0));
       cnt++;
+      xfer_stream_flush(pXfer, 0);
     }
     db_finalize(&q);
   }
@@ -964,9 +1066,10 @@ static int send_unclustered(Xfer *pXfer){
   while( db_step(&q)==SQLITE_ROW ){
     blob_appendf(pXfer->pOut, "igot %s\n", db_column_text(&q, 0));
     cnt++;
-    if( pXfer->resync && pXfer->mxSend<blob_size(pXfer->pOut) ){
+    if( pXfer->resync && pXfer->mxSend<xfer_out_size(pXfer) ){
       pXfer->resync = db_column_int(&q, 1)-1;
     }
+    xfer_stream_flush(pXfer, 0);
   }
   db_finalize(&q);
   if( cnt==0 ) pXfer->resync = 0;
@@ -986,8 +1089,307 @@ static void send_all(Xfer *pXfer){
   );
   while( db_step(&q)==SQLITE_ROW ){
     blob_appendf(pXfer->pOut, "igot %s\n", db_column_text(&q, 0));
+    xfer_stream_flush(pXfer, 0);
+  }
+  db_finalize(&q);
+}
+
+/*
+** Instead of exchanging "igot" cards for all unclustered artifacts on
+** every sync, a client and server that both understand it can compare
+** their holdings using digests.  The artifacts are grouped into buckets
+** by the leading hex digits of their hashes, and each bucket is
+** summarized by a count and a digest:
+**
+**     pragma ihash PREFIX COUNT DIGEST
+**
+** PREFIX is "-" for the bucket holding every artifact.  The client sends
+** the summary of the "-" bucket on its first message.  If the server has
+** the same summary, the two repositories hold the same public artifacts
+** and nothing else needs to be exchanged.  Otherwise the server answers
+** with the summaries of the smaller buckets inside it, and the two sides
+** narrow down on the buckets that differ.  Once a bucket that differs
+** holds no more than XFER_IHASH_LEAF artifacts, each side sends "igot"
+** cards for its own artifacts in that bucket and the usual "gimme" and
+** "file" exchange takes over.
+**
+** A server that takes part says so with "pragma ihash-ok" and then
+** omits its "igot" list.  A server that does not know the pragma ignores
+** it, and the client falls back to sending and receiving "igot" cards.
+*/
+#define XFER_IHASH_LEAF      32    /* List a bucket no larger than this */
+#define XFER_IHASH_MXPREFIX  8     /* Never split buckets beyond this */
+
+/*
+** Return true if pPrefix is a valid bucket name for "pragma ihash".
+*/
+static int xfer_ihash_is_prefix(Blob *pPrefix){
+  int i, n = blob_size(pPrefix);
+  const char *z = blob_buffer(pPrefix);
+  if( n==1 && z[0]=='-' ) return 1;
+  if( n<1 || n>XFER_IHASH_MXPREFIX ) return 0;
+  for(i=0; i<n; i++){
+    if( (z[i]<'0' || z[i]>'9') && (z[i]<'a' || z[i]>'f') ) return 0;
+  }
+  return 1;
+}
+
+/*
+** Prepare a query for the hashes of all public artifacts that begin
+** with zPrefix, in hash order.  The second column is the rid.
+*/
+static void xfer_ihash_query(Stmt *pQuery, const char *zPrefix){
+  int n = (int)strlen(zPrefix);
+  char zEnd[XFER_IHASH_MXPREFIX+1];
+  memcpy(zEnd, zPrefix, n+1);
+  if( n>0 ) zEnd[n-1]++;
+  db_prepare(pQuery,
+    "SELECT uuid, rid FROM blob"
+    " WHERE uuid>=%Q AND (%d OR uuid<%Q)"
+    "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
+    "   AND NOT EXISTS(SELECT 1 FROM phantom WHERE rid=blob.rid)"
+    "   AND NOT EXISTS(SELECT 1 FROM private WHERE rid=blob.rid)"
+    " ORDER BY uuid",
+    zPrefix, n==0, zEnd
+  );
+}
+
+/*
+** Return a hash of the things that decide which artifacts are public:
+** the newest rid, the phantom and private sets, the shunned hashes and
+** the number of purged artifacts.  The summary of the "-" bucket is
+** cached in the CONFIG table under this key, since adding, removing,
+** publishing or filling in an artifact changes it.  Space to hold the
+** key is obtained from fossil_malloc().
+*/
+static char *xfer_ihash_cache_key(void){
+  char *zState = db_text(0,
+    "SELECT (SELECT max(rid) FROM blob)"
+    " || ' ' || (SELECT count(*) || ' ' || total(rid) FROM phantom)"
+    " || ' ' || (SELECT count(*) || ' ' || total(rid) FROM private)"
+    " || ' ' || (SELECT count(*) FROM shun)"
+  );
+  Stmt q;
+  sha1sum_step_text(zState, -1);
+  fossil_free(zState);
+  db_prepare(&q, "SELECT uuid FROM shun ORDER BY uuid");
+  while( db_step(&q)==SQLITE_ROW ){
+    sha1sum_step_text(db_column_text(&q, 0), db_column_bytes(&q, 0));
   }
   db_finalize(&q);
+  if( db_table_exists("repository", "purgeitem") ){
+    char *zPurged = db_text(0, "SELECT ' ' || count(*) FROM purgeitem");
+    sha1sum_step_text(zPurged, -1);
+    fossil_free(zPurged);
+  }
+  return fossil_strdup(sha1sum_finish(0));
+}
+
+/*
+** Compute the summary of the public artifacts whose hashes begin with
+** zPrefix ("" for all of them).  Write the digest into zDigest, which
+** must hold at least 17 bytes, and return the number of artifacts.
+**
+** The summary of all artifacts is sent on every sync and so is kept in
+** the "ihash-summary" CONFIG entry as "KEY COUNT DIGEST", where KEY is
+** from xfer_ihash_cache_key().  A new value is held in zIhashSave until
+** xfer_ihash_save() so that the client does not lock the repository for
+** writing before the server has answered.
+*/
+static char *zIhashSave = 0;
+static int xfer_ihash_summary(const char *zPrefix, char *zDigest){
+  Stmt q;
+  int cnt = 0;
+  char *zKey = 0;
+  if( zPrefix[0]==0 ){
+    char *zCached = db_text(0,
+        "SELECT value FROM config WHERE name='ihash-summary'");
+    char zCachedKey[41];
+    zKey = xfer_ihash_cache_key();
+    if( zCached
+     && sscanf(zCached, "%40s %d %16s", zCachedKey, &cnt, zDigest)==3
+     && fossil_strcmp(zCachedKey, zKey)==0
+    ){
+      fossil_free(zCached);
+      fossil_free(zKey);
+      return cnt;
+    }
+    fossil_free(zCached);
+    cnt = 0;
+  }
+  xfer_ihash_query(&q, zPrefix);
+  while( db_step(&q)==SQLITE_ROW ){
+    sha1sum_step_text(db_column_text(&q, 0), db_column_bytes(&q, 0));
+    cnt++;
+  }
+  db_finalize(&q);
+  if( cnt ){
+    sqlite3_snprintf(17, zDigest, "%.16s", sha1sum_finish(0));
+  }else{
+    sqlite3_snprintf(17, zDigest, "-");
+  }
+  if( zKey ){
+    fossil_free(zIhashSave);
+    zIhashSave = mprintf("%s %d %s", zKey, cnt, zDigest);
+    fossil_free(zKey);
+  }
+  return cnt;
+}
+
+/*
+** Store the summary computed by xfer_ihash_summary(), if any.
+*/
+static void xfer_ihash_save(void){
+  if( zIhashSave==0 ) return;
+  if( db_is_writeable("repository") ){
+    db_multi_exec(
+      "REPLACE INTO config(name,value,mtime)"
+      " VALUES('ihash-summary',%Q,now())", zIhashSave
+    );
+  }
+  fossil_free(zIhashSave);
+  zIhashSave = 0;
+}
+
+/*
+** Discard the cached summary of all artifacts.  This must be called
+** whenever artifacts are deleted from the BLOB table, since that need not
+** change the key made by xfer_ihash_cache_key().
+*/
+void xfer_ihash_forget(void){
+  db_multi_exec("DELETE FROM repository.config WHERE name='ihash-summary'");
+}
+
+/*
+** Send a "pragma ihash" card for each of the buckets that are nExtra
+** hex digits longer than zPrefix and lie inside it.  Empty buckets are
+** included so that the other side can see artifacts missing here.
+*/
+static void xfer_ihash_split(Xfer *pXfer, const char *zPrefix, int nExtra){
+  static const char zHex[] = "0123456789abcdef";
+  int n = (int)strlen(zPrefix);
+  int nBucket = 1<<(4*nExtra);
+  int iBucket = 0;
+  int cnt = 0;
+  int i, j;
+  char zCur[XFER_IHASH_MXPREFIX+1];
+  Stmt q;
+
+  xfer_ihash_query(&q, zPrefix);
+  i = db_step(&q);
+  while( iBucket<nBucket ){
+    memcpy(zCur, zPrefix, n);
+    for(j=0; j<nExtra; j++){
+      zCur[n+j] = zHex[(iBucket>>(4*(nExtra-1-j)))&0xf];
+    }
+    zCur[n+nExtra] = 0;
+    while( i==SQLITE_ROW
+        && memcmp(db_column_text(&q, 0), zCur, n+nExtra)==0 ){
+      sha1sum_step_text(db_column_text(&q, 0), db_column_bytes(&q, 0));
+      cnt++;
+      i = db_step(&q);
+    }
+    blob_appendf(pXfer->pOut, "pragma ihash %s %d %.16s\n",
+                 zCur, cnt, cnt ? sha1sum_finish(0) : "-");
+    cnt = 0;
+    iBucket++;
+  }
+  db_finalize(&q);
+}
+
+/*
+** Send an "igot" card for every public artifact whose hash begins with
+** zPrefix.  Artifacts that the other side is known to have are skipped.
+** Return the number of cards sent.
+*/
+static int xfer_ihash_list(Xfer *pXfer, const char *zPrefix){
+  static Stmt onRemote;
+  Stmt q;
+  int cnt = 0;
+  db_static_prepare(&onRemote, "SELECT 1 FROM onremote WHERE rid=:rid");
+  xfer_ihash_query(&q, zPrefix);
+  while( db_step(&q)==SQLITE_ROW ){
+    int isOnRemote;
+    db_bind_int(&onRemote, ":rid", db_column_int(&q, 1));
+    isOnRemote = db_step(&onRemote)==SQLITE_ROW;
+    db_reset(&onRemote);
+    if( isOnRemote ) continue;
+    blob_appendf(pXfer->pOut, "igot %s\n", db_column_text(&q, 0));
+    cnt++;
+    xfer_stream_flush(pXfer, 0);
+  }
+  db_finalize(&q);
+  return cnt;
+}
+
+/*
+** The client remembers the buckets it has sent "igot" cards for during
+** the current sync in the TEMP table ihash_listed, so that it can answer
+** "pragma ihash-list" for every other bucket.
+*/
+static void xfer_ihash_mark_listed(const char *zPrefix){
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS ihash_listed(prefix TEXT PRIMARY KEY);"
+    "INSERT OR IGNORE INTO ihash_listed VALUES(%Q);", zPrefix
+  );
+}
+static int xfer_ihash_was_listed(const char *zPrefix){
+  return db_table_exists("temp", "ihash_listed")
+      && db_exists("SELECT 1 FROM ihash_listed"
+                   " WHERE substr(%Q,1,length(prefix))=prefix", zPrefix);
+}
+
+/*
+** The other side summarized its bucket zPrefix as nRemote artifacts
+** with digest zRemote.  If that differs from the local summary, either
+** split the bucket and send summaries of the pieces, or, once the bucket
+** is small, settle it:
+**
+**   *  The server lists its artifacts in the bucket and follows them
+**      with "pragma ihash-list" to ask the client for its own.
+**
+**   *  The client lists its artifacts in the bucket, if it is pushing,
+**      and sends its own summary so that the server lists its side.
+**
+** Both sides split, so a bucket that differs is narrowed by two levels
+** on every round trip.  Return the number of cards sent.
+*/
+static int xfer_ihash_compare(
+  Xfer *pXfer,            /* The transfer in progress */
+  int isServer,           /* True for the server side */
+  int isPush,             /* Client only: true if pushing */
+  Blob *pPrefix,          /* Bucket name, as sent */
+  int nRemote,            /* Number of artifacts the other side has there */
+  Blob *pRemote           /* The other side's digest for the bucket */
+){
+  const char *zWire = blob_str(pPrefix);
+  const char *zPrefix = zWire[0]=='-' ? "" : zWire;
+  char zDigest[17];
+  int n, nMax, nExtra, cnt = 0;
+
+  n = xfer_ihash_summary(zPrefix, zDigest);
+  if( n==nRemote && blob_eq_str(pRemote, zDigest, -1) ) return 0;
+  nMax = n>nRemote ? n : nRemote;
+  if( n<=XFER_IHASH_LEAF || nRemote<=XFER_IHASH_LEAF
+   || strlen(zPrefix)>=XFER_IHASH_MXPREFIX
+  ){
+    if( isServer ){
+      cnt = xfer_ihash_list(pXfer, zPrefix);
+      blob_appendf(pXfer->pOut, "pragma ihash-list %s\n", zWire);
+    }else{
+      if( isPush ){
+        cnt = xfer_ihash_list(pXfer, zPrefix);
+        xfer_ihash_mark_listed(zPrefix);
+      }
+      blob_appendf(pXfer->pOut, "pragma ihash %s %d %s\n",
+                   zWire, n, zDigest);
+    }
+    return cnt+1;
+  }
+  nExtra = nMax>16*XFER_IHASH_LEAF ? 2 : 1;
+  if( strlen(zPrefix)+nExtra>XFER_IHASH_MXPREFIX ) nExtra = 1;
+  xfer_ihash_split(pXfer, zPrefix, nExtra);
+  return 1<<(4*nExtra);
 }
 
 /*
@@ -1042,6 +1444,7 @@ static void send_unversioned_catalog(Xfer *pXfer){
       if( zHash==0 ){ sz = 0; zHash = "-"; }
       blob_appendf(pXfer->pOut, "uvigot %s %lld %s %d\n",
                    zName, mtime, zHash, sz);
+      xfer_stream_flush(pXfer, 0);
     }
     db_finalize(&uvq);
   }
@@ -1124,6 +1527,26 @@ int xfer_run_common_script(void){
 */
 static int disableLogin = 0;
 
+/*
+** Send the artifacts of a version iVers clone reply, beginning with
+** seqno, until the reply is large enough or takes too long.  Then send
+** the "clone_seqno" card saying where the next request should begin.
+*/
+static void send_clone_files(Xfer *pXfer, int seqno, int iVers){
+  int max = db_int(0, "SELECT max(rid) FROM blob");
+  while( pXfer->mxSend>xfer_out_size(pXfer) && seqno<=max){
+    if( time(NULL) >= pXfer->maxTime ) break;
+    if( iVers>=3 ){
+      send_compressed_file(pXfer, seqno);
+    }else{
+      send_file(pXfer, seqno, 0, 1);
+    }
+    seqno++;
+  }
+  if( seqno>max ) seqno = 0;
+  blob_appendf(pXfer->pOut, "clone_seqno %d\n", seqno);
+}
+
 /*
 ** The CGI/HTTP preprocessor always redirects requests with a content-type
 ** of application/x-fossil or application/x-fossil-debug to this page,
@@ -1155,6 +1578,10 @@ void page_xfer(void){
   char **pzUuidList = 0;
   int *pnUuidList = 0;
   int uvCatalogSent = 0;
+  int bStreamReply = 0;
+  int cloneSeqno = -1;          /* Deferred clone: first artifact to send */
+  int cloneVers = 0;            /* Deferred clone: protocol version */
+  int nGimmeDeferred = 0;       /* Number of rows in TEMP table gimmelist */
 
   if( fossil_strcmp(PD("REQUEST_METHOD","POST"),"POST") ){
      fossil_redirect_home();
@@ -1267,7 +1694,14 @@ void page_xfer(void){
       nGimme++;
       if( isPull ){
         int rid = rid_from_uuid(&xfer.aToken[1], 0, 0);
-        if( rid ){
+        if( rid && bStreamReply ){
+          if( nGimmeDeferred++==0 ){
+            db_multi_exec(
+              "CREATE TEMP TABLE gimmelist(seq INTEGER PRIMARY KEY, rid INT)"
+            );
+          }
+          db_multi_exec("INSERT INTO gimmelist(rid) VALUES(%d)", rid);
+        }else if( rid ){
           send_file(&xfer, rid, &xfer.aToken[1], deltaFlag);
         }
       }
@@ -1374,23 +1808,18 @@ void page_xfer(void){
        && blob_is_int(&xfer.aToken[1], &iVers)
        && iVers>=2
       ){
-        int seqno, max;
+        int seqno;
         if( iVers>=3 ){
           cgi_set_content_type("application/x-fossil-uncompressed");
+          xfer.streamLevel = Z_BEST_SPEED;
         }
         blob_is_int(&xfer.aToken[2], &seqno);
-        max = db_int(0, "SELECT max(rid) FROM blob");
-        while( xfer.mxSend>blob_size(xfer.pOut) && seqno<=max){
-          if( time(NULL) >= xfer.maxTime ) break;
-          if( iVers>=3 ){
-            send_compressed_file(&xfer, seqno);
-          }else{
-            send_file(&xfer, seqno, 0, 1);
-          }
-          seqno++;
+        if( bStreamReply ){
+          cloneSeqno = seqno;
+          cloneVers = iVers;
+        }else{
+          send_clone_files(&xfer, seqno, iVers);
         }
-        if( seqno>max ) seqno = 0;
-        @ clone_seqno %d(seqno)
       }else{
         isClone = 1;
         isPull = 1;
@@ -1537,6 +1966,66 @@ void page_xfer(void){
         xfer.resync = 0x7fffffff;
       }
 
+      /*   pragma stream-reply
+      **
+      ** The client is able to process a reply that is sent as a single
+      ** zlib stream of content type "application/x-fossil-stream" with
+      ** no Content-Length.  Once every card of the request has been
+      ** processed without error, a large reply is sent as it is
+      ** generated rather than being accumulated in memory first.
+      */
+      if( blob_eq(&xfer.aToken[1], "stream-reply")
+       && fossil_strcmp(g.zContentType, "application/x-fossil")==0
+      ){
+        bStreamReply = 1;
+      }
+
+      /*   pragma ihash PREFIX COUNT DIGEST
+      **   pragma ihash-ok
+      **
+      ** The client compares holdings using digests rather than "igot"
+      ** cards.  Reply with more detail for a bucket that differs from the
+      ** client's summary of it, and leave out the usual "igot" cards for
+      ** unclustered artifacts.  The "ihash-ok" form is sent on later
+      ** rounds of the same sync.  Any new cluster is formed first so
+      ** that the summaries include it.
+      **
+      ** A pull-only client gains nothing from narrowing down buckets
+      ** over several rounds, since the "igot" list gets it everything in
+      ** one.  So for a pull without a push, only a matching summary of
+      ** everything is accepted, and then there is nothing to list.
+      */
+      if( blob_eq(&xfer.aToken[1], "ihash")
+       && xfer.nToken==5
+       && isPull
+       && xfer_ihash_is_prefix(&xfer.aToken[2])
+       && blob_is_int(&xfer.aToken[3], &size)
+      ){
+        if( !xfer.ihash ) create_cluster();
+        if( isPush ){
+          if( !xfer.ihash ){
+            @ pragma ihash-ok
+            xfer.ihash = 1;
+          }
+          xfer_ihash_compare(&xfer, 1, 0, &xfer.aToken[2], size,
+                             &xfer.aToken[4]);
+        }else if( !xfer.ihash && blob_eq(&xfer.aToken[2], "-") ){
+          char zDigest[17];
+          if( xfer_ihash_summary("", zDigest)==size
+           && blob_eq_str(&xfer.aToken[4], zDigest, -1)
+          ){
+            @ pragma ihash-ok
+            xfer.ihash = 1;
+          }
+        }
+      }
+      if( blob_eq(&xfer.aToken[1], "ihash-ok") && isPull ){
+        if( !xfer.ihash ){
+          @ pragma ihash-ok
+          xfer.ihash = 1;
+        }
+      }
+
       /*   pragma uv-hash HASH
       **
       ** The client wants to make sure that unversioned files are all synced.
@@ -1579,6 +2068,28 @@ void page_xfer(void){
     }
     request_phantoms(&xfer, 500);
   }
+  if( bStreamReply && nErr==0 ){
+    /* Every card has been checked, so the reply can no longer be replaced
+    ** by an error message.  Start streaming it once it grows large, and
+    ** only now send the artifacts that were asked for, so that they are
+    ** streamed as they are read instead of being held in memory. */
+    xfer.streamReply = 1;
+    xfer_stream_flush(&xfer, 0);
+    if( cloneSeqno>=0 ){
+      send_clone_files(&xfer, cloneSeqno, cloneVers);
+    }
+    if( nGimmeDeferred ){
+      Stmt q;
+      db_prepare(&q, "SELECT rid FROM gimmelist ORDER BY seq");
+      while( db_step(&q)==SQLITE_ROW ){
+        send_file(&xfer, db_column_int(&q, 0), 0, deltaFlag);
+      }
+      db_finalize(&q);
+    }
+  }
+  if( nGimmeDeferred ){
+    db_multi_exec("DROP TABLE gimmelist");
+  }
   if( zUuidList ){
     Th_Free(g.interp, zUuidList);
   }
@@ -1594,7 +2105,7 @@ void page_xfer(void){
     if( xfer.syncPrivate ) send_private(&xfer);
   }else if( isPull ){
     create_cluster();
-    send_unclustered(&xfer);
+    if( !xfer.ihash ) send_unclustered(&xfer);
     if( xfer.syncPrivate ) send_private(&xfer);
   }
   if( recvConfig ){
@@ -1602,6 +2113,7 @@ void page_xfer(void){
   }
   db_multi_exec("DROP TABLE onremote");
   manifest_crosslink_end(MC_PERMIT_HOOKS);
+  xfer_ihash_save();
 
   /* Send the server timestamp last, in case prior processing happened
   ** to use up a significant fraction of our time window.
@@ -1612,6 +2124,7 @@ void page_xfer(void){
 
   db_end_transaction(0);
   configure_rebuild();
+  xfer_stream_flush(&xfer, 1);
 }
 
 /*
@@ -1720,6 +2233,7 @@ int client_sync(
   int uvDoPush = 0;       /* Generate uvfile messages to send to server */
   int nUvGimmeSent = 0;   /* Number of uvgimme cards sent on this cycle */
   int nUvFileRcvd = 0;    /* Number of uvfile cards received on this cycle */
+  int nIhashSent = 0;     /* Number of cards sent due to "pragma ihash" */
   sqlite3_int64 mtime;    /* Modification time on a UV file */
 
   if( db_get_boolean("dont-push", 0) ) syncFlags &= ~SYNC_PUSH;
@@ -1749,6 +2263,18 @@ int client_sync(
     xfer.syncPrivate = 1;
   }
 
+  /* Offer to compare holdings with digests when pulling, unless every
+  ** artifact is to be listed anyway or the server is for a different
+  ** project.  1 means the offer is pending and 2 that the server has
+  ** accepted it.  A push-only sync sends "igot" cards straight away.
+  */
+  if( (syncFlags & SYNC_PULL)!=0
+   && (syncFlags & (SYNC_CLONE|SYNC_RESYNC|SYNC_FROMPARENT))==0
+  ){
+    xfer.ihash = 1;
+    db_multi_exec("DROP TABLE IF EXISTS temp.ihash_listed");
+  }
+
   blobarray_zero(xfer.aToken, count(xfer.aToken));
   blob_zero(&send);
   blob_zero(&recv);
@@ -1762,6 +2288,13 @@ int client_sync(
     blob_append(&send, "pragma send-private\n", -1);
   }
 
+  /* Ask the server to stream large replies, unless the replies must be
+  ** delimited by their length (SSH) or captured in full (--httptrace).
+  */
+  if( !g.url.isSsh && !g.fHttpTrace ){
+    blob_append(&send, "pragma stream-reply\n", -1);
+  }
+
   /* When syncing unversioned files, create a TEMP table in which to store
   ** the names of files that need to be sent from client to server.
   **
@@ -1838,9 +2371,18 @@ int client_sync(
     ){
       request_phantoms(&xfer, mxPhantomReq);
     }
+    if( xfer.ihash==1 && nCycle==0 ){
+      char zDigest[17];
+      int n = xfer_ihash_summary("", zDigest);
+      blob_appendf(&send, "pragma ihash - %d %s\n", n, zDigest);
+      nCardSent++;
+    }else if( xfer.ihash==2 ){
+      blob_append(&send, "pragma ihash-ok\n", -1);
+      nCardSent++;
+    }
     if( syncFlags & SYNC_PUSH ){
       send_unsent(&xfer);
-      nCardSent += send_unclustered(&xfer);
+      if( xfer.ihash==0 ) nCardSent += send_unclustered(&xfer);
       if( syncFlags & SYNC_PRIVATE ) send_private(&xfer);
     }
 
@@ -1984,6 +2526,9 @@ int client_sync(
     if( syncFlags & SYNC_PRIVATE ){
       blob_append(&send, "pragma send-private\n", -1);
     }
+    if( !g.url.isSsh && !g.fHttpTrace ){
+      blob_append(&send, "pragma stream-reply\n", -1);
+    }
 
     /* Begin constructing the next message (which might never be
     ** sent) by beginning with the pull or push cards
@@ -1999,9 +2544,10 @@ int client_sync(
     go = 0;
     nUvGimmeSent = 0;
     nUvFileRcvd = 0;
+    nIhashSent = 0;
 
     /* Process the reply that came back from the server */
-    while( blob_line(&recv, &xfer.line) ){
+    while( http_reply_line(&recv, &xfer.line) ){
       if( blob_buffer(&xfer.line)[0]=='#' ){
         const char *zLine = blob_buffer(&xfer.line);
         if( memcmp(zLine, "# timestamp ", 12)==0 ){
@@ -2017,6 +2563,7 @@ int client_sync(
           if( fossil_fabs(rDiff)>fossil_fabs(rSkew) ) rSkew = rDiff;
         }
         nCardRcvd++;
+        blob_reset(&xfer.line);
         continue;
       }
       xfer.nToken = blob_tokenize(&xfer.line, xfer.aToken, count(xfer.aToken));
@@ -2212,6 +2759,7 @@ int client_sync(
         const char *zName = blob_str(&xfer.aToken[1]);
         Blob content;
         blob_zero(&content);
+        http_reply_need(xfer.pIn, size+1);
         blob_extract(xfer.pIn, size, &content);
         g.perm.Admin = g.perm.RdAddr = 1;
         configure_receive(zName, &content, origConfigRcvMask);
@@ -2296,6 +2844,38 @@ int client_sync(
         }else if( blob_eq(&xfer.aToken[1], "uv-push-ok") ){
           uvDoPush = 1;
         }
+
+        /* The server accepts "pragma ihash" and has left out its "igot"
+        ** cards.  "pragma ihash" cards that follow summarize buckets
+        ** where the server's holdings differ from ours, and
+        ** "pragma ihash-list" follows the server's "igot" cards for a
+        ** bucket and asks for ours, unless we have listed that bucket
+        ** already.
+        */
+        else if( blob_eq(&xfer.aToken[1], "ihash-ok") ){
+          if( xfer.ihash ) xfer.ihash = 2;
+        }else if( blob_eq(&xfer.aToken[1], "ihash")
+               && xfer.ihash
+               && xfer.nToken==5
+               && xfer_ihash_is_prefix(&xfer.aToken[2])
+               && blob_is_int(&xfer.aToken[3], &size)
+        ){
+          nIhashSent += xfer_ihash_compare(&xfer, 0,
+                               (syncFlags & SYNC_PUSH)!=0, &xfer.aToken[2],
+                               size, &xfer.aToken[4]);
+        }else if( blob_eq(&xfer.aToken[1], "ihash-list")
+               && xfer.ihash
+               && xfer.nToken==3
+               && xfer_ihash_is_prefix(&xfer.aToken[2])
+               && (syncFlags & SYNC_PUSH)!=0
+        ){
+          const char *zPrefix = blob_str(&xfer.aToken[2]);
+          if( zPrefix[0]=='-' ) zPrefix = "";
+          if( !xfer_ihash_was_listed(zPrefix) ){
+            nIhashSent += xfer_ihash_list(&xfer, zPrefix);
+            xfer_ihash_mark_listed(zPrefix);
+          }
+        }
       }else
 
       /*   error MESSAGE
@@ -2358,6 +2938,10 @@ int client_sync(
       blobarray_reset(xfer.aToken, xfer.nToken);
       blob_reset(&xfer.line);
     }
+    if( http_reply_end(&recv) && nErr==0 ){
+      fossil_warning("server reply is incomplete");
+      nErr++;
+    }
     if( (configRcvMask & (CONFIGSET_USER|CONFIGSET_TKT))!=0
      && (configRcvMask & CONFIGSET_OLDFORMAT)!=0
     ){
@@ -2374,6 +2958,17 @@ int client_sync(
     }
     blob_reset(&recv);
     nCycle++;
+    nCardSent += nIhashSent;
+
+    /* A server that ignored "pragma ihash" has not been told what we
+    ** have.  Send "igot" cards on another round.  Keep going while
+    ** buckets that differ are being narrowed down.
+    */
+    if( xfer.ihash==1 ){
+      xfer.ihash = 0;
+      if( syncFlags & SYNC_PUSH ) go = 1;
+    }
+    if( nIhashSent>0 ) go = 1;
 
     /* If we received one or more files on the previous exchange but
     ** there are still phantoms, then go another round.
@@ -2413,6 +3008,7 @@ int client_sync(
     if( nUvGimmeSent>0 && (nUvFileRcvd>0 || nCycle<3) ) go = 1;
 
     db_multi_exec("DROP TABLE onremote");
+    xfer_ihash_save();
     if( go ){
       manifest_crosslink_end(MC_PERMIT_HOOKS);
     }else{
@@ -255,11 +255,16 @@ proc get_all_settings {} {
       case-sensitive \
       clean-glob \
       clearsign \
+      content-cache-size \
       crlf-glob \
       crnl-glob \
       default-perms \
+      delta-cache-depth \
+      delta-cache-size \
+      delta-encoder \
       diff-binary \
       diff-command \
+      diff-jobs \
       dont-push \
       dotfiles \
       editor \
@@ -276,6 +281,7 @@ proc get_all_settings {} {
       localauth \
       main-branch \
       manifest \
+      manifest-cache-size \
       max-loadavg \
       max-upload \
       mtime-changes \
@@ -283,6 +289,7 @@ proc get_all_settings {} {
       proxy \
       relative-paths \
       repo-cksum \
+      scan-jobs \
       self-register \
       ssh-command \
       ssl-ca-location \